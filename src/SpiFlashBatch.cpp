@@ -0,0 +1,251 @@
+#include "Particle.h"
+
+#include "SpiFlashBatch.h"
+
+SpiFlashBatch::SpiFlashBatch(SpiFlash &flash, size_t maxRequests) : flash(flash) {
+	requests = new Request[maxRequests];
+	pageBuf = new uint8_t[flash.getPageSize()];
+	if (requests && pageBuf) {
+		this->maxRequests = maxRequests;
+	}
+}
+
+SpiFlashBatch::~SpiFlashBatch() {
+	delete[] requests;
+	delete[] pageBuf;
+}
+
+bool SpiFlashBatch::read(size_t addr, void *buf, size_t len) {
+	if (len == 0) {
+		return true;
+	}
+	Request *req = allocRequest(REQUEST_READ, addr, len);
+	if (!req) {
+		return false;
+	}
+	req->readBuf = (uint8_t *)buf;
+	return true;
+}
+
+bool SpiFlashBatch::write(size_t addr, const void *buf, size_t len) {
+	if (len == 0) {
+		return true;
+	}
+	Request *req = allocRequest(REQUEST_WRITE, addr, len);
+	if (!req) {
+		return false;
+	}
+	req->writeBuf = (const uint8_t *)buf;
+	return true;
+}
+
+bool SpiFlashBatch::eraseRange(size_t addr, size_t len) {
+	size_t sectorSize = flash.getSectorSize();
+	if ((addr % sectorSize) != 0 || (len % sectorSize) != 0) {
+		return false;
+	}
+	if (len == 0) {
+		return true;
+	}
+
+	// Erases are executed before writes, so this would erase before the write, not after it
+	for(size_t ii = 0; ii < numRequests; ii++) {
+		const Request &req = requests[ii];
+		if (req.type == REQUEST_WRITE && req.addr < addr + len && addr < req.addr + req.len) {
+			return false;
+		}
+	}
+	return allocRequest(REQUEST_ERASE, addr, len) != 0;
+}
+
+bool SpiFlashBatch::execute() {
+	SpiFlash::OperationLock lock(flash, flash.writePriority);
+
+	if (flash.asyncState != SpiFlash::AsyncState::IDLE) {
+		return false;
+	}
+
+	// Programs and reads are sent without waiting, so an operation from startPageProgram() or a start
+	// erase function has to finish first
+	flash.waitForOperationComplete();
+
+	pagePrograms = 0;
+	sortRequests();
+
+	// Requests are now grouped by type
+	size_t firstWrite = 0;
+	while(firstWrite < numRequests && requests[firstWrite].type == REQUEST_ERASE) {
+		firstWrite++;
+	}
+	size_t firstRead = firstWrite;
+	while(firstRead < numRequests && requests[firstRead].type == REQUEST_WRITE) {
+		firstRead++;
+	}
+
+	// If an erase or program timed out, the chip may still be busy, so the writes would not be programmed
+	// and the reads would not return the data
+	bool result = true;
+	if (firstWrite > 0 && !executeErases(0, firstWrite - 1)) {
+		result = false;
+	}
+	if (result && firstRead > firstWrite && !executeWrites(firstWrite, firstRead - 1)) {
+		result = false;
+	}
+	if (result && numRequests > firstRead) {
+		executeReads(firstRead, numRequests - 1);
+	}
+
+	numRequests = 0;
+	return result;
+}
+
+SpiFlashBatch::Request *SpiFlashBatch::allocRequest(uint8_t type, size_t addr, size_t len) {
+	if (numRequests >= maxRequests) {
+		return 0;
+	}
+	Request *req = &requests[numRequests++];
+	req->type = type;
+	req->addr = addr;
+	req->len = len;
+	req->writeBuf = 0;
+	req->readBuf = 0;
+	return req;
+}
+
+void SpiFlashBatch::sortRequests() {
+	// Insertion sort, which is stable so reads stay in order, and fast for the small number of requests
+	for(size_t ii = 1; ii < numRequests; ii++) {
+		Request req = requests[ii];
+		size_t jj = ii;
+		while(jj > 0) {
+			const Request &prev = requests[jj - 1];
+			bool before = (req.type < prev.type) || (req.type == prev.type && req.type != REQUEST_READ && req.addr < prev.addr);
+			if (!before) {
+				break;
+			}
+			requests[jj] = requests[jj - 1];
+			jj--;
+		}
+		requests[jj] = req;
+	}
+}
+
+bool SpiFlashBatch::executeErases(size_t first, size_t last) {
+	// Merge overlapping and adjacent ranges so eraseRange() can use block erases
+	bool result = true;
+	size_t ii = first;
+	while(ii <= last) {
+		size_t start = requests[ii].addr;
+		size_t end = start + requests[ii].len;
+
+		for(ii++; ii <= last && requests[ii].addr <= end; ii++) {
+			if (requests[ii].addr + requests[ii].len > end) {
+				end = requests[ii].addr + requests[ii].len;
+			}
+		}
+		if (!flash.eraseRange(start, end - start)) {
+			result = false;
+		}
+	}
+	return result;
+}
+
+bool SpiFlashBatch::executeWrites(size_t first, size_t last) {
+	size_t pageSize = flash.getPageSize();
+	bool result = true;
+
+	for(size_t ii = first; ii <= last; ii++) {
+		flash.sectorCacheBeforeWrite(requests[ii].addr, requests[ii].len);
+	}
+
+	// Program one page at a time, starting with the lowest address that hasn't been programmed
+	size_t done = 0;
+	while(true) {
+		size_t next = SIZE_MAX;
+		for(size_t ii = first; ii <= last; ii++) {
+			const Request &req = requests[ii];
+			if (req.addr + req.len > done) {
+				size_t start = (req.addr > done) ? req.addr : done;
+				if (start < next) {
+					next = start;
+				}
+			}
+		}
+		if (next == SIZE_MAX) {
+			break;
+		}
+
+		size_t pageStart = next - (next % pageSize);
+		size_t pageEnd = pageStart + pageSize;
+
+		// Combine all of the writes to this page. Bytes that aren't written are 0xff, which doesn't change
+		// the bits on the chip.
+		memset(pageBuf, 0xff, pageSize);
+		size_t low = pageSize, high = 0;
+		for(size_t ii = first; ii <= last; ii++) {
+			const Request &req = requests[ii];
+			size_t start = (req.addr > pageStart) ? req.addr : pageStart;
+			size_t end = (req.addr + req.len < pageEnd) ? (req.addr + req.len) : pageEnd;
+			if (start >= end) {
+				continue;
+			}
+			for(size_t addr = start; addr < end; addr++) {
+				pageBuf[addr - pageStart] &= req.writeBuf[addr - req.addr];
+			}
+			if (start - pageStart < low) {
+				low = start - pageStart;
+			}
+			if (end - pageStart > high) {
+				high = end - pageStart;
+			}
+		}
+
+		if (!flash.pageProgram(pageStart + low, &pageBuf[low], high - low)) {
+			result = false;
+		}
+		pagePrograms++;
+		done = pageEnd;
+	}
+	return result;
+}
+
+void SpiFlashBatch::executeReads(size_t first, size_t last) {
+	size_t ii = first;
+	while(ii <= last) {
+		// Reads of consecutive addresses continue in the same transaction
+		size_t jj = ii;
+		size_t total = requests[ii].len;
+		while(jj < last && requests[jj + 1].addr == requests[jj].addr + requests[jj].len) {
+			jj++;
+			total += requests[jj].len;
+		}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+		SpiFlash::StatsMark mark;
+		flash.statsStart(mark);
+#endif
+
+		bool suspended = flash.readWaitForChip();
+
+		flash.readBegin(requests[ii].addr);
+		for(size_t kk = ii; kk <= jj; kk++) {
+			flash.readTransfer(requests[kk].readBuf, requests[kk].len);
+		}
+		flash.endTransaction();
+
+		if (suspended) {
+			flash.eraseResume();
+		}
+
+		for(size_t kk = ii; kk <= jj; kk++) {
+			flash.writeCombineOverlay(requests[kk].addr, requests[kk].readBuf, requests[kk].len);
+			flash.sectorCacheOverlay(requests[kk].addr, requests[kk].readBuf, requests[kk].len);
+		}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+		flash.statsEnd(SPIFLASH_STATS_READ, mark, total);
+#endif
+
+		ii = jj + 1;
+	}
+}
@@ -0,0 +1,165 @@
+/**
+ * Batched operations for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHBATCH_H
+#define __SPIFLASHBATCH_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Queue of reads, writes, and erases that are executed together
+ *
+ * Operations are added with read(), write(), and erase functions, then run with execute(). The request
+ * descriptors come from a fixed pool allocated by the constructor, so adding and executing operations
+ * never allocates memory.
+ *
+ * A batch always executes in this order, regardless of the order the operations were added:
+ *
+ * - Erases, sorted by address. Adjacent and overlapping ranges are merged and use 32K and 64K block
+ * erases where possible. An erase can't be added after a write to the same range, since it would be
+ * done first.
+ * - Writes, sorted by address. All of the writes to the same page are combined into a single page program.
+ * Because programming can only change bits from 1 to 0, writes that overlap have the same result in any
+ * order.
+ * - Reads, in the order they were added, so they see the result of the erases and writes. Reads of
+ * consecutive addresses are done in a single SPI transaction.
+ *
+ * The status register is only read to wait for a program or erase to complete, not before each operation.
+ */
+class SpiFlashBatch {
+public:
+	/**
+	 * @brief Construct a batch for a flash chip
+	 *
+	 * @param flash The flash chip
+	 * @param maxRequests Size of the request descriptor pool (default: 16)
+	 */
+	SpiFlashBatch(SpiFlash &flash, size_t maxRequests = 16);
+	virtual ~SpiFlashBatch();
+
+	/**
+	 * @brief Adds a read. buf must remain valid until execute() returns.
+	 *
+	 * Returns false if the pool is full.
+	 */
+	bool read(size_t addr, void *buf, size_t len);
+
+	/**
+	 * @brief Adds a write. buf is not copied, so it must remain valid until execute() returns.
+	 *
+	 * Returns false if the pool is full.
+	 */
+	bool write(size_t addr, const void *buf, size_t len);
+
+	/**
+	 * @brief Adds a sector erase
+	 *
+	 * Returns false if the pool is full, addr is not sector aligned, or it overlaps a write. See eraseRange().
+	 */
+	bool sectorErase(size_t addr) { return eraseRange(addr, flash.getSectorSize()); };
+
+	/**
+	 * @brief Adds a 64K block erase
+	 *
+	 * Returns false if the pool is full, addr is not sector aligned, or it overlaps a write. See eraseRange().
+	 */
+	bool blockErase(size_t addr) { return eraseRange(addr, 65536); };
+
+	/**
+	 * @brief Adds an erase of a range of sectors
+	 *
+	 * Returns false if the pool is full, addr or len are not sector aligned, or the range overlaps a write
+	 * already in the batch. Erases are executed before writes, so execute() the write first in that case.
+	 */
+	bool eraseRange(size_t addr, size_t len);
+
+	/**
+	 * @brief Executes the operations and clears the batch
+	 *
+	 * Returns false if an asynchronous operation is in progress (nothing is done and the batch is not
+	 * cleared), or if a program or erase timed out. The chip may still be busy after a timeout, so the
+	 * operations after it are not done: the writes after an erase timeout, and the reads after either. The
+	 * read buffers are not changed in that case.
+	 */
+	bool execute();
+
+	/**
+	 * @brief Removes all operations without executing them
+	 */
+	void clear() { numRequests = 0; };
+
+	/**
+	 * @brief Returns the number of operations in the batch
+	 */
+	size_t getNumRequests() const { return numRequests; };
+
+	/**
+	 * @brief Returns the size of the request descriptor pool
+	 */
+	size_t getMaxRequests() const { return maxRequests; };
+
+	/**
+	 * @brief Returns the number of page programs done by the last execute()
+	 */
+	size_t getPagePrograms() const { return pagePrograms; };
+
+protected:
+	/**
+	 * @brief Request types, in the order they are executed
+	 */
+	enum RequestType {
+		REQUEST_ERASE = 0,
+		REQUEST_WRITE,
+		REQUEST_READ
+	};
+
+	/**
+	 * @brief Request descriptor
+	 */
+	struct Request {
+		uint8_t type;				//!< RequestType
+		size_t addr;				//!< Address
+		size_t len;					//!< Length in bytes
+		const uint8_t *writeBuf;	//!< Data for REQUEST_WRITE
+		uint8_t *readBuf;			//!< Buffer for REQUEST_READ
+	};
+
+	/**
+	 * @brief Returns the next free request descriptor, or NULL if the pool is full
+	 */
+	Request *allocRequest(uint8_t type, size_t addr, size_t len);
+
+	/**
+	 * @brief Sorts requests by type and erases and writes by address. Reads stay in the order they were added.
+	 */
+	void sortRequests();
+
+	/**
+	 * @brief Executes the erase requests from first to last
+	 */
+	bool executeErases(size_t first, size_t last);
+
+	/**
+	 * @brief Executes the write requests from first to last
+	 */
+	bool executeWrites(size_t first, size_t last);
+
+	/**
+	 * @brief Executes the read requests from first to last
+	 */
+	void executeReads(size_t first, size_t last);
+
+	SpiFlash &flash;
+	Request *requests = 0;
+	size_t maxRequests = 0;
+	size_t numRequests = 0;
+	uint8_t *pageBuf = 0;
+	size_t pagePrograms = 0;
+};
+
+#endif /* __SPIFLASHBATCH_H */
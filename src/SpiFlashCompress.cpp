@@ -0,0 +1,441 @@
+#include "Particle.h"
+
+#include "SpiFlashCompress.h"
+
+#include <limits.h>
+
+// Hash of the 3 bytes at p, used to find earlier occurrences of them
+static inline size_t lzHash(const uint8_t *p) {
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+	return (size_t)((uint32_t)(v * 2654435761U) >> 22);
+}
+
+// Appends literal bytes to dst in runs of up to 32, returning false if they don't fit
+static bool lzLiterals(const uint8_t *src, size_t len, uint8_t *dst, size_t &dstPos, size_t dstLen) {
+	while(len > 0) {
+		size_t count = (len < 32) ? len : 32;
+		if (dstPos + 1 + count > dstLen) {
+			return false;
+		}
+		dst[dstPos++] = (uint8_t)(count - 1);
+		memcpy(&dst[dstPos], src, count);
+		dstPos += count;
+		src += count;
+		len -= count;
+	}
+	return true;
+}
+
+// static
+size_t SpiFlashLz::compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen, uint16_t *hashTable) {
+	// Positions that haven't been set are 0, which is checked like any other candidate
+	memset(hashTable, 0, HASH_ENTRIES * sizeof(uint16_t));
+
+	size_t dstPos = 0;
+	size_t litStart = 0;
+	size_t pos = 0;
+	while(pos + 2 < srcLen) {
+		size_t hash = lzHash(&src[pos]);
+		size_t ref = hashTable[hash];
+		hashTable[hash] = (uint16_t)pos;
+
+		if (ref >= pos || pos - ref > MAX_OFFSET || memcmp(&src[ref], &src[pos], 3) != 0) {
+			pos++;
+			continue;
+		}
+
+		size_t maxLen = srcLen - pos;
+		if (maxLen > MAX_MATCH) {
+			maxLen = MAX_MATCH;
+		}
+		size_t len = 3;
+		while(len < maxLen && src[ref + len] == src[pos + len]) {
+			len++;
+		}
+
+		if (!lzLiterals(&src[litStart], pos - litStart, dst, dstPos, dstLen) || dstPos + 3 > dstLen) {
+			return 0;
+		}
+
+		// A match is the length - 2 in the top 3 bits, with 7 meaning the rest of the length is in the next byte,
+		// and the offset - 1 in the low 5 bits and the last byte
+		size_t offset = pos - ref - 1;
+		if (len - 2 < 7) {
+			dst[dstPos++] = (uint8_t)(((len - 2) << 5) | (offset >> 8));
+		}
+		else {
+			dst[dstPos++] = (uint8_t)((7 << 5) | (offset >> 8));
+			dst[dstPos++] = (uint8_t)(len - 2 - 7);
+		}
+		dst[dstPos++] = (uint8_t)offset;
+
+		// Add the positions inside the match so later data can refer to them
+		size_t end = pos + len;
+		for(pos++; pos < end && pos + 2 < srcLen; pos++) {
+			hashTable[lzHash(&src[pos])] = (uint16_t)pos;
+		}
+		pos = end;
+		litStart = pos;
+	}
+
+	if (!lzLiterals(&src[litStart], srcLen - litStart, dst, dstPos, dstLen)) {
+		return 0;
+	}
+	return dstPos;
+}
+
+// static
+size_t SpiFlashLz::decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen) {
+	size_t srcPos = 0;
+	size_t dstPos = 0;
+	while(srcPos < srcLen) {
+		uint8_t ctrl = src[srcPos++];
+		if (ctrl < 32) {
+			size_t count = ctrl + 1;
+			if (srcPos + count > srcLen || dstPos + count > dstLen) {
+				return 0;
+			}
+			memcpy(&dst[dstPos], &src[srcPos], count);
+			srcPos += count;
+			dstPos += count;
+			continue;
+		}
+
+		size_t len = ctrl >> 5;
+		if (len == 7) {
+			if (srcPos >= srcLen) {
+				return 0;
+			}
+			len += src[srcPos++];
+		}
+		len += 2;
+		if (srcPos >= srcLen) {
+			return 0;
+		}
+		size_t offset = (((size_t)ctrl & 0x1f) << 8) + src[srcPos++] + 1;
+		if (offset > dstPos || dstPos + len > dstLen) {
+			return 0;
+		}
+
+		// Byte at a time, because the match can overlap the data being written
+		const uint8_t *ref = &dst[dstPos - offset];
+		for(size_t ii = 0; ii < len; ii++) {
+			dst[dstPos + ii] = ref[ii];
+		}
+		dstPos += len;
+	}
+	return dstPos;
+}
+
+
+SpiFlashCompressRegion::SpiFlashCompressRegion(SpiFlashBase &flash, size_t startAddr, size_t len) :
+	flash(flash), startAddr(startAddr), endAddr(startAddr + len) {
+}
+
+SpiFlashCompressRegion::HeaderStatus SpiFlashCompressRegion::readHeader(size_t addr, BlockHeader &hdr) {
+	if (addr + sizeof(hdr) > endAddr) {
+		return HeaderStatus::ERASED;
+	}
+	flash.readData(addr, &hdr, sizeof(hdr));
+	if (SpiFlashBase::isErasedBuffer(&hdr, sizeof(hdr))) {
+		return HeaderStatus::ERASED;
+	}
+	if (hdr.magic != HEADER_MAGIC || hdr.storedLen != (uint16_t)~hdr.storedLenCheck || hdr.storedLen == 0 ||
+		hdr.storedLen > hdr.rawLen || hdr.rawLen > BLOCK_SIZE || addr + sizeof(hdr) + hdr.storedLen > endAddr) {
+		return HeaderStatus::INVALID;
+	}
+	return HeaderStatus::VALID;
+}
+
+size_t SpiFlashCompressRegion::resync(size_t addr) {
+	// This is a byte at a time search, but it's only needed after an interrupted write or corruption
+	uint8_t buf[64];
+	for(addr++; addr + sizeof(BlockHeader) <= endAddr; ) {
+		size_t count = endAddr - addr;
+		if (count > sizeof(buf)) {
+			count = sizeof(buf);
+		}
+		flash.readData(addr, buf, count);
+		if (SpiFlashBase::isErasedBuffer(buf, count)) {
+			return addr;
+		}
+
+		for(size_t ii = 0; ii + sizeof(BlockHeader) <= count; ii++) {
+			uint16_t magic;
+			memcpy(&magic, &buf[ii], sizeof(magic));
+
+			BlockHeader hdr;
+			if (magic == HEADER_MAGIC && readHeader(addr + ii, hdr) == HeaderStatus::VALID) {
+				return addr + ii;
+			}
+		}
+
+		// The next buffer overlaps this one so a header that crosses the end isn't missed
+		addr += count - sizeof(BlockHeader) + 1;
+	}
+	return endAddr;
+}
+
+// static
+uint32_t SpiFlashCompressRegion::headerCrc(const BlockHeader &hdr) {
+	return SpiFlashBase::crc32(&hdr, offsetof(BlockHeader, crc));
+}
+
+
+SpiFlashCompressWriter::SpiFlashCompressWriter(SpiFlashBase &flash, size_t startAddr, size_t len) :
+	SpiFlashCompressRegion(flash, startAddr, len), writeAddr(startAddr) {
+}
+
+SpiFlashCompressWriter::~SpiFlashCompressWriter() {
+	flush();
+}
+
+bool SpiFlashCompressWriter::begin() {
+	writeAddr = startAddr;
+	rawOffset = 0;
+	rawLen = 0;
+	tailLen = 0;
+	full = false;
+
+	valid = flash.isValid();
+	if (!valid) {
+		return false;
+	}
+
+	size_t addr = startAddr;
+	while(addr < endAddr) {
+		BlockHeader hdr;
+		HeaderStatus status = readHeader(addr, hdr);
+		if (status == HeaderStatus::ERASED) {
+			break;
+		}
+		if (status == HeaderStatus::INVALID) {
+			// Interrupted while writing a header, so continue after whatever was written
+			addr = resync(addr);
+			continue;
+		}
+		rawOffset = hdr.rawOffset + hdr.rawLen;
+		addr += sizeof(hdr) + hdr.storedLen;
+	}
+	writeAddr = addr;
+	if (writeAddr >= endAddr) {
+		writeAddr = endAddr;
+		full = true;
+	}
+	return true;
+}
+
+size_t SpiFlashCompressWriter::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t SpiFlashCompressWriter::write(const uint8_t *buf, size_t size) {
+	if (!valid) {
+		return 0;
+	}
+
+	size_t done = 0;
+	while(done < size) {
+		if (rawLen == BLOCK_SIZE && !writeBlock()) {
+			break;
+		}
+		size_t count = BLOCK_SIZE - rawLen;
+		if (count > size - done) {
+			count = size - done;
+		}
+		memcpy(&rawBuf[rawLen], &buf[done], count);
+		rawLen += count;
+		done += count;
+	}
+	return done;
+}
+
+bool SpiFlashCompressWriter::flush() {
+	if (!valid) {
+		return true;
+	}
+	bool result = (rawLen == 0 || writeBlock());
+	if (tailLen > 0) {
+		flash.writeData(writeAddr - tailLen, outBuf, tailLen);
+		tailLen = 0;
+	}
+	return result;
+}
+
+void SpiFlashCompressWriter::clear() {
+	flash.eraseRange(startAddr, endAddr - startAddr);
+	writeAddr = startAddr;
+	rawOffset = 0;
+	rawLen = 0;
+	tailLen = 0;
+	full = false;
+}
+
+bool SpiFlashCompressWriter::writeBlock() {
+	if (full) {
+		return false;
+	}
+
+	// The block goes after the end of the last block, which hasn't been programmed yet
+	BlockHeader hdr;
+	uint8_t *blockBuf = &outBuf[tailLen];
+	uint8_t *data = &blockBuf[sizeof(hdr)];
+
+	// Data that doesn't get smaller is stored as is
+	size_t storedLen = SpiFlashLz::compress(rawBuf, rawLen, data, rawLen - 1, hashTable);
+	if (storedLen == 0) {
+		memcpy(data, rawBuf, rawLen);
+		storedLen = rawLen;
+	}
+
+	if (writeAddr + sizeof(hdr) + storedLen > endAddr) {
+		full = true;
+		return false;
+	}
+
+	hdr.magic = HEADER_MAGIC;
+	hdr.storedLen = (uint16_t)storedLen;
+	hdr.storedLenCheck = (uint16_t)~storedLen;
+	hdr.rawLen = (uint16_t)rawLen;
+	hdr.rawOffset = (uint32_t)rawOffset;
+	hdr.crc = SpiFlashBase::crc32(data, storedLen, headerCrc(hdr));
+	memcpy(blockBuf, &hdr, sizeof(hdr));
+
+	// Only program up to the last page boundary, so the blocks are packed into whole page programs. The rest is
+	// programmed with the next block or by flush(). Pages are programmed in order, so if this is interrupted the
+	// block is either not started or fails the CRC check.
+	size_t bufAddr = writeAddr - tailLen;
+	size_t total = tailLen + sizeof(hdr) + storedLen;
+	size_t pageSize = flash.getPageSize();
+	size_t newTailLen = (bufAddr + total) % pageSize;
+	if (newTailLen > total || pageSize > PAGE_BUFFER_SIZE) {
+		newTailLen = (pageSize > PAGE_BUFFER_SIZE) ? 0 : total;
+	}
+	if (total > newTailLen) {
+		flash.writeData(bufAddr, outBuf, total - newTailLen);
+		memmove(outBuf, &outBuf[total - newTailLen], newTailLen);
+	}
+	tailLen = newTailLen;
+
+	writeAddr += sizeof(hdr) + storedLen;
+	rawOffset += rawLen;
+	rawLen = 0;
+	return true;
+}
+
+
+SpiFlashCompressReader::SpiFlashCompressReader(SpiFlashBase &flash, size_t startAddr, size_t len) :
+	SpiFlashCompressRegion(flash, startAddr, len), nextAddr(startAddr) {
+}
+
+int SpiFlashCompressReader::available() {
+	if (curPos >= curLen && !loadBlock(nextAddr)) {
+		return 0;
+	}
+	size_t remaining = curLen - curPos;
+	return (remaining > INT_MAX) ? INT_MAX : (int)remaining;
+}
+
+int SpiFlashCompressReader::read() {
+	if (curPos >= curLen && !loadBlock(nextAddr)) {
+		return -1;
+	}
+	return rawBuf[curPos++];
+}
+
+int SpiFlashCompressReader::peek() {
+	if (curPos >= curLen && !loadBlock(nextAddr)) {
+		return -1;
+	}
+	return rawBuf[curPos];
+}
+
+size_t SpiFlashCompressReader::read(uint8_t *buf, size_t len) {
+	size_t done = 0;
+	while(done < len) {
+		if (curPos >= curLen && !loadBlock(nextAddr)) {
+			break;
+		}
+		size_t count = curLen - curPos;
+		if (count > len - done) {
+			count = len - done;
+		}
+		memcpy(&buf[done], &rawBuf[curPos], count);
+		curPos += count;
+		done += count;
+	}
+	return done;
+}
+
+bool SpiFlashCompressReader::seek(size_t offset) {
+	// Skip over the blocks before offset using only their headers
+	size_t addr = startAddr;
+	while(addr < endAddr) {
+		BlockHeader hdr;
+		HeaderStatus status = readHeader(addr, hdr);
+		if (status == HeaderStatus::ERASED) {
+			break;
+		}
+		if (status == HeaderStatus::INVALID) {
+			addr = resync(addr);
+			continue;
+		}
+		if (offset < hdr.rawOffset + hdr.rawLen) {
+			if (!loadBlock(addr)) {
+				break;
+			}
+			if (offset > blockOffset) {
+				curPos = offset - blockOffset;
+			}
+			return true;
+		}
+		addr += sizeof(hdr) + hdr.storedLen;
+	}
+	return false;
+}
+
+bool SpiFlashCompressReader::seekBlock(size_t blockAddr) {
+	BlockHeader hdr;
+	if (blockAddr < startAddr || readHeader(blockAddr, hdr) != HeaderStatus::VALID) {
+		return false;
+	}
+	return loadBlock(blockAddr);
+}
+
+bool SpiFlashCompressReader::loadBlock(size_t addr) {
+	// If there are no more blocks, getOffset() stays at the end of the data
+	blockOffset += curPos;
+	curPos = curLen = 0;
+
+	while(addr < endAddr) {
+		BlockHeader hdr;
+		HeaderStatus status = readHeader(addr, hdr);
+		if (status == HeaderStatus::ERASED) {
+			break;
+		}
+		if (status == HeaderStatus::INVALID) {
+			corruptBlocks++;
+			addr = resync(addr);
+			continue;
+		}
+
+		bool compressed = (hdr.storedLen < hdr.rawLen);
+		uint8_t *data = compressed ? storedBuf : rawBuf;
+		flash.readData(addr + sizeof(hdr), data, hdr.storedLen);
+		addr += sizeof(hdr) + hdr.storedLen;
+
+		if (SpiFlashBase::crc32(data, hdr.storedLen, headerCrc(hdr)) != hdr.crc ||
+			(compressed && SpiFlashLz::decompress(storedBuf, hdr.storedLen, rawBuf, hdr.rawLen) != hdr.rawLen)) {
+			corruptBlocks++;
+			continue;
+		}
+
+		nextAddr = addr;
+		blockOffset = hdr.rawOffset;
+		curLen = hdr.rawLen;
+		return true;
+	}
+
+	nextAddr = addr;
+	return false;
+}
@@ -0,0 +1,325 @@
+/**
+ * Compressed streams for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHCOMPRESS_H
+#define __SPIFLASHCOMPRESS_H
+
+#include "SpiFlashRK.h"
+
+#ifndef SPIFLASHRK_COMPRESS_BLOCK_SIZE
+/**
+ * @brief Uncompressed size of each block written by SpiFlashCompressWriter
+ *
+ * Larger blocks compress better but use more RAM, and are the unit of random access. Must be between 64 and
+ * 32768. The writer uses about 4 times this much RAM, including the compression hash table, and the reader 2 times.
+ */
+#define SPIFLASHRK_COMPRESS_BLOCK_SIZE 1024
+#endif
+
+/**
+ * @brief Small LZ77 codec, compatible with the LZF format
+ *
+ * Compression uses a hash table supplied by the caller (2 Kbyte) and no other memory. Decompression uses no
+ * memory other than the output buffer. It's fast rather than compact: text and telemetry typically compress to
+ * 30 to 50% of their size.
+ */
+class SpiFlashLz {
+public:
+	/**
+	 * @brief Compresses data
+	 *
+	 * @param src Data to compress
+	 * @param srcLen Length of src. Must be less than 65536.
+	 * @param dst Buffer for the compressed data
+	 * @param dstLen Length of dst
+	 * @param hashTable Work area of HASH_ENTRIES entries. It doesn't need to be initialized.
+	 *
+	 * @return The length of the compressed data, or 0 if it doesn't fit in dstLen bytes
+	 */
+	static size_t compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen, uint16_t *hashTable);
+
+	/**
+	 * @brief Decompresses data
+	 *
+	 * @param src Compressed data
+	 * @param srcLen Length of src
+	 * @param dst Buffer for the decompressed data
+	 * @param dstLen Length of dst
+	 *
+	 * @return The length of the decompressed data, or 0 if the data is not valid or doesn't fit in dstLen bytes
+	 */
+	static size_t decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen);
+
+	static const size_t HASH_ENTRIES = 1024;		//!< Number of entries in the compression hash table
+	static const size_t MAX_OFFSET = 8192;		//!< Furthest back a match can be
+	static const size_t MAX_MATCH = 264;			//!< Longest match
+};
+
+/**
+ * @brief A range of flash holding compressed blocks, common to SpiFlashCompressWriter and SpiFlashCompressReader
+ *
+ * Each block is a BlockHeader followed by up to SPIFLASHRK_COMPRESS_BLOCK_SIZE bytes of data compressed with
+ * SpiFlashLz, or stored as is if it doesn't compress. Blocks are written one after the other with no padding.
+ */
+class SpiFlashCompressRegion {
+public:
+	/**
+	 * @brief Header at the start of each block
+	 */
+	struct BlockHeader {
+		uint16_t magic;				//!< HEADER_MAGIC
+		uint16_t storedLen;			//!< Length of the data after the header
+		uint16_t storedLenCheck;	//!< ~storedLen
+		uint16_t rawLen;			//!< Length of the data after decompressing. Equal to storedLen if it's not compressed.
+		uint32_t rawOffset;			//!< Offset of the first byte of the block in the uncompressed stream
+		uint32_t crc;				//!< CRC-32 of the fields above and the stored data
+	};
+
+	static const uint16_t HEADER_MAGIC = 0x5a4c; //!< "LZ"
+	static const size_t BLOCK_SIZE = SPIFLASHRK_COMPRESS_BLOCK_SIZE; //!< Uncompressed size of a full block
+
+protected:
+	/**
+	 * @brief Result of readHeader()
+	 */
+	enum class HeaderStatus {
+		VALID,		//!< The header is valid, though the CRC of the data has not been checked
+		ERASED,		//!< The header is 0xff bytes, so this is the end of the data
+		INVALID		//!< The header was interrupted or is not a header
+	};
+
+	/**
+	 * @brief Construct a region
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Address of the first block
+	 * @param len Length of the region in bytes
+	 */
+	SpiFlashCompressRegion(SpiFlashBase &flash, size_t startAddr, size_t len);
+
+	/**
+	 * @brief Reads and checks the block header at addr
+	 */
+	HeaderStatus readHeader(size_t addr, BlockHeader &hdr);
+
+	/**
+	 * @brief After an invalid header at addr, finds the next valid header or the start of the erased space
+	 *
+	 * Returns endAddr if there is neither.
+	 */
+	size_t resync(size_t addr);
+
+	/**
+	 * @brief Returns the CRC-32 of the header fields before crc
+	 */
+	static uint32_t headerCrc(const BlockHeader &hdr);
+
+	SpiFlashBase &flash;
+	size_t startAddr;
+	size_t endAddr;
+};
+
+/**
+ * @brief Writes a stream of data, like a sequence of telemetry records, compressed to a range of flash
+ *
+ * Data is collected in a block buffer, and each full block is compressed with SpiFlashLz and written with a
+ * header. Blocks are packed together, and only whole pages are programmed until flush() is called, so if the data
+ * compresses 3:1, it takes about a third of the page programs, erases, and space. All buffers are
+ * members, so there's no heap allocation. Declare the object as a global or allocate it with new, as it's about
+ * 4 Kbyte with the default block size.
+ *
+ * Blocks are appended to the range until it's full. Call clear() to erase it and start again. begin() finds the
+ * end of the existing blocks, so writing continues after a reset. A block that was being written when the device
+ * reset is skipped by SpiFlashCompressReader.
+ */
+class SpiFlashCompressWriter : public Print, public SpiFlashCompressRegion {
+public:
+	/**
+	 * @brief Construct a writer
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Start of the range. Must be sector aligned to use clear().
+	 * @param len Length of the range in bytes. Must be a multiple of the sector size to use clear().
+	 */
+	SpiFlashCompressWriter(SpiFlashBase &flash, size_t startAddr, size_t len);
+
+	/**
+	 * @brief Destroys the writer, calling flush() first
+	 */
+	virtual ~SpiFlashCompressWriter();
+
+	/**
+	 * @brief Finds the end of the existing blocks. Call after flash.begin().
+	 *
+	 * This reads each block header, not the data, so it's about one 16 byte read per block. Returns false if the
+	 * flash is not valid.
+	 */
+	bool begin();
+
+	/**
+	 * @brief Writes one byte
+	 */
+	virtual size_t write(uint8_t c);
+
+	/**
+	 * @brief Writes size bytes
+	 *
+	 * @return The number of bytes written, which is less than size only if the range is full
+	 */
+	virtual size_t write(const uint8_t *buf, size_t size);
+
+	using Print::write;
+
+	/**
+	 * @brief Writes the partially filled block, if any, and programs the buffered end of the last block
+	 *
+	 * Blocks are only readable after this, or once later blocks have been written. Ending a block early compresses
+	 * less well than a full block. Returns false if the block doesn't fit in the range.
+	 */
+	bool flush();
+
+	/**
+	 * @brief Discards the buffered data and erases the range
+	 */
+	void clear();
+
+	/**
+	 * @brief Returns the address the next block will be written to
+	 *
+	 * Save this at a point of interest, then pass it to SpiFlashCompressReader::seekBlock() to read from there.
+	 * Call flush() first so the data after this point starts a new block.
+	 */
+	size_t getBlockAddr() const { return writeAddr; };
+
+	/**
+	 * @brief Returns the number of uncompressed bytes written, including the bytes still in the buffer
+	 */
+	size_t getOffset() const { return rawOffset + rawLen; };
+
+	/**
+	 * @brief Returns the number of bytes of flash used by blocks
+	 */
+	size_t getStoredSize() const { return writeAddr - startAddr; };
+
+	/**
+	 * @brief Returns true if the last block written didn't fit
+	 */
+	bool isFull() const { return full; };
+
+protected:
+	/**
+	 * @brief Compresses and writes the block buffer
+	 */
+	bool writeBlock();
+
+	static const size_t PAGE_BUFFER_SIZE = 256; //!< Largest page size that the end of the last block is buffered for
+
+	bool valid = false;
+	bool full = false;
+	size_t writeAddr;
+	size_t rawOffset = 0;
+	size_t rawLen = 0;
+	size_t tailLen = 0;
+	uint8_t rawBuf[BLOCK_SIZE];
+	uint8_t outBuf[PAGE_BUFFER_SIZE + sizeof(BlockHeader) + BLOCK_SIZE];
+	uint16_t hashTable[SpiFlashLz::HASH_ENTRIES];
+};
+
+/**
+ * @brief Reads the data written by SpiFlashCompressWriter as a Stream
+ *
+ * Each block is read with one readData() call, its CRC is checked, and it's decompressed into a buffer that
+ * read() returns data from. Blocks that fail the CRC check are skipped. seek() and seekBlock() start reading
+ * from the middle of the data without decompressing the blocks before it.
+ */
+class SpiFlashCompressReader : public Stream, public SpiFlashCompressRegion {
+public:
+	/**
+	 * @brief Construct a reader. No flash access is done until the first read.
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Start of the range, as passed to SpiFlashCompressWriter
+	 * @param len Length of the range in bytes
+	 */
+	SpiFlashCompressReader(SpiFlashBase &flash, size_t startAddr, size_t len);
+
+	/**
+	 * @brief Returns the number of bytes that can be read without reading another block, or 0 at the end
+	 */
+	virtual int available();
+
+	/**
+	 * @brief Reads one byte, or returns -1 at the end of the data
+	 */
+	virtual int read();
+
+	/**
+	 * @brief Returns the next byte without removing it, or -1 at the end of the data
+	 */
+	virtual int peek();
+
+	/**
+	 * @brief Does nothing, since a reader has no output
+	 */
+	virtual void flush() {};
+
+	/**
+	 * @brief Does nothing, since a reader can't be written to
+	 */
+	virtual size_t write(uint8_t c) { return 0; };
+
+	/**
+	 * @brief Reads up to len bytes
+	 *
+	 * @return The number of bytes read, which is less than len only at the end of the data
+	 */
+	size_t read(uint8_t *buf, size_t len);
+
+	/**
+	 * @brief Moves to an offset in the uncompressed data
+	 *
+	 * This reads the block headers from the start of the range to find the block containing offset, then reads
+	 * only that block. Returns false if offset is past the end of the data.
+	 */
+	bool seek(size_t offset);
+
+	/**
+	 * @brief Moves to the start of the block at blockAddr, from SpiFlashCompressWriter::getBlockAddr()
+	 *
+	 * Returns false if there isn't a valid block there.
+	 */
+	bool seekBlock(size_t blockAddr);
+
+	/**
+	 * @brief Returns the offset in the uncompressed data of the next byte that will be read
+	 */
+	size_t getOffset() const { return blockOffset + curPos; };
+
+	/**
+	 * @brief Returns the number of blocks skipped because they were not valid or their CRC did not match
+	 */
+	uint32_t getCorruptBlocks() const { return corruptBlocks; };
+
+protected:
+	/**
+	 * @brief Loads the first valid block at or after addr into rawBuf
+	 *
+	 * @return false at the end of the data
+	 */
+	bool loadBlock(size_t addr);
+
+	size_t nextAddr;
+	size_t blockOffset = 0;
+	size_t curPos = 0;
+	size_t curLen = 0;
+	uint32_t corruptBlocks = 0;
+	uint8_t rawBuf[BLOCK_SIZE];
+	uint8_t storedBuf[BLOCK_SIZE];
+};
+
+#endif /* __SPIFLASHCOMPRESS_H */
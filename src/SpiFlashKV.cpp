@@ -0,0 +1,467 @@
+#include "Particle.h"
+
+#include "SpiFlashKV.h"
+
+SpiFlashKV::SpiFlashKV(SpiFlashBase &flash, size_t startAddr, size_t numSectors, size_t maxKeys) :
+	flash(flash), startAddr(startAddr), numSectors(numSectors), maxKeys(maxKeys) {
+
+	// Power of 2 with at least twice as many entries as keys, so probe sequences stay short
+	hashTableSize = 4;
+	while(hashTableSize < maxKeys * 2) {
+		hashTableSize *= 2;
+	}
+	sectorSize = flash.getSectorSize();
+}
+
+SpiFlashKV::~SpiFlashKV() {
+	delete[] hashTable;
+}
+
+bool SpiFlashKV::begin() {
+	sectorSize = flash.getSectorSize();
+	headSequence = tailSequence = 0;
+	writeOffset = 0;
+	compactOffset = 0;
+	numKeys = 0;
+	liveBytes = 0;
+
+	if (!hashTable) {
+		hashTable = new IndexEntry[hashTableSize];
+	}
+	valid = (numSectors >= 3 && hashTable != 0 && flash.isValid());
+	if (!valid) {
+		return false;
+	}
+	for(size_t ii = 0; ii < hashTableSize; ii++) {
+		hashTable[ii].addr = EMPTY;
+	}
+
+	// The head is the sector with the highest sequence number. The sectors in use are the ones before it with
+	// consecutive sequence numbers.
+	for(size_t ii = 0; ii < numSectors; ii++) {
+		uint32_t seq = readSequence(ii);
+		if (seq > headSequence) {
+			headSequence = seq;
+		}
+	}
+	if (headSequence == 0) {
+		// Empty
+		return true;
+	}
+	tailSequence = headSequence;
+	while(headSequence - tailSequence + 1 < numSectors && tailSequence - 1 >= numSectors &&
+		readSequence((tailSequence - 1) % numSectors) == tailSequence - 1) {
+		tailSequence--;
+	}
+
+	// Build the hash table by reading the records from oldest to newest, so the last record for each key wins
+	for(uint32_t seq = tailSequence; seq <= headSequence; seq++) {
+		size_t sectorStart = sectorAddr(seq % numSectors);
+		size_t sectorEnd = sectorStart + sectorSize;
+		size_t offset = sizeof(SectorHeader);
+
+		RecordHeader hdr;
+		char key[MAX_KEY_LEN];
+		bool crcValid;
+		size_t len;
+		while((len = readRecord(sectorStart + offset, sectorEnd, hdr, key, crcValid)) != 0) {
+			if (crcValid) {
+				uint32_t hash = hashKey(key, hdr.keyLen);
+				bool found;
+				size_t entry = findEntry(key, hdr.keyLen, hash, found);
+				if (found) {
+					liveBytes -= hashTable[entry].recordLen;
+				}
+
+				if (hdr.flags & FLAG_DELETED) {
+					if (found) {
+						removeEntry(entry);
+						numKeys--;
+					}
+				}
+				else
+				if (found || numKeys < maxKeys) {
+					if (!found) {
+						hashTable[entry].hash = hash;
+						numKeys++;
+					}
+					hashTable[entry].addr = (uint32_t)(sectorStart + offset);
+					hashTable[entry].recordLen = (uint16_t)len;
+					liveBytes += len;
+				}
+			}
+			offset += len;
+		}
+
+		if (seq == headSequence) {
+			bool blank = (offset + sizeof(hdr) > sectorSize) ||
+				(hdr.keyLen == 0xff && hdr.flags == 0xff && hdr.valueLen == 0xffff && hdr.crc == 0xffffffff);
+
+			// A damaged header from a reset during a write can't be written over, so start a new sector
+			writeOffset = blank ? offset : sectorSize;
+		}
+	}
+
+	return true;
+}
+
+bool SpiFlashKV::put(const char *key, const void *value, size_t len) {
+	return writeRecord(key, value, len, false);
+}
+
+int SpiFlashKV::get(const char *key, void *buf, size_t bufLen) {
+	size_t keyLen = key ? strlen(key) : 0;
+	if (!valid || keyLen == 0 || keyLen > MAX_KEY_LEN) {
+		return -1;
+	}
+
+	bool found;
+	int valueLen = -1;
+	findEntry(key, keyLen, hashKey(key, keyLen), found, buf, bufLen, &valueLen);
+
+	return found ? valueLen : -1;
+}
+
+bool SpiFlashKV::contains(const char *key) {
+	size_t keyLen = key ? strlen(key) : 0;
+	if (!valid || keyLen == 0 || keyLen > MAX_KEY_LEN) {
+		return false;
+	}
+
+	bool found;
+	findEntry(key, keyLen, hashKey(key, keyLen), found);
+	return found;
+}
+
+bool SpiFlashKV::remove(const char *key) {
+	return writeRecord(key, 0, 0, true);
+}
+
+bool SpiFlashKV::compactStep(bool force) {
+	if (!valid || headSequence == 0 || tailSequence == headSequence) {
+		return false;
+	}
+	if (!force && getFreeSectors() >= compactThreshold) {
+		return false;
+	}
+
+	size_t sectorStart = sectorAddr(tailSequence % numSectors);
+	if (compactOffset < sizeof(SectorHeader)) {
+		compactOffset = sizeof(SectorHeader);
+	}
+
+	RecordHeader hdr;
+	char key[MAX_KEY_LEN];
+	bool crcValid;
+	size_t addr = sectorStart + compactOffset;
+	size_t len = readRecord(addr, sectorStart + sectorSize, hdr, key, crcValid);
+	if (len == 0) {
+		// Everything current has been copied out of the oldest sector
+		flash.sectorErase(sectorStart);
+		tailSequence++;
+		compactOffset = sizeof(SectorHeader);
+		return true;
+	}
+
+	if (!crcValid || (hdr.flags & FLAG_DELETED) != 0) {
+		// Deleted keys don't need to be kept once they're in the oldest sector, because there are no older
+		// records for the key left to hide
+		compactOffset += len;
+		return true;
+	}
+
+	// The record is current if the hash table entry for its key points to it
+	uint32_t hash = hashKey(key, hdr.keyLen);
+	size_t mask = hashTableSize - 1;
+	size_t entry;
+	for(entry = hash & mask; hashTable[entry].addr != EMPTY; entry = (entry + 1) & mask) {
+		if (hashTable[entry].hash == hash && hashTable[entry].addr == addr) {
+			break;
+		}
+	}
+	if (hashTable[entry].addr == EMPTY) {
+		compactOffset += len;
+		return true;
+	}
+
+	if (!makeRoom(len, true)) {
+		return false;
+	}
+
+	size_t dest = sectorAddr(headSequence % numSectors) + writeOffset;
+	uint8_t buf[256];
+	for(size_t offset = 0; offset < len; offset += sizeof(buf)) {
+		size_t count = len - offset;
+		if (count > sizeof(buf)) {
+			count = sizeof(buf);
+		}
+		flash.readData(addr + offset, buf, count);
+		flash.writeData(dest + offset, buf, count);
+	}
+	writeOffset += len;
+	compactOffset += len;
+	hashTable[entry].addr = (uint32_t)dest;
+
+	return true;
+}
+
+size_t SpiFlashKV::getMaxValueSize(size_t keyLen) const {
+	size_t result = sectorSize - sizeof(SectorHeader) - sizeof(RecordHeader) - keyLen;
+	if (result > 0xffff) {
+		result = 0xffff;
+	}
+	return result;
+}
+
+// static
+uint32_t SpiFlashKV::hashKey(const char *key, size_t keyLen) {
+	uint32_t hash = 2166136261UL;
+	for(size_t ii = 0; ii < keyLen; ii++) {
+		hash ^= (uint8_t)key[ii];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+size_t SpiFlashKV::findEntry(const char *key, size_t keyLen, uint32_t hash, bool &found, void *buf, size_t bufLen, int *valueLen) {
+	size_t mask = hashTableSize - 1;
+
+	found = false;
+	for(size_t entry = hash & mask; ; entry = (entry + 1) & mask) {
+		const IndexEntry &e = hashTable[entry];
+		if (e.addr == EMPTY) {
+			return entry;
+		}
+		if (e.hash != hash || e.recordLen < sizeof(RecordHeader) + keyLen) {
+			continue;
+		}
+
+		// Read the whole record if it fits, so a lookup of a small value is a single read
+		uint32_t scratch[64];
+		size_t readLen = e.recordLen;
+		if (readLen > sizeof(scratch)) {
+			readLen = sizeof(RecordHeader) + keyLen;
+		}
+		flash.readData(e.addr, scratch, readLen);
+
+		const RecordHeader *hdr = (const RecordHeader *)scratch;
+		const uint8_t *recordKey = (const uint8_t *)scratch + sizeof(RecordHeader);
+		if (hdr->keyLen != keyLen || memcmp(recordKey, key, keyLen) != 0) {
+			// Different key with the same hash
+			continue;
+		}
+
+		found = true;
+		if (valueLen) {
+			*valueLen = hdr->valueLen;
+
+			size_t count = (hdr->valueLen < bufLen) ? hdr->valueLen : bufLen;
+			if (readLen == e.recordLen) {
+				memcpy(buf, recordKey + keyLen, count);
+			}
+			else {
+				flash.readData(e.addr + sizeof(RecordHeader) + keyLen, buf, count);
+			}
+		}
+		return entry;
+	}
+}
+
+void SpiFlashKV::removeEntry(size_t entry) {
+	size_t mask = hashTableSize - 1;
+
+	// Move back any later entries in the probe sequence that would no longer be reachable
+	for(size_t next = (entry + 1) & mask; hashTable[next].addr != EMPTY; next = (next + 1) & mask) {
+		size_t home = hashTable[next].hash & mask;
+		bool reachable = (next > entry) ? (home > entry && home <= next) : (home > entry || home <= next);
+		if (!reachable) {
+			hashTable[entry] = hashTable[next];
+			entry = next;
+		}
+	}
+	hashTable[entry].addr = EMPTY;
+}
+
+bool SpiFlashKV::writeRecord(const char *key, const void *value, size_t len, bool deleted) {
+	size_t keyLen = key ? strlen(key) : 0;
+	if (!valid || keyLen == 0 || keyLen > MAX_KEY_LEN || len > getMaxValueSize(keyLen)) {
+		return false;
+	}
+
+	uint32_t hash = hashKey(key, keyLen);
+	bool found;
+	size_t entry = findEntry(key, keyLen, hash, found);
+	if (deleted && !found) {
+		return false;
+	}
+	if (!deleted && !found && numKeys >= maxKeys) {
+		return false;
+	}
+
+	size_t recordLen = sizeof(RecordHeader) + keyLen + len;
+
+	if (!deleted && found && hashTable[entry].recordLen == recordLen) {
+		// Don't write anything if the value hasn't changed
+		size_t valueAddr = hashTable[entry].addr + sizeof(RecordHeader) + keyLen;
+		bool same = true;
+		uint8_t buf[64];
+		for(size_t offset = 0; offset < len && same; offset += sizeof(buf)) {
+			size_t count = len - offset;
+			if (count > sizeof(buf)) {
+				count = sizeof(buf);
+			}
+			flash.readData(valueAddr + offset, buf, count);
+			same = memcmp(buf, (const uint8_t *)value + offset, count) == 0;
+		}
+		if (same) {
+			return true;
+		}
+	}
+
+	// Leave one sector free for garbage collection and one for records that don't fit at the end of sectors
+	size_t usable = (numSectors - 2) * (sectorSize - sizeof(SectorHeader));
+	size_t newLiveBytes = liveBytes - (found ? hashTable[entry].recordLen : 0) + (deleted ? 0 : recordLen);
+	if (newLiveBytes > usable) {
+		return false;
+	}
+
+	// Garbage collection only changes the addresses in the hash table, so entry is still valid after this
+	if (!makeRoom(recordLen, false)) {
+		return false;
+	}
+
+	RecordHeader hdr;
+	hdr.keyLen = (uint8_t)keyLen;
+	hdr.flags = deleted ? FLAG_DELETED : 0;
+	hdr.valueLen = (uint16_t)len;
+	hdr.crc = SpiFlashBase::crc32(&hdr, offsetof(RecordHeader, crc));
+	hdr.crc = SpiFlashBase::crc32(key, keyLen, hdr.crc);
+	hdr.crc = SpiFlashBase::crc32(value, len, hdr.crc);
+
+	// Write small records with a single writeData so they're usually a single page program
+	size_t addr = sectorAddr(headSequence % numSectors) + writeOffset;
+	uint8_t buf[256];
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(&buf[sizeof(hdr)], key, keyLen);
+	// value is NULL for remove(), and memcpy() from NULL is undefined even for 0 bytes
+	if (recordLen <= sizeof(buf)) {
+		if (len) {
+			memcpy(&buf[sizeof(hdr) + keyLen], value, len);
+		}
+		flash.writeData(addr, buf, recordLen);
+	}
+	else {
+		flash.writeData(addr, buf, sizeof(hdr) + keyLen);
+		if (len) {
+			flash.writeData(addr + sizeof(hdr) + keyLen, value, len);
+		}
+	}
+	writeOffset += recordLen;
+
+	if (found) {
+		liveBytes -= hashTable[entry].recordLen;
+	}
+	if (deleted) {
+		removeEntry(entry);
+		numKeys--;
+	}
+	else {
+		if (!found) {
+			hashTable[entry].hash = hash;
+			numKeys++;
+		}
+		hashTable[entry].addr = (uint32_t)addr;
+		hashTable[entry].recordLen = (uint16_t)recordLen;
+		liveBytes += recordLen;
+	}
+
+	// Incremental garbage collection, when free sectors are running low
+	compactStep();
+
+	return true;
+}
+
+bool SpiFlashKV::makeRoom(size_t len, bool forCompact) {
+	if (headSequence == 0) {
+		startSector((uint32_t)numSectors);
+	}
+
+	size_t compactions = 0;
+	while(writeOffset + len > sectorSize) {
+		// Garbage collection can use the last free sector, because it frees a sector when it's done
+		if (getFreeSectors() > (forCompact ? 0 : 1)) {
+			startSector(headSequence + 1);
+			continue;
+		}
+		if (forCompact || ++compactions > numSectors) {
+			return false;
+		}
+
+		// Finish compacting the oldest sector to free it
+		uint32_t tail = tailSequence;
+		while(tailSequence == tail) {
+			if (!compactStep(true)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void SpiFlashKV::startSector(uint32_t sequence) {
+	size_t sectorIndex = sequence % numSectors;
+	eraseIfNeeded(sectorIndex);
+
+	SectorHeader hdr;
+	hdr.magic = HEADER_MAGIC;
+	hdr.sequence = sequence;
+	hdr.sequenceCheck = ~sequence;
+	flash.writeData(sectorAddr(sectorIndex), &hdr, sizeof(hdr));
+
+	if (headSequence == 0) {
+		tailSequence = sequence;
+	}
+	headSequence = sequence;
+	writeOffset = sizeof(SectorHeader);
+}
+
+size_t SpiFlashKV::readRecord(size_t addr, size_t sectorEnd, RecordHeader &hdr, char *key, bool &crcValid) {
+	memset(&hdr, 0xff, sizeof(hdr));
+	crcValid = false;
+	if (addr + sizeof(hdr) > sectorEnd) {
+		return 0;
+	}
+
+	flash.readData(addr, &hdr, sizeof(hdr));
+	if (hdr.keyLen == 0 || hdr.keyLen > MAX_KEY_LEN) {
+		return 0;
+	}
+	size_t len = sizeof(hdr) + hdr.keyLen + hdr.valueLen;
+	if (addr + len > sectorEnd) {
+		return 0;
+	}
+	flash.readData(addr + sizeof(hdr), key, hdr.keyLen);
+
+	uint32_t crc = SpiFlashBase::crc32(&hdr, offsetof(RecordHeader, crc));
+	crc = SpiFlashBase::crc32(key, hdr.keyLen, crc);
+	crc = flash.crc32Range(addr + sizeof(hdr) + hdr.keyLen, hdr.valueLen, crc);
+	crcValid = (crc == hdr.crc);
+
+	return len;
+}
+
+uint32_t SpiFlashKV::readSequence(size_t sectorIndex) {
+	SectorHeader hdr;
+	flash.readData(sectorAddr(sectorIndex), &hdr, sizeof(hdr));
+
+	if (hdr.magic != HEADER_MAGIC || hdr.sequenceCheck != ~hdr.sequence || hdr.sequence % numSectors != sectorIndex) {
+		return 0;
+	}
+	return hdr.sequence;
+}
+
+void SpiFlashKV::eraseIfNeeded(size_t sectorIndex) {
+	if (!flash.isErased(sectorAddr(sectorIndex), sectorSize)) {
+		flash.sectorErase(sectorAddr(sectorIndex));
+	}
+}
@@ -0,0 +1,233 @@
+/**
+ * Key-value store for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHKV_H
+#define __SPIFLASHKV_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Log-structured key-value store for small values like configuration and calibration data
+ *
+ * Setting a key appends a record with the key and value to the head sector, so a write is normally a single
+ * page program and never requires reading or erasing a sector first. A hash table in RAM maps the hash of each
+ * key to the address of its newest record, so a lookup is normally a single readData() of the record.
+ *
+ * Older copies of a key and deleted keys are left in the flash until garbage collection reaches them. The sectors
+ * are used in a ring, and garbage collection copies the records that are still current from the oldest sector
+ * to the head, then erases the oldest sector. This is done a record at a time as the store fills, so no single
+ * write has to wait for a whole sector to be compacted. It can also be done from loop() with compactStep().
+ *
+ * begin() reads every record to build the hash table, so keep the number of sectors small.
+ */
+class SpiFlashKV {
+public:
+	/**
+	 * @brief Construct a key-value store using part of a flash chip
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Address of the first sector to use. Must be sector aligned.
+	 * @param numSectors Number of sectors to use. Must be at least 3. One sector is always kept free for
+	 * garbage collection.
+	 * @param maxKeys Maximum number of keys (default: 64). The hash table uses 12 bytes of RAM per entry,
+	 * with twice as many entries as keys.
+	 */
+	SpiFlashKV(SpiFlashBase &flash, size_t startAddr, size_t numSectors, size_t maxKeys = 64);
+	virtual ~SpiFlashKV();
+
+	/**
+	 * @brief Reads the records and builds the hash table. Call after flash.begin().
+	 *
+	 * Returns false if the flash is not valid, numSectors is too small, or the hash table could not be
+	 * allocated.
+	 */
+	bool begin();
+
+	/**
+	 * @brief Sets the value of a key
+	 *
+	 * @param key Key, a c-string of 1 to MAX_KEY_LEN characters
+	 * @param value Value to store
+	 * @param len Length of value. Can be 0.
+	 *
+	 * Returns false if the store is full or the key or value are too long. Setting a key to the value it
+	 * already has does not write anything.
+	 */
+	bool put(const char *key, const void *value, size_t len);
+
+	/**
+	 * @brief Gets the value of a key
+	 *
+	 * @param key Key to look up
+	 * @param buf Buffer to store the value in
+	 * @param bufLen Length of buf. If the value is longer, only bufLen bytes are copied.
+	 *
+	 * Returns the length of the value, or -1 if the key does not exist.
+	 */
+	int get(const char *key, void *buf, size_t bufLen);
+
+	/**
+	 * @brief Returns true if the key exists. Only reads the header and key of the record, not the value.
+	 */
+	bool contains(const char *key);
+
+	/**
+	 * @brief Deletes a key
+	 *
+	 * Returns false if the key does not exist or the store is full.
+	 */
+	bool remove(const char *key);
+
+	/**
+	 * @brief Does one step of garbage collection
+	 *
+	 * Copies one current record from the oldest sector to the head, or erases the oldest sector if there are
+	 * no more records to copy. Returns false if there is nothing to do because there are enough free sectors.
+	 * Set force to true to do a step anyway, as long as there is more than one sector in use.
+	 */
+	bool compactStep(bool force = false);
+
+	/**
+	 * @brief Returns the number of keys
+	 */
+	size_t getNumKeys() const { return numKeys; };
+
+	/**
+	 * @brief Returns the number of bytes used by the current records, including their headers
+	 */
+	size_t getLiveBytes() const { return liveBytes; };
+
+	/**
+	 * @brief Returns the number of sectors that have been erased and not yet used
+	 */
+	size_t getFreeSectors() const { return headSequence ? (numSectors - (headSequence - tailSequence + 1)) : numSectors; };
+
+	/**
+	 * @brief Returns the largest value that can be stored with a key of keyLen characters
+	 */
+	size_t getMaxValueSize(size_t keyLen) const;
+
+	/**
+	 * @brief Sets the number of free sectors below which writes also do a garbage collection step (default: 2)
+	 */
+	inline SpiFlashKV &withCompactThreshold(size_t value) { compactThreshold = value; return *this; };
+
+	/**
+	 * @brief Header at the start of each sector
+	 */
+	struct SectorHeader {
+		uint32_t magic;				//!< HEADER_MAGIC
+		uint32_t sequence;			//!< Sequence number, congruent to the sector index modulo numSectors
+		uint32_t sequenceCheck;		//!< ~sequence
+	};
+
+	/**
+	 * @brief Header before each record, followed by the key (without a null terminator) and the value
+	 */
+	struct RecordHeader {
+		uint8_t keyLen;				//!< Length of the key
+		uint8_t flags;				//!< FLAG_DELETED if the key was deleted, otherwise 0
+		uint16_t valueLen;			//!< Length of the value
+		uint32_t crc;				//!< CRC-32 of the first 4 bytes of the header, the key, and the value
+	};
+
+	static const uint32_t HEADER_MAGIC = 0x564b4653; //!< "SFKV"
+	static const size_t MAX_KEY_LEN = 64;	//!< Maximum length of a key
+	static const uint8_t FLAG_DELETED = 0x01; //!< RecordHeader flags for a deleted key
+
+protected:
+	/**
+	 * @brief Entry in the hash table
+	 */
+	struct IndexEntry {
+		uint32_t hash;				//!< Hash of the key
+		uint32_t addr;				//!< Address of the newest record for the key, or EMPTY
+		uint16_t recordLen;			//!< Length of the record including the header
+	};
+
+	static const uint32_t EMPTY = 0xffffffff;
+
+	/**
+	 * @brief Address of the sector at index on the flash chip
+	 */
+	size_t sectorAddr(size_t index) const { return startAddr + index * sectorSize; };
+
+	/**
+	 * @brief Returns the FNV-1a hash of a key
+	 */
+	static uint32_t hashKey(const char *key, size_t keyLen);
+
+	/**
+	 * @brief Finds the hash table entry for a key
+	 *
+	 * Returns the index of the entry for the key, or the empty entry where it would be inserted. If the entry
+	 * was found, the value is read into buf if it fits. Only reads the flash if the hash matches.
+	 */
+	size_t findEntry(const char *key, size_t keyLen, uint32_t hash, bool &found, void *buf = 0, size_t bufLen = 0, int *valueLen = 0);
+
+	/**
+	 * @brief Removes the hash table entry at index, moving later entries back so no tombstone is needed
+	 */
+	void removeEntry(size_t index);
+
+	/**
+	 * @brief Writes a record for key at the head, making room first, and updates the hash table
+	 */
+	bool writeRecord(const char *key, const void *value, size_t len, bool deleted);
+
+	/**
+	 * @brief Makes sure the head sector has room for a record of len bytes
+	 *
+	 * @param len Length of the record including the header
+	 * @param forCompact true when called from garbage collection, which may use the last free sector
+	 */
+	bool makeRoom(size_t len, bool forCompact);
+
+	/**
+	 * @brief Starts a new head sector with the given sequence number
+	 */
+	void startSector(uint32_t sequence);
+
+	/**
+	 * @brief Reads the record at addr and checks its CRC
+	 *
+	 * Returns the record length, or 0 if there is no record or the header is damaged. crcValid is false if the
+	 * record was not completely written.
+	 */
+	size_t readRecord(size_t addr, size_t sectorEnd, RecordHeader &hdr, char *key, bool &crcValid);
+
+	/**
+	 * @brief Returns the sequence number in the header of the sector at index, or 0 if the header is not valid
+	 */
+	uint32_t readSequence(size_t index);
+
+	/**
+	 * @brief Erases the sector at index unless it's already blank
+	 */
+	void eraseIfNeeded(size_t index);
+
+	SpiFlashBase &flash;
+	size_t startAddr;
+	size_t numSectors;
+	size_t sectorSize = 4096;
+	size_t maxKeys;
+	size_t compactThreshold = 2;
+
+	IndexEntry *hashTable = 0;
+	size_t hashTableSize = 0;
+	size_t numKeys = 0;
+	size_t liveBytes = 0;
+
+	bool valid = false;
+	uint32_t headSequence = 0;
+	uint32_t tailSequence = 0;
+	size_t writeOffset = 0;
+	size_t compactOffset = 0;
+};
+
+#endif /* __SPIFLASHKV_H */
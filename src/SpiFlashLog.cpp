@@ -0,0 +1,240 @@
+#include "Particle.h"
+
+#include "SpiFlashLog.h"
+
+SpiFlashLog::SpiFlashLog(SpiFlashBase &flash, size_t startAddr, size_t numSectors) :
+	flash(flash), startAddr(startAddr), numSectors(numSectors) {
+
+	sectorSize = flash.getSectorSize();
+}
+
+bool SpiFlashLog::begin() {
+	sectorSize = flash.getSectorSize();
+	headSequence = tailSequence = 0;
+	writeOffset = 0;
+	headersRead = 0;
+	nextSectorErased = false;
+
+	valid = (numSectors >= 2 && flash.isValid());
+	if (!valid) {
+		return false;
+	}
+
+	// From the first valid sector up to the head, the sequence numbers increase. After the head, there is an
+	// erased sector, then the older sectors that have smaller sequence numbers. Sector 0 is only invalid if the
+	// log is empty or the head is the last sector, in which case sector 0 is the erased sector after it.
+	size_t low = 0;
+	uint32_t firstSeq = readSequence(0);
+	if (firstSeq == 0) {
+		low = 1;
+		firstSeq = readSequence(1);
+		if (firstSeq == 0) {
+			// Empty
+			return true;
+		}
+	}
+
+	// Binary search for the last sector with a sequence number >= firstSeq
+	size_t high = numSectors - 1;
+	uint32_t lowSeq = firstSeq;
+	while(low < high) {
+		size_t mid = low + (high - low + 1) / 2;
+		uint32_t seq = readSequence(mid);
+		if (seq >= firstSeq) {
+			low = mid;
+			lowSeq = seq;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	size_t headIndex = low;
+	headSequence = lowSeq;
+
+	// If the log has wrapped, the oldest sector is the one after the erased sector
+	uint32_t seq = readSequence((headIndex + 2) % numSectors);
+	if (seq != 0 && seq == headSequence + 2 - numSectors) {
+		tailSequence = seq;
+	}
+	else {
+		tailSequence = firstSeq;
+	}
+
+	// The erase-ahead may have been interrupted
+	eraseIfNeeded((headIndex + 1) % numSectors);
+	nextSectorErased = true;
+
+	writeOffset = findWriteOffset();
+
+	return true;
+}
+
+bool SpiFlashLog::append(const void *data, size_t len) {
+	if (!valid || len == 0 || len > getMaxRecordSize()) {
+		return false;
+	}
+
+	if (headSequence == 0) {
+		startSector((uint32_t)numSectors);
+	}
+	else
+	if (writeOffset + sizeof(RecordHeader) + len > sectorSize) {
+		startSector(headSequence + 1);
+	}
+
+	RecordHeader hdr;
+	hdr.length = (uint16_t)len;
+	hdr.lengthCheck = (uint16_t)~hdr.length;
+	hdr.crc = SpiFlashBase::crc32(data, len);
+
+	// If this is interrupted the CRC won't match, so read() skips the record
+	size_t addr = sectorAddr(headSequence % numSectors) + writeOffset;
+	flash.writeData(addr, &hdr, sizeof(hdr));
+	flash.writeData(addr + sizeof(hdr), data, len);
+	writeOffset += sizeof(hdr) + len;
+
+	return true;
+}
+
+int SpiFlashLog::read(SpiFlashLogCursor &cursor, void *buf, size_t bufLen) {
+	if (!valid || headSequence == 0) {
+		return -1;
+	}
+
+	while(true) {
+		if (cursor.sequence < tailSequence || cursor.sequence > headSequence) {
+			// New cursor, or the sector it was reading has been erased
+			cursor.sequence = tailSequence;
+			cursor.offset = sizeof(SectorHeader);
+		}
+		if (cursor.offset < sizeof(SectorHeader)) {
+			cursor.offset = sizeof(SectorHeader);
+		}
+		if (cursor.sequence == headSequence && cursor.offset >= writeOffset) {
+			return -1;
+		}
+
+		size_t addr = sectorAddr(cursor.sequence % numSectors);
+
+		RecordHeader hdr;
+		bool found = false;
+		if (cursor.offset + sizeof(hdr) <= sectorSize) {
+			flash.readData(addr + cursor.offset, &hdr, sizeof(hdr));
+			found = hdr.lengthCheck == (uint16_t)~hdr.length && hdr.length != 0 &&
+				cursor.offset + sizeof(hdr) + hdr.length <= sectorSize;
+		}
+		if (!found) {
+			// End of the records in this sector
+			if (cursor.sequence == headSequence) {
+				return -1;
+			}
+			cursor.sequence++;
+			cursor.offset = sizeof(SectorHeader);
+			continue;
+		}
+
+		size_t dataAddr = addr + cursor.offset + sizeof(hdr);
+		cursor.offset += sizeof(hdr) + hdr.length;
+
+		size_t count = (hdr.length < bufLen) ? hdr.length : bufLen;
+		flash.readData(dataAddr, buf, count);
+		uint32_t crc = SpiFlashBase::crc32(buf, count);
+
+		// The CRC covers the whole record, even if only part of it fits in buf
+		crc = flash.crc32Range(dataAddr + count, hdr.length - count, crc);
+
+		if (crc != hdr.crc) {
+			corruptRecords++;
+			continue;
+		}
+		return hdr.length;
+	}
+}
+
+void SpiFlashLog::clear() {
+	for(size_t index = 0; index < numSectors; index++) {
+		eraseIfNeeded(index);
+	}
+	headSequence = tailSequence = 0;
+	writeOffset = 0;
+	nextSectorErased = false;
+}
+
+size_t SpiFlashLog::getMaxRecordSize() const {
+	size_t result = sectorSize - sizeof(SectorHeader) - sizeof(RecordHeader);
+	if (result > 0xfffe) {
+		result = 0xfffe;
+	}
+	return result;
+}
+
+uint32_t SpiFlashLog::readSequence(size_t index) {
+	SectorHeader hdr;
+	flash.readData(sectorAddr(index), &hdr, sizeof(hdr));
+	headersRead++;
+
+	if (hdr.magic != HEADER_MAGIC || hdr.sequenceCheck != ~hdr.sequence || hdr.sequence % numSectors != index) {
+		return 0;
+	}
+	return hdr.sequence;
+}
+
+bool SpiFlashLog::isSectorBlank(size_t index) {
+	return flash.isErased(sectorAddr(index), sectorSize);
+}
+
+void SpiFlashLog::eraseIfNeeded(size_t index) {
+	// A sector with a valid header is never blank, so don't bother reading the rest of it
+	if (readSequence(index) != 0 || !isSectorBlank(index)) {
+		flash.sectorErase(sectorAddr(index));
+	}
+}
+
+void SpiFlashLog::startSector(uint32_t sequence) {
+	size_t index = sequence % numSectors;
+
+	// Normally the sector was already erased by the erase-ahead
+	if (!nextSectorErased || headSequence == 0) {
+		eraseIfNeeded(index);
+	}
+
+	SectorHeader hdr;
+	hdr.magic = HEADER_MAGIC;
+	hdr.sequence = sequence;
+	hdr.sequenceCheck = ~sequence;
+	flash.writeData(sectorAddr(index), &hdr, sizeof(hdr));
+
+	if (headSequence == 0) {
+		tailSequence = sequence;
+	}
+	headSequence = sequence;
+	writeOffset = sizeof(SectorHeader);
+
+	// Erase the next sector now. Once the log has wrapped, this discards the oldest sector.
+	if (tailSequence + numSectors < sequence + 2) {
+		tailSequence = sequence + 2 - (uint32_t)numSectors;
+	}
+	eraseIfNeeded((index + 1) % numSectors);
+	nextSectorErased = true;
+}
+
+size_t SpiFlashLog::findWriteOffset() {
+	size_t addr = sectorAddr(headSequence % numSectors);
+	size_t offset = sizeof(SectorHeader);
+
+	while(offset + sizeof(RecordHeader) <= sectorSize) {
+		RecordHeader hdr;
+		flash.readData(addr + offset, &hdr, sizeof(hdr));
+
+		if (hdr.length == 0xffff && hdr.lengthCheck == 0xffff && hdr.crc == 0xffffffff) {
+			// Blank, this is where the next record goes
+			break;
+		}
+		if (hdr.lengthCheck != (uint16_t)~hdr.length || hdr.length == 0 || offset + sizeof(hdr) + hdr.length > sectorSize) {
+			// Damaged header, from a reset during a write. Start the next record in a new sector.
+			return sectorSize;
+		}
+		offset += sizeof(hdr) + hdr.length;
+	}
+	return offset;
+}
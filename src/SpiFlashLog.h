@@ -0,0 +1,182 @@
+/**
+ * Circular log store for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHLOG_H
+#define __SPIFLASHLOG_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Position in a SpiFlashLog, used to read records from oldest to newest
+ *
+ * A new cursor, or one that has fallen behind because the sectors it was reading have been reused, starts at
+ * the oldest record.
+ */
+struct SpiFlashLogCursor {
+	uint32_t sequence = 0;		//!< Sequence number of the sector being read
+	size_t offset = 0;			//!< Offset of the next record in the sector, 0 for the first record
+};
+
+/**
+ * @brief Append-only circular log of variable length records
+ *
+ * Records are appended at the head of the log. When the log is full, the oldest sector of records is erased
+ * to make room. Each record has a length and a CRC-32 so a record that was being written when the device
+ * reset is skipped when reading.
+ *
+ * Each sector starts with a header containing a sequence number. The sequence number of the sector at
+ * index i is always congruent to i modulo the number of sectors, so the sequence numbers increase from the
+ * start of the range up to the head of the log, then drop. begin() finds the head by a binary search over
+ * the sector headers, so recovery reads about log2(numSectors) headers instead of scanning the whole chip,
+ * then scans the records of the head sector only.
+ *
+ * The sector after the head is always kept erased (erase-ahead), so starting a new sector never needs to
+ * wait for an erase of that sector and there is always a blank sector between the head and the tail.
+ */
+class SpiFlashLog {
+public:
+	/**
+	 * @brief Construct a log using part of a flash chip
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Address of the first sector to use. Must be sector aligned.
+	 * @param numSectors Number of sectors to use. Must be at least 2.
+	 */
+	SpiFlashLog(SpiFlashBase &flash, size_t startAddr, size_t numSectors);
+
+	/**
+	 * @brief Finds the head and tail of the log. Call after flash.begin().
+	 *
+	 * Returns false if the flash is not valid or numSectors is too small.
+	 */
+	bool begin();
+
+	/**
+	 * @brief Appends a record to the log
+	 *
+	 * @param data Record data
+	 * @param len Length of the record. Must be between 1 and getMaxRecordSize().
+	 *
+	 * If the record does not fit in the rest of the head sector, it's written at the start of the next sector,
+	 * which may erase the oldest sector.
+	 */
+	bool append(const void *data, size_t len);
+
+	/**
+	 * @brief Reads the record at cursor and advances the cursor to the next record
+	 *
+	 * @param cursor Position to read from
+	 * @param buf Buffer to store the record in
+	 * @param bufLen Length of buf. If the record is longer, only bufLen bytes are copied.
+	 *
+	 * Returns the length of the record, or -1 if there are no more records. Records that fail the CRC check
+	 * are skipped.
+	 */
+	int read(SpiFlashLogCursor &cursor, void *buf, size_t bufLen);
+
+	/**
+	 * @brief Erases every sector in the log that is not already blank
+	 */
+	void clear();
+
+	/**
+	 * @brief Returns true if the log has no records
+	 */
+	bool isEmpty() const { return headSequence == 0; };
+
+	/**
+	 * @brief Returns the largest record that can be appended
+	 */
+	size_t getMaxRecordSize() const;
+
+	/**
+	 * @brief Returns the sequence number of the sector records are being appended to, or 0 if empty
+	 */
+	uint32_t getHeadSequence() const { return headSequence; };
+
+	/**
+	 * @brief Returns the sequence number of the sector containing the oldest records, or 0 if empty
+	 */
+	uint32_t getTailSequence() const { return tailSequence; };
+
+	/**
+	 * @brief Returns the number of sector headers read by the last call to begin()
+	 */
+	size_t getHeadersRead() const { return headersRead; };
+
+	/**
+	 * @brief Returns the number of records skipped by read() because their CRC did not match
+	 */
+	uint32_t getCorruptRecords() const { return corruptRecords; };
+
+	/**
+	 * @brief Header at the start of each sector
+	 */
+	struct SectorHeader {
+		uint32_t magic;				//!< HEADER_MAGIC
+		uint32_t sequence;			//!< Sequence number, congruent to the sector index modulo numSectors
+		uint32_t sequenceCheck;		//!< ~sequence
+	};
+
+	/**
+	 * @brief Header before each record
+	 */
+	struct RecordHeader {
+		uint16_t length;			//!< Length of the data, not including this header
+		uint16_t lengthCheck;		//!< ~length
+		uint32_t crc;				//!< CRC-32 of the data
+	};
+
+	static const uint32_t HEADER_MAGIC = 0x474c4653; //!< "SFLG"
+
+protected:
+	/**
+	 * @brief Address of the sector at index on the flash chip
+	 */
+	size_t sectorAddr(size_t index) const { return startAddr + index * sectorSize; };
+
+	/**
+	 * @brief Returns the sequence number in the header of the sector at index, or 0 if the header is not valid
+	 */
+	uint32_t readSequence(size_t index);
+
+	/**
+	 * @brief Returns true if the entire sector reads as 0xff
+	 */
+	bool isSectorBlank(size_t index);
+
+	/**
+	 * @brief Erases the sector at index unless it's already blank
+	 */
+	void eraseIfNeeded(size_t index);
+
+	/**
+	 * @brief Starts a new head sector with the given sequence number and erases the sector after it
+	 */
+	void startSector(uint32_t sequence);
+
+	/**
+	 * @brief Finds the offset of the end of the records in the head sector
+	 */
+	size_t findWriteOffset();
+
+	SpiFlashBase &flash;
+	size_t startAddr;
+	size_t numSectors;
+	size_t sectorSize = 4096;
+
+	bool valid = false;
+	uint32_t headSequence = 0;
+	uint32_t tailSequence = 0;
+	size_t writeOffset = 0;
+	bool nextSectorErased = false;
+	size_t headersRead = 0;
+	uint32_t corruptRecords = 0;
+};
+
+#endif /* __SPIFLASHLOG_H */
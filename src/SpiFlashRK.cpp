@@ -3,252 +3,2750 @@
 #include "SpiFlashRK.h"
 
 
+bool SpiFlashBase::eraseRange(size_t addr, size_t len) {
+	if ((addr % sectorSize) != 0 || (len % sectorSize) != 0) {
+		return false;
+	}
+
+	if (addr == 0 && capacity != 0 && len >= capacity) {
+		chipErase();
+		return true;
+	}
+
+	for(size_t offset = 0; offset < len; offset += sectorSize) {
+		sectorErase(addr + offset);
+	}
+	return true;
+}
+
+bool SpiFlashBase::syncData(size_t addr, const void *buf, size_t bufLen, SpiFlashSyncStats *stats) {
+	SpiFlashSyncStats localStats;
+	if (!stats) {
+		stats = &localStats;
+	}
+	*stats = SpiFlashSyncStats();
+
+	if (bufLen == 0) {
+		return true;
+	}
+
+	uint8_t *sectorBuf = new uint8_t[sectorSize];
+	if (!sectorBuf) {
+		return false;
+	}
+
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	while(bufLen > 0) {
+		size_t sectorOffset = addr % sectorSize;
+		size_t sectorAddr = addr - sectorOffset;
+
+		size_t count = sectorSize - sectorOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		// Programming can only change bits from 1 to 0
+		uint8_t *flashData = &sectorBuf[sectorOffset];
+		readData(addr, flashData, count);
+
+		bool needErase = false;
+		for(size_t ii = 0; ii < count; ii++) {
+			if ((curBuf[ii] & ~flashData[ii]) != 0) {
+				needErase = true;
+				break;
+			}
+		}
+
+		if (needErase) {
+			// Keep the data in the sector outside of the range
+			if (sectorOffset > 0) {
+				readData(sectorAddr, sectorBuf, sectorOffset);
+			}
+			if (sectorOffset + count < sectorSize) {
+				readData(addr + count, &flashData[count], sectorSize - sectorOffset - count);
+			}
+			memcpy(flashData, curBuf, count);
+
+			sectorErase(sectorAddr);
+			stats->sectorsErased++;
+
+			// Pages that are all 0xff are already blank
+			for(size_t offset = 0; offset < sectorSize; offset += pageSize) {
+				if (isErasedBuffer(&sectorBuf[offset], pageSize)) {
+					stats->pagesSkipped++;
+				}
+				else {
+					writeData(sectorAddr + offset, &sectorBuf[offset], pageSize);
+					stats->pagesProgrammed++;
+				}
+			}
+		}
+		else {
+			stats->sectorsSkipped++;
+
+			for(size_t offset = 0; offset < count; ) {
+				size_t pageCount = pageSize - ((addr + offset) % pageSize);
+				if (pageCount > count - offset) {
+					pageCount = count - offset;
+				}
+				if (memcmp(&curBuf[offset], &flashData[offset], pageCount) == 0) {
+					stats->pagesSkipped++;
+				}
+				else {
+					writeData(addr + offset, &curBuf[offset], pageCount);
+					stats->pagesProgrammed++;
+				}
+				offset += pageCount;
+			}
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+
+	delete[] sectorBuf;
+	return true;
+}
+
+bool SpiFlashBase::isErased(size_t addr, size_t len) {
+	uint32_t buf[64];
+	size_t count = 16;
+
+	while(len > 0) {
+		if (count > len) {
+			count = len;
+		}
+		readData(addr, buf, count);
+		if (!isErasedBuffer(buf, count)) {
+			return false;
+		}
+		addr += count;
+		len -= count;
+		count = sizeof(buf);
+	}
+	return true;
+}
+
+size_t SpiFlashBase::findErasedBoundary(size_t start, size_t end) {
+	if (end <= start) {
+		return start;
+	}
+
+	// Pages low to high - 1 are not known yet. Pages before low contain data, and high and after are erased.
+	size_t low = 0;
+	size_t high = (end - start + pageSize - 1) / pageSize;
+	while(low < high) {
+		size_t mid = low + (high - low) / 2;
+		size_t pageAddr = start + mid * pageSize;
+		size_t len = (end - pageAddr < pageSize) ? (end - pageAddr) : pageSize;
+
+		if (isErased(pageAddr, len)) {
+			high = mid;
+		}
+		else {
+			low = mid + 1;
+		}
+	}
+
+	size_t result = start + low * pageSize;
+	return (result < end) ? result : end;
+}
+
+// static
+bool SpiFlashBase::isErasedBuffer(const void *buf, size_t len) {
+	const uint8_t *p = (const uint8_t *)buf;
+
+	// Compare a word at a time. memcpy is used because buf may not be aligned, and it compiles to a load.
+	for(; len >= sizeof(uint32_t); len -= sizeof(uint32_t), p += sizeof(uint32_t)) {
+		uint32_t word;
+		memcpy(&word, p, sizeof(word));
+		if (word != 0xffffffff) {
+			return false;
+		}
+	}
+	for(; len > 0; len--, p++) {
+		if (*p != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SpiFlashBase::readChunks(size_t addr, size_t len, std::function<void(const uint8_t *buf, size_t len)> handler) {
+	uint8_t buf[256];
+
+	while(len > 0) {
+		size_t count = (len < sizeof(buf)) ? len : sizeof(buf);
+		readData(addr, buf, count);
+		handler(buf, count);
+		addr += count;
+		len -= count;
+	}
+}
+
+uint32_t SpiFlashBase::crc32Range(size_t addr, size_t len, uint32_t crc) {
+	readChunks(addr, len, [&crc](const uint8_t *buf, size_t count) {
+		crc = crc32(buf, count, crc);
+	});
+	return crc;
+}
+
+#ifdef SPIFLASHRK_SMALL_CRC32
+
+// static
+uint32_t SpiFlashBase::crc32(const void *data, size_t len, uint32_t crc) {
+	static const uint32_t table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	const uint8_t *p = (const uint8_t *)data;
+
+	crc = ~crc;
+	for(size_t ii = 0; ii < len; ii++) {
+		crc ^= p[ii];
+		crc = (crc >> 4) ^ table[crc & 0xf];
+		crc = (crc >> 4) ^ table[crc & 0xf];
+	}
+	return ~crc;
+}
+
+#else
+
+// CRC-32 slice-by-4 tables. crc32Table[0] is the standard byte-at-a-time table, and crc32Table[k][b] is the
+// CRC of byte b followed by k zero bytes.
+static const uint32_t crc32Table[4][256] = {
+	{
+		0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+		0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+		0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+		0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+		0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+		0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+		0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+		0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+		0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+		0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+		0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+		0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+		0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+		0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+		0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+		0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+		0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+		0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+		0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+		0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+		0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+		0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+		0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+		0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+		0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+		0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+		0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+		0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+		0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+		0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+		0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+		0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+	},
+	{
+		0x00000000, 0x191b3141, 0x32366282, 0x2b2d53c3, 0x646cc504, 0x7d77f445, 0x565aa786, 0x4f4196c7,
+		0xc8d98a08, 0xd1c2bb49, 0xfaefe88a, 0xe3f4d9cb, 0xacb54f0c, 0xb5ae7e4d, 0x9e832d8e, 0x87981ccf,
+		0x4ac21251, 0x53d92310, 0x78f470d3, 0x61ef4192, 0x2eaed755, 0x37b5e614, 0x1c98b5d7, 0x05838496,
+		0x821b9859, 0x9b00a918, 0xb02dfadb, 0xa936cb9a, 0xe6775d5d, 0xff6c6c1c, 0xd4413fdf, 0xcd5a0e9e,
+		0x958424a2, 0x8c9f15e3, 0xa7b24620, 0xbea97761, 0xf1e8e1a6, 0xe8f3d0e7, 0xc3de8324, 0xdac5b265,
+		0x5d5daeaa, 0x44469feb, 0x6f6bcc28, 0x7670fd69, 0x39316bae, 0x202a5aef, 0x0b07092c, 0x121c386d,
+		0xdf4636f3, 0xc65d07b2, 0xed705471, 0xf46b6530, 0xbb2af3f7, 0xa231c2b6, 0x891c9175, 0x9007a034,
+		0x179fbcfb, 0x0e848dba, 0x25a9de79, 0x3cb2ef38, 0x73f379ff, 0x6ae848be, 0x41c51b7d, 0x58de2a3c,
+		0xf0794f05, 0xe9627e44, 0xc24f2d87, 0xdb541cc6, 0x94158a01, 0x8d0ebb40, 0xa623e883, 0xbf38d9c2,
+		0x38a0c50d, 0x21bbf44c, 0x0a96a78f, 0x138d96ce, 0x5ccc0009, 0x45d73148, 0x6efa628b, 0x77e153ca,
+		0xbabb5d54, 0xa3a06c15, 0x888d3fd6, 0x91960e97, 0xded79850, 0xc7cca911, 0xece1fad2, 0xf5facb93,
+		0x7262d75c, 0x6b79e61d, 0x4054b5de, 0x594f849f, 0x160e1258, 0x0f152319, 0x243870da, 0x3d23419b,
+		0x65fd6ba7, 0x7ce65ae6, 0x57cb0925, 0x4ed03864, 0x0191aea3, 0x188a9fe2, 0x33a7cc21, 0x2abcfd60,
+		0xad24e1af, 0xb43fd0ee, 0x9f12832d, 0x8609b26c, 0xc94824ab, 0xd05315ea, 0xfb7e4629, 0xe2657768,
+		0x2f3f79f6, 0x362448b7, 0x1d091b74, 0x04122a35, 0x4b53bcf2, 0x52488db3, 0x7965de70, 0x607eef31,
+		0xe7e6f3fe, 0xfefdc2bf, 0xd5d0917c, 0xcccba03d, 0x838a36fa, 0x9a9107bb, 0xb1bc5478, 0xa8a76539,
+		0x3b83984b, 0x2298a90a, 0x09b5fac9, 0x10aecb88, 0x5fef5d4f, 0x46f46c0e, 0x6dd93fcd, 0x74c20e8c,
+		0xf35a1243, 0xea412302, 0xc16c70c1, 0xd8774180, 0x9736d747, 0x8e2de606, 0xa500b5c5, 0xbc1b8484,
+		0x71418a1a, 0x685abb5b, 0x4377e898, 0x5a6cd9d9, 0x152d4f1e, 0x0c367e5f, 0x271b2d9c, 0x3e001cdd,
+		0xb9980012, 0xa0833153, 0x8bae6290, 0x92b553d1, 0xddf4c516, 0xc4eff457, 0xefc2a794, 0xf6d996d5,
+		0xae07bce9, 0xb71c8da8, 0x9c31de6b, 0x852aef2a, 0xca6b79ed, 0xd37048ac, 0xf85d1b6f, 0xe1462a2e,
+		0x66de36e1, 0x7fc507a0, 0x54e85463, 0x4df36522, 0x02b2f3e5, 0x1ba9c2a4, 0x30849167, 0x299fa026,
+		0xe4c5aeb8, 0xfdde9ff9, 0xd6f3cc3a, 0xcfe8fd7b, 0x80a96bbc, 0x99b25afd, 0xb29f093e, 0xab84387f,
+		0x2c1c24b0, 0x350715f1, 0x1e2a4632, 0x07317773, 0x4870e1b4, 0x516bd0f5, 0x7a468336, 0x635db277,
+		0xcbfad74e, 0xd2e1e60f, 0xf9ccb5cc, 0xe0d7848d, 0xaf96124a, 0xb68d230b, 0x9da070c8, 0x84bb4189,
+		0x03235d46, 0x1a386c07, 0x31153fc4, 0x280e0e85, 0x674f9842, 0x7e54a903, 0x5579fac0, 0x4c62cb81,
+		0x8138c51f, 0x9823f45e, 0xb30ea79d, 0xaa1596dc, 0xe554001b, 0xfc4f315a, 0xd7626299, 0xce7953d8,
+		0x49e14f17, 0x50fa7e56, 0x7bd72d95, 0x62cc1cd4, 0x2d8d8a13, 0x3496bb52, 0x1fbbe891, 0x06a0d9d0,
+		0x5e7ef3ec, 0x4765c2ad, 0x6c48916e, 0x7553a02f, 0x3a1236e8, 0x230907a9, 0x0824546a, 0x113f652b,
+		0x96a779e4, 0x8fbc48a5, 0xa4911b66, 0xbd8a2a27, 0xf2cbbce0, 0xebd08da1, 0xc0fdde62, 0xd9e6ef23,
+		0x14bce1bd, 0x0da7d0fc, 0x268a833f, 0x3f91b27e, 0x70d024b9, 0x69cb15f8, 0x42e6463b, 0x5bfd777a,
+		0xdc656bb5, 0xc57e5af4, 0xee530937, 0xf7483876, 0xb809aeb1, 0xa1129ff0, 0x8a3fcc33, 0x9324fd72
+	},
+	{
+		0x00000000, 0x01c26a37, 0x0384d46e, 0x0246be59, 0x0709a8dc, 0x06cbc2eb, 0x048d7cb2, 0x054f1685,
+		0x0e1351b8, 0x0fd13b8f, 0x0d9785d6, 0x0c55efe1, 0x091af964, 0x08d89353, 0x0a9e2d0a, 0x0b5c473d,
+		0x1c26a370, 0x1de4c947, 0x1fa2771e, 0x1e601d29, 0x1b2f0bac, 0x1aed619b, 0x18abdfc2, 0x1969b5f5,
+		0x1235f2c8, 0x13f798ff, 0x11b126a6, 0x10734c91, 0x153c5a14, 0x14fe3023, 0x16b88e7a, 0x177ae44d,
+		0x384d46e0, 0x398f2cd7, 0x3bc9928e, 0x3a0bf8b9, 0x3f44ee3c, 0x3e86840b, 0x3cc03a52, 0x3d025065,
+		0x365e1758, 0x379c7d6f, 0x35dac336, 0x3418a901, 0x3157bf84, 0x3095d5b3, 0x32d36bea, 0x331101dd,
+		0x246be590, 0x25a98fa7, 0x27ef31fe, 0x262d5bc9, 0x23624d4c, 0x22a0277b, 0x20e69922, 0x2124f315,
+		0x2a78b428, 0x2bbade1f, 0x29fc6046, 0x283e0a71, 0x2d711cf4, 0x2cb376c3, 0x2ef5c89a, 0x2f37a2ad,
+		0x709a8dc0, 0x7158e7f7, 0x731e59ae, 0x72dc3399, 0x7793251c, 0x76514f2b, 0x7417f172, 0x75d59b45,
+		0x7e89dc78, 0x7f4bb64f, 0x7d0d0816, 0x7ccf6221, 0x798074a4, 0x78421e93, 0x7a04a0ca, 0x7bc6cafd,
+		0x6cbc2eb0, 0x6d7e4487, 0x6f38fade, 0x6efa90e9, 0x6bb5866c, 0x6a77ec5b, 0x68315202, 0x69f33835,
+		0x62af7f08, 0x636d153f, 0x612bab66, 0x60e9c151, 0x65a6d7d4, 0x6464bde3, 0x662203ba, 0x67e0698d,
+		0x48d7cb20, 0x4915a117, 0x4b531f4e, 0x4a917579, 0x4fde63fc, 0x4e1c09cb, 0x4c5ab792, 0x4d98dda5,
+		0x46c49a98, 0x4706f0af, 0x45404ef6, 0x448224c1, 0x41cd3244, 0x400f5873, 0x4249e62a, 0x438b8c1d,
+		0x54f16850, 0x55330267, 0x5775bc3e, 0x56b7d609, 0x53f8c08c, 0x523aaabb, 0x507c14e2, 0x51be7ed5,
+		0x5ae239e8, 0x5b2053df, 0x5966ed86, 0x58a487b1, 0x5deb9134, 0x5c29fb03, 0x5e6f455a, 0x5fad2f6d,
+		0xe1351b80, 0xe0f771b7, 0xe2b1cfee, 0xe373a5d9, 0xe63cb35c, 0xe7fed96b, 0xe5b86732, 0xe47a0d05,
+		0xef264a38, 0xeee4200f, 0xeca29e56, 0xed60f461, 0xe82fe2e4, 0xe9ed88d3, 0xebab368a, 0xea695cbd,
+		0xfd13b8f0, 0xfcd1d2c7, 0xfe976c9e, 0xff5506a9, 0xfa1a102c, 0xfbd87a1b, 0xf99ec442, 0xf85cae75,
+		0xf300e948, 0xf2c2837f, 0xf0843d26, 0xf1465711, 0xf4094194, 0xf5cb2ba3, 0xf78d95fa, 0xf64fffcd,
+		0xd9785d60, 0xd8ba3757, 0xdafc890e, 0xdb3ee339, 0xde71f5bc, 0xdfb39f8b, 0xddf521d2, 0xdc374be5,
+		0xd76b0cd8, 0xd6a966ef, 0xd4efd8b6, 0xd52db281, 0xd062a404, 0xd1a0ce33, 0xd3e6706a, 0xd2241a5d,
+		0xc55efe10, 0xc49c9427, 0xc6da2a7e, 0xc7184049, 0xc25756cc, 0xc3953cfb, 0xc1d382a2, 0xc011e895,
+		0xcb4dafa8, 0xca8fc59f, 0xc8c97bc6, 0xc90b11f1, 0xcc440774, 0xcd866d43, 0xcfc0d31a, 0xce02b92d,
+		0x91af9640, 0x906dfc77, 0x922b422e, 0x93e92819, 0x96a63e9c, 0x976454ab, 0x9522eaf2, 0x94e080c5,
+		0x9fbcc7f8, 0x9e7eadcf, 0x9c381396, 0x9dfa79a1, 0x98b56f24, 0x99770513, 0x9b31bb4a, 0x9af3d17d,
+		0x8d893530, 0x8c4b5f07, 0x8e0de15e, 0x8fcf8b69, 0x8a809dec, 0x8b42f7db, 0x89044982, 0x88c623b5,
+		0x839a6488, 0x82580ebf, 0x801eb0e6, 0x81dcdad1, 0x8493cc54, 0x8551a663, 0x8717183a, 0x86d5720d,
+		0xa9e2d0a0, 0xa820ba97, 0xaa6604ce, 0xaba46ef9, 0xaeeb787c, 0xaf29124b, 0xad6fac12, 0xacadc625,
+		0xa7f18118, 0xa633eb2f, 0xa4755576, 0xa5b73f41, 0xa0f829c4, 0xa13a43f3, 0xa37cfdaa, 0xa2be979d,
+		0xb5c473d0, 0xb40619e7, 0xb640a7be, 0xb782cd89, 0xb2cddb0c, 0xb30fb13b, 0xb1490f62, 0xb08b6555,
+		0xbbd72268, 0xba15485f, 0xb853f606, 0xb9919c31, 0xbcde8ab4, 0xbd1ce083, 0xbf5a5eda, 0xbe9834ed
+	},
+	{
+		0x00000000, 0xb8bc6765, 0xaa09c88b, 0x12b5afee, 0x8f629757, 0x37def032, 0x256b5fdc, 0x9dd738b9,
+		0xc5b428ef, 0x7d084f8a, 0x6fbde064, 0xd7018701, 0x4ad6bfb8, 0xf26ad8dd, 0xe0df7733, 0x58631056,
+		0x5019579f, 0xe8a530fa, 0xfa109f14, 0x42acf871, 0xdf7bc0c8, 0x67c7a7ad, 0x75720843, 0xcdce6f26,
+		0x95ad7f70, 0x2d111815, 0x3fa4b7fb, 0x8718d09e, 0x1acfe827, 0xa2738f42, 0xb0c620ac, 0x087a47c9,
+		0xa032af3e, 0x188ec85b, 0x0a3b67b5, 0xb28700d0, 0x2f503869, 0x97ec5f0c, 0x8559f0e2, 0x3de59787,
+		0x658687d1, 0xdd3ae0b4, 0xcf8f4f5a, 0x7733283f, 0xeae41086, 0x525877e3, 0x40edd80d, 0xf851bf68,
+		0xf02bf8a1, 0x48979fc4, 0x5a22302a, 0xe29e574f, 0x7f496ff6, 0xc7f50893, 0xd540a77d, 0x6dfcc018,
+		0x359fd04e, 0x8d23b72b, 0x9f9618c5, 0x272a7fa0, 0xbafd4719, 0x0241207c, 0x10f48f92, 0xa848e8f7,
+		0x9b14583d, 0x23a83f58, 0x311d90b6, 0x89a1f7d3, 0x1476cf6a, 0xaccaa80f, 0xbe7f07e1, 0x06c36084,
+		0x5ea070d2, 0xe61c17b7, 0xf4a9b859, 0x4c15df3c, 0xd1c2e785, 0x697e80e0, 0x7bcb2f0e, 0xc377486b,
+		0xcb0d0fa2, 0x73b168c7, 0x6104c729, 0xd9b8a04c, 0x446f98f5, 0xfcd3ff90, 0xee66507e, 0x56da371b,
+		0x0eb9274d, 0xb6054028, 0xa4b0efc6, 0x1c0c88a3, 0x81dbb01a, 0x3967d77f, 0x2bd27891, 0x936e1ff4,
+		0x3b26f703, 0x839a9066, 0x912f3f88, 0x299358ed, 0xb4446054, 0x0cf80731, 0x1e4da8df, 0xa6f1cfba,
+		0xfe92dfec, 0x462eb889, 0x549b1767, 0xec277002, 0x71f048bb, 0xc94c2fde, 0xdbf98030, 0x6345e755,
+		0x6b3fa09c, 0xd383c7f9, 0xc1366817, 0x798a0f72, 0xe45d37cb, 0x5ce150ae, 0x4e54ff40, 0xf6e89825,
+		0xae8b8873, 0x1637ef16, 0x048240f8, 0xbc3e279d, 0x21e91f24, 0x99557841, 0x8be0d7af, 0x335cb0ca,
+		0xed59b63b, 0x55e5d15e, 0x47507eb0, 0xffec19d5, 0x623b216c, 0xda874609, 0xc832e9e7, 0x708e8e82,
+		0x28ed9ed4, 0x9051f9b1, 0x82e4565f, 0x3a58313a, 0xa78f0983, 0x1f336ee6, 0x0d86c108, 0xb53aa66d,
+		0xbd40e1a4, 0x05fc86c1, 0x1749292f, 0xaff54e4a, 0x322276f3, 0x8a9e1196, 0x982bbe78, 0x2097d91d,
+		0x78f4c94b, 0xc048ae2e, 0xd2fd01c0, 0x6a4166a5, 0xf7965e1c, 0x4f2a3979, 0x5d9f9697, 0xe523f1f2,
+		0x4d6b1905, 0xf5d77e60, 0xe762d18e, 0x5fdeb6eb, 0xc2098e52, 0x7ab5e937, 0x680046d9, 0xd0bc21bc,
+		0x88df31ea, 0x3063568f, 0x22d6f961, 0x9a6a9e04, 0x07bda6bd, 0xbf01c1d8, 0xadb46e36, 0x15080953,
+		0x1d724e9a, 0xa5ce29ff, 0xb77b8611, 0x0fc7e174, 0x9210d9cd, 0x2aacbea8, 0x38191146, 0x80a57623,
+		0xd8c66675, 0x607a0110, 0x72cfaefe, 0xca73c99b, 0x57a4f122, 0xef189647, 0xfdad39a9, 0x45115ecc,
+		0x764dee06, 0xcef18963, 0xdc44268d, 0x64f841e8, 0xf92f7951, 0x41931e34, 0x5326b1da, 0xeb9ad6bf,
+		0xb3f9c6e9, 0x0b45a18c, 0x19f00e62, 0xa14c6907, 0x3c9b51be, 0x842736db, 0x96929935, 0x2e2efe50,
+		0x2654b999, 0x9ee8defc, 0x8c5d7112, 0x34e11677, 0xa9362ece, 0x118a49ab, 0x033fe645, 0xbb838120,
+		0xe3e09176, 0x5b5cf613, 0x49e959fd, 0xf1553e98, 0x6c820621, 0xd43e6144, 0xc68bceaa, 0x7e37a9cf,
+		0xd67f4138, 0x6ec3265d, 0x7c7689b3, 0xc4caeed6, 0x591dd66f, 0xe1a1b10a, 0xf3141ee4, 0x4ba87981,
+		0x13cb69d7, 0xab770eb2, 0xb9c2a15c, 0x017ec639, 0x9ca9fe80, 0x241599e5, 0x36a0360b, 0x8e1c516e,
+		0x866616a7, 0x3eda71c2, 0x2c6fde2c, 0x94d3b949, 0x090481f0, 0xb1b8e695, 0xa30d497b, 0x1bb12e1e,
+		0x43d23e48, 0xfb6e592d, 0xe9dbf6c3, 0x516791a6, 0xccb0a91f, 0x740cce7a, 0x66b96194, 0xde0506f1
+	}
+};
+
+// static
+uint32_t SpiFlashBase::crc32(const void *data, size_t len, uint32_t crc) {
+	const uint8_t *p = (const uint8_t *)data;
+
+	// Four bytes at a time, with the four table lookups independent of each other
+	crc = ~crc;
+	for(; len >= 4; len -= 4, p += 4) {
+		crc ^= (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+		crc = crc32Table[3][crc & 0xff] ^ crc32Table[2][(crc >> 8) & 0xff] ^ crc32Table[1][(crc >> 16) & 0xff] ^ crc32Table[0][crc >> 24];
+	}
+	for(; len > 0; len--, p++) {
+		crc = (crc >> 8) ^ crc32Table[0][(crc ^ *p) & 0xff];
+	}
+	return ~crc;
+}
+
+#endif /* SPIFLASHRK_SMALL_CRC32 */
+
+SpiFlashLock::SpiFlashLock() {
+	os_mutex_create(&mutex);
+	for(size_t ii = 0; ii < SPIFLASH_PRIORITY_COUNT; ii++) {
+		if (os_semaphore_create(&semaphores[ii], 0xffff, 0) != 0) {
+			semaphores[ii] = 0;
+		}
+	}
+	resetStats();
+}
+
+SpiFlashLock::~SpiFlashLock() {
+	for(size_t ii = 0; ii < SPIFLASH_PRIORITY_COUNT; ii++) {
+		if (semaphores[ii]) {
+			os_semaphore_destroy(semaphores[ii]);
+		}
+	}
+	os_mutex_destroy(mutex);
+}
+
+void SpiFlashLock::lock(uint8_t priority) {
+	if (priority >= SPIFLASH_PRIORITY_COUNT) {
+		priority = SPIFLASH_PRIORITY_COUNT - 1;
+	}
+	os_thread_t self = os_thread_current(NULL);
+	unsigned long startUs = micros();
+	bool waited = false;
+
+	os_mutex_lock(mutex);
+	if (depth > 0 && owner == self) {
+		depth++;
+		os_mutex_unlock(mutex);
+		return;
+	}
+
+	// Wait for the owner to release it and for any higher priority threads to take it first
+	while(depth > 0 || higherPriorityWaiting(priority)) {
+		if (!waited) {
+			waiting[priority]++;
+			waited = true;
+		}
+		os_mutex_unlock(mutex);
+		if (semaphores[priority]) {
+			// A give between unlocking the mutex and here is counted, so the wakeup isn't lost
+			os_semaphore_take(semaphores[priority], CONCURRENT_WAIT_FOREVER, false);
+		}
+		else {
+			delay(1);
+		}
+		os_mutex_lock(mutex);
+	}
+	if (waited) {
+		waiting[priority]--;
+	}
+	acquire(self, startUs, waited);
+	os_mutex_unlock(mutex);
+}
+
+bool SpiFlashLock::tryLock(uint8_t priority) {
+	if (priority >= SPIFLASH_PRIORITY_COUNT) {
+		priority = SPIFLASH_PRIORITY_COUNT - 1;
+	}
+	os_thread_t self = os_thread_current(NULL);
+	bool result = true;
+
+	os_mutex_lock(mutex);
+	if (depth > 0 && owner == self) {
+		depth++;
+	}
+	else
+	if (depth == 0 && !higherPriorityWaiting(priority)) {
+		acquire(self, micros(), false);
+	}
+	else {
+		result = false;
+	}
+	os_mutex_unlock(mutex);
+	return result;
+}
+
+void SpiFlashLock::unlock() {
+	os_mutex_lock(mutex);
+	if (depth > 0 && --depth == 0) {
+		unsigned long holdUs = micros() - holdStartUs;
+		stats.totalHoldUs += holdUs;
+		if (holdUs > stats.maxHoldUs) {
+			stats.maxHoldUs = holdUs;
+		}
+		owner = 0;
+		wakeWaiter();
+	}
+	os_mutex_unlock(mutex);
+}
+
+void SpiFlashLock::wakeWaiter() {
+	// A woken thread that finds the lock taken again waits for the next unlock()
+	for(size_t ii = SPIFLASH_PRIORITY_COUNT; ii-- > 0; ) {
+		if (waiting[ii] != 0) {
+			if (semaphores[ii]) {
+				os_semaphore_give(semaphores[ii], false);
+			}
+			break;
+		}
+	}
+}
+
+bool SpiFlashLock::yield(uint8_t priority) {
+	if (priority >= SPIFLASH_PRIORITY_COUNT) {
+		priority = SPIFLASH_PRIORITY_COUNT - 1;
+	}
+	os_thread_t self = os_thread_current(NULL);
+
+	os_mutex_lock(mutex);
+	bool release = (depth == 1 && owner == self && higherPriorityWaiting(priority));
+	if (release) {
+		stats.preemptions++;
+	}
+	os_mutex_unlock(mutex);
+
+	if (!release) {
+		return false;
+	}
+
+	// lock() doesn't take it back until the higher priority thread has had it
+	unlock();
+	lock(priority);
+	return true;
+}
+
+size_t SpiFlashLock::getNumWaiters() const {
+	size_t result = 0;
+
+	os_mutex_lock(mutex);
+	for(size_t ii = 0; ii < SPIFLASH_PRIORITY_COUNT; ii++) {
+		result += waiting[ii];
+	}
+	os_mutex_unlock(mutex);
+	return result;
+}
+
+void SpiFlashLock::getStats(SpiFlashLockStats &result) const {
+	os_mutex_lock(mutex);
+	result = stats;
+	os_mutex_unlock(mutex);
+}
+
+void SpiFlashLock::resetStats() {
+	os_mutex_lock(mutex);
+	memset(&stats, 0, sizeof(stats));
+	os_mutex_unlock(mutex);
+}
+
+bool SpiFlashLock::higherPriorityWaiting(uint8_t priority) const {
+	for(size_t ii = priority + 1; ii < SPIFLASH_PRIORITY_COUNT; ii++) {
+		if (waiting[ii]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void SpiFlashLock::acquire(os_thread_t self, unsigned long startUs, bool waited) {
+	owner = self;
+	depth = 1;
+	holdStartUs = micros();
+
+	stats.acquisitions++;
+	if (waited) {
+		unsigned long waitUs = holdStartUs - startUs;
+		stats.contended++;
+		stats.totalWaitUs += waitUs;
+		if (waitUs > stats.maxWaitUs) {
+			stats.maxWaitUs = waitUs;
+		}
+	}
+}
+
+
+SpiFlash *SpiFlash::asyncInstance = 0;
+
 SpiFlash::SpiFlash(SPIClass &spi, int cs) : spi(spi), cs(cs) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+	resetStats();
+#endif
+	}
+
+SpiFlash::~SpiFlash() {
+	delete[] sectorCacheSlots;
+	delete[] sectorCacheBuf;
+	delete[] sectorCacheChanged;
+	delete[] readCacheLines;
+	delete[] readCacheBuf;
+	delete[] writeCombineBuf;
+	delete deviceLock;
+
+	if (asyncInstance == this) {
+		asyncInstance = 0;
+	}
+}
+
+void SpiFlash::begin() {
+	spi.begin(cs);
+
+	digitalWrite(cs, HIGH);
+
+	// Send release from powerdown 0xab
+	wakeFromSleep();
+
+	if (useSfdp) {
+		configureFromSfdp();
+	}
+}
+
+bool SpiFlash::isValid() {
+	uint8_t foundManufacturerId = (jedecIdRead() >> 16) & 0xff;
+
+	return manufacturerId == foundManufacturerId;
+}
+
+
+void SpiFlash::beginTransaction() {
+	if (busLock) {
+		busLock->lock(operationPriority);
+	}
+
+	__SPISettings settings(spiClockSpeedMHz * MHZ, spiBitOrder, spiDataMode);
+
+	spi.beginTransaction(settings);
+	pinResetFast(cs);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsTransactions++;
+#endif
+
+	// There is some code to do this in the STM32F2xx HAL, but I don't think it's necessary to put
+	// a really tiny delay before doing the SPI transfer
+	// asm("mov r2, r2");
+}
+
+void SpiFlash::endTransaction() {
+	pinSetFast(cs);
+	spi.endTransaction();
+
+	if (busLock) {
+		busLock->unlock();
+	}
+}
+
+SpiFlash &SpiFlash::withLocking(bool value) {
+	if (value && !deviceLock) {
+		deviceLock = new SpiFlashLock();
+	}
+	else
+	if (!value && deviceLock) {
+		delete deviceLock;
+		deviceLock = 0;
+	}
+	return *this;
+}
+
+SpiFlash::OperationLock::OperationLock(SpiFlash &flash, uint8_t priority) : flash(flash) {
+	if (flash.deviceLock) {
+		flash.deviceLock->lock(priority);
+	}
+	// Nested operations, like the erase done by updateData(), use the priority of the outer operation
+	if (flash.operationDepth++ == 0) {
+		flash.operationPriority = priority;
+	}
+}
+
+SpiFlash::OperationLock::~OperationLock() {
+	if (--flash.operationDepth == 0) {
+		flash.operationPriority = SPIFLASH_PRIORITY_NORMAL;
+	}
+	if (flash.deviceLock) {
+		flash.deviceLock->unlock();
+	}
+}
+
+void SpiFlash::yieldLock() {
+	// Not in the middle of flushing the sector cache, which another thread would see half done
+	if (!deviceLock || operationDepth != 1 || sectorCacheFlushing) {
+		return;
+	}
+
+	// The other thread's operations use operationDepth and operationPriority while it has the lock
+	uint8_t priority = operationPriority;
+	operationDepth = 0;
+	deviceLock->yield(priority);
+	operationDepth = 1;
+	operationPriority = priority;
+}
+
+uint32_t SpiFlash::jedecIdRead() {
+
+	uint8_t txBuf[4], rxBuf[4];
+	txBuf[0] = 0x9f;
+
+	beginTransaction();
+	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	endTransaction();
+
+	return (rxBuf[1] << 16) | (rxBuf[2] << 8) | (rxBuf[3]);
+}
+
+uint8_t SpiFlash::readStatus() {
+	uint8_t txBuf[2], rxBuf[2];
+	txBuf[0] = 0x05; // RDSR
+	txBuf[1] = 0;
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+	statsStatusPolls++;
+#endif
+
+	beginTransaction();
+	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	endTransaction();
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_STATUS_POLL, mark, 0);
+#endif
+
+	return rxBuf[1];
+}
+
+uint8_t SpiFlash::readConfiguration() {
+	uint8_t txBuf[2], rxBuf[2];
+	txBuf[0] = 0x15; // RDCR
+	txBuf[1] = 0;
+
+	beginTransaction();
+	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	endTransaction();
+
+	return rxBuf[1];
+}
+
+
+bool SpiFlash::isWriteInProgress() {
+	bool result = (readStatus() & STATUS_WIP) != 0;
+
+	// Nothing can start a new operation without going through writeEnable(), so the chip stays idle
+	knownIdle = !result;
+	return result;
+}
+
+bool SpiFlash::waitForWriteComplete(unsigned long timeout) {
+	unsigned long startTime = millis();
+
+	// Skip reading the status register if the last read showed the chip was idle
+	if (knownIdle) {
+		return true;
 	}
 
-SpiFlash::~SpiFlash() {
+	if (timeout == 0) {
+		timeout = waitWriteCompletionTimeoutMs;
+	}
+
+	// Wait for up to 500 ms. Most operations should take much less than that.
+	while(isWriteInProgress()) {
+		if (millis() - startTime >= timeout) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+			stats.waitTimeouts++;
+#endif
+			return false;
+		}
+
+		// For long timeouts, yield the CPU
+		if (timeout > 500) {
+			delay(1);
+		}
+	}
+
+	// Log.trace("isWriteInProgress=%d time=%u", isWriteInProgress(), millis() - startTime);
+	return true;
+}
+
+// Sleeps using delay() for whole milliseconds so the cloud connection is serviced in
+// non-system-threaded mode, and delayMicroseconds() for the rest
+static void sleepUs(unsigned long us) {
+	if (us >= 1000) {
+		delay(us / 1000);
+	}
+	if (us % 1000) {
+		delayMicroseconds(us % 1000);
+	}
+}
+
+unsigned long SpiFlash::getExpectedTimeUs(WriteOperation op) const {
+	if (op >= WRITE_OP_COUNT) {
+		return 0;
+	}
+	if (expectedTimeUs[op]) {
+		return expectedTimeUs[op];
+	}
+
+	switch(op) {
+	case WRITE_OP_SECTOR_ERASE:
+		return sectorEraseTypicalMs * 1000;
+
+	case WRITE_OP_BLOCK_ERASE:
+		return blockEraseTypicalMs * 1000;
+
+	case WRITE_OP_CHIP_ERASE:
+		return chipEraseTypicalMs * 1000;
+
+	default:
+		return 0;
+	}
+}
+
+void SpiFlash::getPollTiming(WriteOperation op, size_t count, unsigned long &initialDelayUs, unsigned long &intervalUs) const {
+	unsigned long expectedUs = getExpectedTimeUs(op);
+
+	// Partial page programs take roughly proportionally less time than a full page
+	if (op == WRITE_OP_PAGE_PROGRAM && count < pageSize) {
+		expectedUs = (unsigned long)((uint64_t)expectedUs * count / pageSize);
+	}
+
+	if (expectedUs == 0) {
+		initialDelayUs = intervalUs = 0;
+		return;
+	}
+
+	// Sleep through most of the expected time. Datasheet typical times are often pessimistic
+	// so only half is used until the time has been measured on this chip.
+	initialDelayUs = expectedTimeUs[op] ? (expectedUs / 4 * 3) : (expectedUs / 2);
+
+	intervalUs = expectedUs / 64;
+	if (intervalUs < pollIntervalMinUs) {
+		intervalUs = pollIntervalMinUs;
+	}
+	if (intervalUs > pollIntervalMaxUs) {
+		intervalUs = pollIntervalMaxUs;
+	}
+}
+
+bool SpiFlash::waitForOperation(WriteOperation op, unsigned long timeoutMs, size_t count) {
+	if (!adaptivePolling) {
+		bool completed = waitForWriteComplete(timeoutMs);
+#ifdef SPIFLASHRK_ENABLE_STATS
+		if (!completed) {
+			stats.ops[statsOpFor(op)].timeouts++;
+		}
+#endif
+		return completed;
+	}
+
+	unsigned long startMs = millis();
+	unsigned long startUs = micros();
+
+	unsigned long initialDelayUs, intervalUs;
+	getPollTiming(op, count, initialDelayUs, intervalUs);
+
+	// Nothing is known about this operation yet, so back off from the minimum interval
+	bool backoff = (intervalUs == 0);
+	if (backoff) {
+		intervalUs = pollIntervalMinUs;
+	}
+
+	sleepUs(initialDelayUs);
+
+	while(isWriteInProgress()) {
+		if (millis() - startMs >= timeoutMs) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+			stats.waitTimeouts++;
+			stats.ops[statsOpFor(op)].timeouts++;
+#endif
+			return false;
+		}
+		sleepUs(intervalUs);
+
+		if (backoff && intervalUs < pollIntervalMaxUs) {
+			intervalUs += intervalUs / 2;
+		}
+	}
+
+	learnExpectedTime(op, count, micros() - startUs);
+	return true;
+}
+
+void SpiFlash::learnExpectedTime(WriteOperation op, size_t count, unsigned long elapsedUs) {
+	// Only full page programs are used to learn the page program time
+	if (op != WRITE_OP_PAGE_PROGRAM || count >= pageSize) {
+		unsigned long &expected = expectedTimeUs[op];
+
+		expected = expected ? ((uint64_t)expected * 3 + elapsedUs) / 4 : elapsedUs;
+	}
+}
+
+
+void SpiFlash::writeStatus(uint8_t status) {
+	OperationLock lock(*this, writePriority);
+
+	waitForWriteComplete();
+
+	uint8_t txBuf[2];
+	txBuf[0] = 0x01; // WRSR
+	txBuf[1] = status;
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	endTransaction();
+
+	knownIdle = false;
+}
+
+void SpiFlash::readData(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	if (bufLen == 0) {
+		return;
+	}
+
+	OperationLock lock(*this, readPriority);
+
+	// Reads entirely within a cached sector don't need to access the chip
+	if (sectorCacheNumSlots && !sectorCacheFlushing) {
+		size_t sectorAddr = addr - (addr % sectorSize);
+		if (addr + bufLen <= sectorAddr + sectorSize) {
+			for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+				SectorCacheSlot &slot = sectorCacheSlots[ii];
+				if (slot.valid && slot.addr == sectorAddr) {
+					memcpy(buf, sectorCacheData(slot) + (addr - sectorAddr), bufLen);
+					slot.lastUse = ++sectorCacheUseCounter;
+					return;
+				}
+			}
+		}
+	}
+
+	// The sector cache flush compares against the chip, so it must not read through the read cache
+	if (readCacheNumLines && bufLen < readCacheLineSize && !sectorCacheFlushing) {
+		readCacheRead(addr, curBuf, bufLen);
+	}
+	else {
+		readChip(addr, curBuf, bufLen);
+	}
+
+	// Modified data in the sector cache replaces the data read from the chip or the read cache
+	sectorCacheOverlay(addr, curBuf, bufLen);
+}
+
+void SpiFlash::readChip(size_t addr, uint8_t *buf, size_t bufLen) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+	size_t statsBytes = bufLen;
+#endif
+
+	bool suspended = readWaitForChip();
+
+	// Reads are not limited to a page, so the whole range is read with one command
+	readBegin(addr);
+	readTransfer(buf, bufLen);
+	endTransaction();
+
+	if (suspended) {
+		eraseResume();
+	}
+
+	// Data waiting in the write combining buffer is what the chip will contain once it's programmed
+	writeCombineOverlay(addr, buf, bufLen);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_READ, mark, statsBytes);
+#endif
+}
+
+bool SpiFlash::isErased(size_t addr, size_t len) {
+	OperationLock lock(*this, readPriority);
+
+	// readData() merges the modified data in the caches with the data from the chip
+	if (hasUnflushedData()) {
+		return SpiFlashBase::isErased(addr, len);
+	}
+	if (len == 0) {
+		return true;
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+	size_t statsBytes = 0;
+#endif
+
+	bool suspended = readWaitForChip();
+
+	// The whole range is one command, and the transaction ends early at the first byte that isn't 0xff
+	uint32_t buf[64];
+	size_t count = 16;
+	bool result = true;
+
+	readBegin(addr);
+	while(len > 0) {
+		if (count > len) {
+			count = len;
+		}
+		readTransfer((uint8_t *)buf, count);
+#ifdef SPIFLASHRK_ENABLE_STATS
+		statsBytes += count;
+#endif
+		if (!isErasedBuffer(buf, count)) {
+			result = false;
+			break;
+		}
+		len -= count;
+		count = sizeof(buf);
+	}
+	endTransaction();
+
+	if (suspended) {
+		eraseResume();
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_READ, mark, statsBytes);
+#endif
+	return result;
+}
+
+void SpiFlash::readChunks(size_t addr, size_t len, std::function<void(const uint8_t *buf, size_t len)> handler) {
+	OperationLock lock(*this, readPriority);
+
+	// The DMA transfers below need the asynchronous state, and readData() merges the modified data in the caches
+	if (hasUnflushedData() || isBusy() || (asyncInstance && asyncInstance->isBusy())) {
+		SpiFlashBase::readChunks(addr, len, handler);
+		return;
+	}
+	if (len == 0) {
+		return;
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+	size_t statsLen = len;
+#endif
+
+	bool suspended = readWaitForChip();
+
+	// One transaction for the whole range. Each buffer is passed to the handler while the next one is read by DMA.
+	uint8_t bufs[2][256];
+	size_t index = 0;
+	size_t count = (len < sizeof(bufs[0])) ? len : sizeof(bufs[0]);
+
+	readBegin(addr);
+	asyncStartTransfer(NULL, bufs[0], count);
+	while(count > 0) {
+		while(!asyncTransferComplete) {
+			delayMicroseconds(1);
+		}
+		len -= count;
+
+		size_t nextCount = (len < sizeof(bufs[0])) ? len : sizeof(bufs[0]);
+		if (nextCount > 0) {
+			asyncStartTransfer(NULL, bufs[index ^ 1], nextCount);
+		}
+		handler(bufs[index], count);
+
+		index ^= 1;
+		count = nextCount;
+	}
+	endTransaction();
+
+	if (suspended) {
+		eraseResume();
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_READ, mark, statsLen);
+#endif
+}
+
+bool SpiFlash::readWaitForChip() {
+	// The chip ignores reads while an erase or page program is in progress
+	bool suspended = false;
+	if (asyncState == AsyncState::ERASE_WAIT) {
+		suspended = eraseSuspend();
+		if (!suspended) {
+			waitForWriteComplete(asyncEraseTimeoutMs);
+		}
+	}
+	else
+	if (asyncState == AsyncState::WRITE_WAIT) {
+		waitForWriteComplete(pageProgramTimeoutMs);
+	}
+	else
+	if (pendingOp != WRITE_OP_COUNT) {
+		waitForOperationComplete();
+	}
+	return suspended;
+}
+
+void SpiFlash::readBegin(size_t addr) {
+	uint8_t txBuf[6];
+	size_t txLen = getInstWithAddrSize();
+
+	if (fastRead) {
+		setInstWithAddr(0x0B, addr, txBuf); // FAST_READ
+		txBuf[txLen++] = 0; // dummy byte
+	}
+	else {
+		setInstWithAddr(0x03, addr, txBuf); // READ
+	}
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, txLen, NULL);
+}
+
+void SpiFlash::readTransfer(uint8_t *buf, size_t len) {
+	while(len > 0) {
+		size_t count = len;
+		if (count > maxTransferSize) {
+			count = maxTransferSize;
+		}
+
+		spi.transfer(NULL, buf, count, NULL);
+
+		buf += count;
+		len -= count;
+	}
+}
+
+
+// Returns the 4-byte address version of a read, program, or erase instruction, or inst if there isn't one
+static uint8_t to4ByteInst(uint8_t inst) {
+	switch(inst) {
+	case 0x03: return 0x13; // READ4B
+	case 0x0B: return 0x0C; // FAST_READ4B
+	case 0x02: return 0x12; // PP4B
+	case 0x20: return 0x21; // SE4B
+	case 0x52: return 0x5C; // BE32K4B
+	case 0xD8: return 0xDC; // BE4B
+	default: return inst;
+	}
+}
+
+static bool has4ByteInst(uint8_t inst) {
+	return to4ByteInst(inst) != inst;
+}
+
+SpiFlash &SpiFlash::withNative4ByteAddressing(bool value) {
+	native4byte = value;
+	if (native4byte) {
+		if (!has4ByteInst(sectorEraseInst)) {
+			native4byte = false;
+		}
+		else {
+			// Sending a 3-byte address block erase with a 4-byte address would erase the wrong block
+			if (!has4ByteInst(block32EraseInst)) {
+				block32EraseInst = 0;
+			}
+			if (!has4ByteInst(blockEraseInst)) {
+				blockEraseInst = 0;
+			}
+		}
+	}
+	return *this;
+}
+
+void SpiFlash::setInstWithAddr(uint8_t inst, size_t addr, uint8_t *buf) {
+	uint8_t *p = buf;
+	if (native4byte) {
+		*p++ = to4ByteInst(inst);
+		*p++ = (uint8_t) (addr >> 24);
+	}
+	else {
+		*p++ = inst;
+		if (addr4byte) {
+			*p++ = (uint8_t) (addr >> 24);
+		}
+	}
+	*p++ = (uint8_t) (addr >> 16);
+	*p++ = (uint8_t) (addr >> 8);
+	*p++ = (uint8_t) addr;
+}
+
+size_t SpiFlash::getInstWithAddrSize() const {
+	return (addr4byte || native4byte) ? 5 : 4;
+}
+
+
+void SpiFlash::writeData(size_t addr, const void *buf, size_t bufLen) {
+	OperationLock lock(*this, writePriority);
+
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	sectorCacheBeforeWrite(addr, bufLen);
+
+	if (!writeCombineBuf || pageSize > writeCombineBufSize) {
+		programPages(addr, curBuf, bufLen);
+		return;
+	}
+
+	while(bufLen > 0) {
+		size_t pageOffset = addr % pageSize;
+		size_t pageStart = addr - pageOffset;
+
+		size_t count = pageSize - pageOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		if (writeCombineEnd != 0 && writeCombineAddr != pageStart) {
+			writeCombineFlush();
+		}
+
+		if (count == pageSize) {
+			// Full page, nothing to combine with
+			programPages(addr, curBuf, count);
+		}
+		else {
+			if (writeCombineEnd == 0) {
+				memset(writeCombineBuf, 0xff, pageSize);
+				writeCombineAddr = pageStart;
+				writeCombineStart = pageOffset;
+				writeCombineEnd = pageOffset + count;
+			}
+			else {
+				if (pageOffset < writeCombineStart) {
+					writeCombineStart = pageOffset;
+				}
+				if (pageOffset + count > writeCombineEnd) {
+					writeCombineEnd = pageOffset + count;
+				}
+			}
+
+			// Programming the same byte twice clears the bits that are 0 in either value
+			for(size_t ii = 0; ii < count; ii++) {
+				writeCombineBuf[pageOffset + ii] &= curBuf[ii];
+			}
+
+			if (writeCombineStart == 0 && writeCombineEnd == pageSize) {
+				writeCombineFlush();
+			}
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+void SpiFlash::programPages(size_t addr, const uint8_t *curBuf, size_t bufLen) {
+	waitForWriteComplete();
+
+	while(bufLen > 0) {
+		size_t pageOffset = addr % pageSize;
+		size_t pageStart = addr - pageOffset;
+
+		size_t count = (pageStart + pageSize) - addr;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		// Log.info("writeData addr=%lx pageOffset=%lu pageStart=%lu count=%lu pageSize=%lu", addr, pageOffset, pageStart, count, pageSize);
+
+		pageProgram(addr, curBuf, count);
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+
+		if (bufLen > 0) {
+			yieldLock();
+		}
+	}
+}
+
+bool SpiFlash::pageProgram(size_t addr, const uint8_t *buf, size_t count) {
+	uint8_t txBuf[5];
+
+	setInstWithAddr(0x02, addr, txBuf); // PAGE_PROG
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+#endif
+
+	writeEnable();
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
+	spi.transfer(buf, NULL, count, NULL);
+	endTransaction();
+
+	bool completed = waitForOperation(WRITE_OP_PAGE_PROGRAM, pageProgramTimeoutMs, count);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_PAGE_PROGRAM, mark, count);
+#endif
+	return completed;
+}
+
+SpiFlash &SpiFlash::withWriteCombining(bool value) {
+	writeCombineFlush();
+
+	delete[] writeCombineBuf;
+	writeCombineBuf = 0;
+	writeCombineBufSize = 0;
+
+	if (value) {
+		writeCombineBuf = new uint8_t[pageSize];
+		if (writeCombineBuf) {
+			writeCombineBufSize = pageSize;
+		}
+	}
+	return *this;
+}
+
+void SpiFlash::writeCombineFlush() {
+	if (writeCombineEnd == 0) {
+		return;
+	}
+	size_t start = writeCombineStart;
+	size_t end = writeCombineEnd;
+	writeCombineEnd = 0;
+
+	programPages(writeCombineAddr + start, &writeCombineBuf[start], end - start);
+}
+
+void SpiFlash::writeCombineDiscard(size_t addr, size_t len) {
+	if (writeCombineEnd != 0 && writeCombineAddr >= addr && writeCombineAddr - addr < len) {
+		writeCombineEnd = 0;
+	}
+}
+
+void SpiFlash::writeCombineOverlay(size_t addr, uint8_t *buf, size_t len) const {
+	if (writeCombineEnd == 0) {
+		return;
+	}
+	size_t pendingStart = writeCombineAddr + writeCombineStart;
+	size_t pendingEnd = writeCombineAddr + writeCombineEnd;
+	if (addr >= pendingEnd || pendingStart >= addr + len) {
+		return;
+	}
+	size_t start = (pendingStart > addr) ? pendingStart : addr;
+	size_t end = (pendingEnd < addr + len) ? pendingEnd : addr + len;
+	for(size_t cur = start; cur < end; cur++) {
+		buf[cur - addr] &= writeCombineBuf[cur - writeCombineAddr];
+	}
+}
+
+
+bool SpiFlash::updateData(size_t addr, const void *buf, size_t bufLen) {
+	OperationLock lock(*this, writePriority);
+
+	if (sectorCacheNumSlots == 0) {
+		return false;
+	}
+
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	while(bufLen > 0) {
+		size_t sectorOffset = addr % sectorSize;
+		size_t sectorAddr = addr - sectorOffset;
+
+		size_t count = sectorSize - sectorOffset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		// Find the sector in the cache, or the least recently used slot to replace
+		SectorCacheSlot *slot = 0;
+		SectorCacheSlot *victim = 0;
+		for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+			SectorCacheSlot &cur = sectorCacheSlots[ii];
+			if (cur.valid && cur.addr == sectorAddr) {
+				slot = &cur;
+				break;
+			}
+			if (!victim || (victim->valid && (!cur.valid || cur.lastUse < victim->lastUse))) {
+				victim = &cur;
+			}
+		}
+
+		if (!slot) {
+			slot = victim;
+			if (slot->dirty) {
+				sectorCacheFlushSlot(*slot);
+			}
+			slot->valid = false;
+			readData(sectorAddr, sectorCacheData(*slot), sectorSize);
+			readCacheInvalidate(sectorAddr, sectorSize);
+			slot->addr = sectorAddr;
+			slot->valid = true;
+		}
+
+		memcpy(sectorCacheData(*slot) + sectorOffset, curBuf, count);
+		readCacheInvalidate(addr, count);
+		slot->dirty = true;
+		slot->lastUse = ++sectorCacheUseCounter;
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+	return true;
+}
+
+bool SpiFlash::syncData(size_t addr, const void *buf, size_t bufLen, SpiFlashSyncStats *stats) {
+	OperationLock lock(*this, writePriority);
+
+	return SpiFlashBase::syncData(addr, buf, bufLen, stats);
+}
+
+void SpiFlash::flush() {
+	OperationLock lock(*this, writePriority);
+
+	for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+		if (sectorCacheSlots[ii].dirty) {
+			sectorCacheFlushSlot(sectorCacheSlots[ii]);
+		}
+	}
+	writeCombineFlush();
+}
+
+bool SpiFlash::hasUnflushedData() const {
+	if (writeCombineEnd != 0) {
+		return true;
+	}
+	for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+		if (sectorCacheSlots[ii].dirty) {
+			return true;
+		}
+	}
+	return false;
+}
+
+SpiFlash &SpiFlash::withSectorCache(size_t numSectors) {
+	flush();
+
+	delete[] sectorCacheSlots;
+	delete[] sectorCacheBuf;
+	delete[] sectorCacheChanged;
+	sectorCacheSlots = 0;
+	sectorCacheBuf = 0;
+	sectorCacheChanged = 0;
+	sectorCacheNumSlots = 0;
+
+	if (numSectors > 0) {
+		size_t numChunks = (sectorSize + SECTOR_CACHE_CHUNK_SIZE - 1) / SECTOR_CACHE_CHUNK_SIZE;
+		sectorCacheSlots = new SectorCacheSlot[numSectors];
+		sectorCacheBuf = new uint8_t[numSectors * sectorSize];
+		sectorCacheChanged = new uint8_t[(numChunks + 7) / 8];
+		if (sectorCacheSlots && sectorCacheBuf && sectorCacheChanged) {
+			memset(sectorCacheSlots, 0, numSectors * sizeof(SectorCacheSlot));
+			sectorCacheNumSlots = numSectors;
+		}
+		else {
+			delete[] sectorCacheSlots;
+			delete[] sectorCacheBuf;
+			delete[] sectorCacheChanged;
+			sectorCacheSlots = 0;
+			sectorCacheBuf = 0;
+			sectorCacheChanged = 0;
+		}
+	}
+	return *this;
+}
+
+void SpiFlash::sectorCacheFlushSlot(SectorCacheSlot &slot) {
+	const uint8_t *data = sectorCacheData(slot);
+
+	// The hooks in readData, writeData, and the erase functions must not see this slot
+	sectorCacheFlushing = true;
+
+	// Compare with the chip in 256 byte chunks. If no bits need to change from 0 to 1, only
+	// the changed chunks are programmed and the sector is not erased.
+	const size_t chunkSize = SECTOR_CACHE_CHUNK_SIZE;
+	uint8_t chunk[chunkSize];
+	bool needErase = false;
+	memset(sectorCacheChanged, 0, ((sectorSize + chunkSize - 1) / chunkSize + 7) / 8);
+
+	for(size_t offset = 0; offset < sectorSize; offset += chunkSize) {
+		size_t index = offset / chunkSize;
+		readData(slot.addr + offset, chunk, chunkSize);
+		for(size_t ii = 0; ii < chunkSize; ii++) {
+			uint8_t value = data[offset + ii];
+			if (value != chunk[ii]) {
+				sectorCacheChanged[index / 8] |= (uint8_t)(1 << (index % 8));
+				if ((value & ~chunk[ii]) != 0) {
+					needErase = true;
+				}
+			}
+		}
+		if (needErase) {
+			break;
+		}
+	}
+
+	if (needErase) {
+		sectorErase(slot.addr);
+	}
+
+	for(size_t offset = 0; offset < sectorSize; offset += chunkSize) {
+		bool program;
+		if (needErase) {
+			// After erasing, chunks that are all 0xff don't need to be programmed
+			program = !isErasedBuffer(&data[offset], chunkSize);
+		}
+		else {
+			size_t index = offset / chunkSize;
+			program = (sectorCacheChanged[index / 8] & (1 << (index % 8))) != 0;
+		}
+		if (program) {
+			writeData(slot.addr + offset, &data[offset], chunkSize);
+		}
+	}
+
+	sectorCacheFlushing = false;
+	slot.dirty = false;
+	readCacheInvalidate(slot.addr, sectorSize);
+}
+
+void SpiFlash::sectorCacheBeforeWrite(size_t addr, size_t len) {
+	readCacheInvalidate(addr, len);
+
+	if (sectorCacheFlushing) {
+		return;
+	}
+	for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+		SectorCacheSlot &slot = sectorCacheSlots[ii];
+		if (slot.valid && addr < slot.addr + sectorSize && slot.addr < addr + len) {
+			if (slot.dirty) {
+				sectorCacheFlushSlot(slot);
+			}
+			slot.valid = false;
+		}
+	}
+}
+
+void SpiFlash::sectorCacheDiscard(size_t addr, size_t len) {
+	readCacheInvalidate(addr, len);
+	writeCombineDiscard(addr, len);
+
+	if (sectorCacheFlushing) {
+		return;
+	}
+	for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+		SectorCacheSlot &slot = sectorCacheSlots[ii];
+		if (slot.valid && slot.addr >= addr && slot.addr - addr < len) {
+			slot.valid = slot.dirty = false;
+		}
+	}
+}
+
+void SpiFlash::sectorCacheOverlay(size_t addr, uint8_t *buf, size_t len) const {
+	if (sectorCacheFlushing) {
+		return;
+	}
+	for(size_t ii = 0; ii < sectorCacheNumSlots; ii++) {
+		const SectorCacheSlot &slot = sectorCacheSlots[ii];
+		if (!slot.dirty || addr >= slot.addr + sectorSize || slot.addr >= addr + len) {
+			continue;
+		}
+		size_t start = (slot.addr > addr) ? slot.addr : addr;
+		size_t end = (slot.addr + sectorSize < addr + len) ? slot.addr + sectorSize : addr + len;
+		memcpy(&buf[start - addr], sectorCacheData(slot) + (start - slot.addr), end - start);
+	}
+}
+
+SpiFlash &SpiFlash::withReadCache(size_t numLines, size_t lineSize) {
+	delete[] readCacheLines;
+	delete[] readCacheBuf;
+	readCacheLines = 0;
+	readCacheBuf = 0;
+	readCacheNumLines = 0;
+	readCacheHits = readCacheMisses = 0;
+
+	if (numLines > 0) {
+		readCacheLines = new ReadCacheLine[numLines];
+		readCacheBuf = new uint8_t[numLines * lineSize];
+		if (readCacheLines && readCacheBuf) {
+			memset(readCacheLines, 0, numLines * sizeof(ReadCacheLine));
+			readCacheNumLines = numLines;
+			readCacheLineSize = lineSize;
+		}
+		else {
+			delete[] readCacheLines;
+			delete[] readCacheBuf;
+			readCacheLines = 0;
+			readCacheBuf = 0;
+		}
+	}
+	return *this;
+}
+
+void SpiFlash::invalidateReadCache() {
+	for(size_t ii = 0; ii < readCacheNumLines; ii++) {
+		readCacheLines[ii].valid = false;
+	}
+}
+
+void SpiFlash::readCacheRead(size_t addr, uint8_t *buf, size_t len) {
+	while(len > 0) {
+		size_t lineOffset = addr & (readCacheLineSize - 1);
+		size_t lineAddr = addr - lineOffset;
+
+		size_t count = readCacheLineSize - lineOffset;
+		if (count > len) {
+			count = len;
+		}
+
+		ReadCacheLine *line = 0;
+		ReadCacheLine *victim = 0;
+		for(size_t ii = 0; ii < readCacheNumLines; ii++) {
+			ReadCacheLine &cur = readCacheLines[ii];
+			if (cur.valid && cur.addr == lineAddr) {
+				line = &cur;
+				break;
+			}
+			if (!victim || (victim->valid && (!cur.valid || cur.lastUse < victim->lastUse))) {
+				victim = &cur;
+			}
+		}
+
+		uint8_t *lineData;
+		if (line) {
+			readCacheHits++;
+			lineData = &readCacheBuf[(line - readCacheLines) * readCacheLineSize];
+		}
+		else {
+			readCacheMisses++;
+			line = victim;
+			lineData = &readCacheBuf[(line - readCacheLines) * readCacheLineSize];
+
+			// Lines only hold data from the chip, never unflushed data from the sector cache
+			line->valid = false;
+			readChip(lineAddr, lineData, readCacheLineSize);
+			line->addr = lineAddr;
+			line->valid = true;
+		}
+		line->lastUse = ++readCacheUseCounter;
+
+		memcpy(buf, lineData + lineOffset, count);
+
+		addr += count;
+		buf += count;
+		len -= count;
+	}
+}
+
+void SpiFlash::readCacheInvalidate(size_t addr, size_t len) {
+	for(size_t ii = 0; ii < readCacheNumLines; ii++) {
+		ReadCacheLine &line = readCacheLines[ii];
+		if (line.valid && addr < line.addr + readCacheLineSize && (line.addr < addr || line.addr - addr < len)) {
+			line.valid = false;
+		}
+	}
+}
+
+bool SpiFlash::readDataAsync(size_t addr, void *buf, size_t bufLen, AsyncCallback callback) {
+	if (isBusy() || (asyncInstance && asyncInstance->isBusy())) {
+		return false;
+	}
+
+	// The chip ignores the read while an operation from startPageProgram() or startSectorErase() runs
+	waitForOperationComplete();
+
+	asyncCallback = callback;
+	asyncAddr = addr;
+	asyncRxBuf = (uint8_t *)buf;
+	asyncLen = asyncTotal = bufLen;
+	asyncOpStartMs = millis();
+
+	if (bufLen == 0) {
+		asyncFinish(true);
+		return true;
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsStart(asyncStatsMark);
+#endif
+
+	uint8_t txBuf[6];
+	size_t txLen = getInstWithAddrSize();
+
+	if (fastRead) {
+		setInstWithAddr(0x0B, addr, txBuf); // FAST_READ
+		txBuf[txLen++] = 0; // dummy byte
+	}
+	else {
+		setInstWithAddr(0x03, addr, txBuf); // READ
+	}
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, txLen, NULL);
+
+	asyncCount = (asyncLen > maxTransferSize) ? maxTransferSize : asyncLen;
+	asyncState = AsyncState::READ_DATA;
+	asyncStartTransfer(NULL, asyncRxBuf, asyncCount);
+
+	return true;
+}
+
+bool SpiFlash::startReadData(size_t addr, void *buf, size_t bufLen) {
+	return readDataAsync(addr, buf, bufLen);
+}
+
+bool SpiFlash::isReadComplete() {
+	poll();
+	return asyncState != AsyncState::READ_DATA;
+}
+
+bool SpiFlash::writeDataAsync(size_t addr, const void *buf, size_t bufLen, AsyncCallback callback) {
+	if (isBusy() || (asyncInstance && asyncInstance->isBusy())) {
+		return false;
+	}
+
+	sectorCacheBeforeWrite(addr, bufLen);
+	writeCombineFlush();
+
+	asyncCallback = callback;
+	asyncAddr = addr;
+	asyncTxBuf = (const uint8_t *)buf;
+	asyncLen = asyncTotal = bufLen;
+	asyncOpStartMs = millis();
+
+	if (bufLen == 0) {
+		asyncFinish(true);
+		return true;
+	}
+
+	asyncState = AsyncState::WRITE_PAGE;
+	poll();
+
+	return true;
+}
+
+bool SpiFlash::sectorEraseAsync(size_t addr, AsyncCallback callback) {
+	if (isBusy()) {
+		return false;
+	}
+	sectorCacheDiscard(addr, sectorSize);
+	return asyncStartErase(sectorEraseInst, addr, sectorEraseTimeoutMs, WRITE_OP_SECTOR_ERASE, callback); // SECTOR_ER
+}
+
+bool SpiFlash::blockEraseAsync(size_t addr, AsyncCallback callback) {
+	if (blockEraseInst == 0 || isBusy()) {
+		return false;
+	}
+	sectorCacheDiscard(addr, 65536);
+	return asyncStartErase(blockEraseInst, addr, chipEraseTimeoutMs, WRITE_OP_BLOCK_ERASE, callback); // BLOCK_ER
+}
+
+bool SpiFlash::chipEraseAsync(AsyncCallback callback) {
+	if (isBusy()) {
+		return false;
+	}
+	sectorCacheDiscard(0, SIZE_MAX);
+	return asyncStartErase(0xC7, 0, chipEraseTimeoutMs, WRITE_OP_CHIP_ERASE, callback); // CHIP_ER
+}
+
+bool SpiFlash::asyncStartErase(uint8_t inst, size_t addr, unsigned long timeoutMs, WriteOperation op, AsyncCallback callback) {
+	if (isBusy()) {
+		return false;
+	}
+
+	asyncCallback = callback;
+	asyncEraseInst = inst;
+	asyncAddr = addr;
+	asyncEraseTimeoutMs = timeoutMs;
+	asyncEraseOp = op;
+	asyncEraseTypicalMs = getExpectedTimeUs(op) / 1000;
+	asyncOpStartMs = millis();
+
+	asyncState = AsyncState::ERASE_START;
+	poll();
+
+	return true;
+}
+
+bool SpiFlash::startPageProgram(size_t addr, const void *buf, size_t len) {
+	OperationLock lock(*this, writePriority);
+
+	if (isBusy() || (addr % pageSize) + len > pageSize) {
+		return false;
+	}
+
+	sectorCacheBeforeWrite(addr, len);
+	waitForOperationComplete();
+	waitForWriteComplete();
+
+	uint8_t txBuf[5];
+
+	setInstWithAddr(0x02, addr, txBuf); // PAGE_PROG
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsStart(pendingStatsMark);
+#endif
+
+	writeEnable();
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
+	spi.transfer((const uint8_t *)buf, NULL, len, NULL);
+	endTransaction();
+
+	startOperation(WRITE_OP_PAGE_PROGRAM, len, pageProgramTimeoutMs);
+	return true;
+}
+
+bool SpiFlash::startSectorErase(size_t addr) {
+	return startErase(sectorEraseInst, addr, sectorSize, sectorEraseTimeoutMs, WRITE_OP_SECTOR_ERASE); // SECTOR_ER
+}
+
+bool SpiFlash::startBlockErase(size_t addr) {
+	if (blockEraseInst == 0) {
+		return false;
+	}
+	return startErase(blockEraseInst, addr, 65536, chipEraseTimeoutMs, WRITE_OP_BLOCK_ERASE); // BLOCK_ER
+}
+
+bool SpiFlash::startChipErase() {
+	return startErase(0xC7, 0, SIZE_MAX, chipEraseTimeoutMs, WRITE_OP_CHIP_ERASE); // CHIP_ER
+}
+
+bool SpiFlash::startErase(uint8_t inst, size_t addr, size_t len, unsigned long timeoutMs, WriteOperation op) {
+	OperationLock lock(*this, writePriority);
+
+	if (isBusy()) {
+		return false;
+	}
+
+	sectorCacheDiscard(addr, len);
+	waitForOperationComplete();
+	waitForWriteComplete();
+
+	uint8_t txBuf[5];
+	size_t txLen = 1;
+
+	if (inst == 0xC7) {
+		txBuf[0] = inst;
+	}
+	else {
+		setInstWithAddr(inst, addr, txBuf);
+		txLen = getInstWithAddrSize();
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsStart(pendingStatsMark);
+#endif
+
+	writeEnable();
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, txLen, NULL);
+	endTransaction();
+
+	startOperation(op, 0, timeoutMs);
+	return true;
+}
+
+void SpiFlash::startOperation(WriteOperation op, size_t count, unsigned long timeoutMs) {
+	pendingOp = op;
+	pendingCount = count;
+	pendingTimeoutMs = timeoutMs;
+
+	// The same timing as the asynchronous functions, which can't be running at the same time
+	asyncStartMs = millis();
+	asyncStartUs = asyncLastPollUs = micros();
+	getPollTiming(op, count, asyncPollDelayUs, asyncPollIntervalUs);
+}
+
+bool SpiFlash::isOperationComplete() {
+	if (pendingOp == WRITE_OP_COUNT) {
+		return true;
+	}
+	unsigned long prevPollUs = asyncLastPollUs;
+	if (!asyncPollDue()) {
+		return false;
+	}
+	if (isWriteInProgress()) {
+		if (millis() - asyncStartMs < pendingTimeoutMs) {
+			return false;
+		}
+#ifdef SPIFLASHRK_ENABLE_STATS
+		stats.ops[statsOpFor(pendingOp)].timeouts++;
+#endif
+	}
+	else
+	if (adaptivePolling) {
+		// The completion time is only learned if the status register was read when it was due, not
+		// some time later because this wasn't called often enough
+		unsigned long now = micros();
+		unsigned long lateUs = now - asyncStartUs - asyncPollDelayUs;
+		if (now - prevPollUs - asyncPollIntervalUs < lateUs) {
+			lateUs = now - prevPollUs - asyncPollIntervalUs;
+		}
+		if (lateUs <= asyncPollIntervalUs || lateUs <= pollIntervalMinUs) {
+			learnExpectedTime(pendingOp, pendingCount, now - asyncStartUs);
+		}
+	}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(statsOpFor(pendingOp), pendingStatsMark, pendingCount);
+#endif
+	pendingOp = WRITE_OP_COUNT;
+	return true;
+}
+
+unsigned long SpiFlash::getOperationWaitUs() const {
+	if (pendingOp == WRITE_OP_COUNT || !adaptivePolling) {
+		return 0;
+	}
+
+	unsigned long now = micros();
+	unsigned long waitUs = 0;
+	if (now - asyncStartUs < asyncPollDelayUs) {
+		waitUs = asyncPollDelayUs - (now - asyncStartUs);
+	}
+	if (now - asyncLastPollUs < asyncPollIntervalUs && asyncPollIntervalUs - (now - asyncLastPollUs) > waitUs) {
+		waitUs = asyncPollIntervalUs - (now - asyncLastPollUs);
+	}
+	return waitUs;
+}
+
+void SpiFlash::waitForOperationComplete() {
+	while(!isOperationComplete()) {
+		sleepUs(getOperationWaitUs());
+	}
+}
+
+bool SpiFlash::eraseSuspend() {
+	if (eraseSuspendInst == 0 || eraseSuspended || !isWriteInProgress()) {
+		return false;
+	}
+
+	// Give the erase some time to make progress after the last resume
+	unsigned long sinceResume = micros() - eraseResumeUs;
+	if (sinceResume < eraseSuspendDelayUs) {
+		delayMicroseconds(eraseSuspendDelayUs - sinceResume);
+	}
+
+	uint8_t txBuf[1];
+	txBuf[0] = eraseSuspendInst;
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	endTransaction();
+
+	// WIP clears within tSUS once the erase is suspended. If the chip doesn't support
+	// suspend, the erase continues and WIP stays set.
+	delayMicroseconds(eraseSuspendDelayUs);
+	if (isWriteInProgress()) {
+		return false;
+	}
+
+	eraseSuspended = true;
+	eraseSuspendMs = millis();
+	eraseSuspendUs = micros();
+	return true;
+}
+
+void SpiFlash::eraseResume() {
+	if (!eraseSuspended) {
+		return;
+	}
+
+	uint8_t txBuf[1];
+	txBuf[0] = eraseResumeInst;
+
+	beginTransaction();
+	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	endTransaction();
+
+	eraseSuspended = false;
+	eraseResumeUs = micros();
+	knownIdle = false;
+
+	// Time spent suspended does not count against the erase timeout
+	asyncStartMs += millis() - eraseSuspendMs;
+	asyncStartUs += micros() - eraseSuspendUs;
+}
+
+unsigned long SpiFlash::getAsyncElapsedMs() const {
+	if (!isBusy()) {
+		return 0;
+	}
+	return millis() - asyncOpStartMs;
+}
+
+int SpiFlash::getAsyncProgress() const {
+	switch(asyncState) {
+	case AsyncState::IDLE:
+		return 100;
+
+	case AsyncState::ERASE_START:
+		return 0;
+
+	case AsyncState::ERASE_WAIT: {
+		unsigned long elapsed = millis() - asyncStartMs;
+		if (asyncEraseTypicalMs == 0 || elapsed >= asyncEraseTypicalMs) {
+			return 99;
+		}
+		int progress = (int)((uint64_t)elapsed * 100 / asyncEraseTypicalMs);
+		return (progress > 99) ? 99 : progress;
+	}
+
+	default:
+		return (int)((uint64_t)(asyncTotal - asyncLen) * 100 / asyncTotal);
+	}
+}
+
+void SpiFlash::poll() {
+	switch(asyncState) {
+	case AsyncState::IDLE:
+		break;
+
+	case AsyncState::READ_DATA:
+		if (!asyncTransferComplete) {
+			break;
+		}
+		asyncRxBuf += asyncCount;
+		asyncLen -= asyncCount;
+
+		if (asyncLen > 0) {
+			// Continue the read in the same transaction
+			asyncCount = (asyncLen > maxTransferSize) ? maxTransferSize : asyncLen;
+			asyncStartTransfer(NULL, asyncRxBuf, asyncCount);
+		}
+		else {
+			endTransaction();
+			writeCombineOverlay(asyncAddr, asyncRxBuf - asyncTotal, asyncTotal);
+			sectorCacheOverlay(asyncAddr, asyncRxBuf - asyncTotal, asyncTotal);
+#ifdef SPIFLASHRK_ENABLE_STATS
+			statsEnd(SPIFLASH_STATS_READ, asyncStatsMark, asyncTotal);
+#endif
+			asyncFinish(true);
+		}
+		break;
+
+	case AsyncState::WRITE_PAGE: {
+		if (isWriteInProgress()) {
+			break;
+		}
+
+		size_t pageOffset = asyncAddr % pageSize;
+		asyncCount = pageSize - pageOffset;
+		if (asyncCount > asyncLen) {
+			asyncCount = asyncLen;
+		}
+
+		uint8_t txBuf[5];
+
+		setInstWithAddr(0x02, asyncAddr, txBuf); // PAGE_PROG
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+		statsStart(asyncStatsMark);
+#endif
+
+		writeEnable();
+
+		beginTransaction();
+		spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
+
+		asyncState = AsyncState::WRITE_DATA;
+		asyncStartTransfer(asyncTxBuf, NULL, asyncCount);
+		break;
+	}
+
+	case AsyncState::WRITE_DATA:
+		if (!asyncTransferComplete) {
+			break;
+		}
+		endTransaction();
+
+		asyncStartMs = millis();
+		asyncStartUs = asyncLastPollUs = micros();
+		getPollTiming(WRITE_OP_PAGE_PROGRAM, asyncCount, asyncPollDelayUs, asyncPollIntervalUs);
+		asyncState = AsyncState::WRITE_WAIT;
+		break;
+
+	case AsyncState::WRITE_WAIT:
+		if (!asyncPollDue()) {
+			break;
+		}
+		if (isWriteInProgress()) {
+			if (millis() - asyncStartMs >= pageProgramTimeoutMs) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+				stats.ops[SPIFLASH_STATS_PAGE_PROGRAM].timeouts++;
+				statsEnd(SPIFLASH_STATS_PAGE_PROGRAM, asyncStatsMark, asyncCount);
+#endif
+				asyncFinish(false);
+			}
+			break;
+		}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+		statsEnd(SPIFLASH_STATS_PAGE_PROGRAM, asyncStatsMark, asyncCount);
+#endif
+
+		asyncAddr += asyncCount;
+		asyncTxBuf += asyncCount;
+		asyncLen -= asyncCount;
+
+		if (asyncLen > 0) {
+			// Start the next page right away
+			asyncState = AsyncState::WRITE_PAGE;
+			poll();
+		}
+		else {
+			asyncFinish(true);
+		}
+		break;
+
+	case AsyncState::ERASE_START: {
+		if (isWriteInProgress()) {
+			break;
+		}
+
+		uint8_t txBuf[5];
+		size_t txLen = 1;
+
+		if (asyncEraseInst == 0xC7) {
+			txBuf[0] = asyncEraseInst;
+		}
+		else {
+			setInstWithAddr(asyncEraseInst, asyncAddr, txBuf);
+			txLen = getInstWithAddrSize();
+		}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+		statsStart(asyncStatsMark);
+#endif
+
+		writeEnable();
+
+		beginTransaction();
+		spi.transfer(txBuf, NULL, txLen, NULL);
+		endTransaction();
+
+		asyncStartMs = millis();
+		asyncStartUs = asyncLastPollUs = micros();
+		getPollTiming(asyncEraseOp, 0, asyncPollDelayUs, asyncPollIntervalUs);
+		asyncState = AsyncState::ERASE_WAIT;
+		break;
+	}
+
+	case AsyncState::ERASE_WAIT:
+		if (!asyncPollDue()) {
+			break;
+		}
+		if (!isWriteInProgress()) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+			statsEnd(statsOpFor(asyncEraseOp), asyncStatsMark, 0);
+#endif
+			asyncFinish(true);
+		}
+		else
+		if (millis() - asyncStartMs >= asyncEraseTimeoutMs) {
+#ifdef SPIFLASHRK_ENABLE_STATS
+			stats.ops[statsOpFor(asyncEraseOp)].timeouts++;
+			statsEnd(statsOpFor(asyncEraseOp), asyncStatsMark, 0);
+#endif
+			asyncFinish(false);
+		}
+		break;
+	}
+}
+
+bool SpiFlash::asyncPollDue() {
+	if (!adaptivePolling) {
+		return true;
+	}
+
+	// The completion time isn't learned here because it depends on how often poll() is called
+	unsigned long now = micros();
+	if (now - asyncStartUs < asyncPollDelayUs || now - asyncLastPollUs < asyncPollIntervalUs) {
+		return false;
+	}
+	asyncLastPollUs = now;
+	return true;
+}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+void SpiFlash::getStats(SpiFlashStats &result) const {
+	result = stats;
+	result.periodMs = millis() - stats.periodMs;
+}
+
+void SpiFlash::resetStats() {
+	memset(&stats, 0, sizeof(stats));
+	for(size_t ii = 0; ii < SPIFLASH_STATS_OP_COUNT; ii++) {
+		stats.ops[ii].minUs = 0xffffffff;
+	}
+	// Holds the time of the reset until getStats() converts it to the elapsed time
+	stats.periodMs = millis();
+}
+
+void SpiFlash::statsStart(StatsMark &mark) const {
+	mark.startUs = micros();
+	mark.transactions = statsTransactions;
+	mark.statusPolls = statsStatusPolls;
+}
+
+void SpiFlash::statsEnd(SpiFlashStatsOp op, const StatsMark &mark, size_t bytes) {
+	SpiFlashOpStats &opStats = stats.ops[op];
+	uint32_t elapsedUs = (uint32_t)(micros() - mark.startUs);
+
+	opStats.count++;
+	opStats.bytes += bytes;
+	opStats.transactions += statsTransactions - mark.transactions;
+	opStats.statusPolls += statsStatusPolls - mark.statusPolls;
+	opStats.totalUs += elapsedUs;
+	if (elapsedUs < opStats.minUs) {
+		opStats.minUs = elapsedUs;
+	}
+	if (elapsedUs > opStats.maxUs) {
+		opStats.maxUs = elapsedUs;
+	}
+
+	size_t bucket = 0;
+	while((elapsedUs >> 1) != 0 && bucket < SPIFLASH_STATS_BUCKETS - 1) {
+		elapsedUs >>= 1;
+		bucket++;
+	}
+	opStats.histogram[bucket]++;
+}
+
+// static
+SpiFlashStatsOp SpiFlash::statsOpFor(WriteOperation op) {
+	switch(op) {
+	case WRITE_OP_PAGE_PROGRAM:
+		return SPIFLASH_STATS_PAGE_PROGRAM;
 
-}
+	case WRITE_OP_BLOCK32_ERASE:
+		return SPIFLASH_STATS_BLOCK32_ERASE;
 
-void SpiFlash::begin() {
-	spi.begin(cs);
+	case WRITE_OP_BLOCK_ERASE:
+		return SPIFLASH_STATS_BLOCK_ERASE;
 
-	digitalWrite(cs, HIGH);
+	case WRITE_OP_CHIP_ERASE:
+		return SPIFLASH_STATS_CHIP_ERASE;
 
-	// Send release from powerdown 0xab
-	wakeFromSleep();
+	default:
+		return SPIFLASH_STATS_SECTOR_ERASE;
+	}
 }
 
-bool SpiFlash::isValid() {
-	uint8_t foundManufacturerId = (jedecIdRead() >> 16) & 0xff;
+uint32_t SpiFlashOpStats::getPercentileUs(int percent) const {
+	if (count == 0) {
+		return 0;
+	}
 
-	return manufacturerId == foundManufacturerId;
+	uint64_t target = ((uint64_t)count * percent + 99) / 100;
+	uint64_t sum = 0;
+	for(size_t ii = 0; ii < SPIFLASH_STATS_BUCKETS - 1; ii++) {
+		sum += histogram[ii];
+		if (sum >= target) {
+			// Upper bound of the bucket, but never more than the longest operation seen
+			uint32_t upperUs = ((uint32_t)2 << ii) - 1;
+			return (upperUs < maxUs) ? upperUs : maxUs;
+		}
+	}
+	return maxUs;
 }
 
+// static
+const char *SpiFlashStats::getOpName(SpiFlashStatsOp op) {
+	static const char *names[SPIFLASH_STATS_OP_COUNT] = {
+		"read", "pageProgram", "sectorErase", "block32Erase", "blockErase", "chipErase", "statusPoll"
+	};
+	return (op < SPIFLASH_STATS_OP_COUNT) ? names[op] : "";
+}
+#endif /* SPIFLASHRK_ENABLE_STATS */
 
-void SpiFlash::beginTransaction() {
-	
-	__SPISettings settings(spiClockSpeedMHz * MHZ, spiBitOrder, spiDataMode);
+void SpiFlash::asyncStartTransfer(const void *txBuf, void *rxBuf, size_t len) {
+	asyncTransferComplete = false;
+	asyncInstance = this;
+	spi.transfer(txBuf, rxBuf, len, asyncTransferCallback);
+}
 
-	spi.beginTransaction(settings);
-	pinResetFast(cs);
+void SpiFlash::asyncFinish(bool success) {
+	asyncState = AsyncState::IDLE;
 
-	// There is some code to do this in the STM32F2xx HAL, but I don't think it's necessary to put
-	// a really tiny delay before doing the SPI transfer
-	// asm("mov r2, r2");
+	if (asyncCallback) {
+		// Copy the callback first, as it may start another asynchronous operation
+		AsyncCallback callback = asyncCallback;
+		asyncCallback = 0;
+		callback(success);
+	}
 }
 
-void SpiFlash::endTransaction() {
-	pinSetFast(cs);
-	spi.endTransaction();
+// static
+void SpiFlash::asyncTransferCallback() {
+	if (asyncInstance) {
+		asyncInstance->asyncTransferComplete = true;
+	}
 }
 
-uint32_t SpiFlash::jedecIdRead() {
 
-	uint8_t txBuf[4], rxBuf[4];
-	txBuf[0] = 0x9f;
+void SpiFlash::sectorErase(size_t addr) {
+	OperationLock lock(*this, writePriority);
 
-	beginTransaction();
-	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
-	endTransaction();
+	sectorCacheDiscard(addr, sectorSize);
 
-	return (rxBuf[1] << 16) | (rxBuf[2] << 8) | (rxBuf[3]);
-}
+	waitForWriteComplete();
 
-uint8_t SpiFlash::readStatus() {
-	uint8_t txBuf[2], rxBuf[2];
-	txBuf[0] = 0x05; // RDSR
-	txBuf[1] = 0;
+	uint8_t txBuf[5];
+
+	// Log.trace("sectorEraseCmd=%02x", sectorEraseCmd);
+
+	//
+	setInstWithAddr(sectorEraseInst, addr, txBuf); // SECTOR_ER
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+#endif
+
+	writeEnable();
 
 	beginTransaction();
-	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
 	endTransaction();
 
-	return rxBuf[1];
+	waitForOperation(WRITE_OP_SECTOR_ERASE, sectorEraseTimeoutMs);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_SECTOR_ERASE, mark, 0);
+#endif
 }
 
-uint8_t SpiFlash::readConfiguration() {
-	uint8_t txBuf[2], rxBuf[2];
-	txBuf[0] = 0x15; // RDCR
-	txBuf[1] = 0;
+void SpiFlash::blockErase(size_t addr) {
+	OperationLock lock(*this, writePriority);
+
+	if (blockEraseInst == 0) {
+		// Not supported by this chip (from SFDP)
+		for(size_t offset = 0; offset < 65536; offset += sectorSize) {
+			sectorErase(addr + offset);
+		}
+		return;
+	}
+
+	sectorCacheDiscard(addr, 65536);
+
+	waitForWriteComplete();
+
+	uint8_t txBuf[5];
+
+	setInstWithAddr(blockEraseInst, addr, txBuf); // BLOCK_ER
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+#endif
+
+	writeEnable();
 
 	beginTransaction();
-	spi.transfer(txBuf, rxBuf, sizeof(txBuf), NULL);
+	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
 	endTransaction();
 
-	return rxBuf[1];
-}
+	waitForOperation(WRITE_OP_BLOCK_ERASE, chipEraseTimeoutMs);
 
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_BLOCK_ERASE, mark, 0);
+#endif
 
-bool SpiFlash::isWriteInProgress() {
-	return (readStatus() & STATUS_WIP) != 0;
 }
 
-void SpiFlash::waitForWriteComplete(unsigned long timeout) {
-	unsigned long startTime = millis();
-
-	if (timeout == 0) {
-		timeout = waitWriteCompletionTimeoutMs;
-	}
+void SpiFlash::block32Erase(size_t addr) {
+	OperationLock lock(*this, writePriority);
 
-	// Wait for up to 500 ms. Most operations should take much less than that.
-	while(isWriteInProgress() && millis() - startTime < timeout) {
-		// For long timeouts, yield the CPU
-		if (timeout > 500) {
-			delay(1);
+	if (block32EraseInst == 0) {
+		// Not supported by this chip (from SFDP), or has no 4-byte address form
+		for(size_t offset = 0; offset < 32768; offset += sectorSize) {
+			sectorErase(addr + offset);
 		}
+		return;
 	}
 
-	// Log.trace("isWriteInProgress=%d time=%u", isWriteInProgress(), millis() - startTime);
-}
-
+	sectorCacheDiscard(addr, 32768);
 
-void SpiFlash::writeStatus(uint8_t status) {
 	waitForWriteComplete();
 
-	uint8_t txBuf[2];
-	txBuf[0] = 0x01; // WRSR
-	txBuf[1] = status;
+	uint8_t txBuf[5];
+
+	setInstWithAddr(block32EraseInst, addr, txBuf); // BLOCK_ER_32K
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+#endif
+
+	writeEnable();
 
 	beginTransaction();
-	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
 	endTransaction();
+
+	waitForOperation(WRITE_OP_BLOCK32_ERASE, chipEraseTimeoutMs);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_BLOCK32_ERASE, mark, 0);
+#endif
 }
 
-void SpiFlash::readData(size_t addr, void *buf, size_t bufLen) {
-	uint8_t *curBuf = (uint8_t *)buf;
+void SpiFlash::chipErase() {
+	OperationLock lock(*this, writePriority);
 
-	while(bufLen > 0) {
-		size_t pageOffset = addr % pageSize;
-		size_t pageStart = addr - pageOffset;
+	sectorCacheDiscard(0, SIZE_MAX);
 
-		size_t count = (pageStart + pageSize) - addr;
-		if (count > bufLen) {
-			count = bufLen;
-		}
+	waitForWriteComplete();
 
-		uint8_t txBuf[5];
+	uint8_t txBuf[1];
 
-		setInstWithAddr(0x03, addr, txBuf); // READ
+	txBuf[0] = 0xC7; // CHIP_ER
 
-		beginTransaction();
-		spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
-		spi.transfer(NULL, curBuf, bufLen, NULL);
-		endTransaction();
+#ifdef SPIFLASHRK_ENABLE_STATS
+	StatsMark mark;
+	statsStart(mark);
+#endif
 
-		addr += count;
-		curBuf += count;
-		bufLen -= count;
-	}
-}
+	writeEnable();
 
+	beginTransaction();
+	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	endTransaction();
 
-void SpiFlash::setInstWithAddr(uint8_t inst, size_t addr, uint8_t *buf) {
-	uint8_t *p = buf;
-	*p++ = inst;
-	if (addr4byte) {
-		*p++ = (uint8_t) (addr >> 24);
-	}
-	*p++ = (uint8_t) (addr >> 16);
-	*p++ = (uint8_t) (addr >> 8);
-	*p++ = (uint8_t) addr;
-}
+	waitForOperation(WRITE_OP_CHIP_ERASE, chipEraseTimeoutMs);
 
-size_t SpiFlash::getInstWithAddrSize() const {
-	return addr4byte ? 5 : 4;	
+#ifdef SPIFLASHRK_ENABLE_STATS
+	statsEnd(SPIFLASH_STATS_CHIP_ERASE, mark, 0);
+#endif
 }
 
+bool SpiFlash::eraseRange(size_t addr, size_t len) {
+	OperationLock lock(*this, writePriority);
 
-void SpiFlash::writeData(size_t addr, const void *buf, size_t bufLen) {
-	uint8_t *curBuf = (uint8_t *)buf;
+	if ((addr % sectorSize) != 0 || (len % sectorSize) != 0) {
+		return false;
+	}
 
-	waitForWriteComplete();
+	// Each erase waits until a status read shows the chip is idle, so if it isn't, the erase timed out
+	if (addr == 0 && capacity != 0 && len >= capacity) {
+		chipErase();
+		return knownIdle;
+	}
 
-	while(bufLen > 0) {
-		size_t pageOffset = addr % pageSize;
-		size_t pageStart = addr - pageOffset;
+	while(len > 0) {
+		size_t count;
 
-		size_t count = (pageStart + pageSize) - addr;
-		if (count > bufLen) {
-			count = bufLen;
+		if (blockEraseInst != 0 && (addr % 65536) == 0 && len >= 65536) {
+			blockErase(addr);
+			count = 65536;
+		}
+		else
+		if (block32EraseInst != 0 && (addr % 32768) == 0 && len >= 32768) {
+			block32Erase(addr);
+			count = 32768;
+		}
+		else {
+			sectorErase(addr);
+			count = sectorSize;
+		}
+		if (!knownIdle) {
+			return false;
 		}
 
-		// Log.info("writeData addr=%lx pageOffset=%lu pageStart=%lu count=%lu pageSize=%lu", addr, pageOffset, pageStart, count, pageSize);
+		addr += count;
+		len -= count;
 
-		uint8_t txBuf[5];
+		if (len > 0) {
+			yieldLock();
+		}
+	}
+	return true;
+}
 
-		setInstWithAddr(0x02, addr, txBuf); // PAGE_PROG
+void SpiFlash::readSfdp(size_t addr, void *buf, size_t bufLen) {
+	OperationLock lock(*this, readPriority);
 
-		writeEnable();
+	// Read SFDP always uses a 3-byte address and 8 dummy clocks
+	uint8_t txBuf[5];
+	txBuf[0] = 0x5A; // RDSFDP
+	txBuf[1] = (uint8_t) (addr >> 16);
+	txBuf[2] = (uint8_t) (addr >> 8);
+	txBuf[3] = (uint8_t) addr;
+	txBuf[4] = 0;
 
-		beginTransaction();
-		spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
-		spi.transfer(curBuf, NULL, count, NULL);
-		endTransaction();
+	beginTransaction();
+	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
+	spi.transfer(NULL, buf, bufLen, NULL);
+	endTransaction();
+}
 
-		waitForWriteComplete(pageProgramTimeoutMs);
+// Converts a JESD216 erase time field (5-bit count, 2-bit units) to milliseconds
+static unsigned long sfdpEraseTimeMs(uint32_t value, const unsigned long *units) {
+	return ((value & 0x1f) + 1) * units[(value >> 5) & 0x3];
+}
 
-		addr += count;
-		curBuf += count;
-		bufLen -= count;
+bool SpiFlash::sfdpHas4ByteInstructions(size_t table4Addr, size_t table4Len, const uint32_t *dw) {
+	if (table4Len < 2) {
+		return false;
 	}
 
-}
+	uint8_t tableBuf[8];
+	readSfdp(table4Addr, tableBuf, sizeof(tableBuf));
+	uint32_t supported = tableBuf[0] | (tableBuf[1] << 8) | (tableBuf[2] << 16) | ((uint32_t)tableBuf[3] << 24);
 
+	// DWORD 1 bits 0, 1, and 6: READ4B, FAST_READ4B, and PP4B
+	if ((supported & 0x43) != 0x43) {
+		return false;
+	}
 
-void SpiFlash::sectorErase(size_t addr) {
-	waitForWriteComplete();
+	// DWORD 1 bits 9-12: erase types 1-4, DWORD 2: their 4-byte address instructions. The sector
+	// erase must be supported, with the instruction that setInstWithAddr() sends. Block erases that
+	// aren't are disabled, like the 32K block erase on the W25Q256.
+	bool noBlock32 = false;
+	bool noBlock64 = false;
+	for(size_t ii = 0; ii < 4; ii++) {
+		uint32_t value = (dw[7 + ii / 2] >> (16 * (ii % 2))) & 0xffff;
+		uint8_t sizeN = (uint8_t)value;
+		if (sizeN != 12 && sizeN != 15 && sizeN != 16) {
+			continue;
+		}
+		uint8_t inst = (uint8_t)(value >> 8);
+		if ((supported & (1 << (9 + ii))) == 0 || !has4ByteInst(inst) || tableBuf[4 + ii] != to4ByteInst(inst)) {
+			if (sizeN == 12) {
+				return false;
+			}
+			if (sizeN == 15) {
+				noBlock32 = true;
+			}
+			else {
+				noBlock64 = true;
+			}
+		}
+	}
+	if (noBlock32) {
+		block32EraseInst = 0;
+	}
+	if (noBlock64) {
+		blockEraseInst = 0;
+	}
+	return true;
+}
 
-	uint8_t txBuf[5];
+bool SpiFlash::configureFromSfdp() {
+	sfdpValid = false;
 
-	// Log.trace("sectorEraseCmd=%02x", sectorEraseCmd);
+	uint8_t header[8];
+	readSfdp(0, header, sizeof(header));
+	if (header[0] != 'S' || header[1] != 'F' || header[2] != 'D' || header[3] != 'P') {
+		return false;
+	}
 
-	//
-	// ISSI 25LQ080 uses 0x20 or 0xD7
-	// Winbond uses 0x20 only, so use that
-	setInstWithAddr(0x20, addr, txBuf); // SECTOR_ER
+	// Find the JEDEC basic flash parameter table (ID 0xFF00), which is required to be first
+	// but a later revision may follow it
+	size_t numHeaders = (size_t)header[6] + 1;
+	size_t tableAddr = 0;
+	size_t tableLen = 0;
+	uint8_t tableRev = 0;
+	size_t table4Addr = 0;
+	size_t table4Len = 0;
+	for(size_t ii = 0; ii < numHeaders && ii < 8; ii++) {
+		uint8_t paramHeader[8];
+		readSfdp(8 + ii * 8, paramHeader, sizeof(paramHeader));
+
+		if (paramHeader[0] == 0x00 && paramHeader[7] == 0xff && paramHeader[2] == 1 && (tableLen == 0 || paramHeader[1] >= tableRev)) {
+			tableRev = paramHeader[1];
+			tableLen = paramHeader[3];
+			tableAddr = paramHeader[4] | (paramHeader[5] << 8) | (paramHeader[6] << 16);
+		}
+		else
+		if (paramHeader[0] == 0x84 && paramHeader[7] == 0xff && paramHeader[2] == 1) {
+			// 4-byte address instruction table (ID 0xFF84)
+			table4Len = paramHeader[3];
+			table4Addr = paramHeader[4] | (paramHeader[5] << 8) | (paramHeader[6] << 16);
+		}
+	}
+	if (tableLen < 9) {
+		return false;
+	}
+	if (tableLen > 16) {
+		tableLen = 16;
+	}
 
+	uint8_t tableBuf[16 * 4];
+	uint32_t dw[16];
+	readSfdp(tableAddr, tableBuf, tableLen * 4);
+	for(size_t ii = 0; ii < 16; ii++) {
+		dw[ii] = (ii < tableLen) ? (tableBuf[ii * 4] | (tableBuf[ii * 4 + 1] << 8) | (tableBuf[ii * 4 + 2] << 16) | ((uint32_t)tableBuf[ii * 4 + 3] << 24)) : 0;
+	}
 
-	writeEnable();
+	// DWORD 2: density in bits
+	if (dw[1] & 0x80000000) {
+		uint32_t n = dw[1] & 0x7fffffff;
+		if (n >= 3 && n < 35) {
+			capacity = (size_t)(1ULL << (n - 3));
+		}
+	}
+	else {
+		capacity = (size_t)(((uint64_t)dw[1] + 1) / 8);
+	}
 
-	beginTransaction();
-	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
-	endTransaction();
+	// DWORD 1: 4K erase instruction and address bytes
+	if ((dw[0] & 0x3) == 0x1) {
+		sectorEraseInst = (uint8_t)(dw[0] >> 8);
+	}
+	uint32_t addressBytes = (dw[0] >> 17) & 0x3;
+
+	// DWORDs 8 and 9: erase types. Sizes are 2^N bytes, 0 if not present.
+	// DWORD 10: typical erase times and the multiplier to get the maximum time
+	static const unsigned long eraseUnitsMs[4] = { 1, 16, 128, 1000 };
+	unsigned long eraseMultiplier = 2 * ((dw[9] & 0xf) + 1);
+
+	block32EraseInst = blockEraseInst = 0;
+	for(size_t ii = 0; ii < 4; ii++) {
+		uint32_t value = (dw[7 + ii / 2] >> (16 * (ii % 2))) & 0xffff;
+		uint8_t sizeN = (uint8_t)value;
+		uint8_t inst = (uint8_t)(value >> 8);
+		unsigned long typicalMs = (tableLen >= 11) ? sfdpEraseTimeMs(dw[9] >> (4 + 7 * ii), eraseUnitsMs) : 0;
+
+		if (sizeN == 12) {
+			sectorEraseInst = inst;
+			if (typicalMs) {
+				sectorEraseTypicalMs = typicalMs;
+				sectorEraseTimeoutMs = typicalMs * eraseMultiplier;
+			}
+		}
+		else
+		if (sizeN == 15) {
+			block32EraseInst = inst;
+		}
+		else
+		if (sizeN == 16) {
+			blockEraseInst = inst;
+			if (typicalMs) {
+				blockEraseTypicalMs = typicalMs;
+			}
+		}
+	}
 
-	waitForWriteComplete(sectorEraseTimeoutMs);
-}
+	if (tableLen >= 11) {
+		// DWORD 11: page size, page program time, and chip erase time
+		pageSize = (size_t)1 << ((dw[10] >> 4) & 0xf);
 
-void SpiFlash::blockErase(size_t addr) {
-	waitForWriteComplete();
+		unsigned long programMultiplier = 2 * ((dw[10] & 0xf) + 1);
+		unsigned long pageProgramUs = (((dw[10] >> 8) & 0x1f) + 1) * ((dw[10] & 0x2000) ? 64 : 8);
+		pageProgramTimeoutMs = (pageProgramUs * programMultiplier + 999) / 1000 + 1;
 
-	uint8_t txBuf[5];
+		static const unsigned long chipEraseUnitsMs[4] = { 16, 256, 4000, 64000 };
+		chipEraseTypicalMs = sfdpEraseTimeMs(dw[10] >> 24, chipEraseUnitsMs);
+		chipEraseTimeoutMs = chipEraseTypicalMs * eraseMultiplier;
+	}
 
-	setInstWithAddr(0xD8, addr, txBuf); // BLOCK_ER
+	if (tableLen >= 13) {
+		// DWORD 12 bit 31 is 0 if suspend and resume are supported, DWORD 13 has the instructions
+		if ((dw[11] & 0x80000000) == 0) {
+			eraseSuspendInst = (uint8_t)(dw[12] >> 24);
+			eraseResumeInst = (uint8_t)(dw[12] >> 16);
+		}
+		else {
+			eraseSuspendInst = eraseResumeInst = 0;
+		}
+	}
 
-	writeEnable();
+	sfdpValid = true;
 
-	beginTransaction();
-	spi.transfer(txBuf, NULL, getInstWithAddrSize(), NULL);
-	endTransaction();
+	if (addressBytes == 2) {
+		// 4-byte address only
+		addr4byte = true;
+	}
+	else
+	if (addressBytes == 1 && capacity > 16 * 1024 * 1024) {
+		if (sfdpHas4ByteInstructions(table4Addr, table4Len, dw)) {
+			withNative4ByteAddressing();
+		}
+		else {
+			set4ByteAddressing(true);
+		}
+	}
 
-	waitForWriteComplete(chipEraseTimeoutMs);
+	return true;
+}
 
+// Values are from the datasheets. Winbond and Macronix parts of different sizes have the same
+// sector and block erase times, but chip erase time depends on the size.
+static constexpr SpiFlashChipInfo chipDatabase[] = {
+	// jedecId   name           capacity           clk  rd  4b     4b32K  sus   res  wel  pp   se  seMax  be      ceTyp    ceMax
+	{ 0x9d6014, "IS25LQ080",    1024 * 1024,       104, 33, false, false, 0x00, 0x00, 3, 10,  70,  300,  150,     500,    6000 },
+	{ 0xef4014, "W25Q80",       1024 * 1024,       104, 50, false, false, 0x75, 0x7A, 0,  3,  45,  400,  150,    2500,   10000 },
+	{ 0xef4015, "W25Q16",       2 * 1024 * 1024,   104, 50, false, false, 0x75, 0x7A, 0,  3,  45,  400,  150,    5000,   25000 },
+	{ 0xef4016, "W25Q32",       4 * 1024 * 1024,   133, 50, false, false, 0x75, 0x7A, 0,  3,  45,  400,  150,   10000,   50000 },
+	{ 0xef4017, "W25Q64",       8 * 1024 * 1024,   133, 50, false, false, 0x75, 0x7A, 0,  3,  45,  400,  150,   20000,  100000 },
+	{ 0xef4018, "W25Q128",      16 * 1024 * 1024,  133, 50, false, false, 0x75, 0x7A, 0,  3,  45,  400,  150,   40000,  200000 },
+	{ 0xef4019, "W25Q256",      32 * 1024 * 1024,  133, 50, true,  false, 0x75, 0x7A, 0,  3,  45,  400,  150,   80000,  400000 },
+	{ 0xc22014, "MX25L8006E",   1024 * 1024,       86,  33, false, false, 0x00, 0x00, 0, 10,  60,  200,  700,    9000,   20000 },
+	{ 0xc22015, "MX25L1606E",   2 * 1024 * 1024,   86,  33, false, false, 0x00, 0x00, 0, 10,  60,  200,  700,   14000,   30000 },
+	{ 0xc22016, "MX25L3233F",   4 * 1024 * 1024,   133, 50, false, false, 0xB0, 0x30, 0, 10,  40,  200,  400,   25000,   50000 },
+	{ 0xc22017, "MX25L6433F",   8 * 1024 * 1024,   133, 50, false, false, 0xB0, 0x30, 0, 10,  40,  200,  400,   50000,   80000 },
+	{ 0xc22018, "MX25L12835F",  16 * 1024 * 1024,  133, 50, false, false, 0xB0, 0x30, 0, 10,  40,  200,  400,   80000,  150000 },
+	{ 0xc22019, "MX25L25645G",  32 * 1024 * 1024,  133, 50, true,  true,  0xB0, 0x30, 0, 10,  30,  200,  280,  150000,  220000 },
+};
+
+// static
+const SpiFlashChipInfo *SpiFlash::findChipInfo(uint32_t jedecId) {
+	for(size_t ii = 0; ii < sizeof(chipDatabase) / sizeof(chipDatabase[0]); ii++) {
+		if (chipDatabase[ii].jedecId == jedecId) {
+			return &chipDatabase[ii];
+		}
+	}
+	return 0;
 }
 
-void SpiFlash::chipErase() {
-	waitForWriteComplete();
+void SpiFlash::configureFromChipInfo(const SpiFlashChipInfo *info) {
+	chipInfo = info;
+
+	manufacturerId = (uint8_t)(info->jedecId >> 16);
+	capacity = info->capacity;
+	writeEnableDelayUs = info->writeEnableDelayUs;
+	pageProgramTimeoutMs = info->pageProgramTimeoutMs;
+	sectorEraseTypicalMs = info->sectorEraseTypicalMs;
+	sectorEraseTimeoutMs = info->sectorEraseTimeoutMs;
+	blockEraseTypicalMs = info->blockEraseTypicalMs;
+	chipEraseTypicalMs = info->chipEraseTypicalMs;
+	chipEraseTimeoutMs = info->chipEraseTimeoutMs;
+	eraseSuspendInst = info->eraseSuspendInst;
+	eraseResumeInst = info->eraseResumeInst;
+
+	// 60 MHz is the fastest SPI clock on any Particle device
+	spiClockSpeedMHz = (info->maxClockMHz < 60) ? info->maxClockMHz : 60;
+	fastRead = (spiClockSpeedMHz > info->maxReadClockMHz);
+
+	if (info->supports4ByteAddressing && capacity > 16 * 1024 * 1024) {
+		if (!info->supports4ByteBlock32Erase) {
+			block32EraseInst = 0;
+		}
+		withNative4ByteAddressing();
+	}
+}
 
-	uint8_t txBuf[1];
+bool SpiFlash::autoConfigure() {
+	uint32_t jedecId = jedecIdRead();
+	if (jedecId == 0 || jedecId == 0xffffff) {
+		return false;
+	}
 
-	txBuf[0] = 0xC7; // CHIP_ER
+	const SpiFlashChipInfo *info = findChipInfo(jedecId);
+	if (info) {
+		configureFromChipInfo(info);
+	}
+	else
+	if (!configureFromSfdp()) {
+		// Most manufacturers encode the capacity as a power of 2 in device ID 2
+		uint8_t capacityCode = (uint8_t)jedecId;
+		if (capacityCode >= 0x10 && capacityCode <= 0x20) {
+			capacity = (size_t)1 << capacityCode;
+		}
+	}
+	manufacturerId = (uint8_t)(jedecId >> 16);
 
-	writeEnable();
+	return true;
+}
 
-	beginTransaction();
-	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
-	endTransaction();
+// static
+SpiFlash *SpiFlash::detect(SPIClass &spi, int cs) {
+	SpiFlash *spiFlash = new SpiFlash(spi, cs);
+	if (!spiFlash) {
+		return 0;
+	}
 
-	waitForWriteComplete(chipEraseTimeoutMs);
+	spiFlash->begin();
+	if (!spiFlash->autoConfigure()) {
+		delete spiFlash;
+		return 0;
+	}
+	return spiFlash;
 }
 
 void SpiFlash::resetDevice() {
@@ -271,6 +2769,7 @@ void SpiFlash::resetDevice() {
 	endTransaction();
 
 	delayMicroseconds(1);
+	knownIdle = false;
 }
 
 void SpiFlash::wakeFromSleep() {
@@ -284,6 +2783,9 @@ void SpiFlash::wakeFromSleep() {
 
 	// Need to wait tres (3 microseconds) before issuing the next command
 	delayMicroseconds(3);
+
+	// The MCU may have reset during an operation, so read the status register before the next one
+	knownIdle = false;
 }
 
 // Note: not all chips support this. Macronix does.
@@ -304,6 +2806,8 @@ void SpiFlash::deepPowerDown() {
 void SpiFlash::writeEnable() {
 	uint8_t txBuf[1];
 
+	knownIdle = false;
+
 	beginTransaction();
 	txBuf[0] = 0x06; // WREN
 	spi.transfer(txBuf, NULL, sizeof(txBuf), NULL);
@@ -316,6 +2820,7 @@ void SpiFlash::writeEnable() {
 }
 
 bool SpiFlash::set4ByteAddressing(bool enable) {
+	OperationLock lock(*this, writePriority);
 
 	uint8_t txBuf[1];
 	txBuf[0] = enable ? 0xb7 : 0xe9; // EN4B / EX4B
@@ -349,6 +2854,7 @@ bool SpiFlash::set4ByteAddressing(bool enable) {
 #include "spi_flash.h"
 
 SpiFlashP1::SpiFlashP1() {
+	capacity = 1024 * 1024;
 
 }
 SpiFlashP1::~SpiFlashP1() {
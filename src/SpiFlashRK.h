@@ -11,6 +11,18 @@
 
 #include "Particle.h"
 
+#include <functional>
+
+/**
+ * @brief Results from SpiFlashBase::syncData()
+ */
+struct SpiFlashSyncStats {
+	uint32_t pagesProgrammed = 0;	//!< Pages that were programmed
+	uint32_t pagesSkipped = 0;		//!< Pages that already contained the data, or were blank after an erase
+	uint32_t sectorsErased = 0;		//!< Sectors that had to be erased because a bit changed from 0 to 1
+	uint32_t sectorsSkipped = 0;	//!< Sectors that were updated without erasing
+};
+
 /**
  * @brief Pure virtual base class SPI for SpiFlash devices
  *
@@ -78,6 +90,104 @@ public:
 	 */
 	virtual void chipErase() = 0;
 
+	/**
+	 * @brief Erases a range of sectors
+	 *
+	 * @param addr Address of the beginning of the range. Must be at the start of a sector boundary.
+	 * @param len Number of bytes to erase. Must be a multiple of the sector size.
+	 *
+	 * @return true if the range was erased, false if addr or len are not sector aligned.
+	 *
+	 * The default implementation erases each sector in turn, or uses chipErase() if the range covers
+	 * the whole device and the capacity is known. SpiFlash uses 32K and 64K block erase where possible.
+	 */
+	virtual bool eraseRange(size_t addr, size_t len);
+
+	/**
+	 * @brief Writes data, skipping the pages that are unchanged and only erasing the sectors that need it
+	 *
+	 * @param addr The address to write to
+	 * @param buf The data to write
+	 * @param bufLen The number of bytes to write
+	 * @param stats If not NULL, filled in with the number of pages and sectors programmed, erased, and skipped
+	 *
+	 * @return true if the data was written, false if the sector buffer could not be allocated
+	 *
+	 * Unlike writeData() the range doesn't need to be erased first, and unlike SpiFlash::updateData() no
+	 * sector cache is needed. Each sector is read and compared with the new data. Pages that already
+	 * contain the data are skipped, and if the data only changes bits from 1 to 0 the changed pages are
+	 * programmed directly. Otherwise the sector is erased and reprogrammed, keeping the data in the sector
+	 * outside of the range. A buffer of getSectorSize() bytes is allocated during the call.
+	 *
+	 * Rewriting data that is mostly unchanged, like configuration or a firmware image that was already
+	 * staged, is several times faster than erasing and writing it, and doesn't use erase cycles.
+	 */
+	virtual bool syncData(size_t addr, const void *buf, size_t bufLen, SpiFlashSyncStats *stats = 0);
+
+	/**
+	 * @brief Returns true if every byte from addr to addr + len is 0xff
+	 *
+	 * The range is read through a small buffer and compared a word at a time, stopping at the first byte
+	 * that isn't 0xff. The first read is only 16 bytes, so a range that has been written is usually
+	 * rejected quickly. SpiFlash reads the range in a single transaction.
+	 */
+	virtual bool isErased(size_t addr, size_t len);
+
+	/**
+	 * @brief Finds the end of the data in an append-only region
+	 *
+	 * @param start Start of the region. Should be page aligned.
+	 * @param end End of the region (exclusive)
+	 *
+	 * @return The address of the first erased page, or end if no page is erased.
+	 *
+	 * The region must be written from the start without gaps, so every page before the boundary
+	 * contains data and every page after it is erased. It's a binary search, so only about
+	 * log2(number of pages) pages are checked, 16 for 16 Mbyte of 256 byte pages, instead of scanning
+	 * the whole region.
+	 */
+	size_t findErasedBoundary(size_t start, size_t end);
+
+	/**
+	 * @brief Returns true if every byte of a buffer in RAM is 0xff, comparing a word at a time
+	 */
+	static bool isErasedBuffer(const void *buf, size_t len);
+
+	/**
+	 * @brief Starts reading data, which may continue in the background
+	 *
+	 * @return true if the read was started, false if it could not be started and readData() should be used instead
+	 *
+	 * The buffer must remain valid and not be used until isReadComplete() returns true. The default
+	 * implementation calls readData(). SpiFlash reads using DMA.
+	 */
+	virtual bool startReadData(size_t addr, void *buf, size_t bufLen) { readData(addr, buf, bufLen); return true; };
+
+	/**
+	 * @brief Returns true if the read started by startReadData() is complete
+	 */
+	virtual bool isReadComplete() { return true; };
+
+	/**
+	 * @brief Starts programming data within a single page, which may continue in the background
+	 *
+	 * @return true if the program was started, false if it could not be started and writeData() should be used instead
+	 *
+	 * The buffer can be reused as soon as this returns. The default implementation calls writeData().
+	 * SpiFlash returns without waiting for the chip to finish programming.
+	 */
+	virtual bool startPageProgram(size_t addr, const void *buf, size_t len) { writeData(addr, buf, len); return true; };
+
+	/**
+	 * @brief Returns true if the operation started by startPageProgram() is complete
+	 */
+	virtual bool isOperationComplete() { return true; };
+
+	/**
+	 * @brief Waits for the operation started by startPageProgram() to complete
+	 */
+	virtual void waitForOperationComplete() {};
+
 	/**
 	 * @brief Gets the page size (default: 256)
 	 */
@@ -98,10 +208,264 @@ public:
 	 */
 	inline SpiFlashBase &withSectorSize(size_t value) { sectorSize = value; return *this; };
 
+	/**
+	 * @brief Gets the capacity of the device in bytes (default: 0, unknown)
+	 */
+	inline size_t getCapacity() const { return capacity; };
+
+	/**
+	 * @brief Sets the capacity of the device in bytes (default: 0, unknown)
+	 */
+	inline SpiFlashBase &withCapacity(size_t value) { capacity = value; return *this; };
+
+	/**
+	 * @brief Calculates a CRC-32 (IEEE 802.3, as used by zlib)
+	 *
+	 * This uses 4 Kbyte of tables to process 4 bytes at a time. Define SPIFLASHRK_SMALL_CRC32 when compiling the
+	 * library to use a 64 byte table and process 4 bits at a time instead.
+	 *
+	 * @param data Data to calculate the CRC of
+	 * @param len Length of data
+	 * @param crc Pass the result of a previous call to continue a calculation, or 0 to start a new one
+	 */
+	static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+	/**
+	 * @brief Reads a range of flash and passes it to handler a piece at a time
+	 *
+	 * @param addr Address to start reading from
+	 * @param len Number of bytes to read
+	 * @param handler Called with each piece of the range, in order. Each piece is at most 256 bytes.
+	 *
+	 * This is used to process a range that's too large to read into RAM, like calculating a CRC. SpiFlash reads the
+	 * whole range in a single transaction, and the next piece is read by DMA while the handler processes the
+	 * previous one. Don't use the flash from the handler.
+	 */
+	virtual void readChunks(size_t addr, size_t len, std::function<void(const uint8_t *buf, size_t len)> handler);
+
+	/**
+	 * @brief Calculates the CRC-32 of a range of flash, as crc32() would on the same data in RAM
+	 *
+	 * @param addr Address to start at
+	 * @param len Number of bytes
+	 * @param crc Pass the result of a previous call to continue a calculation, or 0 to start a new one
+	 */
+	uint32_t crc32Range(size_t addr, size_t len, uint32_t crc = 0);
+
+	/**
+	 * @brief Calculates the SHA-256 hash of a range of flash
+	 *
+	 * @param addr Address to start at
+	 * @param len Number of bytes
+	 * @param hash Filled in with the 32 byte hash
+	 *
+	 * This is implemented in SpiFlashSha256.cpp, which is only linked if it's used.
+	 */
+	void sha256Range(size_t addr, size_t len, uint8_t *hash);
+
 protected:
 	size_t pageSize = 256;
 	size_t sectorSize = 4096;
+	size_t capacity = 0;
+
+};
+
+/**
+ * @brief Parameters for a specific flash chip, used by SpiFlash::detect() and SpiFlash::autoConfigure()
+ *
+ * Times are in milliseconds. Typical times are used to estimate erase progress, timeouts are the
+ * maximum values from the datasheet.
+ */
+struct SpiFlashChipInfo {
+	uint32_t jedecId;				//!< Manufacturer ID, device ID 1, device ID 2 as returned by jedecIdRead()
+	const char *name;				//!< Part number
+	uint32_t capacity;				//!< Capacity in bytes
+	uint8_t maxClockMHz;			//!< Maximum SPI clock speed
+	uint8_t maxReadClockMHz;		//!< Maximum SPI clock speed for READ (0x03). Above this, FAST_READ is used.
+	bool supports4ByteAddressing;	//!< Supports the 4-byte address instructions and EN4B/EX4B
+	bool supports4ByteBlock32Erase;	//!< Has the 4-byte address 32K block erase (0x5C). If not, 32K erases aren't used.
+	uint8_t eraseSuspendInst;		//!< Erase suspend instruction, or 0 if not supported
+	uint8_t eraseResumeInst;		//!< Erase resume instruction
+	uint8_t writeEnableDelayUs;		//!< Delay after write enable in microseconds
+	uint16_t pageProgramTimeoutMs;	//!< Maximum page program time
+	uint16_t sectorEraseTypicalMs;	//!< Typical 4K sector erase time
+	uint16_t sectorEraseTimeoutMs;	//!< Maximum 4K sector erase time
+	uint16_t blockEraseTypicalMs;	//!< Typical 64K block erase time
+	uint32_t chipEraseTypicalMs;	//!< Typical chip erase time
+	uint32_t chipEraseTimeoutMs;	//!< Maximum chip erase time
+};
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+/**
+ * @brief Operation types that statistics are kept for
+ */
+enum SpiFlashStatsOp {
+	SPIFLASH_STATS_READ = 0,		//!< readData and readDataAsync
+	SPIFLASH_STATS_PAGE_PROGRAM,	//!< Each page programmed by writeData and writeDataAsync
+	SPIFLASH_STATS_SECTOR_ERASE,	//!< 4K sector erase
+	SPIFLASH_STATS_BLOCK32_ERASE,	//!< 32K block erase
+	SPIFLASH_STATS_BLOCK_ERASE,		//!< 64K block erase
+	SPIFLASH_STATS_CHIP_ERASE,		//!< Chip erase
+	SPIFLASH_STATS_STATUS_POLL,		//!< Status register read
+	SPIFLASH_STATS_OP_COUNT			//!< Number of operation types, not an operation type
+};
+
+/**
+ * @brief Number of latency histogram buckets
+ *
+ * Bucket 0 counts operations that took less than 2 microseconds. Bucket n counts operations that took
+ * from 2^n to 2^(n+1)-1 microseconds. The last bucket also counts anything longer.
+ */
+static const size_t SPIFLASH_STATS_BUCKETS = 28;
+
+/**
+ * @brief Statistics for one type of operation
+ */
+struct SpiFlashOpStats {
+	uint32_t count;				//!< Number of operations
+	uint32_t timeouts;			//!< Number of operations where waiting for completion timed out
+	uint64_t bytes;				//!< Number of bytes read or programmed
+	uint32_t transactions;		//!< Number of SPI transactions, including status polls and write enables
+	uint32_t statusPolls;		//!< Number of status register reads
+	uint32_t minUs;				//!< Shortest operation in microseconds (0xffffffff if count is 0)
+	uint32_t maxUs;				//!< Longest operation in microseconds
+	uint64_t totalUs;			//!< Sum of the operation times in microseconds
+	uint32_t histogram[SPIFLASH_STATS_BUCKETS]; //!< Latency histogram, see SPIFLASH_STATS_BUCKETS
+
+	/**
+	 * @brief Returns the average operation time in microseconds, or 0 if count is 0
+	 */
+	uint32_t getAvgUs() const { return count ? (uint32_t)(totalUs / count) : 0; };
+
+	/**
+	 * @brief Returns an upper bound for the given percentile (0 - 100) of operation times, from the histogram
+	 */
+	uint32_t getPercentileUs(int percent) const;
+};
+
+/**
+ * @brief Snapshot of the statistics for a SpiFlash object, from SpiFlash::getStats()
+ */
+struct SpiFlashStats {
+	SpiFlashOpStats ops[SPIFLASH_STATS_OP_COUNT];	//!< Indexed by SpiFlashStatsOp
+	uint32_t waitTimeouts;		//!< Number of times waiting for the write-in-progress flag to clear gave up
+	unsigned long periodMs;		//!< Milliseconds since the statistics were reset
+
+	/**
+	 * @brief Returns a short name for the operation type, like "read" or "sectorErase"
+	 */
+	static const char *getOpName(SpiFlashStatsOp op);
+};
+#endif /* SPIFLASHRK_ENABLE_STATS */
+
+/**
+ * @brief Priorities for SpiFlashLock. When the lock is released, a waiting thread with a higher priority gets it first.
+ */
+enum SpiFlashPriority {
+	SPIFLASH_PRIORITY_LOW = 0,		//!< Bulk writes and erases (default for SpiFlash writes and erases)
+	SPIFLASH_PRIORITY_NORMAL,		//!< Default for lock()
+	SPIFLASH_PRIORITY_HIGH,			//!< Latency-sensitive operations (default for SpiFlash reads)
+	SPIFLASH_PRIORITY_COUNT			//!< Number of priorities, not a priority
+};
+
+/**
+ * @brief Statistics for a SpiFlashLock, from SpiFlashLock::getStats()
+ */
+struct SpiFlashLockStats {
+	uint32_t acquisitions;			//!< Number of times the lock was acquired (not counting recursive locks)
+	uint32_t contended;				//!< Number of acquisitions that had to wait for another thread
+	uint32_t preemptions;			//!< Number of times the owner released the lock for a higher priority thread
+	uint64_t totalWaitUs;			//!< Total time spent waiting for the lock in microseconds
+	uint32_t maxWaitUs;				//!< Longest wait for the lock in microseconds
+	uint64_t totalHoldUs;			//!< Total time the lock was held in microseconds
+	uint32_t maxHoldUs;				//!< Longest time the lock was held in microseconds
+};
+
+/**
+ * @brief Recursive lock with priorities, for sharing a SpiFlash object or an SPI bus between threads
+ *
+ * A thread waiting with a higher priority gets the lock before threads waiting with a lower priority,
+ * and the owner can let it in early at a convenient point with yield(). The same thread can lock it
+ * more than once, and it's released when unlock() has been called the same number of times.
+ *
+ * Waiting threads block on a semaphore for their priority, which unlock() gives to the highest
+ * priority waiter, so they use no CPU while waiting and can't starve a lower priority owner.
+ */
+class SpiFlashLock {
+public:
+	SpiFlashLock();
+	virtual ~SpiFlashLock();
+
+	/**
+	 * @brief Waits until the lock is available and takes it
+	 *
+	 * @param priority A SpiFlashPriority value
+	 */
+	void lock(uint8_t priority = SPIFLASH_PRIORITY_NORMAL);
+
+	/**
+	 * @brief Takes the lock if it's available or already owned by this thread, without waiting
+	 *
+	 * Returns false if another thread owns the lock or a higher priority thread is waiting for it.
+	 */
+	bool tryLock(uint8_t priority = SPIFLASH_PRIORITY_NORMAL);
+
+	/**
+	 * @brief Releases the lock taken by lock() or tryLock()
+	 */
+	void unlock();
+
+	/**
+	 * @brief Releases and retakes the lock if a thread with a higher priority than priority is waiting
+	 *
+	 * Returns true if the lock was released. Only releases the lock if this thread owns it and has only
+	 * locked it once, since the outer lock is presumably protecting something that's in an intermediate state.
+	 */
+	bool yield(uint8_t priority);
+
+	/**
+	 * @brief Returns the number of threads waiting for the lock
+	 */
+	size_t getNumWaiters() const;
+
+	/**
+	 * @brief Returns true if any thread owns the lock
+	 */
+	bool isLocked() const { return depth != 0; };
+
+	/**
+	 * @brief Copies the statistics collected since the lock was created or the last resetStats()
+	 */
+	void getStats(SpiFlashLockStats &result) const;
+
+	/**
+	 * @brief Clears the statistics
+	 */
+	void resetStats();
+
+protected:
+	/**
+	 * @brief Returns true if a thread with a higher priority than priority is waiting. Call with mutex locked.
+	 */
+	bool higherPriorityWaiting(uint8_t priority) const;
+
+	/**
+	 * @brief Takes the lock once it's available. Call with mutex locked.
+	 */
+	void acquire(os_thread_t self, unsigned long startUs, bool waited);
 
+	/**
+	 * @brief Wakes the highest priority waiting thread, if any. Call with mutex locked.
+	 */
+	void wakeWaiter();
+
+	os_mutex_t mutex = 0;
+	os_semaphore_t semaphores[SPIFLASH_PRIORITY_COUNT] = {0};
+	os_thread_t owner = 0;
+	volatile unsigned int depth = 0;
+	uint16_t waiting[SPIFLASH_PRIORITY_COUNT] = {0};
+	unsigned long holdStartUs = 0;
+	SpiFlashLockStats stats;
 };
 
 /**
@@ -111,6 +475,7 @@ protected:
  * and allocate it as a global variable.
  */
 class SpiFlash : public SpiFlashBase {
+	friend class SpiFlashBatch;
 public:
 	SpiFlash(SPIClass &spi, int cs);
 	virtual ~SpiFlash();
@@ -156,8 +521,31 @@ public:
 	 *
 	 * Waits up to waitWriteCompletionTimeoutMs milliseconds (default: 500) if
 	 * not specified or 0. Otherwise, waits the specified number of milliseconds.
+	 *
+	 * @return true if the operation completed, false if it timed out
+	 */
+	bool waitForWriteComplete(unsigned long timeout = 0);
+
+	/**
+	 * @brief Operations whose completion time is learned by adaptive polling
+	 */
+	enum WriteOperation {
+		WRITE_OP_PAGE_PROGRAM = 0,	//!< Full page program
+		WRITE_OP_SECTOR_ERASE,		//!< 4K sector erase
+		WRITE_OP_BLOCK32_ERASE,		//!< 32K block erase
+		WRITE_OP_BLOCK_ERASE,		//!< 64K block erase
+		WRITE_OP_CHIP_ERASE,		//!< Chip erase
+		WRITE_OP_COUNT				//!< Number of operations, not an operation
+	};
+
+	/**
+	 * @brief Returns the expected time for an operation in microseconds, or 0 if not known
+	 *
+	 * This is the running average of the measured completion times on this chip. Until an
+	 * operation has completed once, it's the typical time from the datasheet or SFDP, or 0 for
+	 * page program and 32K block erase.
 	 */
-	void waitForWriteComplete(unsigned long timeout = 0);
+	unsigned long getExpectedTimeUs(WriteOperation op) const;
 
 	/**
 	 * @brief Writes the status register.
@@ -170,6 +558,14 @@ public:
 	 * @param addr The address to read from
 	 * @param buf The buffer to store data in
 	 * @param bufLen The number of bytes to read
+	 *
+	 * The whole range is read in a single SPI transaction with one READ (0x03) or FAST_READ (0x0B)
+	 * command, since NOR flash reads continue across page boundaries. The data phase is split
+	 * into multiple transfers only if it's larger than maxTransferSize.
+	 *
+	 * This can be called while an asynchronous erase is in progress. If the chip supports erase
+	 * suspend the erase is suspended for the duration of the read, otherwise the read waits for
+	 * the erase to complete. Don't read from the region being erased.
 	 */
 	void readData(size_t addr, void *buf, size_t bufLen);
 
@@ -183,125 +579,652 @@ public:
 	void writeData(size_t addr, const void *buf, size_t bufLen);
 
 	/**
-	 * @brief Erases a sector. Sectors are 4K (4096 bytes) and the smallest unit that can be erased.
+	 * @brief Updates data in place, setting bits to 1 as well as 0. Requires withSectorCache().
 	 *
-	 * This call blocks for the duration of the erase, which take take some time (up to 500 milliseconds).
+	 * @param addr The address to write to
+	 * @param buf The data to write
+	 * @param bufLen The number of bytes to write
 	 *
-	 * @param addr Address of the beginning of the sector. Must be at the start of a sector boundary.
-	 */
-	void sectorErase(size_t addr);
-
-	/**
-	 * @brief Erases a block. Blocks are 64K (65536 bytes) or 16 sectors. There are 16 blocks on a 1 MByte device.
+	 * @return true if the data was updated, false if there is no sector cache.
 	 *
-	 * This call blocks for the duration of the erase, which take take some time (up to 1 second).
-	 * This call is not in the base API because the P1 does not support it. SPIFFS doesn't need it for operation
-	 * and uses sector erase.
+	 * Unlike writeData(), which can only change bits from 1 to 0, this can change any data. The sectors
+	 * containing the data are read into the sector cache and updated in RAM. Repeated updates to the same
+	 * sector are merged, and the sector is only written to flash when it's evicted from the cache or
+	 * flush() is called. If the new data only changes bits from 1 to 0, only the changed pages are
+	 * programmed; otherwise the sector is erased once and reprogrammed.
 	 *
-	 * @param addr Address of the beginning of the block
+	 * readData() returns the updated data even before it's flushed. writeData() and the erase functions
+	 * flush or discard any cached sectors they overlap.
 	 */
-	void blockErase(size_t addr);
+	bool updateData(size_t addr, const void *buf, size_t bufLen);
 
 	/**
-	 * @brief Erases the entire chip.
+	 * @brief Writes data, skipping unchanged pages and only erasing when needed. See SpiFlashBase::syncData().
 	 *
-	 * This call blocks for the duration of the erase, which take take some time (several secoonds). This function
-	 * uses delay(1) so the cloud connection will be serviced in non-system-threaded mode.
+	 * The whole operation holds the lock enabled by withLocking().
 	 */
-	void chipErase();
+	virtual bool syncData(size_t addr, const void *buf, size_t bufLen, SpiFlashSyncStats *stats = 0);
 
 	/**
-	 * @brief Sends the device reset sequence
-	 *
-	 * Winbond devices support this, ISSI devices do not.
+	 * @brief Returns true if every byte in the range is 0xff. See SpiFlashBase::isErased().
 	 */
-	void resetDevice();
+	virtual bool isErased(size_t addr, size_t len);
 
 	/**
-	 * @brief Wakes the chip from sleep. Not normally necessary, except when doing deep power down on Macronix chips
+	 * @brief Reads a range in a single transaction, passing each piece to handler while the next is read by DMA.
+	 * See SpiFlashBase::readChunks().
 	 */
-	void wakeFromSleep();
+	virtual void readChunks(size_t addr, size_t len, std::function<void(const uint8_t *buf, size_t len)> handler);
 
 	/**
-	 * @brief Deep power down. Only supported by Macronix.
+	 * @brief Writes all modified sectors in the sector cache and the write combining buffer to flash
+	 *
+	 * Call this before power down or reset, otherwise data from updateData() that has not been
+	 * evicted from the cache, or the last partial page written with write combining enabled, is lost.
 	 */
-	void deepPowerDown();
+	void flush();
 
+	/**
+	 * @brief Returns true if the sector cache or write combining buffer has data that has not been written to flash
+	 */
+	bool hasUnflushedData() const;
 
 	/**
-	 * @brief Enable or disable 4-byte addressing mode for devices larger than 128 Mbit
-	 * 
-	 * @param enable Enable 4-byte addressing if true
-	 * 
-	 * The default power-on state is 3-byte addressing. 3-byte addressing is used if disabled,
-	 * power-on, or device reset.
+	 * @brief Callback for asynchronous operations
+	 *
+	 * @param success true if the operation completed, false if it timed out
 	 */
-	bool set4ByteAddressing(bool enable);
+	typedef std::function<void(bool success)> AsyncCallback;
 
 	/**
-	 * @brief Sets the page size (default: 256)
+	 * @brief Reads data asynchronously using DMA
+	 *
+	 * @param addr The address to read from
+	 * @param buf The buffer to store data in. Must remain valid until the callback is called.
+	 * @param bufLen The number of bytes to read
+	 * @param callback Called from poll() when the read is complete. May be NULL.
+	 *
+	 * @return true if the read was started, false if another asynchronous operation is in progress.
+	 *
+	 * If an operation started by startPageProgram() or a start erase function is in progress, this waits
+	 * for it to complete first. You must call poll() frequently, typically from loop(), until isBusy()
+	 * returns false.
 	 */
-	inline SpiFlash &withPageSize(size_t value) { pageSize = value; return *this; };
+	bool readDataAsync(size_t addr, void *buf, size_t bufLen, AsyncCallback callback = 0);
 
 	/**
-	 * @brief Sets the sector size (default: 4096)
+	 * @brief Starts reading data using readDataAsync()
+	 *
+	 * @return false if another asynchronous operation is in progress
 	 */
-	inline SpiFlash &withSectorSize(size_t value) { sectorSize = value; return *this; };
+	virtual bool startReadData(size_t addr, void *buf, size_t bufLen);
 
 	/**
-	 * @brief Sets the SPI clock speed (default: 30 MHz)
+	 * @brief Calls poll() and returns true if the read started by startReadData() is complete
 	 */
-	inline SpiFlash &withSpiClockSpeedMHz(uint8_t value) { spiClockSpeedMHz = value; return *this; };
+	virtual bool isReadComplete();
 
 	/**
-	 * @brief Sets shared bus mode
+	 * @brief Writes data asynchronously using DMA. Can write data across page boundaries.
 	 *
-	 * @param delayus Amount of time in microseconds to delay after changing SPI settings to allow the bus to settle.
-	 * 
-	 * This is no longer necessary and is only included for backward compatibility and does nothing.
+	 * @param addr The address to write to
+	 * @param buf The data to write. Must remain valid until the callback is called.
+	 * @param bufLen The number of bytes to write
+	 * @param callback Called from poll() when the write is complete. May be NULL.
+	 *
+	 * @return true if the write was started, false if another asynchronous operation is in progress.
+	 *
+	 * Each page is programmed in turn. The page data is sent by DMA and the write-in-progress flag
+	 * is checked once per call to poll(), so the calling thread is never blocked waiting for
+	 * the page program to complete.
 	 */
-	inline SpiFlash &withSharedBus(unsigned long delayus) { return *this;};
-
-protected:
-	// Flags for the status register
-	static const uint8_t STATUS_WIP 	= 0x01;
-	static const uint8_t STATUS_WEL 	= 0x02;
-	static const uint8_t STATUS_SRWD 	= 0x80;
+	bool writeDataAsync(size_t addr, const void *buf, size_t bufLen, AsyncCallback callback = 0);
 
 	/**
-	 * @brief The expected manufacturerId, used by isValid(). This is overridden by flash-chip-specific subclasses.
+	 * @brief Starts erasing a sector asynchronously
+	 *
+	 * @param addr Address of the beginning of the sector. Must be at the start of a sector boundary.
+	 * @param callback Called from poll() when the erase is complete. May be NULL.
+	 *
+	 * @return true if the erase was started, false if another asynchronous operation is in progress.
+	 *
+	 * Unlike sectorErase(), this returns immediately. Call poll() until isBusy() returns false.
 	 */
-	uint8_t manufacturerId = 0x9d;
+	bool sectorEraseAsync(size_t addr, AsyncCallback callback = 0);
 
 	/**
-	 * @brief The bit order for SPI. Must be MSBFIRST for SPI flash modules.
+	 * @brief Starts erasing a 64K block asynchronously
+	 *
+	 * @param addr Address of the beginning of the block
+	 * @param callback Called from poll() when the erase is complete. May be NULL.
+	 *
+	 * @return true if the erase was started, false if another asynchronous operation is in progress.
 	 */
-	uint8_t spiBitOrder = MSBFIRST;
+	bool blockEraseAsync(size_t addr, AsyncCallback callback = 0);
 
 	/**
-	 * @brief The maximum speed to use. Most flash modules can handle 60 MHz without difficulties.
+	 * @brief Starts erasing the entire chip asynchronously
 	 *
-	 * Flash-chip-specific subclasses can override this if they need a slower speed.
+	 * @param callback Called from poll() when the erase is complete. May be NULL.
+	 *
+	 * @return true if the erase was started, false if another asynchronous operation is in progress.
+	 *
+	 * This can take minutes on large chips, but poll() only does a single status register read
+	 * each time it's called, so the main loop, cloud connection, and watchdog are not affected.
 	 */
-	uint8_t spiClockSpeedMHz = 30;
+	bool chipEraseAsync(AsyncCallback callback = 0);
 
 	/**
-	 * @brief The data mode.
+	 * @brief Suspends the erase in progress so the chip can be read
 	 *
-	 * Most chips can use SPI_MODE0 or SPI_MODE3 but I've found that Winbond chips don't work very reliably in mode 0
-	 * so the default is SPI_MODE3, since both ISSI and Winbond chips work well with MODE3.
+	 * @return true if an erase was suspended. Returns false if the chip doesn't support erase
+	 * suspend or an erase was not in progress.
+	 *
+	 * Only reads are allowed while an erase is suspended, and data in the region being erased
+	 * is not valid. Call eraseResume() to continue the erase. You normally don't need to call
+	 * this directly as readData() does it automatically during an asynchronous erase.
 	 */
-	uint8_t spiDataMode = SPI_MODE3;
+	bool eraseSuspend();
 
 	/**
-	 * @brief Maximum time to wait for a write call to complete in milliseconds.
+	 * @brief Resumes an erase suspended by eraseSuspend()
 	 */
-	unsigned long waitWriteCompletionTimeoutMs = 10;
+	void eraseResume();
 
 	/**
-	 * @brief Maximum amount of time to wait for a sector erase call to complete in milliseconds.
+	 * @brief Returns true if the chip supports erase suspend and resume
 	 */
-	unsigned long sectorEraseTimeoutMs = 500;
+	bool isEraseSuspendSupported() const { return eraseSuspendInst != 0; };
+
+	/**
+	 * @brief Returns the number of milliseconds since the current asynchronous operation started
+	 */
+	unsigned long getAsyncElapsedMs() const;
+
+	/**
+	 * @brief Returns the estimated progress of the current asynchronous operation in percent (0 - 100)
+	 *
+	 * For reads and writes this is the fraction of the data transferred. The flash chip does not
+	 * report erase progress, so for erases this is the elapsed time compared to the typical
+	 * erase time for the chip, and stays at 99 if the erase takes longer than typical.
+	 * Returns 100 if no operation is in progress.
+	 */
+	int getAsyncProgress() const;
+
+	/**
+	 * @brief Returns true if an asynchronous operation is in progress
+	 */
+	bool isBusy() const { return asyncState != AsyncState::IDLE; };
+
+	/**
+	 * @brief Advances the asynchronous operation in progress, if any
+	 *
+	 * Call this from loop() while isBusy() is true. It never blocks waiting for the flash chip.
+	 * Call it from the thread that started the operation, not a software timer or the DMA
+	 * completion interrupt, since the SPI bus is locked in one call and released in a later one.
+	 *
+	 * Do not call the synchronous functions like readData() and writeData() while an
+	 * asynchronous operation is in progress.
+	 */
+	void poll();
+
+	/**
+	 * @brief Starts programming data within a single page and returns without waiting for it to complete
+	 *
+	 * @param addr The address to write to
+	 * @param buf The data to write. It's sent to the chip before returning, so it doesn't need to remain valid.
+	 * @param len The number of bytes to write. addr to addr + len must be within one page.
+	 *
+	 * @return false if an asynchronous operation is in progress or the data crosses a page boundary
+	 *
+	 * Unlike writeDataAsync() this doesn't use DMA, so operations can be in progress on several SpiFlash
+	 * objects at the same time, for example to overlap one chip's page program with transfers to other chips
+	 * on the same SPI bus. Call isOperationComplete() until it returns true before using this chip again.
+	 * readData() waits for the operation to complete if necessary.
+	 */
+	virtual bool startPageProgram(size_t addr, const void *buf, size_t len);
+
+	/**
+	 * @brief Starts a sector erase and returns without waiting for it to complete
+	 *
+	 * @return false if an asynchronous operation is in progress. See startPageProgram().
+	 */
+	bool startSectorErase(size_t addr);
+
+	/**
+	 * @brief Starts a 64K block erase and returns without waiting for it to complete
+	 *
+	 * @return false if an asynchronous operation is in progress or the chip doesn't support block erase.
+	 * See startPageProgram().
+	 */
+	bool startBlockErase(size_t addr);
+
+	/**
+	 * @brief Starts a chip erase and returns without waiting for it to complete
+	 *
+	 * @return false if an asynchronous operation is in progress. See startPageProgram().
+	 */
+	bool startChipErase();
+
+	/**
+	 * @brief Returns true if the operation started by startPageProgram() or an erase start function has
+	 * completed or timed out, or if there is no operation
+	 *
+	 * With adaptive polling the status register is only read once the operation is expected to be
+	 * nearly done, so this can be called as often as convenient. It never blocks. The completion time is
+	 * learned the same way as the synchronous functions if this is called when getOperationWaitUs() is 0.
+	 */
+	virtual bool isOperationComplete();
+
+	/**
+	 * @brief Returns how many microseconds until isOperationComplete() will next read the status register
+	 *
+	 * Returns 0 if there is no operation, or if it will read the status register on the next call.
+	 */
+	unsigned long getOperationWaitUs() const;
+
+	/**
+	 * @brief Waits for the operation started by startPageProgram() or an erase start function to complete
+	 */
+	virtual void waitForOperationComplete();
+
+	/**
+	 * @brief Erases a sector. Sectors are 4K (4096 bytes) and the smallest unit that can be erased.
+	 *
+	 * This call blocks for the duration of the erase, which take take some time (up to 500 milliseconds).
+	 *
+	 * @param addr Address of the beginning of the sector. Must be at the start of a sector boundary.
+	 */
+	void sectorErase(size_t addr);
+
+	/**
+	 * @brief Erases a block. Blocks are 64K (65536 bytes) or 16 sectors. There are 16 blocks on a 1 MByte device.
+	 *
+	 * This call blocks for the duration of the erase, which take take some time (up to 1 second).
+	 * This call is not in the base API because the P1 does not support it. SPIFFS doesn't need it for operation
+	 * and uses sector erase.
+	 *
+	 * @param addr Address of the beginning of the block
+	 */
+	void blockErase(size_t addr);
+
+	/**
+	 * @brief Erases a 32K block (32768 bytes, 8 sectors) using instruction 0x52.
+	 *
+	 * This call blocks for the duration of the erase.
+	 *
+	 * @param addr Address of the beginning of the block
+	 */
+	void block32Erase(size_t addr);
+
+	/**
+	 * @brief Erases the entire chip.
+	 *
+	 * This call blocks for the duration of the erase, which take take some time (several secoonds). This function
+	 * uses delay(1) so the cloud connection will be serviced in non-system-threaded mode.
+	 */
+	void chipErase();
+
+	/**
+	 * @brief Erases a range using the fewest erase commands
+	 *
+	 * @param addr Address of the beginning of the range. Must be at the start of a sector boundary.
+	 * @param len Number of bytes to erase. Must be a multiple of the sector size.
+	 *
+	 * @return true if the range was erased, false if addr or len are not sector aligned or an erase
+	 * timed out. Nothing after an erase that timed out is erased.
+	 *
+	 * Uses 64K block erase, 32K block erase, and sector erase, in that order of preference, based on
+	 * the alignment of each part of the range. If the range covers the whole chip and the capacity
+	 * is known, chip erase is used instead. For example, erasing 1 Mbyte takes 16 block erases
+	 * instead of 256 sector erases.
+	 */
+	bool eraseRange(size_t addr, size_t len);
+
+	/**
+	 * @brief Reads the JEDEC SFDP (Serial Flash Discoverable Parameters) tables and configures the driver from them
+	 *
+	 * @return true if the chip has a valid basic flash parameter table. If false, the settings are unchanged.
+	 *
+	 * Sets the capacity, page size, erase instructions (4K, 32K, 64K), erase suspend and resume instructions,
+	 * and the typical and maximum program and erase times from the table. If the chip is larger than
+	 * 16 Mbyte, the 4-byte address instructions are used if the 4-byte address instruction table lists
+	 * them, otherwise 4-byte addressing mode is enabled. Older chips like the MX25L8006E don't support SFDP.
+	 *
+	 * This is called automatically from begin() if withSfdp() is used.
+	 */
+	bool configureFromSfdp();
+
+	/**
+	 * @brief Reads from the SFDP area using instruction 0x5A
+	 *
+	 * @param addr The SFDP address to read from
+	 * @param buf The buffer to store data in
+	 * @param bufLen The number of bytes to read
+	 */
+	void readSfdp(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * @brief Returns true if configureFromSfdp() found a valid SFDP table
+	 */
+	bool hasSfdp() const { return sfdpValid; };
+
+	/**
+	 * @brief Configures the driver for whichever chip is connected
+	 *
+	 * @return true if a chip was found, false if there is no chip (JEDEC ID is all 0 or all 1 bits).
+	 *
+	 * Reads the JEDEC ID and looks it up in the built-in chip table. If it's not found, the SFDP
+	 * table is used instead. If the chip doesn't support SFDP either, only the manufacturer ID and
+	 * capacity (from the JEDEC ID) are set. The manufacturer ID is always set to the detected
+	 * value so isValid() returns true.
+	 *
+	 * When the chip is in the table the SPI clock speed is set to the fastest the chip supports, up to
+	 * 60 MHz, and FAST_READ is enabled if that's too fast for READ.
+	 */
+	bool autoConfigure();
+
+	/**
+	 * @brief Applies the settings from a chip table entry
+	 */
+	void configureFromChipInfo(const SpiFlashChipInfo *info);
+
+	/**
+	 * @brief Returns the chip table entry for the detected chip, or NULL if not detected or not in the table
+	 */
+	const SpiFlashChipInfo *getChipInfo() const { return chipInfo; };
+
+	/**
+	 * @brief Looks up a JEDEC ID in the built-in chip table
+	 *
+	 * @return The table entry or NULL if not found
+	 */
+	static const SpiFlashChipInfo *findChipInfo(uint32_t jedecId);
+
+	/**
+	 * @brief Allocates a SpiFlash object configured for whichever chip is connected
+	 *
+	 * @param spi The SPI interface (SPI, SPI1, ...)
+	 * @param cs The chip select pin
+	 *
+	 * @return A new SpiFlash object that has already had begin() called, or NULL if no chip was found.
+	 *
+	 * This is an alternative to choosing SpiFlashISSI, SpiFlashWinbond, or SpiFlashMacronix at compile time
+	 * for boards that may have different chips installed. See autoConfigure().
+	 */
+	static SpiFlash *detect(SPIClass &spi, int cs);
+
+	/**
+	 * @brief Sends the device reset sequence
+	 *
+	 * Winbond devices support this, ISSI devices do not.
+	 */
+	void resetDevice();
+
+	/**
+	 * @brief Wakes the chip from sleep. Not normally necessary, except when doing deep power down on Macronix chips
+	 */
+	void wakeFromSleep();
+
+	/**
+	 * @brief Deep power down. Only supported by Macronix.
+	 */
+	void deepPowerDown();
+
+
+	/**
+	 * @brief Enable or disable 4-byte addressing mode for devices larger than 128 Mbit
+	 * 
+	 * @param enable Enable 4-byte addressing if true
+	 * 
+	 * The default power-on state is 3-byte addressing. 3-byte addressing is used if disabled,
+	 * power-on, or device reset.
+	 *
+	 * On chips that support them, withNative4ByteAddressing() is preferred since the mode is lost
+	 * if the chip is reset without the driver knowing.
+	 */
+	bool set4ByteAddressing(bool enable);
+
+	/**
+	 * @brief Sets the page size (default: 256)
+	 */
+	inline SpiFlash &withPageSize(size_t value) { pageSize = value; return *this; };
+
+	/**
+	 * @brief Sets the sector size (default: 4096)
+	 */
+	inline SpiFlash &withSectorSize(size_t value) { sectorSize = value; return *this; };
+
+	/**
+	 * @brief Sets the capacity of the device in bytes (default: 0, unknown)
+	 *
+	 * This is used by eraseRange() to decide whether it can use chip erase.
+	 */
+	inline SpiFlash &withCapacity(size_t value) { capacity = value; return *this; };
+
+	/**
+	 * @brief Sets the SPI clock speed (default: 30 MHz)
+	 */
+	inline SpiFlash &withSpiClockSpeedMHz(uint8_t value) { spiClockSpeedMHz = value; return *this; };
+
+	/**
+	 * @brief Configure the driver from the SFDP tables in begin() (default: false)
+	 *
+	 * See configureFromSfdp() for more information.
+	 */
+	inline SpiFlash &withSfdp(bool value = true) { useSfdp = value; return *this; };
+
+	/**
+	 * @brief Use FAST_READ (0x0B) instead of READ (0x03) (default: false)
+	 *
+	 * FAST_READ adds one dummy byte after the address but works at the full SPI clock speed
+	 * of the chip. Many chips only support READ up to 33 or 50 MHz, so enable this if you
+	 * increase the clock speed using withSpiClockSpeedMHz().
+	 */
+	inline SpiFlash &withFastRead(bool value = true) { fastRead = value; return *this; };
+
+	/**
+	 * @brief Use the 4-byte address instructions instead of 4-byte addressing mode (default: false)
+	 *
+	 * Chips larger than 16 Mbyte need a 4-byte address. Instead of switching the chip into 4-byte
+	 * addressing mode with set4ByteAddressing(), this uses the instructions that always take a 4-byte
+	 * address: 0x13 (READ), 0x0C (FAST_READ), 0x12 (page program), 0x21 (sector erase), 0x5C (32K block
+	 * erase), and 0xDC (64K block erase). No mode switch is needed, and reads and writes still go to the
+	 * right address if the chip is reset or power cycled.
+	 *
+	 * autoConfigure(), detect(), and configureFromSfdp() enable this on chips larger than 16 Mbyte
+	 * that support it.
+	 *
+	 * Block erase instructions that don't have a 4-byte address form are disabled, so eraseRange() uses
+	 * smaller erases instead. If the sector erase instruction doesn't have one, this is not enabled.
+	 * Call after changing the erase instructions.
+	 */
+	SpiFlash &withNative4ByteAddressing(bool value = true);
+
+	/**
+	 * @brief Returns true if the 4-byte address instructions are used
+	 */
+	bool getNative4ByteAddressing() const { return native4byte; };
+
+	/**
+	 * @brief Sets the maximum number of bytes passed to a single SPI transfer (default: 65535)
+	 *
+	 * This is the limit of the DMA controller on the STM32 and nRF52 devices. Larger reads are
+	 * split into multiple transfers but still use a single command and SPI transaction. 0 sets
+	 * the default.
+	 */
+	inline SpiFlash &withMaxTransferSize(size_t value) { maxTransferSize = value ? value : 65535; return *this; };
+
+	/**
+	 * @brief Enables or disables adaptive completion polling (default: true)
+	 *
+	 * When enabled, program and erase operations first sleep for most of the time the operation
+	 * is expected to take, then read the status register at an interval that is a fraction of
+	 * the expected time. The expected time for each type of operation is learned from the
+	 * completion times measured on this chip. This uses far fewer status register reads than
+	 * polling continuously, without adding significant latency.
+	 *
+	 * When disabled, the status register is read continuously, or every millisecond for long
+	 * operations, as in earlier versions.
+	 */
+	inline SpiFlash &withAdaptivePolling(bool value = true) { adaptivePolling = value; return *this; };
+
+	/**
+	 * @brief Allocates a write-back sector cache for updateData() (default: none)
+	 *
+	 * @param numSectors The number of sectors to cache. Each one uses sectorSize (4096) bytes of RAM
+	 * from the heap. 0 frees the cache.
+	 *
+	 * Any modified sectors in an existing cache are flushed first. Call this after withSectorSize() if
+	 * you change the sector size.
+	 */
+	SpiFlash &withSectorCache(size_t numSectors);
+
+	/**
+	 * @brief Enables combining small writes into a single page program (default: false)
+	 *
+	 * When enabled, writeData() calls that write part of a page are combined in a page-sized RAM buffer.
+	 * The page is programmed once when it's full, when a write to a different page arrives, or when
+	 * flush() is called. Writes to the same page don't need to be contiguous and can overlap; the
+	 * result is the same as if each write was programmed separately. Writes of whole pages are
+	 * programmed immediately.
+	 *
+	 * readData() includes the data in the buffer. Erasing the page discards it. Uses pageSize bytes
+	 * of RAM from the heap, so call this after withPageSize() if you change the page size.
+	 */
+	SpiFlash &withWriteCombining(bool value = true);
+
+	/**
+	 * @brief Allocates a read cache (default: none)
+	 *
+	 * @param numLines The number of cache lines. Each one uses lineSize bytes of RAM from the heap. 0 frees the cache.
+	 * @param lineSize The size of each line in bytes (default: 256). Must be a power of 2.
+	 *
+	 * Reads smaller than lineSize are served from the cache. On a miss the whole aligned line is read from
+	 * the chip, replacing the least recently used line. Larger reads bypass the cache. writeData(),
+	 * updateData(), and the erase functions invalidate any lines they overlap.
+	 *
+	 * This is useful when the same small pieces of data, like file system metadata, are read repeatedly.
+	 */
+	SpiFlash &withReadCache(size_t numLines, size_t lineSize = 256);
+
+	/**
+	 * @brief Discards everything in the read cache
+	 *
+	 * You only need to call this if the chip was changed other than by this object, for example
+	 * by another device on the bus.
+	 */
+	void invalidateReadCache();
+
+	/**
+	 * @brief Returns the number of read cache lookups that were found in the cache
+	 */
+	uint32_t getReadCacheHits() const { return readCacheHits; };
+
+	/**
+	 * @brief Returns the number of read cache lookups that required reading from the chip
+	 */
+	uint32_t getReadCacheMisses() const { return readCacheMisses; };
+
+	/**
+	 * @brief Sets shared bus mode
+	 *
+	 * @param delayus Amount of time in microseconds to delay after changing SPI settings to allow the bus to settle.
+	 * 
+	 * This is no longer necessary and is only included for backward compatibility and does nothing.
+	 */
+	inline SpiFlash &withSharedBus(unsigned long delayus) { return *this;};
+
+	/**
+	 * @brief Enables locking so the object can be used from more than one thread (default: false)
+	 *
+	 * Each read, write, and erase holds a SpiFlashLock for this object, so operations from different
+	 * threads can't interleave. A long write is released between page programs and a long eraseRange()
+	 * between erases so a waiting read, which has a higher priority by default, can go first.
+	 *
+	 * The asynchronous functions don't use this lock, only the bus lock. Call poll() from the thread
+	 * that started the operation.
+	 */
+	SpiFlash &withLocking(bool value = true);
+
+	/**
+	 * @brief Returns the lock enabled by withLocking(), or NULL if locking is not enabled
+	 */
+	SpiFlashLock *getLock() const { return deviceLock; };
+
+	/**
+	 * @brief Sets a lock that's held for each SPI transaction (default: NULL)
+	 *
+	 * Pass the same SpiFlashLock to every SpiFlash object on an SPI bus and lock it around transactions
+	 * to other devices on the bus. Transactions then don't interleave, and transactions for higher
+	 * priority operations go first. The lock is not copied and must remain allocated.
+	 */
+	inline SpiFlash &withBusLock(SpiFlashLock *value) { busLock = value; return *this; };
+
+	/**
+	 * @brief Sets the SpiFlashPriority of reads (default: SPIFLASH_PRIORITY_HIGH)
+	 */
+	inline SpiFlash &withReadPriority(uint8_t value) { readPriority = value; return *this; };
+
+	/**
+	 * @brief Sets the SpiFlashPriority of writes and erases (default: SPIFLASH_PRIORITY_LOW)
+	 */
+	inline SpiFlash &withWritePriority(uint8_t value) { writePriority = value; return *this; };
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	/**
+	 * @brief Copies the statistics collected since the object was created or the last resetStats()
+	 *
+	 * Only available if SPIFLASHRK_ENABLE_STATS is defined. See SpiFlashStats.
+	 */
+	void getStats(SpiFlashStats &result) const;
+
+	/**
+	 * @brief Clears the statistics, for example after publishing them
+	 */
+	void resetStats();
+#endif
+
+protected:
+	// Flags for the status register
+	static const uint8_t STATUS_WIP 	= 0x01;
+	static const uint8_t STATUS_WEL 	= 0x02;
+	static const uint8_t STATUS_SRWD 	= 0x80;
+
+	/**
+	 * @brief The expected manufacturerId, used by isValid(). This is overridden by flash-chip-specific subclasses.
+	 */
+	uint8_t manufacturerId = 0x9d;
+
+	/**
+	 * @brief The bit order for SPI. Must be MSBFIRST for SPI flash modules.
+	 */
+	uint8_t spiBitOrder = MSBFIRST;
+
+	/**
+	 * @brief The maximum speed to use. Most flash modules can handle 60 MHz without difficulties.
+	 *
+	 * Flash-chip-specific subclasses can override this if they need a slower speed.
+	 */
+	uint8_t spiClockSpeedMHz = 30;
+
+	/**
+	 * @brief The data mode.
+	 *
+	 * Most chips can use SPI_MODE0 or SPI_MODE3 but I've found that Winbond chips don't work very reliably in mode 0
+	 * so the default is SPI_MODE3, since both ISSI and Winbond chips work well with MODE3.
+	 */
+	uint8_t spiDataMode = SPI_MODE3;
+
+	/**
+	 * @brief Maximum time to wait for a write call to complete in milliseconds.
+	 */
+	unsigned long waitWriteCompletionTimeoutMs = 10;
+
+	/**
+	 * @brief Maximum amount of time to wait for a sector erase call to complete in milliseconds.
+	 */
+	unsigned long sectorEraseTimeoutMs = 500;
 
 	/**
 	 * @brief Maximum amount of time to wait for a page program call to complete in milliseconds.
@@ -313,6 +1236,69 @@ protected:
 	 */
 	unsigned long chipEraseTimeoutMs = 50000;
 
+	/**
+	 * @brief Typical time for a sector erase in milliseconds. Used to estimate progress.
+	 */
+	unsigned long sectorEraseTypicalMs = 50;
+
+	/**
+	 * @brief Typical time for a 64K block erase in milliseconds. Used to estimate progress.
+	 */
+	unsigned long blockEraseTypicalMs = 500;
+
+	/**
+	 * @brief Typical time for a chip erase in milliseconds. Used to estimate progress.
+	 */
+	unsigned long chipEraseTypicalMs = 10000;
+
+	/**
+	 * @brief Instruction for 4K sector erase
+	 *
+	 * ISSI 25LQ080 uses 0x20 or 0xD7, Winbond uses 0x20 only, so the default is 0x20.
+	 */
+	uint8_t sectorEraseInst = 0x20;
+
+	/**
+	 * @brief Instruction for 32K block erase, or 0 if the chip doesn't support it
+	 */
+	uint8_t block32EraseInst = 0x52;
+
+	/**
+	 * @brief Instruction for 64K block erase, or 0 if the chip doesn't support it
+	 */
+	uint8_t blockEraseInst = 0xD8;
+
+	/**
+	 * @brief Call configureFromSfdp() from begin()
+	 */
+	bool useSfdp = false;
+
+	/**
+	 * @brief Set by configureFromSfdp() if the SFDP table was valid
+	 */
+	bool sfdpValid = false;
+
+	/**
+	 * @brief Set by configureFromChipInfo()
+	 */
+	const SpiFlashChipInfo *chipInfo = 0;
+
+	/**
+	 * @brief Instruction to suspend an erase in progress, or 0 if the chip doesn't support it
+	 */
+	uint8_t eraseSuspendInst = 0;
+
+	/**
+	 * @brief Instruction to resume a suspended erase
+	 */
+	uint8_t eraseResumeInst = 0;
+
+	/**
+	 * @brief Time after an erase suspend until the chip can be read, and the minimum time
+	 * after a resume before suspending again, in microseconds (tSUS).
+	 */
+	unsigned long eraseSuspendDelayUs = 20;
+
 	/**
 	 * @brief Amount of time to delay after write enable in microseconds.
 	 *
@@ -320,7 +1306,240 @@ protected:
 	 */
 	unsigned long writeEnableDelayUs = 3;
 
+	/**
+	 * @brief Use FAST_READ (0x0B) instead of READ (0x03) in readData
+	 */
+	bool fastRead = false;
+
+	/**
+	 * @brief Maximum number of bytes to pass to a single spi.transfer() call
+	 */
+	size_t maxTransferSize = 65535;
+
+	/**
+	 * @brief Use adaptive completion polling. See withAdaptivePolling().
+	 */
+	bool adaptivePolling = true;
+
+	/**
+	 * @brief Shortest interval between status register reads with adaptive polling, in microseconds
+	 */
+	unsigned long pollIntervalMinUs = 5;
+
+	/**
+	 * @brief Longest interval between status register reads with adaptive polling, in microseconds
+	 */
+	unsigned long pollIntervalMaxUs = 10000;
+
+	/**
+	 * @brief State of the asynchronous operation state machine
+	 */
+	enum class AsyncState {
+		IDLE,				//!< No asynchronous operation in progress
+		READ_DATA,			//!< Read DMA transfer in progress
+		WRITE_PAGE,			//!< Waiting to start programming the next page
+		WRITE_DATA,			//!< Page program DMA transfer in progress
+		WRITE_WAIT,			//!< Waiting for the page program to complete
+		ERASE_START,		//!< Waiting to send the erase command
+		ERASE_WAIT			//!< Waiting for the erase to complete
+	};
+
 private:
+	/**
+	 * @brief Starts a DMA transfer. asyncTransferComplete is set when it completes.
+	 */
+	void asyncStartTransfer(const void *txBuf, void *rxBuf, size_t len);
+
+	/**
+	 * @brief Starts an asynchronous erase with the given instruction
+	 */
+	bool asyncStartErase(uint8_t inst, size_t addr, unsigned long timeoutMs, WriteOperation op, AsyncCallback callback);
+
+	/**
+	 * @brief Sends an erase command without waiting for it to complete, for the erase start functions
+	 */
+	bool startErase(uint8_t inst, size_t addr, size_t len, unsigned long timeoutMs, WriteOperation op);
+
+	/**
+	 * @brief Records the start of a program or erase for isOperationComplete()
+	 */
+	void startOperation(WriteOperation op, size_t count, unsigned long timeoutMs);
+
+	/**
+	 * @brief Waits for a program or erase to complete using adaptive polling
+	 *
+	 * @param op The operation that was just started
+	 * @param timeoutMs Maximum time to wait in milliseconds
+	 * @param count For page program, the number of bytes programmed
+	 *
+	 * @return true if the operation completed, false if it timed out
+	 */
+	bool waitForOperation(WriteOperation op, unsigned long timeoutMs, size_t count = 0);
+
+	/**
+	 * @brief Gets how long to wait before the first status register read, and between reads after that
+	 *
+	 * Both are 0 if the expected time of the operation is not known yet.
+	 */
+	void getPollTiming(WriteOperation op, size_t count, unsigned long &initialDelayUs, unsigned long &intervalUs) const;
+
+	/**
+	 * @brief Updates the running average of the completion time of an operation
+	 */
+	void learnExpectedTime(WriteOperation op, size_t count, unsigned long elapsedUs);
+
+	/**
+	 * @brief Returns true if the asynchronous WRITE_WAIT or ERASE_WAIT state should read the status register
+	 */
+	bool asyncPollDue();
+
+	/**
+	 * @brief A sector in the sector cache
+	 */
+	struct SectorCacheSlot {
+		size_t addr;			//!< Address of the sector
+		uint32_t lastUse;		//!< Value of sectorCacheUseCounter when last used, for LRU eviction
+		bool valid;				//!< Contains the data for the sector at addr
+		bool dirty;				//!< Modified by updateData() and not written to flash yet
+	};
+
+	/**
+	 * @brief Returns the cached data for a slot
+	 */
+	uint8_t *sectorCacheData(const SectorCacheSlot &slot) const { return &sectorCacheBuf[(&slot - sectorCacheSlots) * sectorSize]; };
+
+	/**
+	 * @brief Writes a dirty slot to flash, using erase only if necessary
+	 */
+	void sectorCacheFlushSlot(SectorCacheSlot &slot);
+
+	static const size_t SECTOR_CACHE_CHUNK_SIZE = 256; //!< Unit that sectorCacheFlushSlot() compares and programs
+
+	/**
+	 * @brief Before writeData, flushes dirty slots that overlap the range and invalidates them
+	 */
+	void sectorCacheBeforeWrite(size_t addr, size_t len);
+
+	/**
+	 * @brief Before an erase, discards slots that overlap the range
+	 */
+	void sectorCacheDiscard(size_t addr, size_t len);
+
+	/**
+	 * @brief Copies modified data from the cache over data just read from flash
+	 */
+	void sectorCacheOverlay(size_t addr, uint8_t *buf, size_t len) const;
+
+	/**
+	 * @brief Programs data, one page program per page. The implementation of writeData without write combining.
+	 */
+	void programPages(size_t addr, const uint8_t *curBuf, size_t bufLen);
+
+	/**
+	 * @brief Programs data within a single page and waits for it to complete
+	 *
+	 * @return true if the page program completed, false if it timed out
+	 */
+	bool pageProgram(size_t addr, const uint8_t *buf, size_t count);
+
+	/**
+	 * @brief Makes the chip ready to read, suspending an asynchronous erase or waiting for the operation in progress
+	 *
+	 * @return true if an erase was suspended. Call eraseResume() after the read.
+	 */
+	bool readWaitForChip();
+
+	/**
+	 * @brief Begins a transaction and sends the READ or FAST_READ command for addr
+	 *
+	 * Follow with readTransfer() and endTransaction().
+	 */
+	void readBegin(size_t addr);
+
+	/**
+	 * @brief Reads data in the transaction started by readBegin(), in chunks of up to maxTransferSize
+	 */
+	void readTransfer(uint8_t *buf, size_t len);
+
+	/**
+	 * @brief Programs the data in the write combining buffer, if any
+	 */
+	void writeCombineFlush();
+
+	/**
+	 * @brief Before an erase, discards the write combining buffer if it's in the range
+	 */
+	void writeCombineDiscard(size_t addr, size_t len);
+
+	/**
+	 * @brief Applies the data in the write combining buffer to data just read from flash
+	 */
+	void writeCombineOverlay(size_t addr, uint8_t *buf, size_t len) const;
+
+	/**
+	 * @brief A line in the read cache
+	 */
+	struct ReadCacheLine {
+		size_t addr;			//!< Address of the line
+		uint32_t lastUse;		//!< Value of readCacheUseCounter when last used, for LRU eviction
+		bool valid;				//!< Contains the data for the line at addr
+	};
+
+	/**
+	 * @brief Reads data from the chip, with the write combining buffer applied but not the sector cache
+	 *
+	 * Used by readData() and to fill read cache lines.
+	 */
+	void readChip(size_t addr, uint8_t *buf, size_t bufLen);
+
+	/**
+	 * @brief Reads data that is smaller than a line through the read cache
+	 *
+	 * Lines are filled from the chip with readChip(), so the caller must apply the sector cache.
+	 */
+	void readCacheRead(size_t addr, uint8_t *buf, size_t len);
+
+	/**
+	 * @brief Invalidates read cache lines that overlap the range
+	 */
+	void readCacheInvalidate(size_t addr, size_t len);
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	/**
+	 * @brief Counters at the start of an operation, used to calculate the per-operation statistics
+	 */
+	struct StatsMark {
+		unsigned long startUs;
+		uint32_t transactions;
+		uint32_t statusPolls;
+	};
+
+	/**
+	 * @brief Call at the start of an operation
+	 */
+	void statsStart(StatsMark &mark) const;
+
+	/**
+	 * @brief Call at the end of an operation to add it to the statistics
+	 */
+	void statsEnd(SpiFlashStatsOp op, const StatsMark &mark, size_t bytes);
+
+	/**
+	 * @brief Returns the statistics operation type for a program or erase
+	 */
+	static SpiFlashStatsOp statsOpFor(WriteOperation op);
+#endif
+
+	/**
+	 * @brief Ends the asynchronous operation and calls the callback
+	 */
+	void asyncFinish(bool success);
+
+	/**
+	 * @brief DMA transfer complete callback. Called from an ISR.
+	 */
+	static void asyncTransferCallback();
+
 	/**
 	 * @brief Enables writes to the status register, flash writes, and erases.
 	 *
@@ -343,7 +1562,8 @@ private:
 	 * @brief Sets a instruction code and an address 
 	 * 
 	 * 3-byte, 24-bit, big endian value, except wehn in 4 byte mode, when
-	 * it's 4-byte, 32-bit, big endian.
+	 * it's 4-byte, 32-bit, big endian. With withNative4ByteAddressing() the instruction is
+	 * replaced by its 4-byte address version and the address is always 4 bytes.
 	 */
 	void setInstWithAddr(uint8_t inst, size_t addr, uint8_t *buf);
 
@@ -352,9 +1572,113 @@ private:
 	 */
 	size_t getInstWithAddrSize() const;
 
+	/**
+	 * @brief Returns true if the SFDP 4-byte address instruction table supports all of the instructions that are used
+	 *
+	 * Block erase instructions without a 4-byte address form are set to 0 so they're not used.
+	 *
+	 * @param table4Addr SFDP address of the 4-byte address instruction table
+	 * @param table4Len Length of the table in DWORDs, 0 if not present
+	 * @param dw The basic flash parameter table, for the erase types
+	 */
+	bool sfdpHas4ByteInstructions(size_t table4Addr, size_t table4Len, const uint32_t *dw);
+
+	/**
+	 * @brief Holds the lock enabled by withLocking() for the duration of an operation
+	 *
+	 * The priority of the outermost operation is also used for the bus lock.
+	 */
+	class OperationLock {
+	public:
+		OperationLock(SpiFlash &flash, uint8_t priority);
+		~OperationLock();
+
+	private:
+		SpiFlash &flash;
+	};
+
+	/**
+	 * @brief Lets a higher priority thread use the chip between two parts of a long operation
+	 */
+	void yieldLock();
+
 	SPIClass &spi;
 	int cs;
 	bool addr4byte = false;
+	bool native4byte = false;
+
+	AsyncState asyncState = AsyncState::IDLE;
+	AsyncCallback asyncCallback;
+	size_t asyncAddr = 0;
+	uint8_t *asyncRxBuf = 0;
+	const uint8_t *asyncTxBuf = 0;
+	size_t asyncLen = 0;
+	size_t asyncCount = 0;
+	size_t asyncTotal = 0;
+	uint8_t asyncEraseInst = 0;
+	unsigned long asyncEraseTimeoutMs = 0;
+	unsigned long asyncEraseTypicalMs = 0;
+	unsigned long asyncOpStartMs = 0;
+	unsigned long asyncStartMs = 0;
+	unsigned long asyncStartUs = 0;
+	unsigned long asyncPollDelayUs = 0;
+	unsigned long asyncPollIntervalUs = 0;
+	unsigned long asyncLastPollUs = 0;
+	WriteOperation asyncEraseOp = WRITE_OP_SECTOR_ERASE;
+	volatile bool asyncTransferComplete = false;
+	bool eraseSuspended = false;
+	unsigned long eraseSuspendMs = 0;
+	unsigned long eraseSuspendUs = 0;
+	unsigned long expectedTimeUs[WRITE_OP_COUNT] = {0};
+	bool knownIdle = false;
+	WriteOperation pendingOp = WRITE_OP_COUNT;
+	size_t pendingCount = 0;
+	unsigned long pendingTimeoutMs = 0;
+
+	SectorCacheSlot *sectorCacheSlots = 0;
+	uint8_t *sectorCacheBuf = 0;
+	uint8_t *sectorCacheChanged = 0;	//!< Bitmap of the chunks of a slot that differ from the chip, one bit per SECTOR_CACHE_CHUNK_SIZE
+	size_t sectorCacheNumSlots = 0;
+	uint32_t sectorCacheUseCounter = 0;
+	bool sectorCacheFlushing = false;
+
+	uint8_t *writeCombineBuf = 0;
+	size_t writeCombineBufSize = 0;
+	size_t writeCombineAddr = 0;
+	size_t writeCombineStart = 0;
+	size_t writeCombineEnd = 0;
+
+	ReadCacheLine *readCacheLines = 0;
+	uint8_t *readCacheBuf = 0;
+	size_t readCacheNumLines = 0;
+	size_t readCacheLineSize = 256;
+	uint32_t readCacheUseCounter = 0;
+	uint32_t readCacheHits = 0;
+	uint32_t readCacheMisses = 0;
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+	SpiFlashStats stats;
+	uint32_t statsTransactions = 0;
+	uint32_t statsStatusPolls = 0;
+	StatsMark asyncStatsMark;
+	StatsMark pendingStatsMark;
+#endif
+	unsigned long eraseResumeUs = 0;
+
+	SpiFlashLock *deviceLock = 0;
+	SpiFlashLock *busLock = 0;
+	uint8_t readPriority = SPIFLASH_PRIORITY_HIGH;
+	uint8_t writePriority = SPIFLASH_PRIORITY_LOW;
+	uint8_t operationPriority = SPIFLASH_PRIORITY_NORMAL;
+	unsigned int operationDepth = 0;
+
+	/**
+	 * @brief The object that started the current DMA transfer
+	 *
+	 * The DMA completion callback does not take a context pointer, so only one SpiFlash
+	 * object can have a DMA transfer in progress at a time.
+	 */
+	static SpiFlash *asyncInstance;
 };
 
 /**
@@ -366,6 +1690,9 @@ public:
 		sectorEraseTimeoutMs = 300;
 		pageProgramTimeoutMs = 10; // 1 ms actually
 		chipEraseTimeoutMs = 6000;
+		sectorEraseTypicalMs = 70;
+		blockEraseTypicalMs = 150;
+		chipEraseTypicalMs = 500;
 		manufacturerId = 0x9d;
 		writeEnableDelayUs = 3;
 	}
@@ -381,6 +1708,12 @@ public:
 		sectorEraseTimeoutMs = 500;
 		pageProgramTimeoutMs = 10; // 3 ms actually
 		chipEraseTimeoutMs = 50000;
+		sectorEraseTypicalMs = 45;
+		blockEraseTypicalMs = 150;
+		chipEraseTypicalMs = 10000;
+		eraseSuspendInst = 0x75;
+		eraseResumeInst = 0x7A;
+		eraseSuspendDelayUs = 20;
 		manufacturerId = 0xef;
 		writeEnableDelayUs = 0;
 	}
@@ -393,6 +1726,10 @@ public:
  * Timeout of 220 seconds is for the MX25L25645G (110-210 seconds). Note that chip erase
  * only takes as long as is necessary; the timeout is only there in case the device
  * never clears the WIP (write-in-progress) flag, which would be an odd error condition.
+ *
+ * Newer Macronix chips like the MX25L25645G support erase suspend (0xB0) and resume (0x30).
+ * Older chips like the MX25L8006E ignore it, which eraseSuspend() detects because WIP
+ * stays set, and readData() then waits for the erase to complete instead.
  */
 class SpiFlashMacronix : public SpiFlash {
 public:
@@ -400,6 +1737,12 @@ public:
 		sectorEraseTimeoutMs = 200;
 		pageProgramTimeoutMs = 10; // 1 ms actually
  		chipEraseTimeoutMs = 220000;
+		sectorEraseTypicalMs = 60;
+		blockEraseTypicalMs = 700;
+		chipEraseTypicalMs = 9000;
+		eraseSuspendInst = 0xB0;
+		eraseResumeInst = 0x30;
+		eraseSuspendDelayUs = 20;
 		manufacturerId = 0xc2;
 		writeEnableDelayUs = 0;
 	}
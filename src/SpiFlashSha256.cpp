@@ -0,0 +1,122 @@
+#include "Particle.h"
+
+#include "SpiFlashSha256.h"
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+void SpiFlashBase::sha256Range(size_t addr, size_t len, uint8_t *hash) {
+	SpiFlashSha256 sha;
+	readChunks(addr, len, [&sha](const uint8_t *buf, size_t count) {
+		sha.update(buf, count);
+	});
+	sha.finish(hash);
+}
+
+void SpiFlashSha256::begin() {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(state, initial, sizeof(state));
+	totalLen = 0;
+	blockLen = 0;
+}
+
+void SpiFlashSha256::update(const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+	totalLen += len;
+
+	// Whole blocks are processed from the caller's buffer without copying
+	if (blockLen > 0) {
+		size_t count = sizeof(block) - blockLen;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(&block[blockLen], p, count);
+		blockLen += count;
+		p += count;
+		len -= count;
+		if (blockLen < sizeof(block)) {
+			return;
+		}
+		processBlock(block);
+		blockLen = 0;
+	}
+	for(; len >= sizeof(block); len -= sizeof(block), p += sizeof(block)) {
+		processBlock(p);
+	}
+	memcpy(block, p, len);
+	blockLen = len;
+}
+
+void SpiFlashSha256::finish(uint8_t *hash) {
+	uint64_t bitLen = totalLen * 8;
+
+	// Padding is a 1 bit, zeros, then the length in bits, ending on a block boundary
+	block[blockLen++] = 0x80;
+	if (blockLen > sizeof(block) - 8) {
+		memset(&block[blockLen], 0, sizeof(block) - blockLen);
+		processBlock(block);
+		blockLen = 0;
+	}
+	memset(&block[blockLen], 0, sizeof(block) - 8 - blockLen);
+	for(size_t ii = 0; ii < 8; ii++) {
+		block[56 + ii] = (uint8_t)(bitLen >> (56 - ii * 8));
+	}
+	processBlock(block);
+
+	for(size_t ii = 0; ii < 8; ii++) {
+		hash[ii * 4] = (uint8_t)(state[ii] >> 24);
+		hash[ii * 4 + 1] = (uint8_t)(state[ii] >> 16);
+		hash[ii * 4 + 2] = (uint8_t)(state[ii] >> 8);
+		hash[ii * 4 + 3] = (uint8_t)state[ii];
+	}
+}
+
+void SpiFlashSha256::processBlock(const uint8_t *data) {
+	uint32_t w[64];
+	for(size_t ii = 0; ii < 16; ii++) {
+		w[ii] = ((uint32_t)data[ii * 4] << 24) | ((uint32_t)data[ii * 4 + 1] << 16) | ((uint32_t)data[ii * 4 + 2] << 8) | data[ii * 4 + 3];
+	}
+	for(size_t ii = 16; ii < 64; ii++) {
+		uint32_t s0 = rotr(w[ii - 15], 7) ^ rotr(w[ii - 15], 18) ^ (w[ii - 15] >> 3);
+		uint32_t s1 = rotr(w[ii - 2], 17) ^ rotr(w[ii - 2], 19) ^ (w[ii - 2] >> 10);
+		w[ii] = w[ii - 16] + s0 + w[ii - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for(size_t ii = 0; ii < 64; ii++) {
+		uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[ii] + w[ii];
+		uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
@@ -0,0 +1,61 @@
+/**
+ * SHA-256 for verifying data stored with SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHSHA256_H
+#define __SPIFLASHSHA256_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Calculates a SHA-256 hash incrementally
+ *
+ * Use SpiFlashBase::sha256Range() to hash a range of flash. This class can be used directly to hash data in RAM,
+ * for example to hash a firmware image as it's downloaded so the result can be compared with the copy in flash.
+ */
+class SpiFlashSha256 {
+public:
+	/**
+	 * @brief Size of the hash in bytes
+	 */
+	static const size_t HASH_SIZE = 32;
+
+	/**
+	 * @brief Construct a hash object, ready to call update()
+	 */
+	SpiFlashSha256() { begin(); };
+
+	/**
+	 * @brief Starts a new hash
+	 */
+	void begin();
+
+	/**
+	 * @brief Adds data to the hash
+	 */
+	void update(const void *data, size_t len);
+
+	/**
+	 * @brief Finishes the hash and stores the HASH_SIZE byte result in hash
+	 *
+	 * Call begin() before using the object for another hash.
+	 */
+	void finish(uint8_t *hash);
+
+protected:
+	/**
+	 * @brief Processes one 64 byte block
+	 */
+	void processBlock(const uint8_t *block);
+
+	uint32_t state[8];
+	uint64_t totalLen;
+	uint8_t block[64];
+	size_t blockLen;
+};
+
+#endif /* __SPIFLASHSHA256_H */
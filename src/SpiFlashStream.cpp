@@ -0,0 +1,194 @@
+#include "Particle.h"
+
+#include "SpiFlashStream.h"
+
+#include <limits.h>
+
+SpiFlashReader::SpiFlashReader(SpiFlashBase &flash, size_t addr, size_t len, size_t bufferSize) :
+	flash(flash), bufferSize(bufferSize), readAddr(addr), endAddr(addr + len), fetchAddr(addr) {
+	bufs[0] = new uint8_t[bufferSize];
+	bufs[1] = new uint8_t[bufferSize];
+	if (!bufs[0] || !bufs[1]) {
+		this->bufferSize = 0;
+	}
+}
+
+SpiFlashReader::~SpiFlashReader() {
+	end();
+	delete[] bufs[0];
+	delete[] bufs[1];
+}
+
+int SpiFlashReader::available() {
+	size_t remaining = endAddr - readAddr;
+	return (remaining > INT_MAX) ? INT_MAX : (int)remaining;
+}
+
+int SpiFlashReader::read() {
+	if (curPos >= curLen && !nextBuffer()) {
+		return -1;
+	}
+	readAddr++;
+	return bufs[curIndex][curPos++];
+}
+
+int SpiFlashReader::peek() {
+	if (curPos >= curLen && !nextBuffer()) {
+		return -1;
+	}
+	return bufs[curIndex][curPos];
+}
+
+size_t SpiFlashReader::read(uint8_t *buf, size_t len) {
+	size_t done = 0;
+	while(done < len) {
+		if (curPos >= curLen && !nextBuffer()) {
+			break;
+		}
+		size_t count = curLen - curPos;
+		if (count > len - done) {
+			count = len - done;
+		}
+		memcpy(&buf[done], &bufs[curIndex][curPos], count);
+		curPos += count;
+		readAddr += count;
+		done += count;
+	}
+	return done;
+}
+
+void SpiFlashReader::end() {
+	if (fetchPending) {
+		waitForFetch();
+
+		// The prefetched data is still valid, but the next read from the stream must not wait for it again
+		fetchAddr -= fetchLen;
+		fetchPending = false;
+	}
+}
+
+bool SpiFlashReader::nextBuffer() {
+	if (readAddr >= endAddr || bufferSize == 0) {
+		return false;
+	}
+	if (!fetchPending) {
+		startFetch();
+	}
+	waitForFetch();
+
+	curIndex ^= 1;
+	curPos = 0;
+	curLen = fetchLen;
+	fetchPending = false;
+
+	// Prefetch the next buffer while the caller uses this one
+	if (fetchAddr < endAddr) {
+		startFetch();
+	}
+	return true;
+}
+
+void SpiFlashReader::startFetch() {
+	size_t len = bufferSize - (fetchAddr % bufferSize);
+	if (len > endAddr - fetchAddr) {
+		len = endAddr - fetchAddr;
+	}
+
+	uint8_t *buf = bufs[curIndex ^ 1];
+	if (!flash.startReadData(fetchAddr, buf, len)) {
+		flash.readData(fetchAddr, buf, len);
+	}
+	fetchLen = len;
+	fetchAddr += len;
+	fetchPending = true;
+}
+
+void SpiFlashReader::waitForFetch() {
+	while(!flash.isReadComplete()) {
+		delayMicroseconds(1);
+	}
+}
+
+SpiFlashWriter::SpiFlashWriter(SpiFlashBase &flash, size_t addr) : flash(flash), pageSize(flash.getPageSize()), activeAddr(addr) {
+	bufs[0] = new uint8_t[pageSize];
+	bufs[1] = new uint8_t[pageSize];
+	if (!bufs[0] || !bufs[1]) {
+		pageSize = 0;
+	}
+}
+
+SpiFlashWriter::~SpiFlashWriter() {
+	flush();
+	delete[] bufs[0];
+	delete[] bufs[1];
+}
+
+size_t SpiFlashWriter::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+size_t SpiFlashWriter::write(const uint8_t *buf, size_t size) {
+	if (pageSize == 0) {
+		return 0;
+	}
+
+	size_t done = 0;
+	while(done < size) {
+		size_t room = pageSize - ((activeAddr + activeLen) % pageSize);
+		size_t count = (room < size - done) ? room : (size - done);
+
+		memcpy(&bufs[activeIndex][activeLen], &buf[done], count);
+		activeLen += count;
+		done += count;
+
+		if (count == room) {
+			submit();
+		}
+	}
+	servicePending();
+	return size;
+}
+
+void SpiFlashWriter::flush() {
+	if (pageSize == 0) {
+		return;
+	}
+	if (activeLen > 0) {
+		submit();
+	}
+	if (pendingLen > 0) {
+		flash.waitForOperationComplete();
+		startPending();
+	}
+	flash.waitForOperationComplete();
+}
+
+void SpiFlashWriter::submit() {
+	if (pendingLen > 0) {
+		// Both buffers are full
+		flash.waitForOperationComplete();
+		startPending();
+	}
+
+	pendingAddr = activeAddr;
+	pendingLen = activeLen;
+	activeIndex ^= 1;
+	activeAddr += activeLen;
+	activeLen = 0;
+
+	servicePending();
+}
+
+void SpiFlashWriter::servicePending() {
+	if (pendingLen > 0 && flash.isOperationComplete()) {
+		startPending();
+	}
+}
+
+void SpiFlashWriter::startPending() {
+	const uint8_t *buf = bufs[activeIndex ^ 1];
+	if (!flash.startPageProgram(pendingAddr, buf, pendingLen)) {
+		flash.writeData(pendingAddr, buf, pendingLen);
+	}
+	pendingLen = 0;
+}
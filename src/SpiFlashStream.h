@@ -0,0 +1,203 @@
+/**
+ * Buffered sequential streams for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHSTREAM_H
+#define __SPIFLASHSTREAM_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Reads a range of flash sequentially as a Stream, prefetching the next buffer in the background
+ *
+ * Small reads from the stream are copied from a RAM buffer, so the command overhead is only paid once per
+ * buffer. There are two buffers aligned to bufferSize: while the caller consumes one, the next is read into
+ * the other with SpiFlashBase::startReadData(), which uses DMA on SpiFlash. On other SpiFlashBase
+ * implementations the prefetch is a synchronous read.
+ *
+ * Don't use the flash directly while the reader is in use, since a read may be in progress. Call end()
+ * first, or destroy the reader.
+ */
+class SpiFlashReader : public Stream {
+public:
+	/**
+	 * @brief Construct a reader. No flash access is done until the first read.
+	 *
+	 * @param flash The flash device to read from
+	 * @param addr Address of the first byte to read
+	 * @param len Number of bytes that can be read
+	 * @param bufferSize Size of each of the two buffers (default: 256). Reads are aligned to this size,
+	 * so it should be a multiple of the page size.
+	 */
+	SpiFlashReader(SpiFlashBase &flash, size_t addr, size_t len, size_t bufferSize = 256);
+	virtual ~SpiFlashReader();
+
+	/**
+	 * @brief Returns false if the buffers could not be allocated
+	 */
+	bool isValid() const { return bufferSize != 0; };
+
+	/**
+	 * @brief Returns the number of bytes left to read
+	 */
+	virtual int available();
+
+	/**
+	 * @brief Reads one byte, or returns -1 at the end of the range
+	 */
+	virtual int read();
+
+	/**
+	 * @brief Returns the next byte without removing it, or -1 at the end of the range
+	 */
+	virtual int peek();
+
+	/**
+	 * @brief Does nothing, since a reader has no output
+	 */
+	virtual void flush() {};
+
+	/**
+	 * @brief Does nothing, since a reader can't be written to
+	 */
+	virtual size_t write(uint8_t c) { return 0; };
+
+	/**
+	 * @brief Reads up to len bytes
+	 *
+	 * @return The number of bytes read, which is less than len only at the end of the range
+	 */
+	size_t read(uint8_t *buf, size_t len);
+
+	/**
+	 * @brief Waits for the prefetch in progress, if any, so the flash can be used directly
+	 *
+	 * Reading from the stream again starts a new prefetch.
+	 */
+	void end();
+
+	/**
+	 * @brief Returns the address of the next byte that will be read
+	 */
+	size_t getAddr() const { return readAddr; };
+
+protected:
+	/**
+	 * @brief Switches to the buffer being prefetched when the current buffer is used up
+	 *
+	 * @return false at the end of the range
+	 */
+	bool nextBuffer();
+
+	/**
+	 * @brief Starts reading the next part of the range into the buffer that isn't being used
+	 */
+	void startFetch();
+
+	/**
+	 * @brief Waits for the read started by startFetch() to complete
+	 */
+	void waitForFetch();
+
+	SpiFlashBase &flash;
+	size_t bufferSize;
+	uint8_t *bufs[2];
+	size_t readAddr;
+	size_t endAddr;
+	size_t fetchAddr;
+	size_t curIndex = 0;
+	size_t curPos = 0;
+	size_t curLen = 0;
+	size_t fetchLen = 0;
+	bool fetchPending = false;
+};
+
+/**
+ * @brief Writes flash sequentially as a Print, programming one buffer while the caller fills the other
+ *
+ * Data is collected in a page buffer and programmed a page at a time, so small writes don't each pay the
+ * command and page program overhead. When a page is full and the chip is still programming the previous
+ * page, it waits in a second buffer while the caller fills the first, and is started when the chip is
+ * ready. The caller only waits if both buffers are full. SpiFlash returns from
+ * SpiFlashBase::startPageProgram() without waiting for the page program to complete; on other SpiFlashBase
+ * implementations each page is written synchronously.
+ *
+ * Like writeData(), the range must be erased before writing. Call flush() when done, or destroy the writer.
+ */
+class SpiFlashWriter : public Print {
+public:
+	/**
+	 * @brief Construct a writer
+	 *
+	 * @param flash The flash device to write to
+	 * @param addr Address of the first byte to write. It doesn't need to be page aligned.
+	 */
+	SpiFlashWriter(SpiFlashBase &flash, size_t addr);
+
+	/**
+	 * @brief Destroys the writer, calling flush() first
+	 */
+	virtual ~SpiFlashWriter();
+
+	/**
+	 * @brief Returns false if the buffers could not be allocated
+	 */
+	bool isValid() const { return pageSize != 0; };
+
+	/**
+	 * @brief Writes one byte
+	 */
+	virtual size_t write(uint8_t c);
+
+	/**
+	 * @brief Writes size bytes
+	 *
+	 * @return The number of bytes written, which is 0 if isValid() is false and size otherwise
+	 */
+	virtual size_t write(const uint8_t *buf, size_t size);
+
+	using Print::write;
+
+	/**
+	 * @brief Programs the partially filled page, if any, and waits for all programming to complete
+	 *
+	 * Writing can continue after flush(), from the next address.
+	 */
+	void flush();
+
+	/**
+	 * @brief Returns the address the next byte will be written to
+	 */
+	size_t getAddr() const { return activeAddr + activeLen; };
+
+protected:
+	/**
+	 * @brief Queues the active buffer to be programmed and switches to the other buffer
+	 */
+	void submit();
+
+	/**
+	 * @brief Starts programming the queued buffer if the flash is ready, without waiting
+	 */
+	void servicePending();
+
+	/**
+	 * @brief Starts programming the queued buffer
+	 */
+	void startPending();
+
+	SpiFlashBase &flash;
+	size_t pageSize;
+	uint8_t *bufs[2];
+	size_t activeIndex = 0;
+	size_t activeAddr;
+	size_t activeLen = 0;
+	size_t pendingAddr = 0;
+	size_t pendingLen = 0;
+};
+
+#endif /* __SPIFLASHSTREAM_H */
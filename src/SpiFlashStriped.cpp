@@ -0,0 +1,311 @@
+#include "Particle.h"
+
+#include "SpiFlashStriped.h"
+
+#include <limits.h>
+
+// Sleeps until the soonest chip is due to be checked, so time isn't wasted reading status registers
+static void sleepForWait(unsigned long waitUs) {
+	if (waitUs == ULONG_MAX) {
+		return;
+	}
+	if (waitUs >= 1000) {
+		delay(waitUs / 1000);
+	}
+	else
+	if (waitUs > 0) {
+		delayMicroseconds(waitUs);
+	}
+}
+
+// How often to poll an asynchronous operation started on a chip directly, which must finish before the chip can be used
+static const unsigned long ASYNC_POLL_US = 100;
+
+SpiFlashStriped::SpiFlashStriped(SpiFlash *const *chips, size_t numChips, size_t stripeSize) : stripeSize(stripeSize) {
+	this->chips = new SpiFlash *[numChips];
+	cursors = new size_t[numChips];
+	ends = new size_t[numChips];
+	if (this->chips && cursors && ends && stripeSize != 0) {
+		for(size_t ii = 0; ii < numChips; ii++) {
+			this->chips[ii] = chips[ii];
+		}
+		this->numChips = numChips;
+	}
+	updateSizes();
+}
+
+SpiFlashStriped::~SpiFlashStriped() {
+	delete[] chips;
+	delete[] cursors;
+	delete[] ends;
+}
+
+void SpiFlashStriped::begin() {
+	for(size_t ii = 0; ii < numChips; ii++) {
+		chips[ii]->begin();
+	}
+
+	// The chips may have changed their sizes in begin(), from SFDP for example
+	updateSizes();
+}
+
+bool SpiFlashStriped::isValid() {
+	if (numChips == 0) {
+		return false;
+	}
+	for(size_t ii = 0; ii < numChips; ii++) {
+		if (!chips[ii]->isValid()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+uint32_t SpiFlashStriped::jedecIdRead() {
+	return numChips ? chips[0]->jedecIdRead() : 0;
+}
+
+void SpiFlashStriped::readData(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	while(bufLen > 0 && numChips > 0) {
+		size_t count = stripeSize - (addr % stripeSize);
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		size_t chipIndex;
+		size_t chipAddr = toChipAddr(addr, chipIndex);
+		chips[chipIndex]->readData(chipAddr, curBuf, count);
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+void SpiFlashStriped::writeData(size_t addr, const void *buf, size_t bufLen) {
+	const uint8_t *curBuf = (const uint8_t *)buf;
+	size_t end = addr + bufLen;
+
+	waitForAsync();
+
+	// Each chip works through its own stripes in order, starting a page program whenever it's idle
+	for(size_t ii = 0; ii < numChips; ii++) {
+		cursors[ii] = firstAddrOnChip(addr, ii);
+	}
+
+	while(true) {
+		bool active = false;
+		bool started = false;
+		unsigned long waitUs = ULONG_MAX;
+
+		for(size_t ii = 0; ii < numChips; ii++) {
+			size_t cur = cursors[ii];
+			if (cur >= end) {
+				continue;
+			}
+			active = true;
+
+			if (!chips[ii]->isOperationComplete()) {
+				unsigned long chipWaitUs = chips[ii]->getOperationWaitUs();
+				if (chipWaitUs < waitUs) {
+					waitUs = chipWaitUs;
+				}
+				continue;
+			}
+
+			// The stripe size is a multiple of the page size, so a page never crosses a stripe
+			size_t count = pageSize - (cur % pageSize);
+			if (count > end - cur) {
+				count = end - cur;
+			}
+
+			size_t chipIndex;
+			size_t chipAddr = toChipAddr(cur, chipIndex);
+			if (!chips[ii]->startPageProgram(chipAddr, &curBuf[cur - addr], count)) {
+				pollAsync(ii, waitUs);
+				continue;
+			}
+			started = true;
+
+			cur += count;
+			if ((cur % stripeSize) == 0) {
+				// Skip the stripes on the other chips
+				cur += (numChips - 1) * stripeSize;
+			}
+			cursors[ii] = cur;
+		}
+
+		if (!active) {
+			break;
+		}
+		if (!started) {
+			sleepForWait(waitUs);
+		}
+	}
+
+	waitForAll();
+}
+
+void SpiFlashStriped::sectorErase(size_t addr) {
+	eraseRange(addr, sectorSize);
+}
+
+void SpiFlashStriped::chipErase() {
+	waitForAsync();
+	for(size_t ii = 0; ii < numChips; ii++) {
+		while(!chips[ii]->startChipErase()) {
+			unsigned long waitUs = ULONG_MAX;
+			pollAsync(ii, waitUs);
+			sleepForWait(waitUs);
+		}
+	}
+	waitForAll();
+}
+
+bool SpiFlashStriped::eraseRange(size_t addr, size_t len) {
+	if (numChips == 0 || (addr % sectorSize) != 0 || (len % sectorSize) != 0) {
+		return false;
+	}
+	if (len == 0) {
+		return true;
+	}
+	if (addr == 0 && capacity != 0 && len >= capacity) {
+		chipErase();
+		return true;
+	}
+
+	waitForAsync();
+
+	// The part of the range on each chip is contiguous on that chip
+	size_t end = addr + len;
+	for(size_t ii = 0; ii < numChips; ii++) {
+		size_t first = firstAddrOnChip(addr, ii);
+		if (first >= end) {
+			cursors[ii] = ends[ii] = 0;
+			continue;
+		}
+
+		size_t lastStripe = (end - 1) / stripeSize;
+		size_t last;
+		if ((lastStripe % numChips) == ii) {
+			last = end - 1;
+		}
+		else {
+			lastStripe -= (lastStripe % numChips + numChips - ii) % numChips;
+			last = (lastStripe + 1) * stripeSize - 1;
+		}
+
+		size_t chipIndex;
+		cursors[ii] = toChipAddr(first, chipIndex);
+		ends[ii] = toChipAddr(last, chipIndex) + 1;
+	}
+
+	while(true) {
+		bool active = false;
+		bool started = false;
+		unsigned long waitUs = ULONG_MAX;
+
+		for(size_t ii = 0; ii < numChips; ii++) {
+			size_t cur = cursors[ii];
+			if (cur >= ends[ii]) {
+				continue;
+			}
+			active = true;
+
+			if (!chips[ii]->isOperationComplete()) {
+				unsigned long chipWaitUs = chips[ii]->getOperationWaitUs();
+				if (chipWaitUs < waitUs) {
+					waitUs = chipWaitUs;
+				}
+				continue;
+			}
+
+			size_t count;
+			if ((cur % 65536) == 0 && ends[ii] - cur >= 65536 && chips[ii]->startBlockErase(cur)) {
+				count = 65536;
+			}
+			else
+			if (chips[ii]->startSectorErase(cur)) {
+				count = chips[ii]->getSectorSize();
+			}
+			else {
+				pollAsync(ii, waitUs);
+				continue;
+			}
+			started = true;
+			cursors[ii] = cur + count;
+		}
+
+		if (!active) {
+			break;
+		}
+		if (!started) {
+			sleepForWait(waitUs);
+		}
+	}
+
+	waitForAll();
+	return true;
+}
+
+size_t SpiFlashStriped::toChipAddr(size_t addr, size_t &chipIndex) const {
+	size_t stripe = addr / stripeSize;
+	chipIndex = stripe % numChips;
+	return (stripe / numChips) * stripeSize + (addr % stripeSize);
+}
+
+void SpiFlashStriped::updateSizes() {
+	if (numChips == 0) {
+		return;
+	}
+
+	size_t chipSectorSize = chips[0]->getSectorSize();
+	pageSize = chips[0]->getPageSize();
+	sectorSize = (stripeSize < chipSectorSize) ? (chipSectorSize * numChips) : chipSectorSize;
+
+	// The capacity is limited by the smallest chip, and unknown if any of them is unknown
+	size_t chipCapacity = chips[0]->getCapacity();
+	for(size_t ii = 1; ii < numChips; ii++) {
+		if (chips[ii]->getCapacity() < chipCapacity) {
+			chipCapacity = chips[ii]->getCapacity();
+		}
+	}
+	capacity = chipCapacity * numChips;
+}
+
+size_t SpiFlashStriped::firstAddrOnChip(size_t addr, size_t chipIndex) const {
+	size_t stripe = addr / stripeSize;
+	size_t offset = (chipIndex + numChips - (stripe % numChips)) % numChips;
+	return offset ? ((stripe + offset) * stripeSize) : addr;
+}
+
+void SpiFlashStriped::pollAsync(size_t chipIndex, unsigned long &waitUs) {
+	// An asynchronous operation was started on the chip directly, like writeDataAsync(). It's advanced
+	// here, and the start is retried once it's done.
+	chips[chipIndex]->poll();
+	if (ASYNC_POLL_US < waitUs) {
+		waitUs = ASYNC_POLL_US;
+	}
+}
+
+void SpiFlashStriped::waitForAsync() {
+	// An asynchronous read or write holds the SPI bus between DMA transfers, so starting an operation
+	// on another chip on the same bus would interrupt it
+	for(size_t ii = 0; ii < numChips; ii++) {
+		while(chips[ii]->isBusy()) {
+			unsigned long waitUs = ULONG_MAX;
+			pollAsync(ii, waitUs);
+			if (chips[ii]->isBusy()) {
+				sleepForWait(waitUs);
+			}
+		}
+	}
+}
+
+void SpiFlashStriped::waitForAll() {
+	for(size_t ii = 0; ii < numChips; ii++) {
+		chips[ii]->waitForOperationComplete();
+	}
+}
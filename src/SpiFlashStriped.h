@@ -0,0 +1,147 @@
+/**
+ * Multi-chip striping for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHSTRIPED_H
+#define __SPIFLASHSTRIPED_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Combines several flash chips into one larger, faster device (RAID-0 style)
+ *
+ * The address space is divided into stripes of stripeSize bytes that are assigned to the chips in turn,
+ * so stripe 0 is on the first chip, stripe 1 on the second chip, and so on. Because this class implements
+ * SpiFlashBase, code that uses a SpiFlashBase, like a file system, works unchanged.
+ *
+ * Most of the time of a write or erase is spent waiting for the chip to finish programming or erasing,
+ * not transferring data. writeData() and eraseRange() start an operation on each chip in turn without
+ * waiting, and only wait when they come back to a chip that is still busy, so with N chips writes and
+ * erases are close to N times faster. The chips can share an SPI bus with a separate CS pin for each.
+ *
+ * - With stripeSize set to the page size (the default), even small writes are spread over all of the
+ * chips. An erase has to erase a sector on every chip, so getSectorSize() is the chip sector size times
+ * the number of chips.
+ * - With stripeSize set to the chip sector size, getSectorSize() is the chip sector size, but only writes
+ * that span several sectors are faster.
+ *
+ * Reads are done one chip at a time since they're limited by the SPI bus, not the chips.
+ */
+class SpiFlashStriped : public SpiFlashBase {
+public:
+	/**
+	 * @brief Construct a striped device
+	 *
+	 * @param chips Array of pointers to the flash chips. The array is copied, but the chips must remain
+	 * allocated. All of the chips must have the same page and sector size.
+	 * @param numChips Number of chips in the array
+	 * @param stripeSize Number of consecutive bytes on each chip (default: 256). Must be a multiple of the
+	 * page size, and either divide the sector size or be a multiple of it.
+	 */
+	SpiFlashStriped(SpiFlash *const *chips, size_t numChips, size_t stripeSize = 256);
+	virtual ~SpiFlashStriped();
+
+	/**
+	 * @brief Calls begin() on each chip and sets the sizes from the first chip
+	 */
+	virtual void begin();
+
+	/**
+	 * @brief Returns true if every chip is valid
+	 */
+	virtual bool isValid();
+
+	/**
+	 * @brief Returns the JEDEC ID of the first chip
+	 */
+	virtual uint32_t jedecIdRead();
+
+	/**
+	 * @brief Reads data synchronously
+	 */
+	virtual void readData(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * @brief Writes data synchronously, programming pages on all of the chips at the same time
+	 *
+	 * If an asynchronous operation such as writeDataAsync() was started on one of the chips directly, this
+	 * calls its poll() until it's done before writing, so call it from the thread that started the
+	 * operation.
+	 */
+	virtual void writeData(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * @brief Erases a sector, which is a sector on each chip unless the stripe size is the sector size or larger
+	 */
+	virtual void sectorErase(size_t addr);
+
+	/**
+	 * @brief Erases all of the chips at the same time
+	 */
+	virtual void chipErase();
+
+	/**
+	 * @brief Erases a range of sectors on all of the chips at the same time
+	 *
+	 * Uses 64K block erase on each chip where possible. Returns false if addr or len are not aligned to
+	 * getSectorSize(). Like writeData(), first waits for asynchronous operations started on the chips
+	 * directly to finish.
+	 */
+	virtual bool eraseRange(size_t addr, size_t len);
+
+	/**
+	 * @brief Returns the number of chips
+	 */
+	size_t getNumChips() const { return numChips; };
+
+	/**
+	 * @brief Returns the stripe size
+	 */
+	size_t getStripeSize() const { return stripeSize; };
+
+	/**
+	 * @brief Converts an address on the striped device to the chip it's on and the address on that chip
+	 */
+	size_t toChipAddr(size_t addr, size_t &chipIndex) const;
+
+protected:
+	/**
+	 * @brief Sets pageSize, sectorSize, and capacity from the chips
+	 */
+	void updateSizes();
+
+	/**
+	 * @brief Returns the first address at or after addr that is on chipIndex
+	 */
+	size_t firstAddrOnChip(size_t addr, size_t chipIndex) const;
+
+	/**
+	 * @brief Advances the asynchronous operation on a chip that an operation couldn't be started on
+	 *
+	 * @param chipIndex The chip
+	 * @param waitUs Lowered to when the chip should be tried again
+	 */
+	void pollAsync(size_t chipIndex, unsigned long &waitUs);
+
+	/**
+	 * @brief Waits for the asynchronous operations started on the chips directly to complete
+	 */
+	void waitForAsync();
+
+	/**
+	 * @brief Waits for the operation on every chip to complete
+	 */
+	void waitForAll();
+
+	SpiFlash **chips = 0;
+	size_t numChips = 0;
+	size_t stripeSize;
+	size_t *cursors = 0;
+	size_t *ends = 0;
+};
+
+#endif /* __SPIFLASHSTRIPED_H */
@@ -0,0 +1,363 @@
+#include "Particle.h"
+
+#include "SpiFlashWearLevel.h"
+
+SpiFlashWearLevel::SpiFlashWearLevel(SpiFlashBase &flash, size_t startAddr, size_t numSectors, size_t numReserveSectors) :
+	flash(flash), startAddr(startAddr), numSectors(numSectors), numReserveSectors(numReserveSectors) {
+
+	if (this->numSectors > RECYCLE - 1) {
+		this->numSectors = RECYCLE - 1;
+	}
+	if (this->numReserveSectors < 1) {
+		this->numReserveSectors = 1;
+	}
+	numLogicalSectors = (this->numSectors > this->numReserveSectors) ? (this->numSectors - this->numReserveSectors) : 0;
+
+	physicalSectorSize = flash.getSectorSize();
+	pageSize = flash.getPageSize();
+	sectorSize = physicalSectorSize - pageSize;
+	capacity = numLogicalSectors * sectorSize;
+
+	memset(&stats, 0, sizeof(stats));
+}
+
+SpiFlashWearLevel::~SpiFlashWearLevel() {
+	delete[] logicalToPhysical;
+	delete[] physicalToLogical;
+	delete[] eraseCounts;
+}
+
+void SpiFlashWearLevel::begin() {
+	flash.begin();
+
+	unsigned long startMs = millis();
+
+	// The flash object may have changed its sizes in begin(), from SFDP for example
+	physicalSectorSize = flash.getSectorSize();
+	pageSize = flash.getPageSize();
+	sectorSize = physicalSectorSize - pageSize;
+	capacity = numLogicalSectors * sectorSize;
+
+	delete[] logicalToPhysical;
+	delete[] physicalToLogical;
+	delete[] eraseCounts;
+	logicalToPhysical = new uint16_t[numLogicalSectors];
+	physicalToLogical = new uint16_t[numSectors];
+	eraseCounts = new uint32_t[numSectors];
+	mounted = false;
+	if (!logicalToPhysical || !physicalToLogical || !eraseCounts || numLogicalSectors == 0) {
+		return;
+	}
+
+	for(size_t ii = 0; ii < numLogicalSectors; ii++) {
+		logicalToPhysical[ii] = UNMAPPED;
+	}
+
+	// Read the headers. Only 28 bytes per sector are read, so this is fast even for large chips.
+	uint64_t eraseCountSum = 0;
+	size_t eraseCountKnown = 0;
+	nextSequence = 0;
+
+	for(size_t phys = 0; phys < numSectors; phys++) {
+		SectorHeader hdr;
+		flash.readData(physicalAddr(phys), &hdr, sizeof(hdr));
+
+		eraseCounts[phys] = 0;
+
+		if (hdr.magic != HEADER_MAGIC || hdr.eraseCheck != ~hdr.eraseCount) {
+			physicalToLogical[phys] = FORMAT;
+			continue;
+		}
+		eraseCounts[phys] = hdr.eraseCount;
+		eraseCountSum += hdr.eraseCount;
+		eraseCountKnown++;
+
+		if (hdr.logicalSector == 0xffffffff) {
+			physicalToLogical[phys] = UNMAPPED;
+			continue;
+		}
+
+		if (hdr.mapCheck != ~(hdr.logicalSector ^ hdr.sequence) || hdr.commit != 0 || hdr.logicalSector >= numLogicalSectors) {
+			// Interrupted while being assigned or moved
+			physicalToLogical[phys] = RECYCLE;
+			continue;
+		}
+
+		if (hdr.sequence >= nextSequence) {
+			nextSequence = hdr.sequence + 1;
+		}
+
+		uint16_t existing = logicalToPhysical[hdr.logicalSector];
+		if (existing != UNMAPPED) {
+			// Two copies of the same logical sector, from an interrupted move. The newer one wins.
+			SectorHeader existingHdr;
+			flash.readData(physicalAddr(existing), &existingHdr, sizeof(existingHdr));
+			if (existingHdr.sequence > hdr.sequence) {
+				physicalToLogical[phys] = RECYCLE;
+				continue;
+			}
+			physicalToLogical[existing] = RECYCLE;
+		}
+		logicalToPhysical[hdr.logicalSector] = (uint16_t)phys;
+		physicalToLogical[phys] = (uint16_t)hdr.logicalSector;
+	}
+
+	// Sectors without a valid header get the average erase count of the others
+	uint32_t defaultEraseCount = eraseCountKnown ? (uint32_t)(eraseCountSum / eraseCountKnown) : 0;
+
+	for(size_t phys = 0; phys < numSectors; phys++) {
+		if (physicalToLogical[phys] == FORMAT) {
+			// A new chip is already blank, so it only needs the header written
+			eraseCounts[phys] = defaultEraseCount;
+			if (flash.isErased(physicalAddr(phys), physicalSectorSize)) {
+				writeEraseHeader((uint16_t)phys);
+				physicalToLogical[phys] = UNMAPPED;
+			}
+			else {
+				eraseSector((uint16_t)phys);
+			}
+		}
+		else
+		if (physicalToLogical[phys] == RECYCLE) {
+			eraseSector((uint16_t)phys);
+		}
+	}
+
+	mounted = true;
+	stats.mountTimeMs = millis() - startMs;
+}
+
+bool SpiFlashWearLevel::isValid() {
+	return mounted && flash.isValid();
+}
+
+uint32_t SpiFlashWearLevel::jedecIdRead() {
+	return flash.jedecIdRead();
+}
+
+void SpiFlashWearLevel::readData(size_t addr, void *buf, size_t bufLen) {
+	uint8_t *curBuf = (uint8_t *)buf;
+
+	while(bufLen > 0) {
+		size_t logical = addr / sectorSize;
+		size_t offset = addr % sectorSize;
+
+		size_t count = sectorSize - offset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		uint16_t phys = (mounted && logical < numLogicalSectors) ? logicalToPhysical[logical] : UNMAPPED;
+		if (phys != UNMAPPED) {
+			flash.readData(physicalAddr(phys) + pageSize + offset, curBuf, count);
+		}
+		else {
+			memset(curBuf, 0xff, count);
+		}
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+void SpiFlashWearLevel::writeData(size_t addr, const void *buf, size_t bufLen) {
+	const uint8_t *curBuf = (const uint8_t *)buf;
+
+	if (!mounted) {
+		return;
+	}
+
+	while(bufLen > 0) {
+		size_t logical = addr / sectorSize;
+		size_t offset = addr % sectorSize;
+		if (logical >= numLogicalSectors) {
+			break;
+		}
+
+		size_t count = sectorSize - offset;
+		if (count > bufLen) {
+			count = bufLen;
+		}
+
+		uint16_t phys = logicalToPhysical[logical];
+		if (phys == UNMAPPED) {
+			phys = allocateSector(logical);
+			if (phys == UNMAPPED) {
+				break;
+			}
+		}
+
+		flash.writeData(physicalAddr(phys) + pageSize + offset, curBuf, count);
+		stats.hostBytesWritten += count;
+		stats.flashBytesWritten += count;
+
+		addr += count;
+		curBuf += count;
+		bufLen -= count;
+	}
+}
+
+void SpiFlashWearLevel::sectorErase(size_t addr) {
+	size_t logical = addr / sectorSize;
+	if (!mounted || logical >= numLogicalSectors) {
+		return;
+	}
+	stats.hostErases++;
+
+	uint16_t phys = logicalToPhysical[logical];
+	if (phys == UNMAPPED) {
+		// Never written since the last erase, so it's already blank
+		return;
+	}
+	logicalToPhysical[logical] = UNMAPPED;
+	eraseSector(phys);
+
+	staticWearLevel();
+}
+
+void SpiFlashWearLevel::chipErase() {
+	for(size_t logical = 0; logical < numLogicalSectors; logical++) {
+		sectorErase(logical * sectorSize);
+	}
+}
+
+uint32_t SpiFlashWearLevel::getEraseCount(size_t physicalSector) const {
+	return (eraseCounts && physicalSector < numSectors) ? eraseCounts[physicalSector] : 0;
+}
+
+int SpiFlashWearLevel::getPhysicalSector(size_t logicalSector) const {
+	if (!mounted || logicalSector >= numLogicalSectors || logicalToPhysical[logicalSector] == UNMAPPED) {
+		return -1;
+	}
+	return logicalToPhysical[logicalSector];
+}
+
+void SpiFlashWearLevel::getStats(SpiFlashWearLevelStats &result) const {
+	result = stats;
+	result.minEraseCount = result.maxEraseCount = result.avgEraseCount = 0;
+	result.freeSectors = 0;
+	if (!mounted) {
+		return;
+	}
+
+	uint64_t sum = 0;
+	result.minEraseCount = 0xffffffff;
+	for(size_t phys = 0; phys < numSectors; phys++) {
+		uint32_t count = eraseCounts[phys];
+		sum += count;
+		if (count < result.minEraseCount) {
+			result.minEraseCount = count;
+		}
+		if (count > result.maxEraseCount) {
+			result.maxEraseCount = count;
+		}
+		if (physicalToLogical[phys] == UNMAPPED) {
+			result.freeSectors++;
+		}
+	}
+	result.avgEraseCount = (uint32_t)(sum / numSectors);
+}
+
+uint16_t SpiFlashWearLevel::findFreeSector(bool mostWorn) const {
+	uint16_t result = UNMAPPED;
+	for(size_t phys = 0; phys < numSectors; phys++) {
+		if (physicalToLogical[phys] != UNMAPPED) {
+			continue;
+		}
+		if (result == UNMAPPED ||
+			(mostWorn && eraseCounts[phys] > eraseCounts[result]) ||
+			(!mostWorn && eraseCounts[phys] < eraseCounts[result])) {
+			result = (uint16_t)phys;
+		}
+	}
+	return result;
+}
+
+uint16_t SpiFlashWearLevel::allocateSector(size_t logicalSector) {
+	uint16_t phys = findFreeSector(false);
+	if (phys == UNMAPPED) {
+		return UNMAPPED;
+	}
+
+	writeMapHeader(phys, logicalSector, true);
+	logicalToPhysical[logicalSector] = phys;
+	physicalToLogical[phys] = (uint16_t)logicalSector;
+	return phys;
+}
+
+void SpiFlashWearLevel::eraseSector(uint16_t physicalSector) {
+	flash.sectorErase(physicalAddr(physicalSector));
+	eraseCounts[physicalSector]++;
+	stats.flashErases++;
+
+	writeEraseHeader(physicalSector);
+	physicalToLogical[physicalSector] = UNMAPPED;
+}
+
+void SpiFlashWearLevel::writeEraseHeader(uint16_t physicalSector) {
+	uint32_t fields[3];
+	fields[0] = HEADER_MAGIC;
+	fields[1] = eraseCounts[physicalSector];
+	fields[2] = ~eraseCounts[physicalSector];
+
+	flash.writeData(physicalAddr(physicalSector) + offsetof(SectorHeader, magic), fields, sizeof(fields));
+	stats.flashBytesWritten += sizeof(fields);
+}
+
+void SpiFlashWearLevel::writeMapHeader(uint16_t physicalSector, size_t logicalSector, bool commit) {
+	uint32_t fields[4];
+	fields[0] = (uint32_t)logicalSector;
+	fields[1] = nextSequence++;
+	fields[2] = ~(fields[0] ^ fields[1]);
+	fields[3] = 0;
+
+	// When moving a sector, commit is written separately after the data is copied
+	size_t len = commit ? sizeof(fields) : sizeof(fields) - sizeof(fields[3]);
+
+	flash.writeData(physicalAddr(physicalSector) + offsetof(SectorHeader, logicalSector), fields, len);
+	stats.flashBytesWritten += len;
+}
+
+void SpiFlashWearLevel::staticWearLevel() {
+	if (staticThreshold == 0) {
+		return;
+	}
+
+	// Find the least worn sector that contains data
+	uint16_t cold = UNMAPPED;
+	for(size_t phys = 0; phys < numSectors; phys++) {
+		if (physicalToLogical[phys] < numLogicalSectors && (cold == UNMAPPED || eraseCounts[phys] < eraseCounts[cold])) {
+			cold = (uint16_t)phys;
+		}
+	}
+	uint16_t worn = findFreeSector(true);
+	if (cold == UNMAPPED || worn == UNMAPPED || eraseCounts[worn] <= eraseCounts[cold] + staticThreshold) {
+		return;
+	}
+
+	// Copy the cold data to the worn sector so the cold sector can be used for frequently changing data.
+	// If this is interrupted the new copy is not committed, so begin() discards it.
+	size_t logical = physicalToLogical[cold];
+	writeMapHeader(worn, logical, false);
+
+	uint8_t buf[256];
+	for(size_t offset = pageSize; offset < physicalSectorSize; offset += sizeof(buf)) {
+		flash.readData(physicalAddr(cold) + offset, buf, sizeof(buf));
+
+		if (!SpiFlashBase::isErasedBuffer(buf, sizeof(buf))) {
+			flash.writeData(physicalAddr(worn) + offset, buf, sizeof(buf));
+			stats.flashBytesWritten += sizeof(buf);
+		}
+	}
+
+	uint32_t commit = 0;
+	flash.writeData(physicalAddr(worn) + offsetof(SectorHeader, commit), &commit, sizeof(commit));
+	stats.flashBytesWritten += sizeof(commit);
+
+	logicalToPhysical[logical] = worn;
+	physicalToLogical[worn] = (uint16_t)logical;
+	stats.staticMoves++;
+
+	eraseSector(cold);
+}
@@ -0,0 +1,212 @@
+/**
+ * Wear leveling layer for SpiFlashRK
+ *
+ * https://github.com/rickkas7/SpiFlashRK
+ *
+ * License: MIT
+ */
+
+#ifndef __SPIFLASHWEARLEVEL_H
+#define __SPIFLASHWEARLEVEL_H
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Statistics for a SpiFlashWearLevel object, from SpiFlashWearLevel::getStats()
+ */
+struct SpiFlashWearLevelStats {
+	uint64_t hostBytesWritten;		//!< Bytes passed to writeData()
+	uint64_t flashBytesWritten;		//!< Bytes programmed on the flash chip, including headers and sectors moved
+	uint32_t hostErases;			//!< Sectors erased by sectorErase() and chipErase()
+	uint32_t flashErases;			//!< Sectors erased on the flash chip
+	uint32_t staticMoves;			//!< Sectors moved by static wear leveling
+	uint32_t minEraseCount;			//!< Lowest erase count of any physical sector
+	uint32_t maxEraseCount;			//!< Highest erase count of any physical sector
+	uint32_t avgEraseCount;			//!< Average erase count of the physical sectors
+	size_t freeSectors;				//!< Physical sectors not currently mapped to a logical sector
+	unsigned long mountTimeMs;		//!< Time begin() took to read the headers and build the mapping table
+
+	/**
+	 * @brief Returns flashBytesWritten / hostBytesWritten, or 0 if nothing has been written
+	 */
+	float getWriteAmplification() const { return hostBytesWritten ? (float)flashBytesWritten / (float)hostBytesWritten : 0.0f; };
+
+	/**
+	 * @brief Returns flashErases / hostErases, or 0 if nothing has been erased
+	 */
+	float getEraseAmplification() const { return hostErases ? (float)flashErases / (float)hostErases : 0.0f; };
+};
+
+/**
+ * @brief Wear leveling flash translation layer
+ *
+ * Maps logical sectors to physical sectors on another SpiFlashBase object (normally a SpiFlash) so
+ * repeatedly erasing the same logical sector spreads the erases over many physical sectors. Because
+ * this class implements SpiFlashBase, code that uses a SpiFlashBase, like a file system, works unchanged.
+ *
+ * The first page of each physical sector holds a small header with the erase count of the sector and
+ * the logical sector it contains, so the logical sector size is the physical sector size minus one page
+ * (3840 bytes for 4096 byte sectors and 256 byte pages). Use getSectorSize() and getCapacity() instead of
+ * assuming 4096 byte sectors.
+ *
+ * - Dynamic wear leveling: erasing a logical sector frees its physical sector, and the next write to the
+ * logical sector uses the free physical sector with the lowest erase count.
+ * - Static wear leveling: when the erase count of the most worn free sector is more than the threshold
+ * above the least worn sector that holds data, that data is moved so the little-used sector can be reused.
+ * - The erase counts are stored in flash so they survive reset. The mapping table is kept in RAM and rebuilt
+ * by begin() from the headers, which only requires reading a few bytes from each sector.
+ *
+ * Erasing a logical sector that was never written doesn't erase anything.
+ */
+class SpiFlashWearLevel : public SpiFlashBase {
+public:
+	/**
+	 * @brief Construct a wear leveling layer using part of a flash chip
+	 *
+	 * @param flash The flash chip to use, typically a SpiFlash object
+	 * @param startAddr Address of the first physical sector to use. Must be sector aligned.
+	 * @param numSectors Number of physical sectors to use
+	 * @param numReserveSectors Number of physical sectors that are not available as logical sectors (default: 4).
+	 * Must be at least 1. More reserve sectors allow the erases from hot data to be spread further.
+	 */
+	SpiFlashWearLevel(SpiFlashBase &flash, size_t startAddr, size_t numSectors, size_t numReserveSectors = 4);
+	virtual ~SpiFlashWearLevel();
+
+	/**
+	 * @brief Calls begin() on the flash object, then reads the sector headers and builds the mapping table
+	 *
+	 * Sectors without a valid header, like on a new chip, are formatted. This only requires an erase if the
+	 * sector isn't already blank. Sectors left over from an operation that was interrupted by a reset or
+	 * power loss are erased.
+	 */
+	virtual void begin();
+
+	/**
+	 * @brief Returns true if the flash chip is valid and begin() succeeded
+	 */
+	virtual bool isValid();
+
+	/**
+	 * @brief Returns the JEDEC ID of the flash chip
+	 */
+	virtual uint32_t jedecIdRead();
+
+	/**
+	 * @brief Reads logical data. Logical sectors that have not been written since being erased read as 0xff.
+	 */
+	virtual void readData(size_t addr, void *buf, size_t bufLen);
+
+	/**
+	 * @brief Writes logical data. As with the flash chip, bits can only be changed from 1 to 0.
+	 */
+	virtual void writeData(size_t addr, const void *buf, size_t bufLen);
+
+	/**
+	 * @brief Erases a logical sector by freeing the physical sector it uses
+	 *
+	 * @param addr Logical address of the beginning of the sector. Must be a multiple of getSectorSize().
+	 */
+	virtual void sectorErase(size_t addr);
+
+	/**
+	 * @brief Erases all logical sectors
+	 */
+	virtual void chipErase();
+
+	/**
+	 * @brief Sets the static wear leveling threshold in erases (default: 32). 0 disables static wear leveling.
+	 */
+	inline SpiFlashWearLevel &withStaticThreshold(uint32_t value) { staticThreshold = value; return *this; };
+
+	/**
+	 * @brief Returns the erase count for a physical sector (0 to numSectors - 1)
+	 */
+	uint32_t getEraseCount(size_t physicalSector) const;
+
+	/**
+	 * @brief Returns the physical sector (0 to numSectors - 1) used by a logical sector, or -1 if not mapped
+	 */
+	int getPhysicalSector(size_t logicalSector) const;
+
+	/**
+	 * @brief Gets the statistics, for example to decide how many reserve sectors are needed
+	 */
+	void getStats(SpiFlashWearLevelStats &result) const;
+
+	/**
+	 * @brief Header at the start of each physical sector
+	 *
+	 * The erase fields are written after the sector is erased. The mapping fields are written later,
+	 * when the sector is assigned to a logical sector, which is possible because they are still 0xff.
+	 * commit is written last and is only separate when moving a sector.
+	 */
+	struct SectorHeader {
+		uint32_t magic;				//!< HEADER_MAGIC
+		uint32_t eraseCount;		//!< Number of times the sector has been erased
+		uint32_t eraseCheck;		//!< ~eraseCount
+		uint32_t logicalSector;		//!< Logical sector number or 0xffffffff if free
+		uint32_t sequence;			//!< Incremented each time a sector is assigned, the newest copy wins
+		uint32_t mapCheck;			//!< ~(logicalSector ^ sequence)
+		uint32_t commit;			//!< 0 once the data is complete
+	};
+
+	static const uint32_t HEADER_MAGIC = 0x4c574653; //!< "SFWL"
+
+protected:
+	/**
+	 * @brief Address of a physical sector on the flash chip
+	 */
+	size_t physicalAddr(size_t physicalSector) const { return startAddr + physicalSector * physicalSectorSize; };
+
+	/**
+	 * @brief Returns the free sector with the lowest (or highest) erase count, or UNMAPPED if there are none
+	 */
+	uint16_t findFreeSector(bool mostWorn) const;
+
+	/**
+	 * @brief Assigns a free physical sector to a logical sector
+	 */
+	uint16_t allocateSector(size_t logicalSector);
+
+	/**
+	 * @brief Erases a physical sector, increments and writes its erase count, and marks it free
+	 */
+	void eraseSector(uint16_t physicalSector);
+
+	/**
+	 * @brief Writes the erase count fields of the header
+	 */
+	void writeEraseHeader(uint16_t physicalSector);
+
+	/**
+	 * @brief Writes the mapping fields of the header
+	 */
+	void writeMapHeader(uint16_t physicalSector, size_t logicalSector, bool commit);
+
+	/**
+	 * @brief Moves the least worn data to the most worn free sector if the difference is over the threshold
+	 */
+	void staticWearLevel();
+
+	static const uint16_t UNMAPPED = 0xffff;
+	static const uint16_t RECYCLE = 0xfffe;
+	static const uint16_t FORMAT = 0xfffd;
+
+	SpiFlashBase &flash;
+	size_t startAddr;
+	size_t numSectors;
+	size_t numReserveSectors;
+	size_t numLogicalSectors;
+	size_t physicalSectorSize = 4096;
+	uint32_t staticThreshold = 32;
+	bool mounted = false;
+
+	uint16_t *logicalToPhysical = 0;
+	uint16_t *physicalToLogical = 0;
+	uint32_t *eraseCounts = 0;
+	uint32_t nextSequence = 0;
+
+	SpiFlashWearLevelStats stats;
+};
+
+#endif /* __SPIFLASHWEARLEVEL_H */
@@ -0,0 +1,272 @@
+/**
+ * Minimal host (Linux/Mac) replacement for Particle.h so SpiFlashRK can be built and
+ * tested off-device against the simulated flash chip in SpiFlashEmulator.h.
+ *
+ * Only the parts of the Device OS API used by the library are provided. Time is simulated:
+ * millis() and micros() advance only when SPI bytes are clocked or when delay() or
+ * delayMicroseconds() is called, so results are deterministic and independent of the
+ * speed of the host computer.
+ */
+
+#ifndef __PARTICLE_H
+#define __PARTICLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <atomic>
+
+// Host builds use the gcc platform ID
+#ifndef PLATFORM_ID
+#define PLATFORM_ID 3
+#endif
+
+#define MHZ 1000000
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x01
+#define SPI_MODE2 0x02
+#define SPI_MODE3 0x03
+
+#define LOW 0
+#define HIGH 1
+
+typedef enum {
+	INPUT, OUTPUT, INPUT_PULLUP, INPUT_PULLDOWN
+} PinMode;
+
+enum {
+	D0 = 0, D1, D2, D3, D4, D5, D6, D7,
+	A0 = 10, A1, A2, A3, A4, A5
+};
+
+typedef void (*wiring_spi_dma_transfercomplete_callback_t)(void);
+
+/**
+ * @brief Simulated time source shared by all of the host shims
+ */
+class HostClock {
+public:
+	/**
+	 * @brief Current simulated time in nanoseconds
+	 */
+	static uint64_t nowNs() { return now; };
+
+	/**
+	 * @brief Advance the simulated time, running any scheduled callbacks that are now due
+	 */
+	static void advanceNs(uint64_t ns);
+
+	/**
+	 * @brief Run a callback when the simulated time reaches atNs
+	 *
+	 * This is used to simulate interrupts, like DMA transfer complete.
+	 */
+	static void schedule(uint64_t atNs, void (*callback)(void));
+
+	/**
+	 * @brief Software overhead of SPI beginTransaction() in nanoseconds (default: 2000)
+	 *
+	 * This approximates the cost of locking the bus and reconfiguring the peripheral on
+	 * a real device, which is significant compared to the time on the wire for short commands.
+	 */
+	static uint64_t transactionOverheadNs;
+
+private:
+	// Atomic so threads waiting for a lock can read the time while another thread advances it
+	static std::atomic<uint64_t> now;
+};
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Subset of the Device OS concurrency API, implemented with pthreads
+typedef void *os_mutex_t;
+typedef void *os_semaphore_t;
+typedef void *os_thread_t;
+typedef uint32_t system_tick_t;
+
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_destroy(os_mutex_t mutex);
+int os_mutex_lock(os_mutex_t mutex);
+int os_mutex_trylock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+os_thread_t os_thread_current(void *reserved);
+int os_thread_yield(void);
+
+/**
+ * @brief Interface implemented by simulated SPI peripherals (like SpiFlashEmulator)
+ */
+class HostSpiDevice {
+public:
+	virtual ~HostSpiDevice() {};
+
+	/**
+	 * @brief Called when the CS line goes LOW
+	 */
+	virtual void select() = 0;
+
+	/**
+	 * @brief Called when the CS line goes HIGH
+	 */
+	virtual void deselect() = 0;
+
+	/**
+	 * @brief Called for each byte clocked while selected
+	 *
+	 * @param data The byte on MOSI
+	 *
+	 * @param clockHz The SPI clock speed in Hz
+	 *
+	 * @return The byte to return on MISO
+	 */
+	virtual uint8_t transferByte(uint8_t data, uint32_t clockHz) = 0;
+};
+
+void pinMode(uint16_t pin, PinMode mode);
+void digitalWrite(uint16_t pin, uint8_t value);
+int32_t digitalRead(uint16_t pin);
+void pinResetFast(uint16_t pin);
+void pinSetFast(uint16_t pin);
+
+class __SPISettings {
+public:
+	__SPISettings() {};
+	__SPISettings(unsigned int clock, uint8_t bitOrder, uint8_t dataMode) :
+		clock(clock), bitOrder(bitOrder), dataMode(dataMode) {};
+
+	unsigned int clock = 0;
+	uint8_t bitOrder = MSBFIRST;
+	uint8_t dataMode = SPI_MODE0;
+};
+typedef __SPISettings SPISettings;
+
+/**
+ * @brief Simulated SPI bus
+ *
+ * Bytes are routed to every attached HostSpiDevice whose CS pin is LOW. Each byte advances
+ * the simulated clock by 8 SPI clock periods.
+ *
+ * A transfer with a callback simulates DMA: the bytes are exchanged immediately but the
+ * simulated clock does not advance. Instead, the callback is run when the simulated time
+ * reaches the end of the transfer, as if it were called from the DMA complete interrupt.
+ */
+class SPIClass {
+public:
+	void begin();
+	void begin(uint16_t ssPin);
+	void end();
+
+	int32_t beginTransaction();
+	int32_t beginTransaction(const __SPISettings &settings);
+	void endTransaction();
+
+	uint8_t transfer(uint8_t data);
+	void transfer(const void *txBuffer, void *rxBuffer, size_t length, wiring_spi_dma_transfercomplete_callback_t userCallback);
+
+	/**
+	 * @brief Host only. Connects a simulated device to this bus on the given CS pin.
+	 */
+	void attach(HostSpiDevice *device, uint16_t csPin);
+
+	/**
+	 * @brief Host only. Disconnects a simulated device from this bus.
+	 */
+	void detach(HostSpiDevice *device);
+
+	/**
+	 * @brief Host only. Number of bytes clocked on this bus since startup.
+	 */
+	uint64_t getBytesTransferred() const { return bytesTransferred; };
+
+	/**
+	 * @brief Host only. Number of beginTransaction calls on this bus since startup.
+	 */
+	uint64_t getTransactionCount() const { return transactionCount; };
+
+	/**
+	 * @brief Host only. Number of synchronous transfers that had to wait for a DMA transfer to finish.
+	 */
+	uint64_t getDmaWaitCount() const { return dmaWaitCount; };
+
+	/**
+	 * @brief Host only. Settings passed to the most recent beginTransaction.
+	 */
+	const __SPISettings &getSettings() const { return settings; };
+
+private:
+	static const size_t MAX_DEVICES = 8;
+	HostSpiDevice *devices[MAX_DEVICES] = {0};
+	uint16_t devicePins[MAX_DEVICES] = {0};
+	size_t numDevices = 0;
+	__SPISettings settings = __SPISettings(16 * MHZ, MSBFIRST, SPI_MODE0);
+	uint64_t bytesTransferred = 0;
+	uint64_t transactionCount = 0;
+	uint64_t dmaBusyUntilNs = 0;
+	uint64_t dmaWaitCount = 0;
+};
+
+extern SPIClass SPI;
+extern SPIClass SPI1;
+
+/**
+ * @brief Simplified Print, the base class for objects that can be written to
+ */
+class Print {
+public:
+	virtual ~Print() {};
+
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); };
+
+	size_t print(const char *str) { return write(str); };
+	size_t println(const char *str) { return print(str) + println(); };
+	size_t println() { return write("\r\n"); };
+	size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+/**
+ * @brief Simplified Stream. readBytes() doesn't wait for a timeout.
+ */
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() = 0;
+
+	size_t readBytes(char *buffer, size_t length);
+};
+
+/**
+ * @brief Simplified Logger. Output is only printed if enabled is set.
+ */
+class Logger {
+public:
+	void trace(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void info(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void warn(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+	void error(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+
+	static bool enabled;
+};
+
+extern Logger Log;
+
+#endif /* __PARTICLE_H */
@@ -0,0 +1,373 @@
+#include "Particle.h"
+
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+std::atomic<uint64_t> HostClock::now(0);
+uint64_t HostClock::transactionOverheadNs = 2000;
+
+typedef struct {
+	uint64_t atNs;
+	void (*callback)(void);
+} ScheduledCallback;
+static std::vector<ScheduledCallback> scheduledCallbacks;
+
+SPIClass SPI;
+SPIClass SPI1;
+
+Logger Log;
+bool Logger::enabled = false;
+
+static const size_t NUM_PINS = 32;
+static uint8_t pinState[NUM_PINS];
+static HostSpiDevice *pinDevice[NUM_PINS];
+
+// static
+void HostClock::advanceNs(uint64_t ns) {
+	now += ns;
+
+	while(true) {
+		auto it = scheduledCallbacks.begin();
+		for(; it != scheduledCallbacks.end(); it++) {
+			if (it->atNs <= now) {
+				break;
+			}
+		}
+		if (it == scheduledCallbacks.end()) {
+			break;
+		}
+		void (*callback)(void) = it->callback;
+		scheduledCallbacks.erase(it);
+		callback();
+	}
+}
+
+// static
+void HostClock::schedule(uint64_t atNs, void (*callback)(void)) {
+	ScheduledCallback sc;
+	sc.atNs = atNs;
+	sc.callback = callback;
+	scheduledCallbacks.push_back(sc);
+}
+
+unsigned long millis() {
+	return (unsigned long)(HostClock::nowNs() / 1000000);
+}
+
+unsigned long micros() {
+	return (unsigned long)(HostClock::nowNs() / 1000);
+}
+
+void delay(unsigned long ms) {
+	HostClock::advanceNs((uint64_t)ms * 1000000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	HostClock::advanceNs((uint64_t)us * 1000);
+}
+
+int os_mutex_create(os_mutex_t *mutex) {
+	pthread_mutex_t *m = new pthread_mutex_t;
+	pthread_mutex_init(m, NULL);
+	*mutex = m;
+	return 0;
+}
+
+int os_mutex_destroy(os_mutex_t mutex) {
+	pthread_mutex_t *m = (pthread_mutex_t *)mutex;
+	pthread_mutex_destroy(m);
+	delete m;
+	return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex) {
+	return pthread_mutex_lock((pthread_mutex_t *)mutex);
+}
+
+int os_mutex_trylock(os_mutex_t mutex) {
+	return pthread_mutex_trylock((pthread_mutex_t *)mutex);
+}
+
+int os_mutex_unlock(os_mutex_t mutex) {
+	return pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+namespace {
+struct HostSemaphore {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned count;
+	unsigned max;
+};
+}
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+	HostSemaphore *sem = new HostSemaphore;
+	pthread_mutex_init(&sem->mutex, NULL);
+	pthread_cond_init(&sem->cond, NULL);
+	sem->count = initial;
+	sem->max = max;
+	*semaphore = sem;
+	return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t semaphore) {
+	HostSemaphore *sem = (HostSemaphore *)semaphore;
+	pthread_cond_destroy(&sem->cond);
+	pthread_mutex_destroy(&sem->mutex);
+	delete sem;
+	return 0;
+}
+
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved) {
+	// Timeouts are in real time, not simulated time, since another thread has to give the semaphore
+	HostSemaphore *sem = (HostSemaphore *)semaphore;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	int result = 0;
+	pthread_mutex_lock(&sem->mutex);
+	while(sem->count == 0 && result == 0) {
+		if (timeout == CONCURRENT_WAIT_FOREVER) {
+			pthread_cond_wait(&sem->cond, &sem->mutex);
+		}
+		else
+		if (pthread_cond_timedwait(&sem->cond, &sem->mutex, &deadline) != 0) {
+			result = 1;
+		}
+	}
+	if (result == 0) {
+		sem->count--;
+	}
+	pthread_mutex_unlock(&sem->mutex);
+	return result;
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved) {
+	HostSemaphore *sem = (HostSemaphore *)semaphore;
+	int result = 0;
+	pthread_mutex_lock(&sem->mutex);
+	if (sem->count < sem->max) {
+		sem->count++;
+		pthread_cond_signal(&sem->cond);
+	}
+	else {
+		result = 1;
+	}
+	pthread_mutex_unlock(&sem->mutex);
+	return result;
+}
+
+os_thread_t os_thread_current(void *reserved) {
+	// The address of a thread-local variable is unique to each thread
+	static thread_local char marker;
+	return &marker;
+}
+
+int os_thread_yield(void) {
+	return sched_yield();
+}
+
+void pinMode(uint16_t pin, PinMode mode) {
+}
+
+void digitalWrite(uint16_t pin, uint8_t value) {
+	if (pin >= NUM_PINS) {
+		return;
+	}
+	value = value ? HIGH : LOW;
+	if (pinState[pin] == value) {
+		return;
+	}
+	pinState[pin] = value;
+
+	if (pinDevice[pin]) {
+		if (value == LOW) {
+			pinDevice[pin]->select();
+		}
+		else {
+			pinDevice[pin]->deselect();
+		}
+	}
+}
+
+int32_t digitalRead(uint16_t pin) {
+	return (pin < NUM_PINS) ? pinState[pin] : LOW;
+}
+
+void pinResetFast(uint16_t pin) {
+	digitalWrite(pin, LOW);
+}
+
+void pinSetFast(uint16_t pin) {
+	digitalWrite(pin, HIGH);
+}
+
+
+void SPIClass::begin() {
+}
+
+void SPIClass::begin(uint16_t ssPin) {
+	digitalWrite(ssPin, HIGH);
+}
+
+void SPIClass::end() {
+}
+
+int32_t SPIClass::beginTransaction() {
+	transactionCount++;
+	HostClock::advanceNs(HostClock::transactionOverheadNs);
+	return 0;
+}
+
+int32_t SPIClass::beginTransaction(const __SPISettings &settings) {
+	this->settings = settings;
+	return beginTransaction();
+}
+
+void SPIClass::endTransaction() {
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+	uint8_t rx;
+	transfer(&data, &rx, 1, NULL);
+	return rx;
+}
+
+void SPIClass::transfer(const void *txBuffer, void *rxBuffer, size_t length, wiring_spi_dma_transfercomplete_callback_t userCallback) {
+	const uint8_t *tx = (const uint8_t *)txBuffer;
+	uint8_t *rx = (uint8_t *)rxBuffer;
+	uint32_t clockHz = settings.clock ? settings.clock : 1;
+
+	if (HostClock::nowNs() < dmaBusyUntilNs) {
+		// The previous DMA transfer must finish first
+		dmaWaitCount++;
+		HostClock::advanceNs(dmaBusyUntilNs - HostClock::nowNs());
+	}
+
+	for(size_t ii = 0; ii < length; ii++) {
+		uint8_t out = tx ? tx[ii] : 0xff;
+		uint8_t in = 0xff;
+
+		for(size_t dev = 0; dev < numDevices; dev++) {
+			if (digitalRead(devicePins[dev]) == LOW) {
+				in &= devices[dev]->transferByte(out, clockHz);
+			}
+		}
+		if (rx) {
+			rx[ii] = in;
+		}
+	}
+
+	bytesTransferred += length;
+	uint64_t durationNs = (uint64_t)length * 8 * 1000000000ULL / clockHz;
+
+	if (userCallback) {
+		// DMA: the CPU is free while the transfer is in progress
+		dmaBusyUntilNs = HostClock::nowNs() + durationNs;
+		HostClock::schedule(dmaBusyUntilNs, userCallback);
+	}
+	else {
+		HostClock::advanceNs(durationNs);
+	}
+}
+
+void SPIClass::attach(HostSpiDevice *device, uint16_t csPin) {
+	if (numDevices < MAX_DEVICES && csPin < NUM_PINS) {
+		devices[numDevices] = device;
+		devicePins[numDevices] = csPin;
+		numDevices++;
+		pinDevice[csPin] = device;
+		pinState[csPin] = HIGH;
+	}
+}
+
+void SPIClass::detach(HostSpiDevice *device) {
+	for(size_t dev = 0; dev < numDevices; dev++) {
+		if (devices[dev] == device) {
+			pinDevice[devicePins[dev]] = NULL;
+			numDevices--;
+			for(size_t ii = dev; ii < numDevices; ii++) {
+				devices[ii] = devices[ii + 1];
+				devicePins[ii] = devicePins[ii + 1];
+			}
+			break;
+		}
+	}
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+	size_t count = 0;
+	while(count < size && write(buffer[count])) {
+		count++;
+	}
+	return count;
+}
+
+size_t Print::printf(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return 0;
+	}
+	return write((const uint8_t *)buf, ((size_t)len < sizeof(buf)) ? (size_t)len : sizeof(buf) - 1);
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+	size_t count = 0;
+	while(count < length) {
+		int c = read();
+		if (c < 0) {
+			break;
+		}
+		buffer[count++] = (char)c;
+	}
+	return count;
+}
+
+static void logOutput(const char *level, const char *fmt, va_list ap) {
+	if (Logger::enabled) {
+		printf("%s: ", level);
+		vprintf(fmt, ap);
+		printf("\n");
+	}
+}
+
+void Logger::trace(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logOutput("TRACE", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::info(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logOutput("INFO", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::warn(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logOutput("WARN", fmt, ap);
+	va_end(ap);
+}
+
+void Logger::error(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	logOutput("ERROR", fmt, ap);
+	va_end(ap);
+}
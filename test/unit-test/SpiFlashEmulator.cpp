@@ -0,0 +1,656 @@
+#include "SpiFlashEmulator.h"
+
+SpiFlashEmulator::Counters SpiFlashEmulator::Counters::operator-(const Counters &other) const {
+	Counters result;
+	result.csAssertions = csAssertions - other.csAssertions;
+	result.bytes = bytes - other.bytes;
+	result.statusReads = statusReads - other.statusReads;
+	result.readBytes = readBytes - other.readBytes;
+	result.pagePrograms = pagePrograms - other.pagePrograms;
+	result.programBytes = programBytes - other.programBytes;
+	result.sectorErases = sectorErases - other.sectorErases;
+	result.block32Erases = block32Erases - other.block32Erases;
+	result.block64Erases = block64Erases - other.block64Erases;
+	result.chipErases = chipErases - other.chipErases;
+	result.busyViolations = busyViolations - other.busyViolations;
+	result.writeEnableViolations = writeEnableViolations - other.writeEnableViolations;
+	result.readClockViolations = readClockViolations - other.readClockViolations;
+	result.clockViolations = clockViolations - other.clockViolations;
+	result.eraseSuspends = eraseSuspends - other.eraseSuspends;
+	result.suspendedRegionReads = suspendedRegionReads - other.suspendedRegionReads;
+	result.addressModeSwitches = addressModeSwitches - other.addressModeSwitches;
+	return result;
+}
+
+SpiFlashEmulator::SpiFlashEmulator(const Config &config) : config(config) {
+	memory.resize(config.capacity, 0xff);
+	sectorEraseCounts.resize((config.capacity + SECTOR_SIZE - 1) / SECTOR_SIZE, 0);
+	pageBuf.resize(config.pageSize);
+	pageBufValid.resize(config.pageSize);
+	if (config.hasSfdp) {
+		buildSfdp();
+	}
+}
+
+SpiFlashEmulator::~SpiFlashEmulator() {
+}
+
+// static
+SpiFlashEmulator::Config SpiFlashEmulator::winbondW25Q32() {
+	Config config;
+	config.jedecId = 0xef4016;
+	config.capacity = 4 * 1024 * 1024;
+	config.maxClockHz = 133 * MHZ;
+	config.maxReadClockHz = 50 * MHZ;
+	config.timing.tPP = 400;
+	config.timing.tSE = 45000;
+	config.timing.tBE32 = 120000;
+	config.timing.tBE64 = 150000;
+	config.timing.tCE = 10000000;
+	config.eraseSuspendInst = 0x75;
+	config.eraseResumeInst = 0x7a;
+	return config;
+}
+
+// static
+SpiFlashEmulator::Config SpiFlashEmulator::issiIS25LQ080() {
+	Config config;
+	config.jedecId = 0x9d6014;
+	config.capacity = 1024 * 1024;
+	config.maxClockHz = 104 * MHZ;
+	config.maxReadClockHz = 33 * MHZ;
+	config.timing.tBP1 = 8;
+	config.timing.tBPn = 1;
+	config.timing.tPP = 200;
+	config.timing.tSE = 70000;
+	config.timing.tBE32 = 100000;
+	config.timing.tBE64 = 150000;
+	config.timing.tCE = 500000;
+	return config;
+}
+
+// static
+SpiFlashEmulator::Config SpiFlashEmulator::macronixMX25L8006E() {
+	Config config;
+	config.jedecId = 0xc22014;
+	config.capacity = 1024 * 1024;
+	config.maxClockHz = 86 * MHZ;
+	config.maxReadClockHz = 33 * MHZ;
+	config.timing.tBP1 = 9;
+	config.timing.tBPn = 1;
+	config.timing.tPP = 1400;
+	config.timing.tSE = 60000;
+	config.timing.tBE32 = 500000;
+	config.timing.tBE64 = 700000;
+	config.timing.tCE = 9000000;
+	config.hasSfdp = false;
+	return config;
+}
+
+// static
+SpiFlashEmulator::Config SpiFlashEmulator::macronixMX25L25645G() {
+	Config config;
+	config.jedecId = 0xc22019;
+	config.capacity = 32 * 1024 * 1024;
+	config.maxClockHz = 133 * MHZ;
+	config.maxReadClockHz = 50 * MHZ;
+	config.supports4ByteMode = true;
+	config.supports4ByteInstructions = true;
+	config.eraseSuspendInst = 0xb0;
+	config.eraseResumeInst = 0x30;
+	config.timing.tBP1 = 25;
+	config.timing.tBPn = 2;
+	config.timing.tPP = 330;
+	config.timing.tSE = 30000;
+	config.timing.tBE32 = 150000;
+	config.timing.tBE64 = 280000;
+	config.timing.tCE = 150000000;
+	return config;
+}
+
+// static
+SpiFlashEmulator::Config SpiFlashEmulator::winbondW25Q256() {
+	Config config = winbondW25Q32();
+	config.jedecId = 0xef4019;
+	config.capacity = 32 * 1024 * 1024;
+	config.supports4ByteMode = true;
+	config.supports4ByteInstructions = true;
+	config.supports4ByteBlock32Erase = false;
+	config.timing.tCE = 80000000;
+	return config;
+}
+
+bool SpiFlashEmulator::isBusy() const {
+	return HostClock::nowNs() < busyUntilNs;
+}
+
+void SpiFlashEmulator::completeOperation() {
+	if (isBusy()) {
+		HostClock::advanceNs(busyUntilNs - HostClock::nowNs());
+	}
+}
+
+void SpiFlashEmulator::powerCycle() {
+	busyUntilNs = 0;
+	suspended = false;
+	status &= ~STATUS_WEL;
+	addr4byte = false;
+	deepPowerDown = false;
+	resetEnabled = false;
+	phase = Phase::IGNORE;
+}
+
+uint32_t SpiFlashEmulator::getSectorEraseCount(size_t addr) const {
+	return sectorEraseCounts[(addr % config.capacity) / SECTOR_SIZE];
+}
+
+void SpiFlashEmulator::select() {
+	selected = true;
+	phase = Phase::OPCODE;
+	counters.csAssertions++;
+}
+
+void SpiFlashEmulator::deselect() {
+	if (selected) {
+		finishCommand();
+	}
+	selected = false;
+	phase = Phase::IGNORE;
+}
+
+uint8_t SpiFlashEmulator::transferByte(uint8_t data, uint32_t clockHz) {
+	if (!selected) {
+		return 0xff;
+	}
+	counters.bytes++;
+
+	if (clockHz > config.maxClockHz) {
+		counters.clockViolations++;
+	}
+
+	switch(phase) {
+	case Phase::OPCODE:
+		startCommand(data);
+		break;
+
+	case Phase::ADDRESS:
+		addr = (addr << 8) | data;
+		if (--addrBytesRemaining == 0) {
+			addr %= config.capacity;
+			phase = (dummyBytesRemaining > 0) ? Phase::DUMMY : Phase::DATA;
+		}
+		break;
+
+	case Phase::DUMMY:
+		if (--dummyBytesRemaining == 0) {
+			phase = Phase::DATA;
+		}
+		break;
+
+	case Phase::DATA: {
+		if (opcode == 0x03 && clockHz > config.maxReadClockHz) {
+			counters.readClockViolations++;
+		}
+		uint8_t result = dataByte(data);
+		dataIndex++;
+		return result;
+	}
+
+	case Phase::IGNORE:
+	default:
+		break;
+	}
+	return 0xff;
+}
+
+void SpiFlashEmulator::startCommand(uint8_t opcode) {
+	size_t addrSize = addr4byte ? 4 : 3;
+
+	// The 4-byte address instructions always take a 4-byte address, but otherwise work the same
+	// as the 3-byte address instructions, in either address mode
+	if (config.supports4ByteInstructions) {
+		switch(opcode) {
+		case 0x13: opcode = 0x03; addrSize = 4; break; // READ4B
+		case 0x0c: opcode = 0x0b; addrSize = 4; break; // FAST_READ4B
+		case 0x12: opcode = 0x02; addrSize = 4; break; // PP4B
+		case 0x21: opcode = 0x20; addrSize = 4; break; // SE4B
+		case 0x5c: // BE32K4B
+			if (config.supports4ByteBlock32Erase) {
+				opcode = 0x52;
+				addrSize = 4;
+			}
+			break;
+		case 0xdc: opcode = 0xd8; addrSize = 4; break; // BE4B
+		default: break;
+		}
+	}
+
+	this->opcode = opcode;
+	addr = 0;
+	addrBytesRemaining = 0;
+	dummyBytesRemaining = 0;
+	dataIndex = 0;
+	phase = Phase::DATA;
+
+	if (deepPowerDown && opcode != 0xab) {
+		phase = Phase::IGNORE;
+		return;
+	}
+
+	bool isSuspend = (opcode == config.eraseSuspendInst && config.eraseSuspendInst != 0);
+	bool isResume = (opcode == config.eraseResumeInst && config.eraseResumeInst != 0);
+
+	if (isBusy() && opcode != 0x05 && !(isSuspend && busyIsErase && !suspended)) {
+		counters.busyViolations++;
+		phase = Phase::IGNORE;
+		return;
+	}
+
+	if (isSuspend || isResume) {
+		// Handled in finishCommand
+		return;
+	}
+
+	if (suspended) {
+		// Only reads are allowed while an erase is suspended
+		switch(opcode) {
+		case 0x03: case 0x0b: case 0x05: case 0x9f: case 0x15: case 0x06: case 0x04:
+			break;
+		default:
+			counters.busyViolations++;
+			phase = Phase::IGNORE;
+			return;
+		}
+	}
+
+	switch(opcode) {
+	case 0x03: // READ
+	case 0x02: // PP
+	case 0x20: // SE
+	case 0x52: // BE32
+	case 0xd8: // BE64
+		addrBytesRemaining = addrSize;
+		phase = Phase::ADDRESS;
+		break;
+
+	case 0x0b: // FAST_READ
+		addrBytesRemaining = addrSize;
+		dummyBytesRemaining = 1;
+		phase = Phase::ADDRESS;
+		break;
+
+	case 0x5a: // RDSFDP, always 3-byte address
+		addrBytesRemaining = 3;
+		dummyBytesRemaining = 1;
+		phase = Phase::ADDRESS;
+		break;
+
+	case 0x05: // RDSR
+		counters.statusReads++;
+		break;
+
+	case 0x9f: // RDID
+	case 0x15: // RDCR
+	case 0x01: // WRSR
+	case 0x06: // WREN
+	case 0x04: // WRDI
+	case 0xc7: // CE
+	case 0x60: // CE
+	case 0x66: // RSTEN
+	case 0x99: // RST
+	case 0xab: // RES
+	case 0xb9: // DP
+	case 0xb7: // EN4B
+	case 0xe9: // EX4B
+		break;
+
+	default:
+		phase = Phase::IGNORE;
+		break;
+	}
+
+	if (opcode == 0x02) {
+		for(size_t ii = 0; ii < config.pageSize; ii++) {
+			pageBufValid[ii] = false;
+		}
+	}
+}
+
+uint8_t SpiFlashEmulator::dataByte(uint8_t data) {
+	switch(opcode) {
+	case 0x03: // READ
+	case 0x0b: { // FAST_READ
+		size_t readAddr = (addr + dataIndex) % config.capacity;
+		if (suspended && readAddr >= eraseStart && readAddr < eraseStart + eraseSize) {
+			// Data in the region being erased is undefined
+			counters.suspendedRegionReads++;
+		}
+		counters.readBytes++;
+		return memory[readAddr];
+	}
+
+	case 0x5a: // RDSFDP
+		if (addr + dataIndex < sfdp.size()) {
+			return sfdp[addr + dataIndex];
+		}
+		break;
+
+	case 0x02: { // PP
+		// Page program wraps within the page
+		size_t offset = (addr + dataIndex) % config.pageSize;
+		pageBuf[offset] = data;
+		pageBufValid[offset] = true;
+		break;
+	}
+
+	case 0x05: { // RDSR
+		uint8_t result = status & ~STATUS_WIP;
+		if (isBusy()) {
+			result |= STATUS_WIP;
+		}
+		return result;
+	}
+
+	case 0x15: // RDCR
+		return addr4byte ? CONFIG_4BYTE : 0;
+
+	case 0x9f: // RDID
+		if (dataIndex < 3) {
+			return (uint8_t)(config.jedecId >> (8 * (2 - dataIndex)));
+		}
+		break;
+
+	case 0x01: // WRSR
+		if (dataIndex == 0) {
+			pageBuf[0] = data;
+		}
+		break;
+
+	default:
+		break;
+	}
+	return 0xff;
+}
+
+void SpiFlashEmulator::finishCommand() {
+	if (phase == Phase::IGNORE || phase == Phase::OPCODE) {
+		return;
+	}
+	bool addressComplete = (phase == Phase::DATA || phase == Phase::DUMMY);
+	bool wel = (status & STATUS_WEL) != 0;
+
+	if (opcode != 0x99) {
+		resetEnabled = false;
+	}
+
+	if (config.eraseSuspendInst != 0 && opcode == config.eraseSuspendInst) {
+		if (isBusy() && busyIsErase && !suspended) {
+			suspendedRemainingNs = busyUntilNs - HostClock::nowNs();
+			suspended = true;
+			counters.eraseSuspends++;
+			setBusy(config.timing.tSUS);
+		}
+		return;
+	}
+	if (config.eraseResumeInst != 0 && opcode == config.eraseResumeInst) {
+		if (suspended && !isBusy()) {
+			suspended = false;
+			busyUntilNs = HostClock::nowNs() + suspendedRemainingNs;
+			busyIsErase = true;
+		}
+		return;
+	}
+
+	switch(opcode) {
+	case 0x06: // WREN
+		status |= STATUS_WEL;
+		break;
+
+	case 0x04: // WRDI
+		status &= ~STATUS_WEL;
+		break;
+
+	case 0x01: // WRSR
+		if (dataIndex == 0) {
+			break;
+		}
+		if (!wel) {
+			counters.writeEnableViolations++;
+			break;
+		}
+		status = (status & (STATUS_WIP | STATUS_WEL)) | (pageBuf[0] & ~(STATUS_WIP | STATUS_WEL));
+		status &= ~STATUS_WEL;
+		setBusy(config.timing.tW);
+		break;
+
+	case 0x02: { // PP
+		if (phase != Phase::DATA || dataIndex == 0) {
+			break;
+		}
+		if (!wel) {
+			counters.writeEnableViolations++;
+			break;
+		}
+		size_t pageStart = addr - (addr % config.pageSize);
+		size_t count = 0;
+		for(size_t ii = 0; ii < config.pageSize; ii++) {
+			if (pageBufValid[ii]) {
+				// Programming can only change 1 bits to 0
+				memory[pageStart + ii] &= pageBuf[ii];
+				count++;
+			}
+		}
+		counters.pagePrograms++;
+		counters.programBytes += count;
+
+		uint32_t us = config.timing.tBP1 + (uint32_t)(count - 1) * config.timing.tBPn;
+		if (us > config.timing.tPP) {
+			us = config.timing.tPP;
+		}
+		status &= ~STATUS_WEL;
+		setBusy(us);
+		break;
+	}
+
+	case 0x20: // SE
+	case 0x52: // BE32
+	case 0xd8: // BE64
+	case 0xc7: // CE
+	case 0x60: { // CE
+		bool isChip = (opcode == 0xc7 || opcode == 0x60);
+		if (!isChip && !addressComplete) {
+			break;
+		}
+		if (!wel) {
+			counters.writeEnableViolations++;
+			break;
+		}
+		status &= ~STATUS_WEL;
+		eraseStart = addr;
+
+		if (opcode == 0x20) {
+			eraseRegion(addr, 4096);
+			counters.sectorErases++;
+			setBusy(config.timing.tSE);
+			eraseSize = 4096;
+		}
+		else
+		if (opcode == 0x52) {
+			eraseRegion(addr, 32768);
+			counters.block32Erases++;
+			setBusy(config.timing.tBE32);
+			eraseSize = 32768;
+		}
+		else
+		if (opcode == 0xd8) {
+			eraseRegion(addr, 65536);
+			counters.block64Erases++;
+			setBusy(config.timing.tBE64);
+			eraseSize = 65536;
+		}
+		else {
+			eraseRegion(0, config.capacity);
+			counters.chipErases++;
+			setBusy(config.timing.tCE);
+			eraseStart = 0;
+			eraseSize = config.capacity;
+		}
+		eraseStart -= eraseStart % eraseSize;
+		busyIsErase = true;
+		break;
+	}
+
+	case 0x66: // RSTEN
+		resetEnabled = true;
+		break;
+
+	case 0x99: // RST
+		if (resetEnabled) {
+			powerCycle();
+		}
+		break;
+
+	case 0xab: // RES
+		deepPowerDown = false;
+		break;
+
+	case 0xb9: // DP
+		deepPowerDown = true;
+		break;
+
+	case 0xb7: // EN4B
+		counters.addressModeSwitches++;
+		if (config.supports4ByteMode) {
+			addr4byte = true;
+		}
+		break;
+
+	case 0xe9: // EX4B
+		counters.addressModeSwitches++;
+		addr4byte = false;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void SpiFlashEmulator::setBusy(uint32_t us) {
+	busyUntilNs = HostClock::nowNs() + (uint64_t)us * 1000;
+	busyIsErase = false;
+}
+
+void SpiFlashEmulator::eraseRegion(size_t addr, size_t size) {
+	size_t start = addr - (addr % size);
+	memset(&memory[start], 0xff, size);
+
+	for(size_t ii = start; ii < start + size; ii += SECTOR_SIZE) {
+		sectorEraseCounts[ii / SECTOR_SIZE]++;
+	}
+}
+
+// Encodes a time as a count and units field as used in the SFDP basic flash parameter table
+static uint32_t sfdpTime(uint32_t value, const uint32_t *units, size_t numUnits, size_t countBits) {
+	for(size_t ii = 0; ii < numUnits; ii++) {
+		uint32_t count = (value + units[ii] - 1) / units[ii];
+		if (count == 0) {
+			count = 1;
+		}
+		if (count <= (1U << countBits) || ii == numUnits - 1) {
+			if (count > (1U << countBits)) {
+				count = 1U << countBits;
+			}
+			return (uint32_t)(ii << countBits) | (count - 1);
+		}
+	}
+	return 0;
+}
+
+void SpiFlashEmulator::buildSfdp() {
+	static const uint32_t eraseUnitsUs[4] = { 1000, 16000, 128000, 1000000 };
+	static const uint32_t chipEraseUnitsUs[4] = { 16000, 256000, 4000000, 64000000 };
+	static const uint32_t programUnitsUs[2] = { 8, 64 };
+	static const uint32_t byteUnitsUs[2] = { 1, 8 };
+
+	const size_t numDwords = 16;
+	uint32_t dw[numDwords];
+	for(size_t ii = 0; ii < numDwords; ii++) {
+		dw[ii] = 0xffffffff;
+	}
+
+	// 1: 4K erase supported with 0x20, 3-byte only or 3 or 4-byte addressing
+	uint32_t addressBytes = config.supports4ByteMode ? 1 : 0;
+	dw[0] = 0xff800000 | (addressBytes << 17) | (0x20 << 8) | 0x4 | 0x1;
+
+	// 2: density in bits
+	dw[1] = (uint32_t)(config.capacity * 8 - 1);
+
+	// 3-7: fast read modes (not supported, except 1-1-1)
+	dw[2] = dw[3] = 0;
+	dw[4] = 0xffffffee;
+	dw[5] = dw[6] = 0x0000ffff;
+
+	// 8-9: erase types 4K, 32K, 64K
+	dw[7] = (0x52 << 24) | (15 << 16) | (0x20 << 8) | 12;
+	dw[8] = (0x00 << 24) | (0 << 16) | (0xd8 << 8) | 16;
+
+	// 10: erase times, maximum is 8x typical (multiplier 3)
+	dw[9] = (sfdpTime(config.timing.tBE64, eraseUnitsUs, 4, 5) << 18) |
+		(sfdpTime(config.timing.tBE32, eraseUnitsUs, 4, 5) << 11) |
+		(sfdpTime(config.timing.tSE, eraseUnitsUs, 4, 5) << 4) | 3;
+
+	// 11: page size, program times (maximum is 6x typical, multiplier 2) and chip erase time
+	uint32_t pageSizeN = 0;
+	while(((size_t)1 << pageSizeN) < config.pageSize) {
+		pageSizeN++;
+	}
+	dw[10] = (sfdpTime(config.timing.tCE, chipEraseUnitsUs, 4, 5) << 24) |
+		(sfdpTime(config.timing.tBPn, byteUnitsUs, 2, 4) << 19) |
+		(sfdpTime(config.timing.tBP1, byteUnitsUs, 2, 4) << 14) |
+		(sfdpTime(config.timing.tPP, programUnitsUs, 2, 5) << 8) |
+		(pageSizeN << 4) | 2;
+
+	// 12-13: suspend and resume
+	if (config.eraseSuspendInst) {
+		dw[11] = 0x7fffffff;
+		dw[12] = ((uint32_t)config.eraseSuspendInst << 24) | ((uint32_t)config.eraseResumeInst << 16) |
+			((uint32_t)config.eraseSuspendInst << 8) | config.eraseResumeInst;
+	}
+
+	// 4-byte address instruction table: READ, FAST_READ, PP, and erase types 1-3 are supported, except
+	// erase type 2 (32K) if there's no 4-byte 32K block erase
+	const size_t numDwords4 = 2;
+	uint32_t dw4[numDwords4];
+	if (config.supports4ByteBlock32Erase) {
+		dw4[0] = 0xfff00000 | (0x7 << 9) | 0x40 | 0x2 | 0x1;
+		dw4[1] = 0xffdc5c21;
+	}
+	else {
+		dw4[0] = 0xfff00000 | (0x5 << 9) | 0x40 | 0x2 | 0x1;
+		dw4[1] = 0xffdcff21;
+	}
+
+	// SFDP header, parameter headers, basic flash parameter table at 0x30, 4-byte address instruction
+	// table after it
+	const size_t tableAddr = 0x30;
+	const size_t table4Addr = tableAddr + numDwords * 4;
+	sfdp.resize(table4Addr + numDwords4 * 4, 0xff);
+
+	const uint8_t header[24] = {
+		'S', 'F', 'D', 'P', 0x06, 0x01, (uint8_t)(config.supports4ByteInstructions ? 1 : 0), 0xff,
+		0x00, 0x06, 0x01, (uint8_t)numDwords, (uint8_t)tableAddr, 0x00, 0x00, 0xff,
+		0x84, 0x00, 0x01, (uint8_t)numDwords4, (uint8_t)table4Addr, 0x00, 0x00, 0xff
+	};
+	memcpy(sfdp.data(), header, sizeof(header));
+
+	for(size_t ii = 0; ii < numDwords; ii++) {
+		for(size_t jj = 0; jj < 4; jj++) {
+			sfdp[tableAddr + ii * 4 + jj] = (uint8_t)(dw[ii] >> (8 * jj));
+		}
+	}
+	for(size_t ii = 0; ii < numDwords4; ii++) {
+		for(size_t jj = 0; jj < 4; jj++) {
+			sfdp[table4Addr + ii * 4 + jj] = (uint8_t)(dw4[ii] >> (8 * jj));
+		}
+	}
+}
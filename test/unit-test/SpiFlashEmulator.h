@@ -0,0 +1,206 @@
+#ifndef __SPIFLASHEMULATOR_H
+#define __SPIFLASHEMULATOR_H
+
+#include "Particle.h"
+
+#include <vector>
+
+/**
+ * @brief Simulated SPI NOR flash chip for host unit tests and benchmarks
+ *
+ * Models the parts of a real NOR flash that matter to the driver: JEDEC ID, status register
+ * with WIP and WEL, page program with 1 to 0 semantics and wrap within the page, 4K/32K/64K/chip
+ * erase, 3 and 4-byte addressing (EN4B/EX4B), erase suspend and resume, and program and erase
+ * timing, and a JESD216B SFDP table generated from the configuration. While an operation is in
+ * progress WIP is set and all commands other than status reads are ignored, just like a real chip.
+ *
+ * Attach it to a simulated SPIClass with SPIClass::attach().
+ */
+class SpiFlashEmulator : public HostSpiDevice {
+public:
+	/**
+	 * @brief Operation timings in microseconds
+	 *
+	 * Page program time is tBP1 for the first byte plus tBPn for each additional byte, limited
+	 * to tPP, which is how the datasheets specify partial page programming.
+	 */
+	struct Timing {
+		uint32_t tBP1 = 30;
+		uint32_t tBPn = 3;
+		uint32_t tPP = 700;
+		uint32_t tSE = 45000;
+		uint32_t tBE32 = 120000;
+		uint32_t tBE64 = 150000;
+		uint32_t tCE = 5000000;
+		uint32_t tW = 10000;
+		uint32_t tSUS = 20;
+	};
+
+	/**
+	 * @brief Chip configuration
+	 */
+	struct Config {
+		uint32_t jedecId = 0xef4016;
+		size_t capacity = 4 * 1024 * 1024;
+		size_t pageSize = 256;
+		uint32_t maxClockHz = 104 * MHZ;
+		uint32_t maxReadClockHz = 50 * MHZ;
+		bool supports4ByteMode = false;
+		bool supports4ByteInstructions = false;
+		bool supports4ByteBlock32Erase = true;
+		uint8_t eraseSuspendInst = 0;
+		uint8_t eraseResumeInst = 0;
+		bool hasSfdp = true;
+		Timing timing;
+	};
+
+	/**
+	 * @brief Counters that are incremented as the chip is used
+	 *
+	 * Use the difference between two snapshots to measure a single API call.
+	 */
+	struct Counters {
+		uint64_t csAssertions = 0;
+		uint64_t bytes = 0;
+		uint64_t statusReads = 0;
+		uint64_t readBytes = 0;
+		uint64_t pagePrograms = 0;
+		uint64_t programBytes = 0;
+		uint64_t sectorErases = 0;
+		uint64_t block32Erases = 0;
+		uint64_t block64Erases = 0;
+		uint64_t chipErases = 0;
+		uint64_t busyViolations = 0;
+		uint64_t writeEnableViolations = 0;
+		uint64_t readClockViolations = 0;
+		uint64_t clockViolations = 0;
+		uint64_t eraseSuspends = 0;
+		uint64_t suspendedRegionReads = 0;
+		uint64_t addressModeSwitches = 0;
+
+		Counters operator-(const Counters &other) const;
+	};
+
+	SpiFlashEmulator(const Config &config);
+	virtual ~SpiFlashEmulator();
+
+	/**
+	 * @brief Winbond W25Q32JV, 4 Mbyte
+	 */
+	static Config winbondW25Q32();
+
+	/**
+	 * @brief ISSI IS25LQ080, 1 Mbyte
+	 */
+	static Config issiIS25LQ080();
+
+	/**
+	 * @brief Macronix MX25L8006E, 1 Mbyte
+	 */
+	static Config macronixMX25L8006E();
+
+	/**
+	 * @brief Macronix MX25L25645G, 32 Mbyte, requires 4-byte addressing mode or the 4-byte address instructions
+	 */
+	static Config macronixMX25L25645G();
+
+	/**
+	 * @brief Winbond W25Q256JV, 32 Mbyte, has the 4-byte address instructions except the 32K block erase (0x5C)
+	 */
+	static Config winbondW25Q256();
+
+	virtual void select();
+	virtual void deselect();
+	virtual uint8_t transferByte(uint8_t data, uint32_t clockHz);
+
+	/**
+	 * @brief Returns true if a program or erase is in progress
+	 */
+	bool isBusy() const;
+
+	/**
+	 * @brief Returns true if an erase is suspended
+	 */
+	bool isSuspended() const { return suspended; };
+
+	/**
+	 * @brief Advances simulated time until the current operation completes
+	 */
+	void completeOperation();
+
+	/**
+	 * @brief Power cycle the chip. Any operation in progress is aborted and volatile state is reset.
+	 */
+	void powerCycle();
+
+	/**
+	 * @brief Direct access to the simulated memory array, for verifying tests
+	 */
+	uint8_t *getMemory() { return memory.data(); };
+
+	size_t getCapacity() const { return config.capacity; };
+
+	bool is4ByteMode() const { return addr4byte; };
+
+	const Config &getConfig() const { return config; };
+
+	const Counters &getCounters() const { return counters; };
+
+	/**
+	 * @brief Number of times the 4K sector containing addr has been erased
+	 */
+	uint32_t getSectorEraseCount(size_t addr) const;
+
+	static const size_t SECTOR_SIZE = 4096;
+
+protected:
+	enum class Phase {
+		OPCODE,
+		ADDRESS,
+		DUMMY,
+		DATA,
+		IGNORE
+	};
+
+	void startCommand(uint8_t opcode);
+	uint8_t dataByte(uint8_t data);
+	void finishCommand();
+	void setBusy(uint32_t us);
+	void eraseRegion(size_t addr, size_t size);
+	void buildSfdp();
+
+	Config config;
+	std::vector<uint8_t> memory;
+	std::vector<uint32_t> sectorEraseCounts;
+	std::vector<uint8_t> sfdp;
+
+	Counters counters;
+
+	uint8_t status = 0;
+	bool addr4byte = false;
+	bool deepPowerDown = false;
+	bool resetEnabled = false;
+	uint64_t busyUntilNs = 0;
+	bool busyIsErase = false;
+	size_t eraseStart = 0;
+	size_t eraseSize = 0;
+	bool suspended = false;
+	uint64_t suspendedRemainingNs = 0;
+
+	// Current transaction
+	bool selected = false;
+	Phase phase = Phase::IGNORE;
+	uint8_t opcode = 0;
+	size_t addrBytesRemaining = 0;
+	size_t dummyBytesRemaining = 0;
+	size_t addr = 0;
+	size_t dataIndex = 0;
+	std::vector<uint8_t> pageBuf;
+	std::vector<bool> pageBufValid;
+
+	static const uint8_t STATUS_WIP = 0x01;
+	static const uint8_t STATUS_WEL = 0x02;
+	static const uint8_t CONFIG_4BYTE = 0x20;
+};
+
+#endif /* __SPIFLASHEMULATOR_H */
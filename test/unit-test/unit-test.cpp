@@ -0,0 +1,2819 @@
+// Host unit tests and benchmarks for SpiFlashRK, run against SpiFlashEmulator
+//
+// The tests mirror examples/1-unittest-SpiFlashRK, but run on Linux or Mac without hardware.
+// The benchmarks report simulated time, bytes on the wire, and CS assertions for each API call.
+
+#include "Particle.h"
+
+#include "SpiFlashRK.h"
+#include "SpiFlashWearLevel.h"
+#include "SpiFlashLog.h"
+#include "SpiFlashKV.h"
+#include "SpiFlashBatch.h"
+#include "SpiFlashStriped.h"
+#include "SpiFlashStream.h"
+#include "SpiFlashSha256.h"
+#include "SpiFlashCompress.h"
+#include "SpiFlashEmulator.h"
+
+#include <thread>
+
+static int failureCount = 0;
+
+#define assertTrue(x) \
+	do { \
+		if (!(x)) { \
+			printf("assertion failed line %d: %s\n", __LINE__, #x); \
+			failureCount++; \
+		} \
+	} while(0)
+
+#define assertEqual(a, b) \
+	do { \
+		unsigned long long _a = (unsigned long long)(a); \
+		unsigned long long _b = (unsigned long long)(b); \
+		if (_a != _b) { \
+			printf("assertion failed line %d: %s (%llu) == %s (%llu)\n", __LINE__, #a, _a, #b, _b); \
+			failureCount++; \
+		} \
+	} while(0)
+
+/**
+ * @brief A simulated chip attached to SPI with a flash driver object of type T
+ */
+template<class T>
+class Fixture {
+public:
+	Fixture(const SpiFlashEmulator::Config &config) : chip(config), flash(SPI, A2) {
+		SPI.attach(&chip, A2);
+		flash.begin();
+	}
+	~Fixture() {
+		SPI.detach(&chip);
+	}
+
+	SpiFlashEmulator chip;
+	T flash;
+};
+
+/**
+ * @brief Measures the simulated cost of an API call
+ */
+class Measure {
+public:
+	Measure(SpiFlashEmulator &chip) : chip(chip) {
+		start();
+	}
+
+	void start() {
+		startNs = HostClock::nowNs();
+		startCounters = chip.getCounters();
+	}
+
+	uint64_t elapsedNs() const {
+		return HostClock::nowNs() - startNs;
+	}
+
+	SpiFlashEmulator::Counters counters() const {
+		return chip.getCounters() - startCounters;
+	}
+
+	void report(const char *desc) const {
+		SpiFlashEmulator::Counters c = counters();
+		printf("%-40s %12.3f ms %10llu bytes %7llu cs %7llu rdsr\n", desc, (double)elapsedNs() / 1000000.0,
+			(unsigned long long)c.bytes, (unsigned long long)c.csAssertions, (unsigned long long)c.statusReads);
+	}
+
+	SpiFlashEmulator &chip;
+	uint64_t startNs;
+	SpiFlashEmulator::Counters startCounters;
+};
+
+static uint8_t buf1[256];
+static uint8_t buf2[65536];
+
+template<class T>
+static void testBasic(const SpiFlashEmulator::Config &config) {
+	Fixture<T> fixture(config);
+	T &spiFlash = fixture.flash;
+
+	assertEqual(spiFlash.jedecIdRead(), config.jedecId);
+	assertTrue(spiFlash.isValid());
+
+	spiFlash.chipErase();
+	assertTrue(!fixture.chip.isBusy());
+
+	// Make sure it's erased
+	spiFlash.readData(0, buf1, 256);
+	for(size_t ii = 0; ii < 256; ii++) {
+		assertEqual(buf1[ii], 0xff);
+	}
+
+	// Write a whole page
+	for(size_t ii = 0; ii < 256; ii++) {
+		buf1[ii] = (uint8_t)ii;
+	}
+	spiFlash.writeData(0, buf1, sizeof(buf1));
+
+	memset(buf1, 0, sizeof(buf1));
+	spiFlash.readData(0, buf1, 256);
+	for(size_t ii = 0; ii < 256; ii++) {
+		assertEqual(buf1[ii], ii);
+	}
+
+	// Write a page one byte at a time
+	for(size_t ii = 0; ii < 256; ii++) {
+		uint8_t temp = (uint8_t)ii;
+		spiFlash.writeData(256 + ii, &temp, 1);
+	}
+	for(size_t ii = 0; ii < 256; ii++) {
+		uint8_t temp = 0;
+		spiFlash.readData(256 + ii, &temp, 1);
+		assertEqual(temp, ii);
+	}
+
+	// Write and read across a page boundary
+	for(size_t ii = 0; ii < 256; ii++) {
+		buf1[ii] = (uint8_t)ii;
+	}
+	spiFlash.writeData(640, buf1, sizeof(buf1));
+	assertEqual(memcmp(&fixture.chip.getMemory()[640], buf1, sizeof(buf1)), 0);
+
+	memset(buf1, 0, sizeof(buf1));
+	spiFlash.readData(640, buf1, sizeof(buf1));
+	for(size_t ii = 0; ii < 256; ii++) {
+		assertEqual(buf1[ii], ii);
+	}
+
+	// Programming can only change 1 bits to 0
+	uint8_t temp = 0xf0;
+	spiFlash.writeData(2048, &temp, 1);
+	temp = 0x3c;
+	spiFlash.writeData(2048, &temp, 1);
+	spiFlash.readData(2048, &temp, 1);
+	assertEqual(temp, 0x30);
+
+	// Write 4K at 4096 and 8192, then erase the sector at 8192
+	srand(0);
+	for(size_t ii = 0; ii < 8192; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+	spiFlash.writeData(4096, buf2, 8192);
+	assertEqual(memcmp(&fixture.chip.getMemory()[4096], buf2, 8192), 0);
+
+	spiFlash.sectorErase(8192);
+	assertTrue(!fixture.chip.isBusy());
+	assertEqual(memcmp(&fixture.chip.getMemory()[4096], buf2, 4096), 0);
+	for(size_t ii = 8192; ii < 12288; ii++) {
+		assertEqual(fixture.chip.getMemory()[ii], 0xff);
+	}
+
+	// Block erase clears the whole 64K block
+	spiFlash.blockErase(0);
+	assertTrue(!fixture.chip.isBusy());
+	for(size_t ii = 0; ii < 65536; ii++) {
+		assertEqual(fixture.chip.getMemory()[ii], 0xff);
+	}
+
+	assertEqual(fixture.chip.getCounters().busyViolations, 0);
+	assertEqual(fixture.chip.getCounters().writeEnableViolations, 0);
+}
+
+static void test4ByteAddressing() {
+	Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L25645G());
+	SpiFlashMacronix &spiFlash = fixture.flash;
+
+	assertTrue(spiFlash.set4ByteAddressing(true));
+	assertTrue(fixture.chip.is4ByteMode());
+
+	const size_t addr = 20 * 1024 * 1024 + 100;
+	for(size_t ii = 0; ii < 256; ii++) {
+		buf1[ii] = (uint8_t)(ii ^ 0x5a);
+	}
+	spiFlash.writeData(addr, buf1, sizeof(buf1));
+	assertEqual(memcmp(&fixture.chip.getMemory()[addr], buf1, sizeof(buf1)), 0);
+
+	memset(buf1, 0, sizeof(buf1));
+	spiFlash.readData(addr, buf1, sizeof(buf1));
+	for(size_t ii = 0; ii < 256; ii++) {
+		assertEqual(buf1[ii], ii ^ 0x5a);
+	}
+
+	// Addresses above 16 Mbyte must not alias to the bottom of the chip
+	assertEqual(fixture.chip.getMemory()[addr - 16 * 1024 * 1024], 0xff);
+
+	spiFlash.sectorErase(addr - 100);
+	assertEqual(fixture.chip.getMemory()[addr], 0xff);
+
+	assertTrue(spiFlash.set4ByteAddressing(false));
+	assertTrue(!fixture.chip.is4ByteMode());
+}
+
+static void test4ByteInstructions() {
+	Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L25645G());
+	SpiFlashMacronix &spiFlash = fixture.flash;
+	spiFlash.withNative4ByteAddressing();
+
+	const size_t addr = 20 * 1024 * 1024 + 100;
+	for(size_t ii = 0; ii < 256; ii++) {
+		buf1[ii] = (uint8_t)(ii ^ 0x3c);
+	}
+	spiFlash.writeData(addr, buf1, sizeof(buf1));
+	assertEqual(memcmp(&fixture.chip.getMemory()[addr], buf1, sizeof(buf1)), 0);
+	assertEqual(fixture.chip.getMemory()[addr - 16 * 1024 * 1024], 0xff);
+
+	// A reset puts the chip back in 3-byte addressing mode, which doesn't affect the 4-byte address instructions
+	fixture.chip.powerCycle();
+
+	for(int fastRead = 0; fastRead < 2; fastRead++) {
+		spiFlash.withFastRead(fastRead != 0);
+		memset(buf1, 0, sizeof(buf1));
+		spiFlash.readData(addr, buf1, sizeof(buf1));
+		for(size_t ii = 0; ii < 256; ii++) {
+			assertEqual(buf1[ii], ii ^ 0x3c);
+		}
+	}
+
+	fixture.chip.powerCycle();
+	spiFlash.sectorErase(addr - 100);
+	assertEqual(fixture.chip.getMemory()[addr], 0xff);
+	assertEqual(fixture.chip.getMemory()[addr - 16 * 1024 * 1024 - 100 + 4096], 0xff);
+
+	fixture.chip.getMemory()[addr] = 0;
+	spiFlash.block32Erase(addr - 100);
+	assertEqual(fixture.chip.getMemory()[addr], 0xff);
+
+	fixture.chip.getMemory()[addr] = 0;
+	spiFlash.blockErase(addr - 100);
+	assertEqual(fixture.chip.getMemory()[addr], 0xff);
+
+	// Same transaction count as 3-byte addresses, with no mode switches
+	const SpiFlashEmulator::Counters &counters = fixture.chip.getCounters();
+	assertEqual(counters.sectorErases, 1);
+	assertEqual(counters.block32Erases, 1);
+	assertEqual(counters.block64Erases, 1);
+	assertEqual(counters.addressModeSwitches, 0);
+	assertEqual(counters.busyViolations, 0);
+	assertEqual(counters.writeEnableViolations, 0);
+	assertTrue(!fixture.chip.is4ByteMode());
+
+	// The W25Q256 has no 4-byte address 32K block erase (0x5C), so it's not used, from the chip table or SFDP
+	for(int sfdp = 0; sfdp < 2; sfdp++) {
+		SpiFlashEmulator chip(SpiFlashEmulator::winbondW25Q256());
+		SPI.attach(&chip, A2);
+		SpiFlash *flash;
+		if (sfdp) {
+			flash = new SpiFlashWinbond(SPI, A2);
+			flash->withSfdp().begin();
+			assertTrue(flash->hasSfdp());
+		}
+		else {
+			flash = SpiFlash::detect(SPI, A2);
+		}
+		assertTrue(flash != NULL);
+		if (flash) {
+			assertTrue(flash->getNative4ByteAddressing());
+			assertTrue(!chip.is4ByteMode());
+
+			// 32K then 64K, above 16 Mbyte
+			const size_t eraseAddr = 20 * 1024 * 1024 + 32768;
+			const size_t eraseLen = 32768 + 65536;
+			memset(&chip.getMemory()[eraseAddr], 0, eraseLen);
+			Measure m(chip);
+			assertTrue(flash->eraseRange(eraseAddr, eraseLen));
+			for(size_t ii = 0; ii < eraseLen; ii++) {
+				assertEqual(chip.getMemory()[eraseAddr + ii], 0xff);
+			}
+			assertEqual(m.counters().block32Erases, 0);
+			assertEqual(m.counters().block64Erases, 1);
+			assertEqual(m.counters().sectorErases, 8);
+
+			chip.getMemory()[eraseAddr] = 0;
+			m.start();
+			flash->block32Erase(eraseAddr);
+			assertEqual(chip.getMemory()[eraseAddr], 0xff);
+			assertEqual(m.counters().block32Erases, 0);
+			assertEqual(m.counters().sectorErases, 8);
+			delete flash;
+		}
+		SPI.detach(&chip);
+	}
+}
+
+static void testReadData() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+
+	srand(1);
+	for(size_t ii = 0; ii < 65536; ii++) {
+		fixture.chip.getMemory()[1000 + ii] = (uint8_t) rand();
+	}
+
+	// A long unaligned read is a single command and transaction
+	Measure m(fixture.chip);
+	spiFlash.readData(1000, buf2, 65536);
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(m.counters().bytes, 4 + 65536);
+	assertEqual(memcmp(buf2, &fixture.chip.getMemory()[1000], 65536), 0);
+
+	// Split into multiple transfers, but still one transaction
+	memset(buf2, 0, 65536);
+	spiFlash.withMaxTransferSize(1000);
+	m.start();
+	spiFlash.readData(1000, buf2, 65536);
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(memcmp(buf2, &fixture.chip.getMemory()[1000], 65536), 0);
+
+	// 0 is the default rather than a read that never finishes
+	spiFlash.withMaxTransferSize(0);
+	memset(buf2, 0, 1024);
+	spiFlash.readData(1000, buf2, 1024);
+	assertEqual(memcmp(buf2, &fixture.chip.getMemory()[1000], 1024), 0);
+
+	// READ is too slow for 80 MHz, FAST_READ is not
+	spiFlash.withSpiClockSpeedMHz(80);
+	m.start();
+	spiFlash.readData(1000, buf2, 16);
+	assertTrue(m.counters().readClockViolations > 0);
+
+	memset(buf2, 0, 65536);
+	spiFlash.withFastRead();
+	m.start();
+	spiFlash.readData(1000, buf2, 65536);
+	assertEqual(m.counters().readClockViolations, 0);
+	assertEqual(m.counters().bytes, 5 + 65536);
+	assertEqual(memcmp(buf2, &fixture.chip.getMemory()[1000], 65536), 0);
+
+	// Zero-length reads do nothing
+	m.start();
+	spiFlash.readData(0, buf2, 0);
+	assertEqual(m.counters().csAssertions, 0);
+}
+
+static void testAsync() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+
+	srand(2);
+	for(size_t ii = 0; ii < 8192; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	// Unaligned multi-page write
+	int callbackCount = 0;
+	bool callbackSuccess = false;
+	assertTrue(spiFlash.writeDataAsync(100, buf2, 8192, [&](bool success) {
+		callbackCount++;
+		callbackSuccess = success;
+	}));
+	assertTrue(spiFlash.isBusy());
+	assertTrue(!spiFlash.readDataAsync(0, buf1, 1));
+
+	// Simulates the application loop doing 10 microseconds of other work between calls to poll
+	size_t loopCount = 0;
+	while(spiFlash.isBusy()) {
+		delayMicroseconds(10);
+		spiFlash.poll();
+		loopCount++;
+	}
+	assertEqual(callbackCount, 1);
+	assertTrue(callbackSuccess);
+	assertTrue(loopCount > 100);
+	assertEqual(memcmp(&fixture.chip.getMemory()[100], buf2, 8192), 0);
+
+	// Read it back in chunks smaller than the data so multiple DMA transfers are needed
+	static uint8_t readBuf[8192];
+	spiFlash.withMaxTransferSize(1000);
+	callbackCount = 0;
+	Measure m(fixture.chip);
+	assertTrue(spiFlash.readDataAsync(100, readBuf, sizeof(readBuf), [&](bool success) {
+		callbackCount++;
+		callbackSuccess = success;
+	}));
+	loopCount = 0;
+	while(spiFlash.isBusy()) {
+		delayMicroseconds(10);
+		spiFlash.poll();
+		loopCount++;
+	}
+	assertEqual(callbackCount, 1);
+	assertTrue(callbackSuccess);
+	assertTrue(loopCount > 9);
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(memcmp(readBuf, buf2, sizeof(readBuf)), 0);
+	assertEqual(SPI.getDmaWaitCount(), 0);
+
+	// A read waits for an erase started by startSectorErase() instead of reading the busy chip
+	m.start();
+	assertTrue(spiFlash.startSectorErase(12288));
+	memset(readBuf, 0, 256);
+	assertTrue(spiFlash.readDataAsync(100, readBuf, 256));
+	while(spiFlash.isBusy()) {
+		delayMicroseconds(10);
+		spiFlash.poll();
+	}
+	assertEqual(memcmp(readBuf, buf2, 256), 0);
+	assertEqual(m.counters().sectorErases, 1);
+	assertEqual(m.counters().busyViolations, 0);
+}
+
+static void testEraseAsync() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+
+	memset(fixture.chip.getMemory(), 0, 131072);
+
+	int callbackCount = 0;
+	bool callbackSuccess = false;
+	auto callback = [&](bool success) {
+		callbackCount++;
+		callbackSuccess = success;
+	};
+
+	// Sector erase, polled once per millisecond
+	assertTrue(spiFlash.sectorEraseAsync(4096, callback));
+	assertTrue(spiFlash.isBusy());
+	assertTrue(!spiFlash.blockEraseAsync(0));
+	assertEqual(spiFlash.getAsyncProgress(), 0);
+
+	int lastProgress = 0;
+	size_t loopCount = 0;
+	while(spiFlash.isBusy()) {
+		delay(1);
+		spiFlash.poll();
+		if (spiFlash.isBusy()) {
+			assertTrue(spiFlash.getAsyncProgress() >= lastProgress);
+			assertTrue(spiFlash.getAsyncProgress() <= 99);
+			lastProgress = spiFlash.getAsyncProgress();
+		}
+		loopCount++;
+	}
+	assertEqual(callbackCount, 1);
+	assertTrue(callbackSuccess);
+	assertTrue(lastProgress > 90);
+	assertTrue(loopCount >= 45 && loopCount <= 47);
+	assertEqual(spiFlash.getAsyncProgress(), 100);
+	assertEqual(fixture.chip.getMemory()[4095], 0);
+	assertEqual(fixture.chip.getMemory()[4096], 0xff);
+	assertEqual(fixture.chip.getMemory()[8191], 0xff);
+	assertEqual(fixture.chip.getMemory()[8192], 0);
+
+	// Block erase
+	assertTrue(spiFlash.blockEraseAsync(65536, callback));
+	while(spiFlash.isBusy()) {
+		delay(10);
+		spiFlash.poll();
+	}
+	assertEqual(callbackCount, 2);
+	assertEqual(fixture.chip.getCounters().block64Erases, 1);
+	assertEqual(fixture.chip.getMemory()[65535], 0);
+	assertEqual(fixture.chip.getMemory()[65536], 0xff);
+	assertEqual(fixture.chip.getMemory()[131071], 0xff);
+
+	// Chip erase
+	assertTrue(spiFlash.chipEraseAsync(callback));
+	while(spiFlash.isBusy()) {
+		delay(100);
+		spiFlash.poll();
+	}
+	assertEqual(callbackCount, 3);
+	assertTrue(callbackSuccess);
+	assertEqual(fixture.chip.getCounters().chipErases, 1);
+	assertEqual(fixture.chip.getMemory()[0], 0xff);
+}
+
+static void testEraseSuspend() {
+	{
+		Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+		SpiFlashWinbond &spiFlash = fixture.flash;
+		assertTrue(spiFlash.isEraseSuspendSupported());
+
+		memset(fixture.chip.getMemory(), 0, 131072);
+		fixture.chip.getMemory()[70000] = 0x5a;
+
+		unsigned long startMs = millis();
+		assertTrue(spiFlash.blockEraseAsync(0));
+		delay(20);
+		spiFlash.poll();
+
+		// Read from outside the block being erased
+		uint64_t startNs = HostClock::nowNs();
+		uint8_t temp = 0;
+		spiFlash.readData(70000, &temp, 1);
+		uint64_t readNs = HostClock::nowNs() - startNs;
+		assertEqual(temp, 0x5a);
+		assertTrue(readNs < 100000);
+		assertEqual(fixture.chip.getCounters().eraseSuspends, 1);
+		assertTrue(!fixture.chip.isSuspended());
+
+		// Several more reads during the erase
+		for(size_t ii = 0; ii < 5; ii++) {
+			delay(10);
+			spiFlash.poll();
+			spiFlash.readData(70000, &temp, 1);
+			assertEqual(temp, 0x5a);
+		}
+		assertEqual(fixture.chip.getCounters().eraseSuspends, 6);
+
+		while(spiFlash.isBusy()) {
+			delay(1);
+			spiFlash.poll();
+		}
+		assertTrue(millis() - startMs >= 150);
+		assertTrue(millis() - startMs <= 152);
+		assertEqual(fixture.chip.getMemory()[65535], 0xff);
+		assertEqual(fixture.chip.getCounters().busyViolations, 0);
+		assertEqual(fixture.chip.getCounters().suspendedRegionReads, 0);
+	}
+	{
+		// MX25L8006E does not support suspend, so the read waits for the erase
+		Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L8006E());
+		SpiFlashMacronix &spiFlash = fixture.flash;
+
+		memset(fixture.chip.getMemory(), 0, 131072);
+		fixture.chip.getMemory()[70000] = 0x5a;
+
+		assertTrue(spiFlash.sectorEraseAsync(0));
+		delay(20);
+		spiFlash.poll();
+
+		uint8_t temp = 0;
+		spiFlash.readData(70000, &temp, 1);
+		assertEqual(temp, 0x5a);
+		assertTrue(!fixture.chip.isBusy());
+		assertEqual(fixture.chip.getCounters().eraseSuspends, 0);
+		// Only the suspend command is ignored
+		assertEqual(fixture.chip.getCounters().busyViolations, 1);
+
+		spiFlash.poll();
+		assertTrue(!spiFlash.isBusy());
+	}
+}
+
+static void testEraseRange() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	// Not sector aligned
+	assertTrue(!spiFlash.eraseRange(100, 4096));
+	assertTrue(!spiFlash.eraseRange(4096, 100));
+
+	// 7 sectors up to 32K, a 32K block, then a 32K block because there isn't a full 64K left
+	memset(mem, 0, 262144);
+	Measure m(fixture.chip);
+	assertTrue(spiFlash.eraseRange(4096, 94208));
+	assertEqual(m.counters().sectorErases, 7);
+	assertEqual(m.counters().block32Erases, 2);
+	assertEqual(m.counters().block64Erases, 0);
+	assertEqual(mem[4095], 0);
+	assertEqual(mem[4096], 0xff);
+	assertEqual(mem[98303], 0xff);
+	assertEqual(mem[98304], 0);
+
+	// 1 Mbyte is 16 block erases
+	m.start();
+	assertTrue(spiFlash.eraseRange(0, 1024 * 1024));
+	assertEqual(m.counters().block64Erases, 16);
+	assertEqual(m.counters().sectorErases + m.counters().block32Erases, 0);
+
+	// Whole chip uses chip erase once the capacity is known
+	m.start();
+	spiFlash.eraseRange(0, fixture.chip.getCapacity());
+	assertEqual(m.counters().chipErases, 0);
+
+	spiFlash.withCapacity(fixture.chip.getCapacity());
+	m.start();
+	spiFlash.eraseRange(0, fixture.chip.getCapacity());
+	assertEqual(m.counters().chipErases, 1);
+	assertEqual(m.counters().block64Erases, 0);
+}
+
+static void testAdaptivePolling() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	const SpiFlashEmulator::Timing &timing = fixture.chip.getConfig().timing;
+
+	srand(3);
+	for(size_t ii = 0; ii < 16384; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	// Continuous polling, as in earlier versions
+	spiFlash.withAdaptivePolling(false);
+	Measure m(fixture.chip);
+	spiFlash.writeData(0, buf2, 8192);
+	uint64_t legacyNs = m.elapsedNs();
+	uint64_t legacyStatusReads = m.counters().statusReads;
+
+	m.start();
+	spiFlash.sectorErase(65536);
+	uint64_t legacyEraseStatusReads = m.counters().statusReads;
+
+	// Nothing is known about page program time yet, but the backoff still saves most status reads
+	spiFlash.withAdaptivePolling(true);
+	assertEqual(spiFlash.getExpectedTimeUs(SpiFlash::WRITE_OP_PAGE_PROGRAM), 0);
+	m.start();
+	spiFlash.writeData(8192, buf2, 8192);
+	assertTrue(m.counters().statusReads * 4 < legacyStatusReads);
+	assertEqual(memcmp(&fixture.chip.getMemory()[8192], buf2, 8192), 0);
+
+	// Learned from the actual page program time on this chip
+	unsigned long expectedUs = spiFlash.getExpectedTimeUs(SpiFlash::WRITE_OP_PAGE_PROGRAM);
+	assertTrue(expectedUs >= timing.tPP && expectedUs < timing.tPP * 11 / 10);
+
+	// Once learned, far fewer status reads with little extra latency
+	m.start();
+	spiFlash.writeData(16384, buf2, 8192);
+	assertTrue(m.counters().statusReads * 8 < legacyStatusReads);
+	assertTrue(m.elapsedNs() < legacyNs * 102 / 100);
+	assertEqual(memcmp(&fixture.chip.getMemory()[16384], buf2, 8192), 0);
+
+	// Partial page writes are not slowed down by the full page estimate
+	m.start();
+	for(size_t ii = 0; ii < 64; ii++) {
+		spiFlash.writeData(32768 + ii, &buf2[ii], 1);
+	}
+	assertTrue(m.elapsedNs() < 64 * (timing.tBP1 + 20) * 1000);
+	assertEqual(spiFlash.getExpectedTimeUs(SpiFlash::WRITE_OP_PAGE_PROGRAM), expectedUs);
+
+	// Sector erase starts from the datasheet typical time and learns the actual time
+	assertEqual(spiFlash.getExpectedTimeUs(SpiFlash::WRITE_OP_SECTOR_ERASE), 45000);
+	for(size_t ii = 0; ii < 4; ii++) {
+		m.start();
+		spiFlash.sectorErase(ii * 4096);
+		assertTrue(m.counters().statusReads * 100 < legacyEraseStatusReads);
+		assertTrue(m.elapsedNs() < (uint64_t)timing.tSE * 1000 * 102 / 100);
+	}
+	expectedUs = spiFlash.getExpectedTimeUs(SpiFlash::WRITE_OP_SECTOR_ERASE);
+	assertTrue(expectedUs >= timing.tSE && expectedUs < timing.tSE * 102 / 100);
+
+	// Asynchronous erase skips status reads until near the expected time
+	bool done = false;
+	m.start();
+	assertTrue(spiFlash.sectorEraseAsync(65536, [&](bool success) {
+		done = success;
+	}));
+	while(spiFlash.isBusy()) {
+		delayMicroseconds(10);
+		spiFlash.poll();
+	}
+	assertTrue(done);
+	assertTrue(m.counters().statusReads < 50);
+	assertTrue(m.elapsedNs() < (uint64_t)timing.tSE * 1000 * 102 / 100);
+}
+
+static void testUpdateData() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	// Requires a sector cache
+	assertTrue(!spiFlash.updateData(0, buf1, 4));
+	spiFlash.withSectorCache(2);
+
+	memset(mem, 0x55, 3 * 4096);
+
+	// 100 updates of a 4-byte record, setting bits to 1, only erase the sector once on flush
+	Measure m(fixture.chip);
+	for(uint32_t ii = 0; ii < 100; ii++) {
+		uint32_t value = 0xffff0000 | ii;
+		assertTrue(spiFlash.updateData(100, &value, sizeof(value)));
+	}
+	assertEqual(m.counters().sectorErases, 0);
+	assertEqual(m.counters().pagePrograms, 0);
+	assertTrue(spiFlash.hasUnflushedData());
+
+	// Reads see the updated data before it's flushed, and reads within the sector come from the cache
+	uint32_t value = 0;
+	m.start();
+	spiFlash.readData(100, &value, sizeof(value));
+	assertEqual(value, 0xffff0063);
+	assertEqual(m.counters().csAssertions, 0);
+
+	// Reads that span sectors read the chip and then apply the update
+	spiFlash.readData(4094, buf1, 4);
+	assertEqual(buf1[0], 0x55);
+	spiFlash.readData(96, buf1, 8);
+	assertEqual(buf1[0], 0x55);
+	assertEqual(buf1[4], 0x63);
+	assertEqual(buf1[7], 0xff);
+
+	m.start();
+	spiFlash.flush();
+	assertTrue(!spiFlash.hasUnflushedData());
+	assertEqual(m.counters().sectorErases, 1);
+	assertEqual(m.counters().pagePrograms, 16);
+	assertEqual(mem[100], 0x63);
+	assertEqual(mem[103], 0xff);
+	assertEqual(mem[99], 0x55);
+	assertEqual(mem[4095], 0x55);
+
+	// Only clearing bits programs the changed page without erasing
+	value = 0x11111111;
+	spiFlash.updateData(4096 + 300, &value, sizeof(value));
+	m.start();
+	spiFlash.flush();
+	assertEqual(m.counters().sectorErases, 0);
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(mem[4096 + 300], 0x11);
+
+	// A third sector evicts the least recently used one (sector 0, as sector 1 was updated later)
+	value = 0xaaaaaaaa;
+	spiFlash.updateData(0, &value, sizeof(value));
+	spiFlash.updateData(4096, &value, sizeof(value));
+	m.start();
+	spiFlash.updateData(8192, &value, sizeof(value));
+	assertEqual(m.counters().sectorErases, 1);
+	assertEqual(fixture.chip.getSectorEraseCount(0), 2);
+	assertEqual(mem[0], 0xaa);
+	assertEqual(mem[4096], 0x55);
+
+	// writeData flushes the sector first so the write isn't lost
+	buf1[0] = 0x0f;
+	spiFlash.writeData(4097, buf1, 1);
+	assertEqual(mem[4096], 0xaa);
+	assertEqual(mem[4097], 0x0a);
+
+	// Erase discards the pending update
+	spiFlash.sectorErase(8192);
+	assertTrue(!spiFlash.hasUnflushedData());
+	spiFlash.readData(8192, buf1, 4);
+	assertEqual(buf1[0], 0xff);
+
+	// Multi-sector update
+	memset(buf2, 0x33, 6000);
+	assertTrue(spiFlash.updateData(1000, buf2, 6000));
+	spiFlash.flush();
+	assertEqual(mem[3], 0xaa);
+	assertEqual(mem[999], 0x55);
+	assertEqual(mem[1000], 0x33);
+	assertEqual(mem[6999], 0x33);
+	assertEqual(mem[7000], 0x55);
+
+	spiFlash.withSectorCache(0);
+	assertTrue(!spiFlash.updateData(0, buf1, 4));
+
+	// A 64K sector has more 256 byte chunks than bits in a word, and the changed ones past the first
+	// 64 are still programmed
+	spiFlash.withSectorSize(65536).withSectorCache(1);
+	memset(&mem[131072], 0x55, 65536);
+	const size_t chunks[3] = { 3, 70, 200 };
+	value = 0x11111111;
+	for(size_t ii = 0; ii < 3; ii++) {
+		assertTrue(spiFlash.updateData(131072 + chunks[ii] * 256 + 10, &value, sizeof(value)));
+	}
+	m.start();
+	spiFlash.flush();
+	assertEqual(m.counters().sectorErases, 0);
+	assertEqual(m.counters().pagePrograms, 3);
+	for(size_t ii = 0; ii < 3; ii++) {
+		assertEqual(mem[131072 + chunks[ii] * 256 + 10], 0x11);
+		assertEqual(mem[131072 + chunks[ii] * 256 + 9], 0x55);
+	}
+	spiFlash.withSectorCache(0);
+	spiFlash.withSectorSize(4096);
+}
+
+static void testSyncData() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	srand(8);
+	for(size_t ii = 0; ii < 65536; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	// Blank flash doesn't need to be erased
+	SpiFlashSyncStats stats;
+	Measure m(fixture.chip);
+	assertTrue(spiFlash.syncData(0, buf2, 65536, &stats));
+	assertEqual(memcmp(mem, buf2, 65536), 0);
+	assertEqual(stats.pagesProgrammed, 256);
+	assertEqual(stats.pagesSkipped, 0);
+	assertEqual(stats.sectorsErased, 0);
+	assertEqual(stats.sectorsSkipped, 16);
+	assertEqual(m.counters().sectorErases, 0);
+
+	// Unchanged data is only read
+	m.start();
+	assertTrue(spiFlash.syncData(0, buf2, 65536, &stats));
+	uint64_t unchangedNs = m.elapsedNs();
+	assertEqual(stats.pagesProgrammed, 0);
+	assertEqual(stats.pagesSkipped, 256);
+	assertEqual(m.counters().pagePrograms, 0);
+	assertEqual(m.counters().sectorErases, 0);
+	assertEqual(m.counters().csAssertions, 16);
+
+	// Compared to erasing and writing it again
+	m.start();
+	spiFlash.eraseRange(0, 65536);
+	spiFlash.writeData(0, buf2, 65536);
+	assertTrue(unchangedNs * 10 < m.elapsedNs());
+
+	// Changing bits from 1 to 0 only programs that page
+	buf2[5000] &= 0x0f;
+	m.start();
+	assertTrue(spiFlash.syncData(0, buf2, 65536, &stats));
+	assertEqual(stats.pagesProgrammed, 1);
+	assertEqual(stats.pagesSkipped, 255);
+	assertEqual(stats.sectorsErased, 0);
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(mem[5000], buf2[5000]);
+
+	// Changing a bit from 0 to 1 erases only that sector, and keeps the data outside of the range
+	buf2[9000] |= 0xf0;
+	buf2[9001] = 0xff;
+	m.start();
+	assertTrue(spiFlash.syncData(8990, &buf2[8990], 20, &stats));
+	assertEqual(stats.sectorsErased, 1);
+	assertEqual(stats.sectorsSkipped, 0);
+	assertEqual(stats.pagesProgrammed, 16);
+	assertEqual(m.counters().sectorErases, 1);
+	assertEqual(memcmp(mem, buf2, 65536), 0);
+	assertEqual(fixture.chip.getCounters().busyViolations, 0);
+	assertEqual(fixture.chip.getCounters().writeEnableViolations, 0);
+
+	// A range that spans sectors. The middle sector is erased and 3 of its pages are blank.
+	memset(&buf2[13000], 0xff, 1000);
+	assertTrue(spiFlash.syncData(10000, &buf2[10000], 10000, &stats));
+	assertEqual(stats.sectorsErased, 1);
+	assertEqual(stats.sectorsSkipped, 2);
+	assertEqual(stats.pagesProgrammed, 13);
+	assertEqual(stats.pagesSkipped, 9 + 3 + 15);
+	assertEqual(memcmp(mem, buf2, 65536), 0);
+
+	assertTrue(spiFlash.syncData(0, buf2, 0, &stats));
+	assertEqual(stats.pagesProgrammed + stats.pagesSkipped, 0);
+}
+
+static void testErased() {
+	Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L25645G());
+	SpiFlashMacronix &spiFlash = fixture.flash;
+	spiFlash.withNative4ByteAddressing();
+	uint8_t *mem = fixture.chip.getMemory();
+	const size_t flashSize = 32 * 1024 * 1024;
+
+	memset(buf1, 0xff, sizeof(buf1));
+	assertTrue(SpiFlashBase::isErasedBuffer(buf1, sizeof(buf1)));
+	buf1[255] = 0xfe;
+	assertTrue(!SpiFlashBase::isErasedBuffer(buf1, sizeof(buf1)));
+	assertTrue(SpiFlashBase::isErasedBuffer(&buf1[1], 254));
+	assertTrue(SpiFlashBase::isErasedBuffer(buf1, 0));
+
+	// A blank range is read in a single transaction
+	Measure m(fixture.chip);
+	assertTrue(spiFlash.isErased(1000, 10000));
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(m.counters().readBytes, 10000);
+	assertTrue(spiFlash.isErased(0, 0));
+
+	// Written data ends the read early
+	mem[1000] = 0;
+	m.start();
+	assertTrue(!spiFlash.isErased(0, 65536));
+	assertEqual(m.counters().csAssertions, 1);
+	assertTrue(m.counters().readBytes <= 1016 + 256);
+
+	mem[1000] = 0xff;
+	mem[10999] = 0x7f;
+	assertTrue(!spiFlash.isErased(1000, 10000));
+	assertTrue(spiFlash.isErased(1000, 9999));
+	mem[10999] = 0xff;
+
+	// Unflushed data in the sector cache is included
+	spiFlash.withSectorCache(1);
+	buf1[0] = 0x55;
+	spiFlash.updateData(2000, buf1, 1);
+	assertTrue(!spiFlash.isErased(1000, 10000));
+	spiFlash.flush();
+	assertTrue(!spiFlash.isErased(1000, 10000));
+	spiFlash.sectorErase(0);
+	assertTrue(spiFlash.isErased(0, 65536));
+
+	// An append-only log filling most of the chip
+	const size_t logEnd = 20 * 1024 * 1024 + 1234;
+	for(size_t ii = 0; ii < logEnd; ii++) {
+		mem[ii] = (uint8_t)ii;
+	}
+	m.start();
+	assertEqual(spiFlash.findErasedBoundary(0, flashSize), (logEnd + 255) / 256 * 256);
+	assertTrue(m.counters().csAssertions <= 18);
+	assertTrue(m.counters().readBytes <= 18 * 256);
+
+	// Compared to scanning the first Mbyte of it
+	uint64_t searchNs = m.elapsedNs();
+	m.start();
+	for(size_t addr = 0; addr < 1024 * 1024; addr += 256) {
+		spiFlash.readData(addr, buf1, 256);
+	}
+	assertTrue(searchNs * 100 < m.elapsedNs());
+
+	// Empty, full, and a region that is not a multiple of the page size
+	assertEqual(spiFlash.findErasedBoundary(logEnd + 1000, flashSize), logEnd + 1000);
+	assertEqual(spiFlash.findErasedBoundary(4096, 8192), 8192);
+	assertEqual(spiFlash.findErasedBoundary(4096, 4096), 4096);
+	assertEqual(spiFlash.findErasedBoundary(logEnd / 256 * 256 - 4096, logEnd + 100), (logEnd + 255) / 256 * 256);
+	assertEqual(spiFlash.findErasedBoundary(logEnd / 256 * 256 - 4096, logEnd - 50), logEnd - 50);
+	assertEqual(fixture.chip.getCounters().addressModeSwitches, 0);
+}
+
+static void testChecksums() {
+	assertEqual(SpiFlashBase::crc32("", 0), 0);
+	assertEqual(SpiFlashBase::crc32("123456789", 9), 0xcbf43926);
+	assertEqual(SpiFlashBase::crc32("The quick brown fox jumps over the lazy dog", 43), 0x414fa339);
+
+	static const uint8_t abcHash[SpiFlashSha256::HASH_SIZE] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	static const uint8_t longHash[SpiFlashSha256::HASH_SIZE] = {
+		0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+		0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+	};
+	uint8_t hash[SpiFlashSha256::HASH_SIZE];
+	SpiFlashSha256 sha;
+	sha.update("abc", 3);
+	sha.finish(hash);
+	assertEqual(memcmp(hash, abcHash, sizeof(hash)), 0);
+
+	// 56 bytes needs an extra block for the length, and is split across calls
+	const char *longText = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	sha.begin();
+	sha.update(longText, 5);
+	sha.update(&longText[5], 56 - 5);
+	sha.finish(hash);
+	assertEqual(memcmp(hash, longHash, sizeof(hash)), 0);
+
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	const size_t len = 1024 * 1024;
+	srand(9);
+	for(size_t ii = 0; ii < len; ii++) {
+		mem[ii] = (uint8_t) rand();
+	}
+
+	// The whole range is one transaction, and takes about the same time as reading it. The simulation doesn't
+	// include the CPU time of the CRC, but on a device it's done while the next piece is read.
+	Measure m(fixture.chip);
+	assertEqual(spiFlash.crc32Range(0, len), SpiFlashBase::crc32(mem, len));
+	uint64_t crcNs = m.elapsedNs();
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(m.counters().readBytes, len);
+
+	m.start();
+	for(size_t addr = 0; addr < len; addr += sizeof(buf2)) {
+		spiFlash.readData(addr, buf2, sizeof(buf2));
+	}
+	assertTrue(crcNs <= m.elapsedNs() + m.elapsedNs() / 50);
+
+	assertEqual(spiFlash.crc32Range(100, 1000), SpiFlashBase::crc32(&mem[100], 1000));
+	assertEqual(spiFlash.crc32Range(1100, 5000, spiFlash.crc32Range(100, 1000)), SpiFlashBase::crc32(&mem[100], 6000));
+	assertEqual(spiFlash.crc32Range(100, 0, 1234), 1234);
+
+	sha.begin();
+	sha.update(mem, 10000);
+	sha.finish(hash);
+	uint8_t rangeHash[SpiFlashSha256::HASH_SIZE];
+	spiFlash.sha256Range(0, 10000, rangeHash);
+	assertEqual(memcmp(hash, rangeHash, sizeof(hash)), 0);
+
+	// Data in the sector cache that hasn't been written yet is included
+	spiFlash.withSectorCache(1);
+	buf1[0] = (uint8_t)~mem[5000];
+	spiFlash.updateData(5000, buf1, 1);
+	uint8_t saved = mem[5000];
+	mem[5000] = buf1[0];
+	uint32_t expected = SpiFlashBase::crc32(mem, 10000);
+	mem[5000] = saved;
+	assertEqual(spiFlash.crc32Range(0, 10000), expected);
+	spiFlash.flush();
+	assertEqual(spiFlash.crc32Range(0, 10000), expected);
+
+	// SpiFlashBase implementations that don't override readChunks() use readData()
+	SpiFlashWearLevel wearLevel(spiFlash, 65536, 16);
+	wearLevel.begin();
+	for(size_t ii = 0; ii < 5000; ii++) {
+		buf2[ii] = (uint8_t)(ii * 7);
+	}
+	wearLevel.writeData(300, buf2, 5000);
+	assertEqual(wearLevel.crc32Range(300, 5000), SpiFlashBase::crc32(buf2, 5000));
+
+	assertEqual(fixture.chip.getCounters().busyViolations, 0);
+}
+
+static void testReadCache() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	for(size_t ii = 0; ii < 8192; ii++) {
+		mem[ii] = (uint8_t) ii;
+	}
+
+	spiFlash.withReadCache(2);
+
+	// A page read one byte at a time only reads from the chip once
+	Measure m(fixture.chip);
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.readData(512 + ii, &buf1[ii], 1);
+	}
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(m.counters().readBytes, 256);
+	assertEqual(spiFlash.getReadCacheMisses(), 1);
+	assertEqual(spiFlash.getReadCacheHits(), 255);
+	assertEqual(memcmp(buf1, &mem[512], 256), 0);
+
+	// Read spanning two lines
+	m.start();
+	spiFlash.readData(1020, buf1, 8);
+	assertEqual(m.counters().csAssertions, 2);
+	assertEqual(memcmp(buf1, &mem[1020], 8), 0);
+	assertEqual(spiFlash.getReadCacheMisses(), 3);
+
+	// The line at 512 was least recently used and was replaced
+	m.start();
+	spiFlash.readData(1024, buf1, 4);
+	spiFlash.readData(1000, buf1, 4);
+	assertEqual(m.counters().csAssertions, 0);
+	spiFlash.readData(512, buf1, 4);
+	assertEqual(m.counters().csAssertions, 1);
+
+	// Large reads bypass the cache
+	uint32_t misses = spiFlash.getReadCacheMisses();
+	spiFlash.readData(0, buf2, 4096);
+	assertEqual(spiFlash.getReadCacheMisses(), misses);
+	assertEqual(memcmp(buf2, mem, 4096), 0);
+
+	// writeData invalidates the line it overlaps, even when it starts in the middle
+	buf1[0] = 0;
+	spiFlash.writeData(513, buf1, 1);
+	spiFlash.readData(512, buf1, 4);
+	assertEqual(buf1[0], 0);
+	assertEqual(buf1[1], 0);
+	assertEqual(buf1[2], 2);
+
+	// Erase invalidates the lines in the sector
+	spiFlash.sectorErase(0);
+	spiFlash.readData(1020, buf1, 8);
+	assertEqual(buf1[0], 0xff);
+	assertEqual(buf1[7], 0xff);
+
+	// updateData invalidates the line
+	spiFlash.withSectorCache(1);
+	spiFlash.readData(4096, buf1, 4);
+	uint32_t value = 0x12345678;
+	spiFlash.updateData(4096, &value, sizeof(value));
+	spiFlash.readData(4096, buf1, 4);
+	assertEqual(memcmp(buf1, &value, 4), 0);
+	spiFlash.flush();
+	spiFlash.readData(4096, buf1, 4);
+	assertEqual(memcmp(buf1, &value, 4), 0);
+	assertEqual(memcmp(&mem[4096], &value, 4), 0);
+	spiFlash.withSectorCache(0);
+
+	// Lines larger than the flush compare chunks, filled by a read that crosses out of a dirty cached sector,
+	// must not hide the change from flush()
+	spiFlash.withSectorCache(1).withReadCache(16, 512);
+	spiFlash.sectorErase(0);
+	const uint8_t oldData[4] = { 1, 2, 3, 4 };
+	const uint8_t newData[4] = { 5, 6, 7, 8 };
+	spiFlash.writeData(3600, oldData, sizeof(oldData));
+	spiFlash.updateData(3600, newData, sizeof(newData));
+	spiFlash.readData(4095, buf1, 2);
+	spiFlash.readData(3600, buf1, 4);
+	assertEqual(memcmp(buf1, newData, 4), 0);
+	spiFlash.flush();
+	assertEqual(memcmp(&mem[3600], newData, 4), 0);
+	spiFlash.readData(3600, buf1, 4);
+	assertEqual(memcmp(buf1, newData, 4), 0);
+	spiFlash.withSectorCache(0);
+
+	spiFlash.withReadCache(0);
+	m.start();
+	spiFlash.readData(4096, buf1, 4);
+	assertEqual(m.counters().csAssertions, 1);
+}
+
+static void testWriteCombining() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	srand(4);
+	for(size_t ii = 0; ii < 1024; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	spiFlash.withWriteCombining();
+
+	// A page written one byte at a time is one page program
+	Measure m(fixture.chip);
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.writeData(256 + ii, &buf2[ii], 1);
+	}
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(memcmp(&mem[256], buf2, 256), 0);
+	assertTrue(!spiFlash.hasUnflushedData());
+
+	// 10 byte records crossing page boundaries
+	m.start();
+	for(size_t ii = 0; ii < 100; ii++) {
+		spiFlash.writeData(1024 + ii * 10, &buf2[ii * 10], 10);
+	}
+	assertEqual(m.counters().pagePrograms, 3);
+	assertTrue(spiFlash.hasUnflushedData());
+
+	// Reads include the data that has not been programmed yet
+	spiFlash.readData(1024, buf1, 256);
+	assertEqual(memcmp(buf1, buf2, 256), 0);
+	spiFlash.readData(1024 + 990, buf1, 16);
+	assertEqual(memcmp(buf1, &buf2[990], 10), 0);
+	assertEqual(buf1[10], 0xff);
+
+	spiFlash.flush();
+	assertEqual(m.counters().pagePrograms, 4);
+	assertEqual(memcmp(&mem[1024], buf2, 1000), 0);
+	assertTrue(!spiFlash.hasUnflushedData());
+
+	// Overlapping and non-contiguous writes in the same page behave like separate programs
+	uint8_t a[4] = { 0xf0, 0xf0, 0xf0, 0xf0 };
+	uint8_t b[4] = { 0x3c, 0x3c, 0x3c, 0x3c };
+	m.start();
+	spiFlash.writeData(4096, a, 4);
+	spiFlash.writeData(4098, b, 4);
+	spiFlash.writeData(4200, b, 4);
+	spiFlash.flush();
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(mem[4096], 0xf0);
+	assertEqual(mem[4098], 0x30);
+	assertEqual(mem[4100], 0x3c);
+	assertEqual(mem[4102], 0xff);
+	assertEqual(mem[4200], 0x3c);
+
+	// A write to another page programs the pending page first
+	m.start();
+	spiFlash.writeData(8192, a, 4);
+	spiFlash.writeData(16384, a, 4);
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(mem[8192], 0xf0);
+	assertEqual(mem[16384], 0xff);
+
+	// Erasing the page discards the pending data
+	spiFlash.sectorErase(16384);
+	spiFlash.flush();
+	assertEqual(mem[16384], 0xff);
+	assertEqual(m.counters().pagePrograms, 1);
+
+	// Full page writes are programmed immediately
+	m.start();
+	spiFlash.writeData(20480, buf2, 512);
+	assertEqual(m.counters().pagePrograms, 2);
+	assertTrue(!spiFlash.hasUnflushedData());
+
+	spiFlash.withWriteCombining(false);
+	m.start();
+	spiFlash.writeData(24576, a, 1);
+	assertEqual(m.counters().pagePrograms, 1);
+}
+
+static void testWearLevel() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+
+	// 64 physical sectors starting at 1 Mbyte, 4 in reserve. The chip is blank so mounting doesn't erase anything.
+	const size_t startAddr = 1024 * 1024;
+	Measure m(fixture.chip);
+	SpiFlashWearLevel wl(spiFlash, startAddr, 64, 4);
+	wl.begin();
+	assertTrue(wl.isValid());
+	assertEqual(wl.getSectorSize(), 3840);
+	assertEqual(wl.getPageSize(), 256);
+	assertEqual(wl.getCapacity(), 60 * 3840);
+	assertEqual(m.counters().sectorErases, 0);
+
+	// Logical sectors that were never written read as erased
+	wl.readData(0, buf1, 16);
+	assertEqual(buf1[0], 0xff);
+
+	// Write across a logical sector boundary
+	srand(5);
+	for(size_t ii = 0; ii < 8192; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+	wl.writeData(3000, buf2, 2000);
+	static uint8_t readBuf[2000];
+	wl.readData(3000, readBuf, sizeof(readBuf));
+	assertEqual(memcmp(readBuf, buf2, sizeof(readBuf)), 0);
+	assertTrue(wl.getPhysicalSector(0) >= 0);
+	assertTrue(wl.getPhysicalSector(1) >= 0);
+	assertTrue(wl.getPhysicalSector(2) < 0);
+
+	// Cold data in logical sectors 2 - 49
+	for(size_t logical = 2; logical < 50; logical++) {
+		wl.writeData(logical * 3840, &buf2[logical], 100);
+	}
+
+	// Erasing a sector that was never written doesn't erase anything
+	m.start();
+	wl.sectorErase(55 * 3840);
+	assertEqual(m.counters().sectorErases, 0);
+
+	// Hot sector: a record rewritten 2000 times
+	for(uint32_t ii = 0; ii < 2000; ii++) {
+		wl.sectorErase(0);
+		wl.writeData(0, &ii, sizeof(ii));
+	}
+	uint32_t value = 0;
+	wl.readData(0, &value, sizeof(value));
+	assertEqual(value, 1999);
+
+	SpiFlashWearLevelStats stats;
+	wl.getStats(stats);
+	assertEqual(stats.hostErases, 2001);
+	assertTrue(stats.staticMoves > 0);
+	assertTrue(stats.maxEraseCount - stats.minEraseCount <= 32 + 1);
+	assertTrue(stats.maxEraseCount < 2000 / 16);
+	assertTrue(stats.getWriteAmplification() > 1.0f);
+	assertEqual(stats.freeSectors, 64 - 50);
+
+	// Cold data is intact after being moved
+	for(size_t logical = 2; logical < 50; logical++) {
+		wl.readData(logical * 3840, readBuf, 100);
+		assertEqual(memcmp(readBuf, &buf2[logical], 100), 0);
+	}
+
+	// Remount: the mapping and erase counts are rebuilt from the headers without erasing
+	uint32_t eraseCount5 = wl.getEraseCount(5);
+	int phys10 = wl.getPhysicalSector(10);
+	m.start();
+	SpiFlashWearLevel wl2(spiFlash, startAddr, 64, 4);
+	wl2.begin();
+	assertEqual(m.counters().sectorErases, 0);
+	assertEqual(wl2.getEraseCount(5), eraseCount5);
+	assertEqual(wl2.getPhysicalSector(10), phys10);
+	wl2.readData(10 * 3840, readBuf, 100);
+	assertEqual(memcmp(readBuf, &buf2[10], 100), 0);
+	wl2.readData(3000, readBuf, 2000);
+	assertTrue(memcmp(readBuf, buf2, 840) != 0); // sector 0 was rewritten
+	assertEqual(memcmp(&readBuf[840], &buf2[840], 1160), 0);
+
+	SpiFlashWearLevelStats stats2;
+	wl2.getStats(stats2);
+	assertEqual(stats2.maxEraseCount, stats.maxEraseCount);
+	assertTrue(stats2.mountTimeMs < 10);
+
+	// Simulate a reset while moving logical sector 10: a newer uncommitted copy is discarded
+	uint8_t *mem = fixture.chip.getMemory();
+	int freePhys = -1;
+	for(int phys = 0; phys < 64 && freePhys < 0; phys++) {
+		bool used = false;
+		for(size_t logical = 0; logical < 60; logical++) {
+			used = used || (wl2.getPhysicalSector(logical) == phys);
+		}
+		if (!used) {
+			freePhys = phys;
+		}
+	}
+	SpiFlashWearLevel::SectorHeader *hdr = (SpiFlashWearLevel::SectorHeader *)&mem[startAddr + freePhys * 4096];
+	hdr->logicalSector = 10;
+	hdr->sequence = 0x7fffffff;
+	hdr->mapCheck = ~(hdr->logicalSector ^ hdr->sequence);
+	mem[startAddr + freePhys * 4096 + 256] = 0;
+
+	// A committed newer copy of logical sector 11 replaces the old one
+	int oldPhys11 = wl2.getPhysicalSector(11);
+	int newPhys11 = -1;
+	for(int phys = freePhys + 1; phys < 64 && newPhys11 < 0; phys++) {
+		bool used = false;
+		for(size_t logical = 0; logical < 60; logical++) {
+			used = used || (wl2.getPhysicalSector(logical) == phys);
+		}
+		if (!used) {
+			newPhys11 = phys;
+		}
+	}
+	memcpy(&mem[startAddr + newPhys11 * 4096 + 256], &mem[startAddr + oldPhys11 * 4096 + 256], 3840);
+	mem[startAddr + newPhys11 * 4096 + 256] = 0x42;
+	hdr = (SpiFlashWearLevel::SectorHeader *)&mem[startAddr + newPhys11 * 4096];
+	hdr->logicalSector = 11;
+	hdr->sequence = 0x7ffffffe;
+	hdr->mapCheck = ~(hdr->logicalSector ^ hdr->sequence);
+	hdr->commit = 0;
+
+	m.start();
+	SpiFlashWearLevel wl3(spiFlash, startAddr, 64, 4);
+	wl3.begin();
+	assertEqual(m.counters().sectorErases, 2);
+	assertEqual(wl3.getPhysicalSector(10), phys10);
+	assertEqual(wl3.getPhysicalSector(11), newPhys11);
+	wl3.readData(11 * 3840, readBuf, 2);
+	assertEqual(readBuf[0], 0x42);
+	assertEqual(readBuf[1], buf2[12]);
+	assertEqual(wl3.getEraseCount(freePhys), wl2.getEraseCount(freePhys) + 1);
+
+	// Existing SpiFlashBase code works unchanged
+	SpiFlashBase &base = wl3;
+	assertTrue(base.eraseRange(0, 2 * base.getSectorSize()));
+	base.readData(3000, readBuf, 16);
+	assertEqual(readBuf[0], 0xff);
+	assertTrue(wl3.getPhysicalSector(0) < 0);
+}
+
+static size_t logRecord(uint32_t index, uint8_t *buf) {
+	size_t len = 1 + (index * 37) % 200;
+	for(size_t ii = 0; ii < len; ii++) {
+		buf[ii] = (uint8_t)(index + ii);
+	}
+	memcpy(buf, &index, (len < sizeof(index)) ? len : sizeof(index));
+	return len;
+}
+
+static void testLog() {
+	assertEqual(SpiFlashBase::crc32("123456789", 9), 0xcbf43926);
+	assertEqual(SpiFlashBase::crc32("56789", 5, SpiFlashBase::crc32("1234", 4)), 0xcbf43926);
+
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	// 16 sectors at 64K
+	const size_t startAddr = 65536;
+	SpiFlashLog log(spiFlash, startAddr, 16);
+	assertTrue(log.begin());
+	assertTrue(log.isEmpty());
+	assertEqual(log.getMaxRecordSize(), 4096 - 12 - 8);
+
+	SpiFlashLogCursor cursor;
+	assertEqual(log.read(cursor, buf1, sizeof(buf1)), -1);
+	assertTrue(!log.append(buf1, 0));
+	assertTrue(!log.append(buf2, 4096));
+
+	// Write enough to wrap around several times
+	uint8_t rec[256];
+	const uint32_t numRecords = 2000;
+	for(uint32_t ii = 0; ii < numRecords; ii++) {
+		size_t len = logRecord(ii, rec);
+		assertTrue(log.append(rec, len));
+	}
+	assertTrue(!log.isEmpty());
+	assertTrue(log.getHeadSequence() > 3 * 16);
+	assertEqual(log.getTailSequence(), log.getHeadSequence() - 14);
+
+	// The sector after the head is erased
+	size_t headIndex = log.getHeadSequence() % 16;
+	for(size_t ii = 0; ii < 4096; ii++) {
+		assertEqual(mem[startAddr + ((headIndex + 1) % 16) * 4096 + ii], 0xff);
+	}
+
+	// Records are read oldest to newest with none missing, ending with the last one
+	uint32_t first = 0, expected = 0;
+	int len;
+	while((len = log.read(cursor, buf1, sizeof(buf1))) >= 0) {
+		uint32_t index;
+		memcpy(&index, buf1, sizeof(index));
+		if (expected == 0) {
+			first = expected = index;
+		}
+		assertEqual(index, expected);
+		assertEqual(len, (int)logRecord(index, rec));
+		assertEqual(memcmp(buf1, rec, len), 0);
+		expected++;
+	}
+	assertTrue(first > 0);
+	assertEqual(expected, numRecords);
+
+	// A cursor at the end picks up new records
+	len = logRecord(numRecords, rec);
+	assertTrue(log.append(rec, len));
+	assertEqual(log.read(cursor, buf1, 2), len);
+	assertEqual(memcmp(buf1, rec, 2), 0);
+	assertEqual(log.read(cursor, buf1, sizeof(buf1)), -1);
+
+	// Remount: the head, tail, and write position are found from a few headers
+	uint32_t headSequence = log.getHeadSequence();
+	uint32_t tailSequence = log.getTailSequence();
+	Measure m(fixture.chip);
+	SpiFlashLog log2(spiFlash, startAddr, 16);
+	assertTrue(log2.begin());
+	assertEqual(log2.getHeadSequence(), headSequence);
+	assertEqual(log2.getTailSequence(), tailSequence);
+	assertTrue(log2.getHeadersRead() <= 8);
+	assertEqual(m.counters().sectorErases, 0);
+
+	len = logRecord(numRecords + 1, rec);
+	assertTrue(log2.append(rec, len));
+	SpiFlashLogCursor cursor2;
+	uint32_t index = 0;
+	while((len = log2.read(cursor2, buf1, sizeof(buf1))) >= 0) {
+		memcpy(&index, buf1, sizeof(index));
+	}
+	assertEqual(index, numRecords + 1);
+	assertEqual(log2.getCorruptRecords(), 0);
+
+	// A record that was interrupted while writing its data is skipped
+	headIndex = headSequence % 16;
+	mem[startAddr + headIndex * 4096 + 12 + 8] ^= 0x01;
+	SpiFlashLogCursor cursor3;
+	cursor3.sequence = headSequence;
+	int count = 0;
+	while(log2.read(cursor3, buf1, sizeof(buf1)) >= 0) {
+		count++;
+	}
+	assertEqual(log2.getCorruptRecords(), 1);
+
+	// A record header that was interrupted makes the next record start in a new sector
+	SpiFlashLog::RecordHeader hdr;
+	memset(&hdr, 0xff, sizeof(hdr));
+	hdr.length = 0x1234;
+	size_t writeAddr = startAddr + headIndex * 4096 + 12;
+	while(mem[writeAddr] != 0xff) {
+		SpiFlashLog::RecordHeader cur;
+		memcpy(&cur, &mem[writeAddr], sizeof(cur));
+		writeAddr += sizeof(hdr) + cur.length;
+	}
+	memcpy(&mem[writeAddr], &hdr, sizeof(hdr));
+
+	SpiFlashLog log3(spiFlash, startAddr, 16);
+	assertTrue(log3.begin());
+	assertEqual(log3.getHeadSequence(), headSequence);
+	len = logRecord(numRecords + 2, rec);
+	assertTrue(log3.append(rec, len));
+	assertEqual(log3.getHeadSequence(), headSequence + 1);
+	SpiFlashLogCursor cursor4;
+	cursor4.sequence = headSequence;
+	int count2 = 0;
+	while((len = log3.read(cursor4, buf1, sizeof(buf1))) >= 0) {
+		memcpy(&index, buf1, sizeof(index));
+		count2++;
+	}
+	assertEqual(count2, count + 1);
+	assertEqual(index, numRecords + 2);
+
+	// An interrupted erase-ahead is redone by begin()
+	size_t nextIndex = (log3.getHeadSequence() + 1) % 16;
+	mem[startAddr + nextIndex * 4096 + 2000] = 0;
+	SpiFlashLog log4(spiFlash, startAddr, 16);
+	m.start();
+	assertTrue(log4.begin());
+	assertEqual(m.counters().sectorErases, 1);
+	assertEqual(mem[startAddr + nextIndex * 4096 + 2000], 0xff);
+
+	log4.clear();
+	assertTrue(log4.isEmpty());
+	SpiFlashLog log5(spiFlash, startAddr, 16);
+	assertTrue(log5.begin());
+	assertTrue(log5.isEmpty());
+	assertEqual(log5.read(cursor, buf1, sizeof(buf1)), -1);
+}
+
+static void testLogRecovery() {
+	// Recovery time doesn't depend on the chip size. Build the headers of a wrapped log using all of a 32 Mbyte chip.
+	Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L25645G());
+	SpiFlashMacronix &spiFlash = fixture.flash;
+	assertTrue(spiFlash.set4ByteAddressing(true));
+	uint8_t *mem = fixture.chip.getMemory();
+
+	const size_t numSectors = 8192;
+	for(size_t headIndex = 0; headIndex < numSectors; headIndex += 1237) {
+		for(size_t ii = 0; ii < numSectors; ii++) {
+			SpiFlashLog::SectorHeader hdr;
+			if (ii == (headIndex + 1) % numSectors) {
+				memset(&hdr, 0xff, sizeof(hdr));
+			}
+			else {
+				hdr.magic = SpiFlashLog::HEADER_MAGIC;
+				hdr.sequence = (uint32_t)(ii + ((ii <= headIndex) ? 3 : 2) * numSectors);
+				hdr.sequenceCheck = ~hdr.sequence;
+			}
+			memcpy(&mem[ii * 4096], &hdr, sizeof(hdr));
+		}
+
+		Measure m(fixture.chip);
+		SpiFlashLog log(spiFlash, 0, numSectors);
+		assertTrue(log.begin());
+		assertEqual(log.getHeadSequence() % numSectors, headIndex);
+		assertEqual(log.getTailSequence(), log.getHeadSequence() + 2 - numSectors);
+		assertTrue(log.getHeadersRead() <= 20);
+		assertTrue(m.elapsedNs() < 2000000);
+	}
+
+	// Head in the last sector, so sector 0 is the erased one
+	memset(&mem[0], 0xff, sizeof(SpiFlashLog::SectorHeader));
+	for(size_t ii = 1; ii < numSectors; ii++) {
+		SpiFlashLog::SectorHeader hdr;
+		hdr.magic = SpiFlashLog::HEADER_MAGIC;
+		hdr.sequence = (uint32_t)(ii + 3 * numSectors);
+		hdr.sequenceCheck = ~hdr.sequence;
+		memcpy(&mem[ii * 4096], &hdr, sizeof(hdr));
+	}
+	SpiFlashLog log(spiFlash, 0, numSectors);
+	assertTrue(log.begin());
+	assertEqual(log.getHeadSequence(), 4 * numSectors - 1);
+	assertEqual(log.getTailSequence(), 3 * numSectors + 1);
+}
+
+static void testKV() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	// 8 sectors at 128K
+	const size_t startAddr = 131072;
+	SpiFlashKV kv(spiFlash, startAddr, 8, 32);
+	assertTrue(kv.begin());
+	assertEqual(kv.getNumKeys(), 0);
+	assertEqual(kv.get("missing", buf1, sizeof(buf1)), -1);
+	assertTrue(!kv.remove("missing"));
+	assertTrue(!kv.put("", "x", 1));
+
+	// A new key is a single page program
+	uint32_t cal[4] = { 1, 2, 3, 4 };
+	assertTrue(kv.put("cal", cal, sizeof(cal)));
+	Measure m(fixture.chip);
+	assertTrue(kv.put("name", "sensor1", 7));
+	assertEqual(m.counters().pagePrograms, 1);
+	assertEqual(m.counters().sectorErases, 0);
+
+	// A lookup is a single read
+	m.start();
+	uint32_t calRead[4];
+	assertEqual(kv.get("cal", calRead, sizeof(calRead)), (int)sizeof(cal));
+	assertEqual(m.counters().csAssertions, 1);
+	assertEqual(memcmp(cal, calRead, sizeof(cal)), 0);
+
+	// Value longer than the buffer
+	memset(buf1, 0, sizeof(buf1));
+	assertEqual(kv.get("name", buf1, 3), 7);
+	assertEqual(memcmp(buf1, "sen\0", 4), 0);
+
+	// Setting the same value doesn't write
+	m.start();
+	assertTrue(kv.put("name", "sensor1", 7));
+	assertEqual(m.counters().pagePrograms, 0);
+
+	assertTrue(kv.put("name", "sensor2", 7));
+	assertEqual(kv.get("name", buf1, sizeof(buf1)), 7);
+	assertEqual(memcmp(buf1, "sensor2", 7), 0);
+	assertEqual(kv.getNumKeys(), 2);
+
+	assertTrue(kv.put("empty", 0, 0));
+	assertEqual(kv.get("empty", buf1, sizeof(buf1)), 0);
+	assertTrue(kv.remove("empty"));
+	assertTrue(!kv.contains("empty"));
+	assertTrue(kv.contains("name"));
+	assertEqual(kv.getNumKeys(), 2);
+
+	// A large value takes more than one read
+	for(size_t ii = 0; ii < 1000; ii++) {
+		buf2[ii] = (uint8_t)(ii * 7);
+	}
+	assertTrue(kv.put("big", buf2, 1000));
+	assertEqual(kv.get("big", &buf2[2000], 1000), 1000);
+	assertEqual(memcmp(buf2, &buf2[2000], 1000), 0);
+	assertTrue(kv.remove("big"));
+
+	// Many keys, including removes, which move hash table entries
+	char key[16];
+	for(size_t ii = 0; ii < 30; ii++) {
+		snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+		assertTrue(kv.put(key, &ii, sizeof(ii)));
+	}
+	assertEqual(kv.getNumKeys(), 32);
+	assertTrue(!kv.put("onemore", "x", 1));
+	for(size_t ii = 0; ii < 30; ii += 3) {
+		snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+		assertTrue(kv.remove(key));
+	}
+	for(size_t ii = 0; ii < 30; ii++) {
+		snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+		size_t value = 0;
+		if ((ii % 3) == 0) {
+			assertEqual(kv.get(key, &value, sizeof(value)), -1);
+		}
+		else {
+			assertEqual(kv.get(key, &value, sizeof(value)), (int)sizeof(value));
+			assertEqual(value, ii);
+		}
+	}
+	assertEqual(kv.getNumKeys(), 22);
+
+	// Rewrite values many times, far more than fits, so garbage collection runs
+	uint8_t value[100];
+	for(uint32_t pass = 0; pass < 300; pass++) {
+		for(size_t ii = 1; ii < 30; ii += 3) {
+			snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+			memset(value, (uint8_t)(pass + ii), sizeof(value));
+			memcpy(value, &pass, sizeof(pass));
+			assertTrue(kv.put(key, value, sizeof(value)));
+		}
+		assertTrue(kv.getFreeSectors() >= 1);
+	}
+	for(size_t ii = 1; ii < 30; ii += 3) {
+		snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+		assertEqual(kv.get(key, buf1, sizeof(buf1)), 100);
+		assertEqual(buf1[99], (uint8_t)(299 + ii));
+	}
+	cal[0] = 0;
+	assertEqual(kv.get("cal", cal, sizeof(cal)), (int)sizeof(cal));
+	assertEqual(cal[0], 1);
+
+	// Remount: the hash table is rebuilt from the records
+	size_t liveBytes = kv.getLiveBytes();
+	SpiFlashKV kv2(spiFlash, startAddr, 8, 32);
+	assertTrue(kv2.begin());
+	assertEqual(kv2.getNumKeys(), 22);
+	assertEqual(kv2.getLiveBytes(), liveBytes);
+	assertEqual(kv2.getFreeSectors(), kv.getFreeSectors());
+	for(size_t ii = 0; ii < 30; ii++) {
+		snprintf(key, sizeof(key), "key%u", (unsigned)ii);
+		int len = kv2.get(key, buf1, sizeof(buf1));
+		if ((ii % 3) == 0) {
+			assertEqual(len, -1);
+		}
+		else
+		if ((ii % 3) == 1) {
+			assertEqual(len, 100);
+			assertEqual(buf1[99], (uint8_t)(299 + ii));
+		}
+		else {
+			assertEqual(len, (int)sizeof(size_t));
+		}
+	}
+	assertEqual(kv2.get("name", buf1, sizeof(buf1)), 7);
+	assertEqual(memcmp(buf1, "sensor2", 7), 0);
+
+	// Background compaction frees sectors without writing anything new
+	while(kv2.compactStep(true)) {
+	}
+	assertEqual(kv2.getFreeSectors(), 7);
+	assertEqual(kv2.get("name", buf1, sizeof(buf1)), 7);
+
+	// A write interrupted before the data was complete is ignored, so the previous value is used
+	assertTrue(kv2.put("name", "sensor3", 7));
+	size_t addr = startAddr;
+	for(size_t ii = 0; ii < 8 * 4096; ii++) {
+		if (memcmp(&mem[startAddr + ii], "namesensor3", 11) == 0) {
+			addr = startAddr + ii;
+		}
+	}
+	mem[addr + 10] = '0';
+	SpiFlashKV kv3(spiFlash, startAddr, 8, 32);
+	assertTrue(kv3.begin());
+	assertEqual(kv3.get("name", buf1, sizeof(buf1)), 7);
+	assertEqual(memcmp(buf1, "sensor2", 7), 0);
+	assertTrue(kv3.put("name", "sensor4", 7));
+
+	SpiFlashKV kv4(spiFlash, startAddr, 8, 32);
+	assertTrue(kv4.begin());
+	assertEqual(kv4.get("name", buf1, sizeof(buf1)), 7);
+	assertEqual(memcmp(buf1, "sensor4", 7), 0);
+
+	// Filling the store fails cleanly instead of losing data
+	size_t count = 0;
+	for(; count < 32; count++) {
+		snprintf(key, sizeof(key), "fill%u", (unsigned)count);
+		if (!kv4.put(key, buf2, 3000)) {
+			break;
+		}
+	}
+	assertTrue(count >= 4 && count < 10);
+	assertEqual(kv4.get("name", buf1, sizeof(buf1)), 7);
+	assertEqual(memcmp(buf1, "sensor4", 7), 0);
+	assertEqual(kv4.get("fill0", &buf2[4000], 3000), 3000);
+	assertEqual(memcmp(buf2, &buf2[4000], 3000), 0);
+}
+
+static void testBatch() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	srand(6);
+	for(size_t ii = 0; ii < 65536; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+	memset(&mem[65536], 0, 65536);
+
+	// Once the chip is known to be idle, starting an operation doesn't read the status register
+	spiFlash.writeData(0, buf2, 1);
+	Measure m(fixture.chip);
+	spiFlash.readData(0, buf1, 1);
+	spiFlash.writeData(1, buf2, 1);
+	uint64_t statusReads = m.counters().statusReads;
+	m.start();
+	spiFlash.writeData(2, buf2, 1);
+	assertEqual(m.counters().statusReads, statusReads);
+	assertEqual(m.counters().busyViolations, 0);
+
+	SpiFlashBatch batch(spiFlash, 40);
+	assertEqual(batch.getMaxRequests(), 40);
+	assertTrue(!batch.sectorErase(65536 + 100));
+
+	// The 16 adjacent sector erases are merged into a single 64K block erase
+	for(size_t ii = 0; ii < 16; ii++) {
+		assertTrue(batch.sectorErase(65536 + (15 - ii) * 4096));
+	}
+	for(size_t ii = 0; ii < 16; ii++) {
+		assertTrue(batch.write(65536 + 1000 + ii * 16, &buf2[ii * 16], 16));
+	}
+	// Erases are done before writes, so an erase after a write to the same sector would be out of order
+	assertTrue(!batch.sectorErase(65536));
+	assertTrue(!batch.eraseRange(0, 131072));
+	// Overlapping writes are combined the same way the chip would program them
+	assertTrue(batch.write(65536 + 1000, &buf2[1000], 8));
+
+	// Consecutive reads of data written in the batch are a single transaction
+	uint8_t readBuf[4][64];
+	for(size_t ii = 0; ii < 4; ii++) {
+		assertTrue(batch.read(65536 + 1000 + ii * 64, readBuf[ii], 64));
+	}
+	assertEqual(batch.getNumRequests(), 37);
+
+	m.start();
+	assertTrue(batch.execute());
+	assertEqual(batch.getNumRequests(), 0);
+	assertEqual(m.counters().block64Erases, 1);
+	assertEqual(m.counters().sectorErases, 0);
+	// 256 bytes starting at offset 1000 cover two pages
+	assertEqual(batch.getPagePrograms(), 2);
+	assertEqual(m.counters().pagePrograms, 2);
+	assertEqual(m.counters().busyViolations, 0);
+
+	uint8_t expected[256];
+	memcpy(expected, buf2, 256);
+	for(size_t ii = 0; ii < 8; ii++) {
+		expected[ii] &= buf2[1000 + ii];
+	}
+	assertEqual(memcmp(&mem[65536 + 1000], expected, 256), 0);
+	assertEqual(mem[65536 + 999], 0xff);
+	assertEqual(mem[65536 + 1256], 0xff);
+	assertEqual(mem[65536 + 65535], 0xff);
+	assertEqual(memcmp(readBuf, expected, 256), 0);
+
+	// The same operations done one at a time
+	spiFlash.eraseRange(65536, 65536);
+	m.start();
+	for(size_t ii = 0; ii < 16; ii++) {
+		spiFlash.writeData(65536 + 1000 + ii * 16, &buf2[ii * 16], 16);
+	}
+	spiFlash.writeData(65536 + 1000, &buf2[1000], 8);
+	for(size_t ii = 0; ii < 4; ii++) {
+		spiFlash.readData(65536 + 1000 + ii * 64, readBuf[ii], 64);
+	}
+	assertEqual(m.counters().pagePrograms, 18);
+	assertEqual(memcmp(&mem[65536 + 1000], expected, 256), 0);
+
+	// The pool is fixed size
+	batch.clear();
+	for(size_t ii = 0; ii < 40; ii++) {
+		assertTrue(batch.read(ii, &buf1[ii], 1));
+	}
+	assertTrue(!batch.read(40, &buf1[40], 1));
+	assertTrue(batch.execute());
+	assertEqual(memcmp(buf1, mem, 40), 0);
+
+	// Caches see the result of the batch
+	spiFlash.withReadCache(4);
+	spiFlash.readData(200000, buf1, 4);
+	assertTrue(batch.write(200000, "\x01\x02\x03\x04", 4));
+	assertTrue(batch.execute());
+	spiFlash.readData(200000, buf1, 4);
+	assertEqual(memcmp(buf1, "\x01\x02\x03\x04", 4), 0);
+	spiFlash.withReadCache(0);
+
+	// A batch waits for an erase started by startSectorErase() instead of programming and reading the busy chip
+	m.start();
+	assertTrue(spiFlash.startSectorErase(1048576));
+	assertTrue(batch.write(1048576 + 8192, "\x05\x06", 2));
+	assertTrue(batch.read(1048576 + 8192, buf1, 2));
+	assertTrue(batch.execute());
+	assertEqual(memcmp(&mem[1048576 + 8192], "\x05\x06", 2), 0);
+	assertEqual(memcmp(buf1, "\x05\x06", 2), 0);
+	assertEqual(m.counters().busyViolations, 0);
+
+	{
+		// An erase that times out fails the batch, and the writes and reads aren't sent to the busy chip
+		SpiFlashEmulator::Config config = SpiFlashEmulator::winbondW25Q32();
+		config.timing.tSE = 600000;
+		Fixture<SpiFlashWinbond> slowFixture(config);
+		SpiFlashBatch slowBatch(slowFixture.flash);
+		assertTrue(slowBatch.sectorErase(0));
+		assertTrue(slowBatch.write(8192, "\x01\x02", 2));
+		memset(buf1, 0x55, 4);
+		assertTrue(slowBatch.read(8192, buf1, 4));
+		assertTrue(!slowBatch.execute());
+		assertEqual(slowBatch.getNumRequests(), 0);
+		assertEqual(slowFixture.chip.getCounters().pagePrograms, 0);
+		assertEqual(slowFixture.chip.getCounters().readBytes, 0);
+		assertEqual(slowFixture.chip.getCounters().busyViolations, 0);
+		assertEqual(memcmp(buf1, "\x55\x55\x55\x55", 4), 0);
+	}
+}
+
+static void testStreams() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	srand(7);
+	for(size_t ii = 0; ii < 16384; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	// Small writes that aren't page aligned, with 20 microseconds of processing between them
+	const size_t addr = 1000;
+	const size_t len = 16384;
+	const size_t chunk = 37;
+	uint64_t writerNs;
+	{
+		Measure m(fixture.chip);
+		SpiFlashWriter writer(spiFlash, addr);
+		assertTrue(writer.isValid());
+		for(size_t ii = 0; ii < len; ii += chunk) {
+			size_t count = (len - ii < chunk) ? (len - ii) : chunk;
+			assertEqual(writer.write(&buf2[ii], count), count);
+			delayMicroseconds(20);
+		}
+		writer.flush();
+		writerNs = m.elapsedNs();
+		assertEqual(writer.getAddr(), addr + len);
+
+		// One page program per page, including the partial pages at each end
+		assertEqual(m.counters().pagePrograms, 65);
+		assertEqual(m.counters().busyViolations, 0);
+		assertEqual(m.counters().writeEnableViolations, 0);
+	}
+	assertEqual(memcmp(&mem[addr], buf2, len), 0);
+	assertEqual(mem[addr - 1], 0xff);
+	assertEqual(mem[addr + len], 0xff);
+
+	// The processing overlaps the page programs, so it's close to a single writeData() of all of the data
+	spiFlash.eraseRange(0, 65536);
+	Measure m(fixture.chip);
+	spiFlash.writeData(addr, buf2, len);
+	uint64_t bulkNs = m.elapsedNs();
+	uint64_t processingNs = (len + chunk - 1) / chunk * 20000;
+	assertTrue(writerNs < bulkNs + processingNs / 4);
+
+	// Print interface. The destructor flushes.
+	{
+		SpiFlashWriter writer(spiFlash, 100000);
+		writer.print("count=");
+		writer.printf("%d", 42);
+		writer.println("!");
+	}
+	assertEqual(memcmp(&mem[100000], "count=42!\r\n", 11), 0);
+
+	// Reads are one transaction per buffer, aligned to the buffer size
+	uint64_t readerNs;
+	{
+		m.start();
+		SpiFlashReader reader(spiFlash, addr, len);
+		assertTrue(reader.isValid());
+		assertEqual(reader.available(), (int)len);
+		for(size_t ii = 0; ii < len; ii += chunk) {
+			size_t count = (len - ii < chunk) ? (len - ii) : chunk;
+			assertEqual(reader.read(buf1, count), count);
+			assertEqual(memcmp(buf1, &buf2[ii], count), 0);
+			delayMicroseconds(20);
+		}
+		readerNs = m.elapsedNs();
+		assertEqual(reader.available(), 0);
+		assertEqual(reader.read(), -1);
+		assertEqual(reader.peek(), -1);
+		assertEqual(m.counters().csAssertions, 65);
+		assertEqual(m.counters().readBytes, len);
+	}
+
+	// The same reads done directly, one transaction each
+	m.start();
+	for(size_t ii = 0; ii < len; ii += chunk) {
+		size_t count = (len - ii < chunk) ? (len - ii) : chunk;
+		spiFlash.readData(addr + ii, buf1, count);
+		delayMicroseconds(20);
+	}
+	assertTrue(readerNs < m.elapsedNs());
+
+	// The prefetch overlaps the processing, so the reads add little to the processing time
+	assertTrue(readerNs < processingNs + processingNs / 10);
+
+	// Single bytes, and using the flash directly in the middle of a stream
+	{
+		SpiFlashReader reader(spiFlash, addr + 10, 300);
+		assertEqual(reader.peek(), buf2[10]);
+		assertEqual(reader.read(), buf2[10]);
+		assertEqual(reader.getAddr(), addr + 11);
+
+		reader.end();
+		spiFlash.readData(addr + 500, buf1, 4);
+		assertEqual(memcmp(buf1, &buf2[500], 4), 0);
+		assertEqual(fixture.chip.getCounters().busyViolations, 0);
+
+		char temp[299];
+		assertEqual(reader.readBytes(temp, sizeof(temp)), sizeof(temp));
+		assertEqual(memcmp(temp, &buf2[11], sizeof(temp)), 0);
+		assertEqual(reader.read(), -1);
+	}
+}
+
+static SpiFlash *lockTestFlash;
+static std::thread *lockTestThread;
+static uint8_t lockTestReadBuf[256];
+
+// Called by the simulated clock in the middle of writeData(), while the main thread has the lock
+static void lockTestStartReader() {
+	lockTestThread = new std::thread([]() {
+		lockTestFlash->readData(0, lockTestReadBuf, sizeof(lockTestReadBuf));
+	});
+	while(lockTestFlash->getLock()->getNumWaiters() == 0) {
+		std::this_thread::yield();
+	}
+}
+
+// Fills buf with a JSON telemetry record like a device would log, returning its length
+static size_t telemetryRecord(uint32_t index, char *buf, size_t bufLen) {
+	return (size_t)snprintf(buf, bufLen, "{\"ts\":%lu,\"temp\":%d.%d,\"hum\":%d,\"batt\":%d,\"rssi\":-%d,\"state\":\"%s\"}\n",
+		(unsigned long)(1700000000 + index * 60), 20 + (int)(index % 7), (int)(index % 10), 40 + (int)(index % 13),
+		100 - (int)(index / 50) % 100, 60 + (int)(index * 7 % 23), (index % 5) ? "idle" : "sampling");
+}
+
+static void testCompress() {
+	static uint16_t hashTable[SpiFlashLz::HASH_ENTRIES];
+	static uint8_t packed[8192];
+
+	// Round trips of data that compresses well, not at all, and with long and overlapping matches
+	for(int pattern = 0; pattern < 4; pattern++) {
+		size_t len = 4000;
+		srand(pattern);
+		for(size_t ii = 0; ii < len; ii++) {
+			switch(pattern) {
+			case 0: buf2[ii] = 0; break;
+			case 1: buf2[ii] = (uint8_t)rand(); break;
+			case 2: buf2[ii] = (uint8_t)("abcabcabd"[ii % 9]); break;
+			default: buf2[ii] = (uint8_t)((ii < 300) ? rand() : buf2[ii - 300]); break;
+			}
+		}
+		size_t packedLen = SpiFlashLz::compress(buf2, len, packed, sizeof(packed), hashTable);
+		assertTrue(packedLen > 0);
+		if (pattern != 1) {
+			assertTrue(packedLen < len / 2);
+		}
+		assertEqual(SpiFlashLz::decompress(packed, packedLen, &buf2[8192], 8192), len);
+		assertEqual(memcmp(buf2, &buf2[8192], len), 0);
+
+		// Doesn't fit
+		assertEqual(SpiFlashLz::compress(buf2, len, packed, packedLen - 1, hashTable), 0);
+		assertEqual(SpiFlashLz::decompress(packed, packedLen, &buf2[8192], len - 1), 0);
+	}
+	assertEqual(SpiFlashLz::compress(buf2, 1, packed, sizeof(packed), hashTable), 2);
+
+	// Not valid: a match before the start of the output, and a truncated literal run
+	packed[0] = 0x20;
+	packed[1] = 0x00;
+	assertEqual(SpiFlashLz::decompress(packed, 2, buf1, sizeof(buf1)), 0);
+	packed[0] = 0x05;
+	assertEqual(SpiFlashLz::decompress(packed, 3, buf1, sizeof(buf1)), 0);
+
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+	const size_t regionAddr = 65536;
+	const size_t regionLen = 65536;
+
+	// The same telemetry records, raw and compressed
+	char record[128];
+	size_t rawBytes = 0;
+	for(uint32_t ii = 0; ii < 1000; ii++) {
+		rawBytes += telemetryRecord(ii, record, sizeof(record));
+	}
+
+	Measure m(fixture.chip);
+	{
+		SpiFlashWriter raw(spiFlash, 262144);
+		for(uint32_t ii = 0; ii < 1000; ii++) {
+			raw.write((const uint8_t *)record, telemetryRecord(ii, record, sizeof(record)));
+		}
+	}
+	uint64_t rawPrograms = m.counters().pagePrograms;
+
+	m.start();
+	size_t blockAddr500 = 0;
+	{
+		SpiFlashCompressWriter writer(spiFlash, regionAddr, regionLen);
+		assertTrue(writer.begin());
+		assertEqual(writer.getOffset(), 0);
+		for(uint32_t ii = 0; ii < 1000; ii++) {
+			if (ii == 500) {
+				assertTrue(writer.flush());
+				blockAddr500 = writer.getBlockAddr();
+			}
+			size_t len = telemetryRecord(ii, record, sizeof(record));
+			assertEqual(writer.write((const uint8_t *)record, len), len);
+		}
+		assertEqual(writer.getOffset(), rawBytes);
+
+		// About 2.5:1, and the page programs go down by the same ratio
+		assertTrue(writer.getStoredSize() * 2 < rawBytes);
+	}
+	assertTrue(m.counters().pagePrograms * 2 < rawPrograms);
+	assertEqual(fixture.chip.getCounters().busyViolations, 0);
+
+	// Read it all back
+	{
+		SpiFlashCompressReader reader(spiFlash, regionAddr, regionLen);
+		size_t offset = 0;
+		for(uint32_t ii = 0; ii < 1000; ii++) {
+			size_t len = telemetryRecord(ii, record, sizeof(record));
+			char readBuf[128];
+			assertEqual(reader.read((uint8_t *)readBuf, len), len);
+			assertEqual(memcmp(readBuf, record, len), 0);
+			offset += len;
+			assertEqual(reader.getOffset(), offset);
+		}
+		assertEqual(reader.read(), -1);
+		assertEqual(reader.available(), 0);
+		assertEqual(reader.getOffset(), rawBytes);
+		assertEqual(reader.getCorruptBlocks(), 0);
+	}
+
+	// Random access, reading only the headers before the block
+	{
+		SpiFlashCompressReader reader(spiFlash, regionAddr, regionLen);
+		size_t offset = 0;
+		for(uint32_t ii = 0; ii < 700; ii++) {
+			offset += telemetryRecord(ii, record, sizeof(record));
+		}
+		m.start();
+		assertTrue(reader.seek(offset));
+		assertTrue(m.counters().readBytes < 1024 + 64 * sizeof(SpiFlashCompressRegion::BlockHeader));
+		assertEqual(reader.getOffset(), offset);
+		size_t len = telemetryRecord(700, record, sizeof(record));
+		char readBuf[128];
+		assertEqual(reader.read((uint8_t *)readBuf, len), len);
+		assertEqual(memcmp(readBuf, record, len), 0);
+		assertTrue(!reader.seek(rawBytes));
+
+		// Directly to a saved block address
+		assertTrue(reader.seekBlock(blockAddr500));
+		len = telemetryRecord(500, record, sizeof(record));
+		assertEqual(reader.read((uint8_t *)readBuf, len), len);
+		assertEqual(memcmp(readBuf, record, len), 0);
+		assertTrue(!reader.seekBlock(blockAddr500 + 1));
+	}
+
+	// After a reset, writing continues at the end
+	{
+		SpiFlashCompressWriter writer(spiFlash, regionAddr, regionLen);
+		assertTrue(writer.begin());
+		assertEqual(writer.getOffset(), rawBytes);
+		assertEqual(writer.write((const uint8_t *)"more", 4), 4);
+		assertTrue(writer.flush());
+	}
+	{
+		SpiFlashCompressReader reader(spiFlash, regionAddr, regionLen);
+		assertTrue(reader.seek(rawBytes));
+		char readBuf[8];
+		assertEqual(reader.read((uint8_t *)readBuf, sizeof(readBuf)), 4);
+		assertEqual(memcmp(readBuf, "more", 4), 0);
+	}
+
+	// A block that fails the CRC check and one with an invalid header are skipped
+	{
+		size_t secondBlock = regionAddr + sizeof(SpiFlashCompressRegion::BlockHeader) +
+			((SpiFlashCompressRegion::BlockHeader *)&mem[regionAddr])->storedLen;
+		mem[secondBlock + 20] ^= 0x01;
+		mem[regionAddr + 2] = 0;
+
+		SpiFlashCompressReader reader(spiFlash, regionAddr, regionLen);
+		size_t count = 0;
+		while(reader.read() >= 0) {
+			count++;
+		}
+		assertEqual(reader.getCorruptBlocks(), 2);
+		assertTrue(count < rawBytes + 4);
+		assertTrue(count > rawBytes + 4 - 3 * SpiFlashCompressRegion::BLOCK_SIZE);
+	}
+
+	{
+		SpiFlashCompressWriter writer(spiFlash, regionAddr, regionLen);
+		assertTrue(writer.begin());
+		assertEqual(writer.getOffset(), rawBytes + 4);
+	}
+
+	// Filling the range
+	{
+		SpiFlashCompressWriter writer(spiFlash, regionAddr, regionLen);
+		writer.clear();
+		assertTrue(writer.begin());
+		assertEqual(writer.getStoredSize(), 0);
+
+		srand(1);
+		size_t written = 0;
+		while(true) {
+			for(size_t ii = 0; ii < sizeof(buf1); ii++) {
+				buf1[ii] = (uint8_t)rand();
+			}
+			size_t count = writer.write(buf1, sizeof(buf1));
+			written += count;
+			if (count < sizeof(buf1)) {
+				break;
+			}
+		}
+		assertTrue(writer.isFull());
+		assertTrue(!writer.flush());
+		assertTrue(writer.getStoredSize() <= regionLen);
+		assertTrue(written > regionLen - 2 * SpiFlashCompressRegion::BLOCK_SIZE);
+	}
+	assertEqual(mem[regionAddr + regionLen], 0xff);
+}
+
+static void testLocking() {
+	Fixture<SpiFlashWinbond> fixture(SpiFlashEmulator::winbondW25Q32());
+	SpiFlashWinbond &spiFlash = fixture.flash;
+	uint8_t *mem = fixture.chip.getMemory();
+
+	srand(8);
+	for(size_t ii = 0; ii < 65536; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	assertTrue(spiFlash.getLock() == 0);
+	spiFlash.withLocking();
+	SpiFlashLock *lock = spiFlash.getLock();
+	assertTrue(lock != 0);
+
+	// Operations that call other operations lock recursively
+	spiFlash.writeData(0, buf2, 256);
+	spiFlash.withSectorCache(1);
+	spiFlash.updateData(100, "test", 4);
+	spiFlash.flush();
+	spiFlash.withSectorCache(0);
+	assertEqual(memcmp(&mem[100], "test", 4), 0);
+	assertTrue(!lock->isLocked());
+
+	SpiFlashLockStats stats;
+	lock->getStats(stats);
+	assertTrue(stats.acquisitions >= 3);
+	assertEqual(stats.contended, 0);
+	assertEqual(stats.preemptions, 0);
+
+	lock->lock();
+	assertTrue(lock->tryLock());
+	assertTrue(!lock->yield(SPIFLASH_PRIORITY_LOW));
+	lock->unlock();
+	assertTrue(lock->isLocked());
+	lock->unlock();
+	assertTrue(!lock->isLocked());
+
+	// A read from another thread goes ahead of the rest of a long write at the next page boundary
+	lock->resetStats();
+	lockTestFlash = &spiFlash;
+	HostClock::schedule(HostClock::nowNs() + 5000000, lockTestStartReader);
+	Measure m(fixture.chip);
+	spiFlash.writeData(65536, buf2, 65536);
+	assertTrue(m.elapsedNs() > 100000000);
+	assertTrue(lockTestThread != 0);
+	lockTestThread->join();
+	delete lockTestThread;
+	lockTestThread = 0;
+
+	assertEqual(memcmp(lockTestReadBuf, mem, 256), 0);
+	assertEqual(memcmp(&mem[65536], buf2, 65536), 0);
+	assertEqual(m.counters().busyViolations, 0);
+	lock->getStats(stats);
+	assertEqual(stats.preemptions, 1);
+	assertEqual(stats.contended, 2);
+	assertTrue(stats.maxWaitUs < 1000);
+
+	// The bus lock is held for each transaction
+	SpiFlashLock busLock;
+	spiFlash.withLocking(false);
+	spiFlash.withBusLock(&busLock);
+	m.start();
+	spiFlash.readData(0, buf1, 256);
+	spiFlash.sectorErase(0);
+	busLock.getStats(stats);
+	assertEqual(stats.acquisitions, m.counters().csAssertions);
+	assertTrue(stats.totalHoldUs > 0);
+	assertTrue(!busLock.isLocked());
+	spiFlash.withBusLock(0);
+}
+
+/**
+ * @brief Four Winbond chips on the same SPI bus, for testing SpiFlashStriped
+ */
+class StripedFixture {
+public:
+	StripedFixture() : flash0(SPI, A2), flash1(SPI, A3), flash2(SPI, A4), flash3(SPI, A5) {
+		for(size_t ii = 0; ii < 4; ii++) {
+			chips[ii] = new SpiFlashEmulator(SpiFlashEmulator::winbondW25Q32());
+			SPI.attach(chips[ii], A2 + ii);
+		}
+		flashes[0] = &flash0;
+		flashes[1] = &flash1;
+		flashes[2] = &flash2;
+		flashes[3] = &flash3;
+	}
+	~StripedFixture() {
+		for(size_t ii = 0; ii < 4; ii++) {
+			SPI.detach(chips[ii]);
+			delete chips[ii];
+		}
+	}
+
+	SpiFlashEmulator *chips[4];
+	SpiFlashWinbond flash0, flash1, flash2, flash3;
+	SpiFlash *flashes[4];
+};
+
+static void testStriped() {
+	StripedFixture fixture;
+
+	srand(7);
+	for(size_t ii = 0; ii < 65536; ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	// One chip on its own, for comparison
+	SpiFlash &single = fixture.flash0;
+	single.begin();
+	Measure m(*fixture.chips[0]);
+	single.eraseRange(0, 262144);
+	uint64_t singleEraseNs = m.elapsedNs();
+	m.start();
+	single.writeData(0, buf2, 65536);
+	uint64_t singleWriteNs = m.elapsedNs();
+
+	SpiFlashStriped striped(fixture.flashes, 4);
+	striped.begin();
+	assertTrue(striped.isValid());
+	assertEqual(striped.jedecIdRead(), SpiFlashEmulator::winbondW25Q32().jedecId);
+	assertEqual(striped.getPageSize(), 256);
+	assertEqual(striped.getSectorSize(), 16384);
+	assertEqual(striped.getCapacity(), 4 * fixture.flash0.getCapacity());
+	assertTrue(!striped.eraseRange(4096, 16384));
+
+	// 256K is a 64K block erase on each chip, all at the same time
+	m.start();
+	assertTrue(striped.eraseRange(0, 262144));
+	uint64_t stripedEraseNs = m.elapsedNs();
+	assertEqual(m.counters().block64Erases, 1);
+	assertTrue(stripedEraseNs * 3 < singleEraseNs);
+
+	m.start();
+	striped.writeData(0, buf2, 65536);
+	uint64_t stripedWriteNs = m.elapsedNs();
+	assertTrue(stripedWriteNs * 3 < singleWriteNs);
+
+	for(size_t addr = 0; addr < 65536; addr++) {
+		size_t stripe = addr / 256;
+		uint8_t *mem = fixture.chips[stripe % 4]->getMemory();
+		if (mem[(stripe / 4) * 256 + (addr % 256)] != buf2[addr]) {
+			assertEqual(addr, 0xffffffff);
+			break;
+		}
+	}
+	memset(buf2 + 32768, 0, 32768);
+	striped.readData(0, buf2 + 32768, 32768);
+	assertEqual(memcmp(buf2, buf2 + 32768, 32768), 0);
+
+	// Unaligned writes and reads that cross stripes
+	uint8_t readBuf[1000];
+	striped.writeData(65536 + 300, buf2, 1000);
+	striped.readData(65536 + 300, readBuf, 1000);
+	assertEqual(memcmp(readBuf, buf2, 1000), 0);
+	striped.readData(65536 + 299, readBuf, 1);
+	assertEqual(readBuf[0], 0xff);
+
+	size_t chipIndex;
+	assertEqual(striped.toChipAddr(65536 + 300, chipIndex), 16384 + 44);
+	assertEqual(chipIndex, 1);
+
+	// Erasing one striped sector erases a sector on each chip
+	m.start();
+	striped.sectorErase(65536);
+	assertEqual(m.counters().sectorErases, 1);
+	striped.readData(65536 + 300, readBuf, 1000);
+	for(size_t ii = 0; ii < sizeof(readBuf); ii++) {
+		assertEqual(readBuf[ii], 0xff);
+	}
+
+	// Sector striping on two chips
+	SpiFlashStriped striped2(fixture.flashes, 2, 4096);
+	striped2.begin();
+	assertEqual(striped2.getSectorSize(), 4096);
+	m.start();
+	assertTrue(striped2.eraseRange(4096, 8 * 4096));
+	assertEqual(m.counters().sectorErases, 4);
+	assertTrue(m.elapsedNs() < 5 * 45000000ULL);
+
+	striped2.writeData(4096 + 100, buf2, 3 * 4096);
+	assertEqual(memcmp(&fixture.chips[1]->getMemory()[100], buf2, 4096 - 100), 0);
+	assertEqual(memcmp(&fixture.chips[0]->getMemory()[4096], &buf2[4096 - 100], 4096), 0);
+	uint8_t *readBuf2 = buf2 + 32768;
+	striped2.readData(4096 + 100, readBuf2, 3 * 4096);
+	assertEqual(memcmp(readBuf2, buf2, 3 * 4096), 0);
+
+	// An asynchronous operation on one of the chips is finished first, not skipped
+	assertTrue(fixture.flash0.sectorEraseAsync(65536));
+	assertTrue(striped2.eraseRange(0, 4 * 4096));
+	assertTrue(!fixture.flash0.isBusy());
+	assertEqual(fixture.chips[0]->getMemory()[4096], 0xff);
+	assertEqual(fixture.chips[1]->getMemory()[100], 0xff);
+
+	fixture.flash1.sectorErase(65536);
+	assertTrue(fixture.flash1.writeDataAsync(65536, buf1, sizeof(buf1)));
+	striped2.writeData(0, buf2, 4 * 4096);
+	assertTrue(!fixture.flash1.isBusy());
+	assertEqual(memcmp(fixture.chips[0]->getMemory(), buf2, 4096), 0);
+	assertEqual(memcmp(fixture.chips[1]->getMemory(), &buf2[4096], 4096), 0);
+	assertEqual(memcmp(&fixture.chips[0]->getMemory()[4096], &buf2[8192], 4096), 0);
+	assertEqual(memcmp(&fixture.chips[1]->getMemory()[4096], &buf2[12288], 4096), 0);
+	assertEqual(memcmp(&fixture.chips[1]->getMemory()[65536], buf1, sizeof(buf1)), 0);
+
+	for(size_t ii = 0; ii < 4; ii++) {
+		assertEqual(fixture.chips[ii]->getCounters().busyViolations, 0);
+	}
+}
+
+#ifdef SPIFLASHRK_ENABLE_STATS
+static void testStats() {
+	// Sector erase takes longer than the 500 ms timeout
+	SpiFlashEmulator::Config config = SpiFlashEmulator::winbondW25Q32();
+	config.timing.tSE = 600000;
+	Fixture<SpiFlashWinbond> fixture(config);
+	SpiFlashWinbond &spiFlash = fixture.flash;
+
+	SpiFlashStats stats;
+	spiFlash.resetStats();
+	spiFlash.getStats(stats);
+	assertEqual(stats.ops[SPIFLASH_STATS_READ].count, 0);
+	assertEqual(stats.ops[SPIFLASH_STATS_READ].minUs, 0xffffffff);
+
+	Measure m(fixture.chip);
+	spiFlash.writeData(100, buf2, 1000);
+	spiFlash.readData(0, buf2, 4096);
+	spiFlash.readData(0, buf1, 1);
+	spiFlash.blockErase(65536);
+	delay(10);
+
+	spiFlash.getStats(stats);
+	assertTrue(stats.periodMs - m.elapsedNs() / 1000000 <= 1);
+	assertEqual(stats.waitTimeouts, 0);
+
+	const SpiFlashOpStats &read = stats.ops[SPIFLASH_STATS_READ];
+	assertEqual(read.count, 2);
+	assertEqual(read.bytes, 4097);
+	assertEqual(read.transactions, 2);
+	assertEqual(read.statusPolls, 0);
+	assertTrue(read.minUs < read.maxUs);
+	assertTrue(read.maxUs >= 1000);
+	assertEqual(read.totalUs, read.minUs + read.maxUs);
+
+	// Partial first page, 3 full pages, partial last page
+	const SpiFlashOpStats &program = stats.ops[SPIFLASH_STATS_PAGE_PROGRAM];
+	assertEqual(program.count, 5);
+	assertEqual(program.bytes, 1000);
+	assertEqual(program.timeouts, 0);
+	assertTrue(program.statusPolls >= 5);
+	assertEqual(program.transactions, program.statusPolls + 10);
+
+	// Status polls include the ones made by the other operations
+	const SpiFlashOpStats &poll = stats.ops[SPIFLASH_STATS_STATUS_POLL];
+	assertEqual(poll.count, m.counters().statusReads);
+	assertEqual(poll.transactions, poll.count);
+
+	const SpiFlashOpStats &block = stats.ops[SPIFLASH_STATS_BLOCK_ERASE];
+	assertEqual(block.count, 1);
+	assertTrue(block.minUs >= 150000 && block.minUs == block.maxUs);
+	assertEqual(block.histogram[17], 1);
+	assertEqual(block.getPercentileUs(50), block.maxUs);
+
+	uint32_t histogramCount = 0;
+	for(size_t ii = 0; ii < SPIFLASH_STATS_BUCKETS; ii++) {
+		histogramCount += program.histogram[ii];
+	}
+	assertEqual(histogramCount, program.count);
+	assertTrue(program.getPercentileUs(50) <= program.getPercentileUs(100));
+	assertEqual(program.getPercentileUs(100), program.maxUs);
+
+	// The sector erase times out silently but is counted
+	spiFlash.sectorErase(0);
+	spiFlash.getStats(stats);
+	assertEqual(stats.waitTimeouts, 1);
+	assertEqual(stats.ops[SPIFLASH_STATS_SECTOR_ERASE].timeouts, 1);
+	assertEqual(stats.ops[SPIFLASH_STATS_SECTOR_ERASE].count, 1);
+	fixture.chip.completeOperation();
+
+	assertTrue(strcmp(SpiFlashStats::getOpName(SPIFLASH_STATS_SECTOR_ERASE), "sectorErase") == 0);
+
+	spiFlash.resetStats();
+	spiFlash.getStats(stats);
+	assertEqual(stats.waitTimeouts, 0);
+	assertEqual(stats.ops[SPIFLASH_STATS_PAGE_PROGRAM].count, 0);
+	assertEqual(stats.ops[SPIFLASH_STATS_BLOCK_ERASE].histogram[17], 0);
+}
+#endif
+
+static void testSfdp() {
+	{
+		// Generic SpiFlash configured from SFDP
+		SpiFlashEmulator chip(SpiFlashEmulator::winbondW25Q32());
+		SPI.attach(&chip, A2);
+		SpiFlash spiFlash(SPI, A2);
+		spiFlash.withSfdp().begin();
+
+		assertTrue(spiFlash.hasSfdp());
+		assertEqual(spiFlash.getCapacity(), 4 * 1024 * 1024);
+		assertEqual(spiFlash.getPageSize(), 256);
+		assertTrue(spiFlash.isEraseSuspendSupported());
+
+		// Capacity is known, so erasing the whole chip uses chip erase
+		Measure m(chip);
+		spiFlash.eraseRange(0, spiFlash.getCapacity());
+		assertEqual(m.counters().chipErases, 1);
+		assertTrue(!chip.isBusy());
+
+		// Page size from SFDP is used to split writes
+		memset(buf2, 0, 1024);
+		m.start();
+		spiFlash.writeData(0, buf2, 1024);
+		assertEqual(m.counters().pagePrograms, 4);
+		SPI.detach(&chip);
+	}
+	{
+		// The 4-byte address instructions are used automatically on chips larger than 16 Mbyte
+		SpiFlashEmulator chip(SpiFlashEmulator::macronixMX25L25645G());
+		SPI.attach(&chip, A2);
+		SpiFlashMacronix spiFlash(SPI, A2);
+		spiFlash.withSfdp().begin();
+
+		assertTrue(spiFlash.hasSfdp());
+		assertEqual(spiFlash.getCapacity(), 32 * 1024 * 1024);
+		assertTrue(spiFlash.getNative4ByteAddressing());
+		assertTrue(!chip.is4ByteMode());
+		assertEqual(chip.getCounters().addressModeSwitches, 0);
+
+		uint8_t temp = 0x55;
+		spiFlash.writeData(20 * 1024 * 1024, &temp, 1);
+		assertEqual(chip.getMemory()[20 * 1024 * 1024], 0x55);
+		SPI.detach(&chip);
+	}
+	{
+		// Without the 4-byte address instruction table, 4-byte addressing mode is enabled instead
+		SpiFlashEmulator::Config config = SpiFlashEmulator::macronixMX25L25645G();
+		config.supports4ByteInstructions = false;
+		SpiFlashEmulator chip(config);
+		SPI.attach(&chip, A2);
+		SpiFlashMacronix spiFlash(SPI, A2);
+		spiFlash.withSfdp().begin();
+
+		assertTrue(spiFlash.hasSfdp());
+		assertTrue(!spiFlash.getNative4ByteAddressing());
+		assertTrue(chip.is4ByteMode());
+
+		uint8_t temp = 0x55;
+		spiFlash.writeData(20 * 1024 * 1024, &temp, 1);
+		assertEqual(chip.getMemory()[20 * 1024 * 1024], 0x55);
+		SPI.detach(&chip);
+	}
+	{
+		// No SFDP, settings are unchanged
+		Fixture<SpiFlashMacronix> fixture(SpiFlashEmulator::macronixMX25L8006E());
+		assertTrue(!fixture.flash.configureFromSfdp());
+		assertTrue(!fixture.flash.hasSfdp());
+		assertEqual(fixture.flash.getCapacity(), 0);
+	}
+}
+
+static void testDetect() {
+	const struct {
+		SpiFlashEmulator::Config config;
+		const char *name;
+	} chips[] = {
+		{ SpiFlashEmulator::issiIS25LQ080(), "IS25LQ080" },
+		{ SpiFlashEmulator::winbondW25Q32(), "W25Q32" },
+		{ SpiFlashEmulator::macronixMX25L8006E(), "MX25L8006E" },
+		{ SpiFlashEmulator::macronixMX25L25645G(), "MX25L25645G" },
+	};
+
+	for(size_t ii = 0; ii < sizeof(chips) / sizeof(chips[0]); ii++) {
+		SpiFlashEmulator chip(chips[ii].config);
+		SPI.attach(&chip, A2);
+
+		SpiFlash *spiFlash = SpiFlash::detect(SPI, A2);
+		assertTrue(spiFlash != NULL);
+		if (spiFlash) {
+			assertTrue(spiFlash->isValid());
+			assertTrue(spiFlash->getChipInfo() != NULL);
+			if (spiFlash->getChipInfo()) {
+				assertEqual(strcmp(spiFlash->getChipInfo()->name, chips[ii].name), 0);
+			}
+			assertEqual(spiFlash->getCapacity(), chip.getCapacity());
+			assertEqual(spiFlash->isEraseSuspendSupported(), chips[ii].config.eraseSuspendInst != 0);
+
+			// Writes and reads work at the selected clock speed, including above 16 Mbyte
+			size_t addr = chip.getCapacity() - 4096;
+			uint8_t temp = 0xa5;
+			spiFlash->writeData(addr, &temp, 1);
+			temp = 0;
+			spiFlash->readData(addr, &temp, 1);
+			assertEqual(temp, 0xa5);
+			assertEqual(chip.getMemory()[addr], 0xa5);
+			assertEqual(chip.getCounters().clockViolations, 0);
+			assertEqual(chip.getCounters().readClockViolations, 0);
+
+			delete spiFlash;
+		}
+		SPI.detach(&chip);
+	}
+
+	{
+		// Not in the table, so SFDP is used
+		SpiFlashEmulator::Config config = SpiFlashEmulator::winbondW25Q32();
+		config.jedecId = 0x1f8501;
+		config.capacity = 2 * 1024 * 1024;
+		SpiFlashEmulator chip(config);
+		SPI.attach(&chip, A2);
+
+		SpiFlash *spiFlash = SpiFlash::detect(SPI, A2);
+		assertTrue(spiFlash != NULL);
+		if (spiFlash) {
+			assertTrue(spiFlash->isValid());
+			assertTrue(spiFlash->getChipInfo() == NULL);
+			assertTrue(spiFlash->hasSfdp());
+			assertEqual(spiFlash->getCapacity(), 2 * 1024 * 1024);
+			delete spiFlash;
+		}
+		SPI.detach(&chip);
+	}
+
+	// No chip
+	assertTrue(SpiFlash::detect(SPI, A2) == NULL);
+}
+
+template<class T>
+static void benchmark(const char *name, const SpiFlashEmulator::Config &config) {
+	Fixture<T> fixture(config);
+	T &spiFlash = fixture.flash;
+
+	printf("\n%s (%u MHz)\n", name, (unsigned) SPI.getSettings().clock / MHZ);
+
+	Measure m(fixture.chip);
+
+	spiFlash.chipErase();
+	m.report("chipErase");
+
+	srand(0);
+	for(size_t ii = 0; ii < sizeof(buf2); ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	m.start();
+	spiFlash.writeData(0, buf2, 256);
+	m.report("writeData 256 bytes");
+
+	m.start();
+	spiFlash.writeData(4096, buf2, 4096);
+	m.report("writeData 4K");
+
+	m.start();
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.writeData(65536 + ii, &buf2[ii], 1);
+	}
+	m.report("writeData 256 x 1 byte");
+
+	m.start();
+	spiFlash.writeData(131072, buf2, 65536);
+	m.report("writeData 64K");
+
+	m.start();
+	spiFlash.readData(0, buf1, 1);
+	m.report("readData 1 byte");
+
+	m.start();
+	spiFlash.readData(0, buf1, 256);
+	m.report("readData 256 bytes");
+
+	m.start();
+	spiFlash.readData(4096, buf2, 4096);
+	m.report("readData 4K");
+
+	m.start();
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.readData(65536 + ii, &buf1[ii], 1);
+	}
+	m.report("readData 256 x 1 byte");
+
+	m.start();
+	spiFlash.readData(131072, buf2, 65536);
+	m.report("readData 64K");
+
+	spiFlash.withFastRead().withSpiClockSpeedMHz(80);
+	m.start();
+	spiFlash.readData(131072, buf2, 65536);
+	m.report("readData 64K FAST_READ 80 MHz");
+	spiFlash.withFastRead(false).withSpiClockSpeedMHz(30);
+
+	m.start();
+	spiFlash.sectorErase(4096);
+	m.report("sectorErase");
+
+	m.start();
+	spiFlash.blockErase(131072);
+	m.report("blockErase");
+
+	m.start();
+	for(size_t addr = 0; addr < 1024 * 1024; addr += 4096) {
+		spiFlash.sectorErase(addr);
+	}
+	m.report("sectorErase 1 Mbyte");
+
+	m.start();
+	spiFlash.eraseRange(0, 1024 * 1024);
+	m.report("eraseRange 1 Mbyte");
+
+	spiFlash.withSectorCache(1);
+	m.start();
+	for(uint32_t ii = 0; ii < 100; ii++) {
+		spiFlash.updateData(100, &ii, sizeof(ii));
+	}
+	spiFlash.flush();
+	m.report("updateData 100 x 4 bytes + flush");
+	spiFlash.withSectorCache(0);
+
+	spiFlash.withReadCache(8);
+	m.start();
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.readData(65536 + ii, &buf1[ii], 1);
+	}
+	m.report("readData 256 x 1 byte, read cache");
+	spiFlash.withReadCache(0);
+
+	spiFlash.withWriteCombining();
+	m.start();
+	for(size_t ii = 0; ii < 256; ii++) {
+		spiFlash.writeData(196608 + ii, &buf2[ii], 1);
+	}
+	m.report("writeData 256 x 1 byte, write combining");
+
+	m.start();
+	for(size_t ii = 0; ii < 4096; ii += 16) {
+		spiFlash.writeData(200704 + ii, &buf2[ii], 16);
+	}
+	spiFlash.flush();
+	m.report("writeData 4K x 16 bytes, combining");
+	spiFlash.withWriteCombining(false);
+
+	SpiFlashBatch batch(spiFlash, 256);
+	for(size_t ii = 0; ii < 256; ii++) {
+		batch.write(262144 + ii, &buf2[ii], 1);
+	}
+	m.start();
+	batch.execute();
+	m.report("SpiFlashBatch 256 x 1 byte writes");
+
+	spiFlash.eraseRange(262144, 65536);
+	m.start();
+	for(size_t ii = 0; ii < 16384; ii += 32) {
+		spiFlash.writeData(262144 + ii, &buf2[ii], 32);
+		delayMicroseconds(20);
+	}
+	m.report("writeData 16K x 32 bytes, 20 us apart");
+
+	m.start();
+	{
+		SpiFlashWriter writer(spiFlash, 262144 + 16384);
+		for(size_t ii = 0; ii < 16384; ii += 32) {
+			writer.write(&buf2[ii], 32);
+			delayMicroseconds(20);
+		}
+	}
+	m.report("SpiFlashWriter 16K x 32 bytes");
+
+	m.start();
+	for(size_t ii = 0; ii < 16384; ii += 32) {
+		spiFlash.readData(262144 + ii, buf1, 32);
+		delayMicroseconds(20);
+	}
+	m.report("readData 16K x 32 bytes, 20 us apart");
+
+	m.start();
+	{
+		SpiFlashReader reader(spiFlash, 262144, 16384);
+		for(size_t ii = 0; ii < 16384; ii += 32) {
+			reader.read(buf1, 32);
+			delayMicroseconds(20);
+		}
+	}
+	m.report("SpiFlashReader 16K x 32 bytes");
+
+	spiFlash.eraseRange(327680, 65536);
+	m.start();
+	spiFlash.syncData(327680, buf2, 65536);
+	m.report("syncData 64K, blank");
+
+	m.start();
+	spiFlash.syncData(327680, buf2, 65536);
+	m.report("syncData 64K, unchanged");
+
+	m.start();
+	spiFlash.crc32Range(262144, 65536);
+	m.report("crc32Range 64K");
+
+	char record[128];
+	spiFlash.eraseRange(393216, 131072);
+	m.start();
+	{
+		SpiFlashWriter writer(spiFlash, 393216);
+		for(uint32_t ii = 0; ii < 1000; ii++) {
+			writer.write((const uint8_t *)record, telemetryRecord(ii, record, sizeof(record)));
+		}
+	}
+	m.report("SpiFlashWriter 1000 JSON records");
+
+	m.start();
+	{
+		SpiFlashCompressWriter writer(spiFlash, 458752, 65536);
+		writer.begin();
+		for(uint32_t ii = 0; ii < 1000; ii++) {
+			writer.write((const uint8_t *)record, telemetryRecord(ii, record, sizeof(record)));
+		}
+	}
+	m.report("SpiFlashCompressWriter 1000 JSON records");
+}
+
+static void benchmarkStriped() {
+	printf("\nSpiFlashStriped, Winbond W25Q32\n");
+
+	srand(0);
+	for(size_t ii = 0; ii < sizeof(buf2); ii++) {
+		buf2[ii] = (uint8_t) rand();
+	}
+
+	StripedFixture fixture;
+	for(size_t numChips = 1; numChips <= 4; numChips *= 2) {
+		SpiFlashStriped striped(fixture.flashes, numChips);
+		striped.begin();
+		char desc[64];
+
+		Measure m(*fixture.chips[0]);
+		striped.eraseRange(0, numChips * 65536);
+		snprintf(desc, sizeof(desc), "eraseRange %uK, %u chips", (unsigned)numChips * 64, (unsigned)numChips);
+		m.report(desc);
+
+		m.start();
+		striped.writeData(0, buf2, sizeof(buf2));
+		snprintf(desc, sizeof(desc), "writeData 64K, %u chips", (unsigned)numChips);
+		m.report(desc);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	testBasic<SpiFlashWinbond>(SpiFlashEmulator::winbondW25Q32());
+	testBasic<SpiFlashISSI>(SpiFlashEmulator::issiIS25LQ080());
+	testBasic<SpiFlashMacronix>(SpiFlashEmulator::macronixMX25L8006E());
+	test4ByteAddressing();
+	test4ByteInstructions();
+	testReadData();
+	testAsync();
+	testEraseAsync();
+	testEraseSuspend();
+	testEraseRange();
+	testAdaptivePolling();
+	testUpdateData();
+	testSyncData();
+	testErased();
+	testChecksums();
+	testReadCache();
+	testWriteCombining();
+	testWearLevel();
+	testLog();
+	testLogRecovery();
+	testKV();
+	testBatch();
+	testStreams();
+	testCompress();
+	testStriped();
+	testLocking();
+#ifdef SPIFLASHRK_ENABLE_STATS
+	testStats();
+#endif
+	testSfdp();
+	testDetect();
+
+	benchmark<SpiFlashWinbond>("Winbond W25Q32", SpiFlashEmulator::winbondW25Q32());
+	benchmark<SpiFlashMacronix>("Macronix MX25L8006E", SpiFlashEmulator::macronixMX25L8006E());
+	benchmarkStriped();
+
+	if (failureCount) {
+		printf("\n%d tests failed\n", failureCount);
+		return 1;
+	}
+	printf("\nall tests passed\n");
+	return 0;
+}